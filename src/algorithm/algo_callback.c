@@ -29,6 +29,18 @@
   */
 
 #include "algo_callback.h"
+#include "../pllmod_common.h"
+
+static void invalidate_partition(pllmod_treeinfo_t * treeinfo,
+                                 unsigned int partition_index);
+static int treeinfo_model_gradient(pllmod_treeinfo_t * treeinfo,
+                                   unsigned int partition_index,
+                                   unsigned int params_index,
+                                   double * subst_grad,
+                                   double * freqs_grad);
+static double sitecat_loglh(const pll_partition_t * partition,
+                            const double * sitecat_lh,
+                            const double * site_logscale);
 
 double target_freqs_func(void *p, double *x)
 {
@@ -319,7 +331,15 @@ double target_func_onedim_treeinfo(void *p, double *x, double *fx, int * converg
 
       unconverged_flag = 1.;
 
+      /* function was called solely to check convergence -> no LH computation */
+      if (!x)
+      {
+        j++;
+        continue;
+      }
+
       param_setter(treeinfo, i, &x[j], 1);
+      invalidate_partition(treeinfo, i);
 
       j++;
     }
@@ -327,8 +347,10 @@ double target_func_onedim_treeinfo(void *p, double *x, double *fx, int * converg
 
   assert(j == num_parts);
 
-  /* compute negative score */
-  double score = -1 * pllmod_treeinfo_compute_loglh(treeinfo, 0);
+  /* compute negative score, converged partitions are not recomputed */
+  double score = -INFINITY;
+  if (x)
+    score = -1 * pllmod_treeinfo_compute_loglh_dirty(treeinfo);
 
 //  printf("score: %lf\n", score);
 
@@ -407,31 +429,44 @@ double target_func_multidim_treeinfo(void * p, double ** x, double * fx,
           double sum_ratios = 1.0;
 
           double * weights = partition->rate_weights;
-          unsigned int i, cur_weight;
+          unsigned int k, cur_weight;
 
-          for (i = 0; i < (n_weights - 1); ++i)
-            sum_ratios += x[part][i];
+          for (k = 0; k < (n_weights - 1); ++k)
+            sum_ratios += x[part][k];
 
           cur_weight = 0;
-          for (i = 0; i < (n_weights); ++i)
-            if (i != highest_weight_state)
+          for (k = 0; k < (n_weights); ++k)
+            if (k != highest_weight_state)
             {
-              weights[i] = x[part][cur_weight++] / sum_ratios;
+              weights[k] = x[part][cur_weight++] / sum_ratios;
             }
           weights[highest_weight_state] = 1.0 / sum_ratios;
+
+          if (params->sitecat_lh && params->sitecat_lh[part])
+          {
+            /* CLVs do not depend on the weights: re-evaluate at the root
+               only, and keep the partition clean */
+            treeinfo->local_loglh[i] =
+                sitecat_loglh(partition, params->sitecat_lh[part],
+                              params->site_logscale[part]);
+            part++;
+            continue;
+          }
           break;
         }
         default:
           assert(0);
       }
 
+      invalidate_partition(treeinfo, i);
+
       part++;
     }
   }
 
-  /* compute negative score */
+  /* compute negative score, converged partitions are not recomputed */
   if(x)
-    score = -1 * pllmod_treeinfo_compute_loglh(treeinfo, 0);
+    score = -1 * pllmod_treeinfo_compute_loglh_dirty(treeinfo);
 
   /* copy per-partition likelihood to the output array */
   if (fx)
@@ -527,14 +562,15 @@ double target_subst_params_func_multi(void * p, double ** x, double * fx,
 
       /* important!! invalidate eigen-decomposition */
       partition->eigen_decomp_valid[params_index] = 0;
+      invalidate_partition(treeinfo, i);
 
       part++;
     }
   }
 
-  /* compute negative score */
+  /* compute negative score, converged partitions are not recomputed */
   if(x)
-    score = -1 * pllmod_treeinfo_compute_loglh(treeinfo, 0);
+    score = -1 * pllmod_treeinfo_compute_loglh_dirty(treeinfo);
 
   /* copy per-partition likelihood to the output array */
   if (fx)
@@ -626,14 +662,15 @@ double target_freqs_func_multi(void * p, double ** x, double * fx,
 
       /* important!! invalidate eigen-decomposition */
       partition->eigen_decomp_valid[params_index] = 0;
+      invalidate_partition(treeinfo, i);
 
       part++;
     }
   }
 
-  /* compute negative score */
+  /* compute negative score, converged partitions are not recomputed */
   if (x)
-    score = -1 * pllmod_treeinfo_compute_loglh(treeinfo, 0);
+    score = -1 * pllmod_treeinfo_compute_loglh_dirty(treeinfo);
 
   /* copy per-partition likelihood to the output array */
   if (fx)
@@ -657,3 +694,192 @@ double target_freqs_func_multi(void * p, double ** x, double * fx,
 
   return score;
 }
+
+int target_subst_params_grad_multi(void * p, double ** x, double ** g,
+                                   int * skip)
+{
+  struct treeinfo_opt_params * params = (struct treeinfo_opt_params *) p;
+
+  pllmod_treeinfo_t * treeinfo      = params->treeinfo;
+  unsigned int params_index         = params->params_index;
+  unsigned int * subst_free_params  = params->num_free_params;
+
+  size_t i, j;
+  size_t part = 0;
+  for (i = 0; i < treeinfo->partition_count; ++i)
+  {
+    pll_partition_t * partition = treeinfo->partitions[i];
+
+    if (!(treeinfo->params_to_optimize[i] & PLLMOD_OPT_PARAM_SUBST_RATES))
+      continue;
+
+    if (!partition || !x[part] || skip[part])
+    {
+      part++;
+      continue;
+    }
+
+    int * symmetries          = treeinfo->subst_matrix_symmetries[i];
+    unsigned int subst_params = (partition->states * (partition->states-1))/2;
+    double * subst_grad       = (double *) malloc(subst_params * sizeof(double));
+
+    if (!subst_grad)
+    {
+      pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                       "Cannot allocate memory for gradient");
+      return PLL_FAILURE;
+    }
+
+    if (!treeinfo_model_gradient(treeinfo, i, params_index, subst_grad, NULL))
+    {
+      free(subst_grad);
+      return PLL_FAILURE;
+    }
+
+    /* chain rule: the last rate is fixed, symmetric rates share a variable.
+       The score is the negative log-likelihood. */
+    if (symmetries)
+    {
+      size_t l, k = 0;
+      for (l = 0; l <= subst_free_params[part]; ++l)
+      {
+        if (l == (unsigned int)symmetries[subst_params - 1])
+          continue;
+
+        g[part][k] = 0.;
+        for (j = 0; j < subst_params; j++)
+          if ((unsigned int)symmetries[j] == l)
+            g[part][k] -= subst_grad[j];
+        k++;
+      }
+    }
+    else
+    {
+      for (j = 0; j < subst_params - 1; ++j)
+        g[part][j] = -subst_grad[j];
+    }
+
+    free(subst_grad);
+    part++;
+  }
+
+  return PLL_SUCCESS;
+}
+
+int target_freqs_grad_multi(void * p, double ** x, double ** g, int * skip)
+{
+  struct treeinfo_opt_params * params = (struct treeinfo_opt_params *) p;
+
+  pllmod_treeinfo_t * treeinfo      = params->treeinfo;
+  unsigned int params_index         = params->params_index;
+  unsigned int * highest_freq_state = params->fixed_var_index;
+
+  size_t i, j;
+  size_t part = 0;
+  for (i = 0; i < treeinfo->partition_count; ++i)
+  {
+    pll_partition_t * partition = treeinfo->partitions[i];
+
+    if (!(treeinfo->params_to_optimize[i] & PLLMOD_OPT_PARAM_FREQUENCIES))
+      continue;
+
+    if (!partition || !x[part] || skip[part])
+    {
+      part++;
+      continue;
+    }
+
+    unsigned int states  = partition->states;
+    const double * freqs = partition->frequencies[params_index];
+    double * freqs_grad  = (double *) malloc(states * sizeof(double));
+
+    if (!freqs_grad)
+    {
+      pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                       "Cannot allocate memory for gradient");
+      return PLL_FAILURE;
+    }
+
+    if (!treeinfo_model_gradient(treeinfo, i, params_index, NULL, freqs_grad))
+    {
+      free(freqs_grad);
+      return PLL_FAILURE;
+    }
+
+    /* chain rule: freqs[j] = x[j] / sum_ratios and the highest frequency
+       is 1 / sum_ratios, hence dfreqs[j]/dx[m] = (delta_jm - freqs[j]) *
+       freqs[highest]. The score is the negative log-likelihood. */
+    double weighted_sum = 0.;
+    for (j = 0; j < states; ++j)
+      weighted_sum += freqs[j] * freqs_grad[j];
+
+    unsigned int cur_index = 0;
+    for (j = 0; j < states; ++j)
+    {
+      if (j != highest_freq_state[part])
+      {
+        g[part][cur_index] = -(freqs_grad[j] - weighted_sum) *
+                             freqs[highest_freq_state[part]];
+        cur_index++;
+      }
+    }
+
+    free(freqs_grad);
+    part++;
+  }
+
+  return PLL_SUCCESS;
+}
+
+/* static functions */
+
+static int treeinfo_model_gradient(pllmod_treeinfo_t * treeinfo,
+                                   unsigned int partition_index,
+                                   unsigned int params_index,
+                                   double * subst_grad,
+                                   double * freqs_grad)
+{
+  const double brlen_scaler =
+      (treeinfo->brlen_linkage == PLLMOD_TREE_BRLEN_SCALED) ?
+          treeinfo->brlen_scalers[partition_index] : 1.;
+
+  return pllmod_opt_compute_model_gradient(
+                                  treeinfo->partitions[partition_index],
+                                  treeinfo->root,
+                                  treeinfo->param_indices[partition_index],
+                                  params_index,
+                                  brlen_scaler,
+                                  subst_grad,
+                                  freqs_grad);
+}
+
+static void invalidate_partition(pllmod_treeinfo_t * treeinfo,
+                                 unsigned int partition_index)
+{
+  const int old_active_partition = treeinfo->active_partition;
+
+  pllmod_treeinfo_set_active_partition(treeinfo, (int) partition_index);
+  pllmod_treeinfo_invalidate_all(treeinfo);
+  pllmod_treeinfo_set_active_partition(treeinfo, old_active_partition);
+}
+
+static double sitecat_loglh(const pll_partition_t * partition,
+                            const double * sitecat_lh,
+                            const double * site_logscale)
+{
+  unsigned int s, k;
+  unsigned int rate_cats = partition->rate_cats;
+  const double * weights = partition->rate_weights;
+  double loglh = 0.;
+
+  for (s = 0; s < partition->sites; ++s)
+  {
+    double site_lh = 0.;
+    for (k = 0; k < rate_cats; ++k)
+      site_lh += weights[k] * sitecat_lh[(size_t) s * rate_cats + k];
+
+    loglh += partition->pattern_weights[s] * (log(site_lh) + site_logscale[s]);
+  }
+
+  return loglh;
+}
@@ -69,6 +69,9 @@ struct treeinfo_opt_params {
   unsigned int * num_free_params;   /* number of free params for each partition*/
   unsigned int * fixed_var_index;   /* which variable is not being optimized */
   treeinfo_param_set_cb param_set_cb;
+  double ** sitecat_lh;             /* cached per-site, per-category root
+                                       likelihoods for each partition (or NULL) */
+  double ** site_logscale;          /* cached per-site log scaling factors */
 };
 
 
@@ -109,5 +112,12 @@ double target_subst_params_func_multi(void * p, double ** x, double * fx,
 double target_freqs_func_multi(void * p, double ** x, double * fx,
                                int * converged);
 
+/* analytic gradients for target_subst_params_func_multi and
+   target_freqs_func_multi, evaluated at the last computed point */
+int target_subst_params_grad_multi(void * p, double ** x, double ** g,
+                                   int * skip);
+
+int target_freqs_grad_multi(void * p, double ** x, double ** g, int * skip);
+
 
 #endif /* ALGO_CALLBACK_H_ */
@@ -253,13 +253,33 @@ static int algo_bestnode_list_next_index(pllmod_bestnode_list_t * best_node_list
   return curr_index;
 }
 
+/* view of the sumtable cache kept in treeinfo, or NULL if it is not set */
+static pllmod_sumtable_cache_t * algo_sumtable_cache(
+                                            pllmod_treeinfo_t * treeinfo,
+                                            pllmod_sumtable_cache_t * cache)
+{
+  if (!treeinfo->sumtable_cache)
+    return NULL;
+
+  cache->buffers       = treeinfo->sumtable_cache;
+  cache->slots         = treeinfo->sumtable_cache_slots;
+  cache->tags          = treeinfo->sumtable_tags;
+  cache->clv_epoch     = treeinfo->clv_epoch;
+  cache->clv_inputs    = treeinfo->clv_inputs;
+  cache->pmatrix_epoch = treeinfo->pmatrix_epoch;
+  cache->epoch         = &treeinfo->sumtable_epoch;
+
+  return cache;
+}
+
 static double algo_optimize_bl_triplet(pll_unode_t * node,
                                        pllmod_treeinfo_t * treeinfo,
                                        double bl_min,
                                        double bl_max,
                                        int smoothings)
 {
-  double new_loglh = pllmod_opt_optimize_branch_lengths_local_multi(
+  pllmod_sumtable_cache_t cache;
+  double new_loglh = pllmod_opt_optimize_branch_lengths_local_multi_cached(
                                                   treeinfo->partitions,
                                                   treeinfo->partition_count,
                                                   node,
@@ -272,9 +292,14 @@ static double algo_optimize_bl_triplet(pll_unode_t * node,
                                                   smoothings,
                                                   1,    /* radius */
                                                   1,    /* keep_update */
+                                                  algo_sumtable_cache(treeinfo,
+                                                                      &cache),
                                                   treeinfo->parallel_context,
                                                   treeinfo->parallel_reduce_cb);
 
+  /* branch lengths changed behind the back of treeinfo */
+  pllmod_treeinfo_invalidate_loglh(treeinfo);
+
   if (new_loglh)
     return -1 * new_loglh;
   else
@@ -290,11 +315,12 @@ static double algo_optimize_bl_iterative(pllmod_treeinfo_t * treeinfo,
                                          double bl_max,
                                          int smoothings)
 {
+  pllmod_sumtable_cache_t cache;
   double new_loglh;
 
   pllmod_treeinfo_compute_loglh(treeinfo, 0);
 
-  new_loglh = pllmod_opt_optimize_branch_lengths_local_multi(
+  new_loglh = pllmod_opt_optimize_branch_lengths_local_multi_cached(
                                                   treeinfo->partitions,
                                                   treeinfo->partition_count,
                                                   treeinfo->root,
@@ -307,8 +333,14 @@ static double algo_optimize_bl_iterative(pllmod_treeinfo_t * treeinfo,
                                                   smoothings,
                                                   -1,    /* radius */
                                                   1,    /* keep_update */
+                                                  algo_sumtable_cache(treeinfo,
+                                                                      &cache),
                                                   treeinfo->parallel_context,
                                                   treeinfo->parallel_reduce_cb);
+
+  /* branch lengths changed behind the back of treeinfo */
+  pllmod_treeinfo_invalidate_loglh(treeinfo);
+
   if (new_loglh)
     return -1 * new_loglh;
   else
@@ -35,6 +35,8 @@
 #include "algo_callback.h"
 #include "../pllmod_common.h"
 
+#include <sys/time.h>
+
 static void fill_rates   (double *rates,
                           double *x,
                           int *bt, double *lb, double *ub,
@@ -646,6 +648,10 @@ double pllmod_algo_opt_onedim_treeinfo_custom(pllmod_treeinfo_t * treeinfo,
   {
     double * param_vals = (double *) malloc(param_count * sizeof(double));
 
+    /* branch lengths or other partitions may have changed since the last
+       likelihood computation: do not reuse it in the dirty evaluations */
+    pllmod_treeinfo_invalidate_loglh(treeinfo);
+
     /* collect current values of parameters */
     size_t j = 0;
     for (i = 0; i < treeinfo->partition_count; ++i)
@@ -673,11 +679,12 @@ double pllmod_algo_opt_onedim_treeinfo_custom(pllmod_treeinfo_t * treeinfo,
     opt_params.num_opt_partitions = param_count;
     opt_params.param_set_cb       = params_setter;
 
-    /* run BRENT optimization for all partitions in parallel */
-    int ret = pllmod_opt_minimize_brent_multi(param_count,
+    /* run BRENT optimization for all partitions in a batch: converged
+       partitions are not re-evaluated */
+    int ret = pllmod_opt_minimize_brent_batch(param_count,
                                               &min_value, param_vals, &max_value,
                                               tolerance, param_vals,
-                                              NULL, NULL,  /* fx, f2x */
+                                              NULL, NULL,  /* fx, eval_counts */
                                               (void *) &opt_params,
                                               &target_func_onedim_treeinfo,
                                               1 /* global_range */
@@ -740,6 +747,49 @@ PLL_EXPORT double pllmod_algo_opt_onedim_treeinfo(pllmod_treeinfo_t * treeinfo,
                                                 tolerance);
 }
 
+/* analytic gradients are used only if they are available for all partitions
+   in all threads, since finite differences require collective evaluations.
+   The gradient integrates over the branch lengths stored in the tree, which
+   may not be the ones used for the p-matrices if they are unlinked */
+static int treeinfo_model_gradient_available(
+                                          const pllmod_treeinfo_t * treeinfo,
+                                          int param_to_optimize)
+{
+  double available = 1.;
+  unsigned int i, k;
+
+  if (treeinfo->brlen_linkage == PLLMOD_TREE_BRLEN_UNLINKED)
+    available = 0.;
+
+  for (i = 0; i < treeinfo->partition_count; ++i)
+  {
+    const pll_partition_t * partition = treeinfo->partitions[i];
+
+    if (!partition || !(treeinfo->params_to_optimize[i] & param_to_optimize))
+      continue;
+
+    if (partition->asc_bias_alloc)
+      available = 0.;
+
+    for (k = 0; k < partition->rate_cats; ++k)
+      if (partition->prop_invar[treeinfo->param_indices[i][k]] > 0.)
+        available = 0.;
+
+#ifdef PLL_ATTRIB_RATE_SCALERS
+    if (partition->attributes & PLL_ATTRIB_RATE_SCALERS)
+      available = 0.;
+#endif
+  }
+
+  if (treeinfo->parallel_reduce_cb)
+  {
+    treeinfo->parallel_reduce_cb(treeinfo->parallel_context, &available, 1,
+                                 PLLMOD_TREE_REDUCE_MIN);
+  }
+
+  return available > 0.;
+}
+
 PLL_EXPORT
 double pllmod_algo_opt_subst_rates_treeinfo (pllmod_treeinfo_t * treeinfo,
                                              unsigned int params_index,
@@ -791,6 +841,9 @@ double pllmod_algo_opt_subst_rates_treeinfo (pllmod_treeinfo_t * treeinfo,
   if (!part_count)
     return pllmod_treeinfo_compute_loglh(treeinfo, 0);
 
+  /* see pllmod_algo_opt_onedim_treeinfo_custom */
+  pllmod_treeinfo_invalidate_loglh(treeinfo);
+
   x  = (double **) malloc(sizeof(double*) * (part_count));
   lb = (double **) malloc(sizeof(double*) * (part_count));
   ub = (double **) malloc(sizeof(double*) * (part_count));
@@ -892,12 +945,26 @@ double pllmod_algo_opt_subst_rates_treeinfo (pllmod_treeinfo_t * treeinfo,
   opt_params.num_free_params    = subst_free_params;
   opt_params.fixed_var_index    = NULL;
 
-  cur_logl = pllmod_opt_minimize_lbfgsb_multi(part_count, x, lb, ub, bt,
+  if (treeinfo_model_gradient_available(treeinfo,
+                                         PLLMOD_OPT_PARAM_SUBST_RATES))
+  {
+    cur_logl = pllmod_opt_minimize_lbfgsb_multi_grad(part_count, x, lb, ub, bt,
+                                              subst_free_params,
+                                              max_free_params,
+                                              factor, tolerance,
+                                              (void *) &opt_params,
+                                              target_subst_params_func_multi,
+                                              target_subst_params_grad_multi);
+  }
+  else
+  {
+    cur_logl = pllmod_opt_minimize_lbfgsb_multi(part_count, x, lb, ub, bt,
                                               subst_free_params,
                                               max_free_params,
                                               factor, tolerance,
                                               (void *) &opt_params,
                                               target_subst_params_func_multi);
+  }
 
   /* cleanup */
   for (i = 0; i < part_count; ++i)
@@ -959,6 +1026,9 @@ double pllmod_algo_opt_frequencies_treeinfo (pllmod_treeinfo_t * treeinfo,
   if (!part_count)
     return -1 * pllmod_treeinfo_compute_loglh(treeinfo, 0);
 
+  /* see pllmod_algo_opt_onedim_treeinfo_custom */
+  pllmod_treeinfo_invalidate_loglh(treeinfo);
+
   /* IMPORTANT: we need to know max_free_params among all threads! */
   if (treeinfo->parallel_reduce_cb)
   {
@@ -1044,12 +1114,26 @@ double pllmod_algo_opt_frequencies_treeinfo (pllmod_treeinfo_t * treeinfo,
 
   assert(part == part_count);
 
-  cur_logl = pllmod_opt_minimize_lbfgsb_multi(part_count, x, lb, ub, bt,
+  if (treeinfo_model_gradient_available(treeinfo,
+                                         PLLMOD_OPT_PARAM_FREQUENCIES))
+  {
+    cur_logl = pllmod_opt_minimize_lbfgsb_multi_grad(part_count, x, lb, ub, bt,
+                                              num_free_params,
+                                              max_free_params,
+                                              factor, tolerance,
+                                              (void *) &opt_params,
+                                              target_freqs_func_multi,
+                                              target_freqs_grad_multi);
+  }
+  else
+  {
+    cur_logl = pllmod_opt_minimize_lbfgsb_multi(part_count, x, lb, ub, bt,
                                               num_free_params,
                                               max_free_params,
                                               factor, tolerance,
                                               (void *) &opt_params,
                                               target_freqs_func_multi);
+  }
 
   /* cleanup */
   for (i = 0; i < part_count; ++i)
@@ -1069,6 +1153,196 @@ double pllmod_algo_opt_frequencies_treeinfo (pllmod_treeinfo_t * treeinfo,
   return cur_logl;
 }
 
+static void treeinfo_clear_sitecat_cache(struct treeinfo_opt_params * params)
+{
+  unsigned int part;
+
+  for (part = 0; part < params->num_opt_partitions; ++part)
+  {
+    if (params->sitecat_lh[part])
+      free(params->sitecat_lh[part]);
+    if (params->site_logscale[part])
+      free(params->site_logscale[part]);
+    params->sitecat_lh[part] = params->site_logscale[part] = NULL;
+  }
+}
+
+/* cache the per-site, per-category root likelihoods of the partitions
+   optimizing the rate weights. Partitions for which the cache is not
+   available (or cannot be allocated) are evaluated with a full traversal */
+static void treeinfo_update_sitecat_cache(pllmod_treeinfo_t * treeinfo,
+                                          struct treeinfo_opt_params * params)
+{
+  unsigned int i;
+  unsigned int part = 0;
+
+  if (!params->sitecat_lh || !params->site_logscale)
+    return;
+
+  /* CLVs must be up to date with the current rates */
+  pllmod_treeinfo_compute_loglh(treeinfo, 0);
+
+  for (i = 0; i < treeinfo->partition_count; ++i)
+  {
+    pll_partition_t * partition = treeinfo->partitions[i];
+
+    /* same indexing as in target_func_multidim_treeinfo() */
+    if (!(treeinfo->params_to_optimize[i] & PLLMOD_OPT_PARAM_RATE_WEIGHTS))
+      continue;
+
+    if (partition)
+    {
+      double * sitecat_lh = (double *) malloc(sizeof(double) *
+                                      partition->sites * partition->rate_cats);
+      double * site_logscale = (double *) malloc(sizeof(double) *
+                                                 partition->sites);
+
+      if (sitecat_lh && site_logscale &&
+          pllmod_opt_compute_edge_sitecat_lk(partition,
+                                             treeinfo->root,
+                                             treeinfo->param_indices[i],
+                                             sitecat_lh,
+                                             site_logscale))
+      {
+        params->sitecat_lh[part] = sitecat_lh;
+        params->site_logscale[part] = site_logscale;
+      }
+      else
+      {
+        /* not an error: fall back to the full evaluation */
+        pll_errno = 0;
+        if (sitecat_lh)
+          free(sitecat_lh);
+        if (site_logscale)
+          free(site_logscale);
+      }
+    }
+
+    part++;
+  }
+}
+
+/* optimize the rate weights with EM from the cached root likelihoods.
+   Returns 0 (and leaves the weights to L-BFGS-B) unless the cache is
+   available for every partition on every thread */
+static int treeinfo_opt_weights_em(pllmod_treeinfo_t * treeinfo,
+                                   struct treeinfo_opt_params * params,
+                                   double tolerance)
+{
+  unsigned int i, s;
+  unsigned int part = 0;
+  unsigned int part_count = params->num_opt_partitions;
+  double success = 1.;
+
+  if (!params->sitecat_lh || !params->site_logscale)
+    success = 0.;
+  else
+  {
+    for (i = 0; i < treeinfo->partition_count; ++i)
+    {
+      if (!(treeinfo->params_to_optimize[i] & PLLMOD_OPT_PARAM_RATE_WEIGHTS))
+        continue;
+      if (treeinfo->partitions[i] && !params->sitecat_lh[part])
+        success = 0.;
+      part++;
+    }
+  }
+
+  if (treeinfo->parallel_reduce_cb)
+  {
+    treeinfo->parallel_reduce_cb(treeinfo->parallel_context, &success, 1,
+                                 PLLMOD_TREE_REDUCE_MIN);
+  }
+
+  if (!(success > 0.))
+    return 0;
+
+  double ** w = (double **) calloc(part_count, sizeof(double *));
+  unsigned int * w_count = (unsigned int *) calloc(part_count,
+                                                   sizeof(unsigned int));
+  const unsigned int ** site_w = (const unsigned int **) calloc(part_count,
+                                                   sizeof(unsigned int *));
+  unsigned int * sites = (unsigned int *) calloc(part_count,
+                                                 sizeof(unsigned int));
+  double * loglh = (double *) calloc(part_count, sizeof(double));
+
+  if (!w || !w_count || !site_w || !sites || !loglh)
+    success = 0.;
+  else
+  {
+    part = 0;
+    for (i = 0; i < treeinfo->partition_count; ++i)
+    {
+      pll_partition_t * partition = treeinfo->partitions[i];
+
+      if (!(treeinfo->params_to_optimize[i] & PLLMOD_OPT_PARAM_RATE_WEIGHTS))
+        continue;
+
+      if (partition)
+      {
+        w[part]       = partition->rate_weights;
+        w_count[part] = partition->rate_cats;
+        site_w[part]  = partition->pattern_weights;
+        sites[part]   = partition->sites;
+      }
+      part++;
+    }
+
+    success = pllmod_opt_minimize_em_multi(part_count, w, w_count,
+                                   (const double * const *) params->sitecat_lh,
+                                   site_w, sites,
+                                   PLLMOD_ALGO_MIN_WEIGHT_RATIO, tolerance,
+                                   PLLMOD_ALGO_EM_MAX_STEPS, 1,
+                                   treeinfo->parallel_context,
+                                   treeinfo->parallel_reduce_cb,
+                                   loglh);
+  }
+
+  if (success > 0.)
+  {
+    /* weights do not affect the CLVs: partitions stay clean */
+    part = 0;
+    for (i = 0; i < treeinfo->partition_count; ++i)
+    {
+      pll_partition_t * partition = treeinfo->partitions[i];
+
+      if (!(treeinfo->params_to_optimize[i] & PLLMOD_OPT_PARAM_RATE_WEIGHTS))
+        continue;
+
+      if (partition)
+      {
+        for (s = 0; s < partition->sites; ++s)
+          loglh[part] += partition->pattern_weights[s] *
+                         params->site_logscale[part][s];
+        treeinfo->local_loglh[i] = loglh[part];
+      }
+      part++;
+    }
+  }
+  else
+    pll_errno = 0;
+
+  if (w)
+    free(w);
+  if (w_count)
+    free(w_count);
+  if (site_w)
+    free(site_w);
+  if (sites)
+    free(sites);
+  if (loglh)
+    free(loglh);
+
+  /* all threads must agree on whether L-BFGS-B is needed */
+  if (treeinfo->parallel_reduce_cb)
+  {
+    treeinfo->parallel_reduce_cb(treeinfo->parallel_context, &success, 1,
+                                 PLLMOD_TREE_REDUCE_MIN);
+  }
+
+  return success > 0.;
+}
+
 PLL_EXPORT
 double pllmod_algo_opt_rates_weights_treeinfo (pllmod_treeinfo_t * treeinfo,
                                                double min_rate,
@@ -1109,6 +1383,9 @@ double pllmod_algo_opt_rates_weights_treeinfo (pllmod_treeinfo_t * treeinfo,
   if (!part_count)
     return -1 * pllmod_treeinfo_compute_loglh(treeinfo, 0);
 
+  /* see pllmod_algo_opt_onedim_treeinfo_custom */
+  pllmod_treeinfo_invalidate_loglh(treeinfo);
+
   /* IMPORTANT: we need to know max_free_params among all threads! */
   if (treeinfo->parallel_reduce_cb)
   {
@@ -1158,6 +1435,8 @@ double pllmod_algo_opt_rates_weights_treeinfo (pllmod_treeinfo_t * treeinfo,
   opt_params.params_index   = 0;
   opt_params.fixed_var_index = (unsigned int *) calloc(part_count,
                                                        sizeof(unsigned int));
+  opt_params.sitecat_lh    = (double **) calloc(part_count, sizeof(double *));
+  opt_params.site_logscale = (double **) calloc(part_count, sizeof(double *));
 
   /* 2 step BFGS */
 
@@ -1194,12 +1473,20 @@ double pllmod_algo_opt_rates_weights_treeinfo (pllmod_treeinfo_t * treeinfo,
 
     opt_params.param_to_optimize = PLLMOD_OPT_PARAM_RATE_WEIGHTS;
 
-    cur_logl = pllmod_opt_minimize_lbfgsb_multi(part_count, x, lb, ub, bt,
+    /* weights do not affect the CLVs: evaluate them at the root only */
+    treeinfo_update_sitecat_cache(treeinfo, &opt_params);
+
+    if (!treeinfo_opt_weights_em(treeinfo, &opt_params, tolerance))
+    {
+      cur_logl = pllmod_opt_minimize_lbfgsb_multi(part_count, x, lb, ub, bt,
                                                 num_free_params,
                                                 max_free_params,
                                                 factor, tolerance,
                                                 (void *) &opt_params,
                                                 target_func_multidim_treeinfo);
+    }
+
+    treeinfo_clear_sitecat_cache(&opt_params);
 
     /* optimize mixture rates */
 
@@ -1299,6 +1586,298 @@ double pllmod_algo_opt_rates_weights_treeinfo (pllmod_treeinfo_t * treeinfo,
   free(bt);
 
   free(opt_params.fixed_var_index);
+  free(opt_params.sitecat_lh);
+  free(opt_params.site_logscale);
+
+  return -1 * cur_logl;
+}
+
+/* parameter groups handled by the model optimization scheduler, in the
+   default order */
+static const int model_groups[PLLMOD_ALGO_MODEL_GROUPS] =
+{
+  PLLMOD_OPT_PARAM_SUBST_RATES,
+  PLLMOD_OPT_PARAM_FREQUENCIES,
+  PLLMOD_OPT_PARAM_ALPHA,
+  PLLMOD_OPT_PARAM_FREE_RATES | PLLMOD_OPT_PARAM_RATE_WEIGHTS
+};
+
+static double model_wtime(void)
+{
+  struct timeval t;
+  gettimeofday(&t, NULL);
+  return t.tv_sec + t.tv_usec * 1e-6;
+}
+
+/* the group optimizers return -loglh, or either PLL_FAILURE or -INFINITY on
+   error, and set pll_errno (which is reset before each of them) */
+static int model_group_failed(double result)
+{
+  if (!pll_errno && (result == (double) PLL_FAILURE || result == -INFINITY ||
+                     result != result))
+  {
+    pllmod_set_error(PLLMOD_OPT_ERROR_LBFGSB_UNKNOWN,
+                     "Model parameter optimization failed");
+  }
+
+  return pll_errno != 0;
+}
+
+static double model_group_optimize(pllmod_treeinfo_t * treeinfo,
+                                   int group,
+                                   double tolerance)
+{
+  switch (group)
+  {
+    case PLLMOD_OPT_PARAM_SUBST_RATES:
+      return pllmod_algo_opt_subst_rates_treeinfo(treeinfo, 0,
+                                                  PLLMOD_OPT_MIN_SUBST_RATE,
+                                                  PLLMOD_OPT_MAX_SUBST_RATE,
+                                                  PLLMOD_ALGO_BFGS_FACTR,
+                                                  tolerance);
+    case PLLMOD_OPT_PARAM_FREQUENCIES:
+      return pllmod_algo_opt_frequencies_treeinfo(treeinfo, 0,
+                                                  PLLMOD_OPT_MIN_FREQ,
+                                                  PLLMOD_OPT_MAX_FREQ,
+                                                  PLLMOD_ALGO_BFGS_FACTR,
+                                                  tolerance);
+    case PLLMOD_OPT_PARAM_ALPHA:
+      return pllmod_algo_opt_onedim_treeinfo(treeinfo, PLLMOD_OPT_PARAM_ALPHA,
+                                             PLLMOD_OPT_MIN_ALPHA,
+                                             PLLMOD_OPT_MAX_ALPHA,
+                                             tolerance);
+    default:
+      return pllmod_algo_opt_rates_weights_treeinfo(treeinfo,
+                                                    PLLMOD_OPT_MIN_RATE,
+                                                    PLLMOD_OPT_MAX_RATE,
+                                                    PLLMOD_ALGO_BFGS_FACTR,
+                                                    tolerance);
+  }
+}
+
+/**
+ * Optimize the model parameters of all partitions, scheduling the parameter
+ * groups adaptively.
+ *
+ * In each round, the active groups (substitution rates and frequencies of the
+ * first parameter set, alpha, free rates and weights) are optimized once, in
+ * decreasing order of their last log-likelihood gain per second. A group is
+ * stopped when its gain in a round drops below `epsilon`, or when its gain per
+ * second drops below PLLMOD_ALGO_MODEL_MIN_RATE_RATIO times the one of the best
+ * group. A partition is dropped from a group when its own gain drops below
+ * `epsilon` / partition_count. The optimization ends when all groups are
+ * stopped, the gain of a round is below `epsilon`, or after `max_rounds`.
+ *
+ * @param treeinfo treeinfo structure
+ * @param params_to_optimize parameter groups to optimize (PLLMOD_OPT_PARAM_*);
+ *        partitions are selected by treeinfo->params_to_optimize, as usual
+ * @param tolerance tolerance passed to the optimization of each group
+ * @param epsilon minimum log-likelihood gain to keep optimizing
+ * @param max_rounds maximum number of rounds (0 = unlimited)
+ * @param stats timing and gain breakdown of each of the
+ *        PLLMOD_ALGO_MODEL_GROUPS groups [out] (can be NULL); the
+ *        per-partition gains are filled in if `partition_gain` is set
+ *
+ * @return the negated log-likelihood score (-loglh, as the other
+ *         pllmod_algo_opt_*_treeinfo functions), or PLL_FAILURE on error, in
+ *         which case pll_errno is set by the failing parameter group
+ */
+PLL_EXPORT
+double pllmod_algo_opt_model_treeinfo (pllmod_treeinfo_t * treeinfo,
+                                       int params_to_optimize,
+                                       double tolerance,
+                                       double epsilon,
+                                       unsigned int max_rounds,
+                                       pllmod_algo_model_stats_t * stats)
+{
+  const unsigned int partition_count = treeinfo->partition_count;
+  const double partition_epsilon = epsilon / partition_count;
+  pllmod_algo_model_stats_t local_stats[PLLMOD_ALGO_MODEL_GROUPS];
+  double rate[PLLMOD_ALGO_MODEL_GROUPS];
+  int active[PLLMOD_ALGO_MODEL_GROUPS];
+  unsigned int order[PLLMOD_ALGO_MODEL_GROUPS];
+  int * saved_params;
+  double * old_partition_loglh;
+  double cur_logl, round_gain;
+  unsigned int round = 0;
+  unsigned int g, i, j, p;
+  int failed = 0;
+
+  if (!stats)
+  {
+    for (g = 0; g < PLLMOD_ALGO_MODEL_GROUPS; ++g)
+      local_stats[g].partition_gain = NULL;
+    stats = local_stats;
+  }
+
+  saved_params = (int *) malloc(partition_count * sizeof(int));
+  old_partition_loglh = (double *) malloc(partition_count * sizeof(double));
+  if (!saved_params || !old_partition_loglh)
+  {
+    free(saved_params);
+    free(old_partition_loglh);
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for model optimization");
+    return (double) PLL_FAILURE;
+  }
+
+  /* partitions are dropped from low-yield groups by masking their flags */
+  memcpy(saved_params, treeinfo->params_to_optimize,
+         partition_count * sizeof(int));
+
+  for (g = 0; g < PLLMOD_ALGO_MODEL_GROUPS; ++g)
+  {
+    stats[g].param = model_groups[g];
+    stats[g].runs = 0;
+    stats[g].time = 0.;
+    stats[g].gain = 0.;
+    stats[g].stop_round = 0;
+    if (stats[g].partition_gain)
+      memset(stats[g].partition_gain, 0, partition_count * sizeof(double));
+
+    /* untried groups come first, in the default order */
+    rate[g] = INFINITY;
+    active[g] = 0;
+    if (params_to_optimize & model_groups[g])
+    {
+      for (p = 0; p < partition_count; ++p)
+        active[g] |= (saved_params[p] & model_groups[g]) != 0;
+    }
+  }
+
+  cur_logl = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+
+  do
+  {
+    unsigned int active_count = 0;
+    double best_rate = 0.;
+
+    for (g = 0; g < PLLMOD_ALGO_MODEL_GROUPS; ++g)
+    {
+      if (active[g])
+        order[active_count++] = g;
+    }
+
+    if (!active_count)
+      break;
+
+    /* highest gain per second first (stable) */
+    for (i = 1; i < active_count; ++i)
+    {
+      unsigned int cur = order[i];
+      for (j = i; j > 0 && rate[order[j-1]] < rate[cur]; --j)
+        order[j] = order[j-1];
+      order[j] = cur;
+    }
+
+    round_gain = 0.;
+    ++round;
+
+    for (i = 0; i < active_count; ++i)
+    {
+      const int group = model_groups[order[i]];
+      pllmod_algo_model_stats_t * group_stats = stats + order[i];
+      double start_logl = cur_logl;
+      double elapsed, gain, status;
+      int group_partitions = 0;
+
+      memcpy(old_partition_loglh, treeinfo->partition_loglh,
+             partition_count * sizeof(double));
+
+      pllmod_reset_error();
+      elapsed = model_wtime();
+      status = model_group_failed(model_group_optimize(treeinfo, group,
+                                                       tolerance)) ? 1. : 0.;
+
+      /* stop on all threads if any of them failed */
+      if (treeinfo->parallel_reduce_cb)
+      {
+        treeinfo->parallel_reduce_cb(treeinfo->parallel_context, &status, 1,
+                                     PLLMOD_TREE_REDUCE_MAX);
+      }
+
+      if (status)
+      {
+        if (!pll_errno)
+          pllmod_set_error(PLLMOD_OPT_ERROR_LBFGSB_UNKNOWN,
+                           "Model parameter optimization failed on another "
+                           "thread");
+        failed = 1;
+        break;
+      }
+      cur_logl = pllmod_treeinfo_compute_loglh(treeinfo, 1);
+      elapsed = model_wtime() - elapsed;
+
+      /* the timings differ among threads: agree on the slowest one, so that
+         all threads take the same scheduling decisions */
+      if (treeinfo->parallel_reduce_cb)
+      {
+        treeinfo->parallel_reduce_cb(treeinfo->parallel_context, &elapsed, 1,
+                                     PLLMOD_TREE_REDUCE_MAX);
+      }
+
+      gain = cur_logl - start_logl;
+      round_gain += gain;
+
+      group_stats->runs++;
+      group_stats->time += elapsed;
+      group_stats->gain += gain;
+
+      rate[order[i]] = gain / (elapsed > 0. ? elapsed : 1e-9);
+      if (rate[order[i]] > best_rate)
+        best_rate = rate[order[i]];
+
+      for (p = 0; p < partition_count; ++p)
+      {
+        if (!(treeinfo->params_to_optimize[p] & group))
+          continue;
+
+        const double partition_gain =
+            treeinfo->partition_loglh[p] - old_partition_loglh[p];
+
+        if (group_stats->partition_gain)
+          group_stats->partition_gain[p] += partition_gain;
+
+        if (partition_gain < partition_epsilon)
+          treeinfo->params_to_optimize[p] &= ~group;
+        else
+          group_partitions = 1;
+      }
+
+      if (gain < epsilon || !group_partitions)
+      {
+        active[order[i]] = 0;
+        group_stats->stop_round = round;
+      }
+
+      DBG("Model round %u: group %d, gain %.6f in %.3f s\n",
+          round, group, gain, elapsed);
+    }
+
+    if (failed)
+      break;
+
+    /* stop the groups that yield much less than the best one */
+    for (g = 0; g < PLLMOD_ALGO_MODEL_GROUPS; ++g)
+    {
+      if (active[g] && rate[g] < best_rate * PLLMOD_ALGO_MODEL_MIN_RATE_RATIO)
+      {
+        active[g] = 0;
+        stats[g].stop_round = round;
+      }
+    }
+  }
+  while (round_gain >= epsilon && (!max_rounds || round < max_rounds));
+
+  /* restore the partition flags */
+  memcpy(treeinfo->params_to_optimize, saved_params,
+         partition_count * sizeof(int));
+
+  free(saved_params);
+  free(old_partition_loglh);
+
+  if (failed)
+    return (double) PLL_FAILURE;
 
   return -1 * cur_logl;
 }
@@ -28,6 +28,11 @@
 #define PLLMOD_ALGO_MIN_WEIGHT_RATIO   0.1
 #define PLLMOD_ALGO_MAX_WEIGHT_RATIO    10
 #define PLLMOD_ALGO_BFGS_FACTR         1e9
+#define PLLMOD_ALGO_EM_MAX_STEPS        100
+
+/* model optimization scheduler (pllmod_algo_opt_model_treeinfo) */
+#define PLLMOD_ALGO_MODEL_GROUPS          4
+#define PLLMOD_ALGO_MODEL_MIN_RATE_RATIO  0.01
 
 // it's actually defined in lbfgsb.h, but not exported from the optimize module
 #define PLLMOD_ALGO_LBFGSB_ERROR       1.0e-4
@@ -46,6 +51,18 @@ typedef struct cutoff_info
   int lh_dec_count;
 } cutoff_info_t;
 
+/* timing and gain breakdown of a parameter group, see
+   pllmod_algo_opt_model_treeinfo */
+typedef struct pllmod_algo_model_stats
+{
+  int param;                /* parameter group (PLLMOD_OPT_PARAM_*) */
+  unsigned int runs;        /* number of optimization runs */
+  double time;              /* total run time, in seconds */
+  double gain;              /* total log-likelihood gain */
+  double * partition_gain;  /* per-partition gain (optional, caller-owned) */
+  unsigned int stop_round;  /* round after which the group was stopped */
+} pllmod_algo_model_stats_t;
+
 typedef int (*treeinfo_param_set_cb)(pllmod_treeinfo_t * treeinfo,
                                      unsigned int  part_num,
                                      const double * param_vals,
@@ -172,6 +189,15 @@ double pllmod_algo_opt_rates_weights_treeinfo (pllmod_treeinfo_t * treeinfo,
                                                double tolerance);
 
 
+PLL_EXPORT
+double pllmod_algo_opt_model_treeinfo (pllmod_treeinfo_t * treeinfo,
+                                       int params_to_optimize,
+                                       double tolerance,
+                                       double epsilon,
+                                       unsigned int max_rounds,
+                                       pllmod_algo_model_stats_t * stats);
+
+
 /* search */
 
 PLL_EXPORT double pllmod_algo_spr_round(pllmod_treeinfo_t * treeinfo,
@@ -0,0 +1,557 @@
+/*
+ Copyright (C) 2017 Diego Darriba, Pierre Barbera
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+
+/**
+ * @file binary_async.c
+ *
+ * @brief Asynchronous (background) writing of binary files
+ *
+ * Blocks are serialized into memory buffers in the calling thread, such that
+ * the caller can modify the partitions and trees right after each dump call.
+ * A background thread writes the buffers to a temporary file, which is
+ * renamed to the final file name once all blocks have been written. Hence,
+ * a previous checkpoint file is never left in a partially written state.
+ *
+ * @author Diego Darriba
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "pll_binary.h"
+#include "binary_io_operations.h"
+#include "../pllmod_common.h"
+
+#define ASYNC_TMP_SUFFIX ".tmp"
+
+/* serialized block waiting to be written */
+typedef struct async_block_s
+{
+  pll_block_header_t header;
+  char * data;
+  size_t len;
+  struct async_block_s * next;
+} async_block_t;
+
+struct pll_binary_async_s
+{
+  char * filename;            //! final file name
+  char * tmp_filename;        //! file being written
+  FILE * bin_file;
+
+  async_block_t * head;       //! queue of pending blocks
+  async_block_t * tail;
+  int committed;              //! no more blocks will be queued
+  int finished;               //! writer thread is done
+  int dump_failed;            //! a block could not be queued
+
+  int status;                 //! PLL_SUCCESS or PLL_FAILURE
+  int error_code;             //! error raised in the writer thread
+  char error_msg[PLLMOD_ERRMSG_LEN];
+
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+static void * async_writer(void * arg);
+static int async_write_block(FILE * bin_file, async_block_t * block);
+static int async_enqueue(pll_binary_async_t * async,
+                         pll_block_header_t * block_header,
+                         bin_mem_stream_t * mem_stream);
+static int async_dump_error(pll_binary_async_t * async,
+                            bin_mem_stream_t * mem_stream);
+static void async_free(pll_binary_async_t * async);
+
+/**
+ *  Create a binary file that is written in the background.
+ *
+ *  The file is created as `filename` followed by ".tmp", and renamed to
+ *  `filename` after pllmod_binary_async_commit() once all blocks are written.
+ *
+ *  @param filename file to write to
+ *  @param access_type PLLMOD_BIN_ACCESS_[SEQUENTIAL|RANDOM]
+ *  @param n_blocks actual or maximum number of blocks if access is random
+ *
+ *  @return handle of the asynchronous write, NULL on error
+ */
+PLL_EXPORT pll_binary_async_t * pllmod_binary_async_create(
+                                                   const char * filename,
+                                                   unsigned int access_type,
+                                                   unsigned int n_blocks)
+{
+  pll_binary_header_t header;
+  pll_binary_async_t * async;
+  size_t name_len = strlen(filename);
+
+  /* reset error */
+  pll_errno = 0;
+
+  async = (pll_binary_async_t *) calloc(1, sizeof(pll_binary_async_t));
+  if (!async)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for asynchronous writer");
+    return NULL;
+  }
+
+  async->filename = (char *) malloc(name_len + 1);
+  async->tmp_filename = (char *) malloc(name_len + sizeof(ASYNC_TMP_SUFFIX));
+  if (!async->filename || !async->tmp_filename)
+  {
+    async_free(async);
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for asynchronous writer");
+    return NULL;
+  }
+  strcpy(async->filename, filename);
+  strcpy(async->tmp_filename, filename);
+  strcat(async->tmp_filename, ASYNC_TMP_SUFFIX);
+
+  async->bin_file = pllmod_binary_create(async->tmp_filename,
+                                         &header,
+                                         access_type,
+                                         n_blocks);
+  if (!async->bin_file)
+  {
+    assert(pll_errno);
+    async_free(async);
+    return NULL;
+  }
+
+  async->status = PLL_SUCCESS;
+  pthread_mutex_init(&async->mutex, NULL);
+  pthread_cond_init(&async->cond, NULL);
+
+  if (pthread_create(&async->thread, NULL, async_writer, async))
+  {
+    pthread_mutex_destroy(&async->mutex);
+    pthread_cond_destroy(&async->cond);
+    fclose(async->bin_file);
+    remove(async->tmp_filename);
+    async_free(async);
+    pllmod_set_error(PLLMOD_BIN_ERROR_BINARY_IO,
+                     "Cannot start asynchronous writer thread");
+    return NULL;
+  }
+
+  return async;
+}
+
+/**
+ *  Snapshot a partition and queue it for writing.
+ *
+ *  The partition can be modified as soon as this function returns.
+ *
+ *  @param async asynchronous write handle
+ *  @param block_id the block id
+ *  @param partition the partition
+ *  @param attributes block attributes (see pllmod_binary_partition_dump)
+ *
+ *  @return PLL_SUCCESS if OK
+ */
+PLL_EXPORT int pllmod_binary_async_partition_dump(pll_binary_async_t * async,
+                                                  int block_id,
+                                                  pll_partition_t * partition,
+                                                  unsigned int attributes)
+{
+  pll_block_header_t block_header;
+  bin_mem_stream_t mem_stream = {NULL, 0, 0};
+
+  /* reset error */
+  pll_errno = 0;
+
+  block_header.block_id   = block_id;
+  block_header.type       = PLLMOD_BIN_BLOCK_PARTITION;
+  block_header.attributes = attributes;
+  block_header.alignment  = 0;
+
+  if (!binary_partition_serialize(&mem_stream, partition, attributes))
+    return async_dump_error(async, &mem_stream);
+
+  /* partition block length includes the block header */
+  block_header.block_len = sizeof(pll_block_header_t) + mem_stream.pos;
+
+  return async_enqueue(async, &block_header, &mem_stream);
+}
+
+/**
+ *  Snapshot a CLV and queue it for writing.
+ *
+ *  @param async asynchronous write handle
+ *  @param block_id the block id
+ *  @param partition the partition
+ *  @param clv_index the CLV index
+ *  @param attributes block attributes (see pllmod_binary_clv_dump)
+ *
+ *  @return PLL_SUCCESS if OK
+ */
+PLL_EXPORT int pllmod_binary_async_clv_dump(pll_binary_async_t * async,
+                                            int block_id,
+                                            pll_partition_t * partition,
+                                            unsigned int clv_index,
+                                            unsigned int attributes)
+{
+  pll_block_header_t block_header;
+  bin_mem_stream_t mem_stream = {NULL, 0, 0};
+  unsigned int sites_alloc = partition->asc_bias_alloc ?
+                 partition->sites + partition->states :
+                 partition->sites;
+
+  size_t clv_size = sites_alloc * partition->states_padded *
+                      partition->rate_cats;
+
+  /* reset error */
+  pll_errno = 0;
+
+  block_header.block_id   = block_id;
+  block_header.type       = PLLMOD_BIN_BLOCK_CLV;
+  block_header.attributes = attributes;
+  block_header.block_len  = clv_size * sizeof(double);
+  block_header.alignment  = (attributes & PLLMOD_BIN_ATTRIB_ALIGNED &&
+                             !(attributes & PLLMOD_BIN_ATTRIB_COMPRESS)) ?
+                            (unsigned int) partition->alignment : 0;
+
+  if (!binary_clv_apply(&mem_stream,
+                        partition,
+                        clv_index,
+                        attributes,
+                        clv_size,
+                        bin_mwrite_func(attributes)))
+    return async_dump_error(async, &mem_stream);
+
+  return async_enqueue(async, &block_header, &mem_stream);
+}
+
+/**
+ *  Snapshot an unrooted tree and queue it for writing.
+ *
+ *  @param async asynchronous write handle
+ *  @param block_id the block id
+ *  @param tree the tree (an inner node)
+ *  @param tip_count number of tips in the tree
+ *  @param attributes block attributes
+ *
+ *  @return PLL_SUCCESS if OK
+ */
+PLL_EXPORT int pllmod_binary_async_utree_dump(pll_binary_async_t * async,
+                                              int block_id,
+                                              pll_unode_t * tree,
+                                              unsigned int tip_count,
+                                              unsigned int attributes)
+{
+  pll_block_header_t block_header;
+  bin_mem_stream_t mem_stream = {NULL, 0, 0};
+  unsigned int n_utrees = tip_count + 3 * (tip_count - 2);
+
+  /* reset error */
+  pll_errno = 0;
+
+  block_header.block_id   = block_id;
+  block_header.type       = PLLMOD_BIN_BLOCK_TREE;
+  block_header.attributes = attributes;
+  block_header.block_len  = n_utrees * sizeof(pll_unode_t);
+  block_header.alignment  = 0;
+
+  if (!binary_utree_serialize(&mem_stream, tree, tip_count))
+    return async_dump_error(async, &mem_stream);
+
+  return async_enqueue(async, &block_header, &mem_stream);
+}
+
+/**
+ *  Snapshot a custom memory region and queue it for writing.
+ *
+ *  @param async asynchronous write handle
+ *  @param block_id the block id
+ *  @param data the data to write
+ *  @param size size of `data` in bytes
+ *  @param attributes block attributes
+ *
+ *  @return PLL_SUCCESS if OK
+ */
+PLL_EXPORT int pllmod_binary_async_custom_dump(pll_binary_async_t * async,
+                                               int block_id,
+                                               void * data,
+                                               size_t size,
+                                               unsigned int attributes)
+{
+  pll_block_header_t block_header;
+  bin_mem_stream_t mem_stream = {NULL, 0, 0};
+
+  /* reset error */
+  pll_errno = 0;
+
+  memset(&block_header, 0, sizeof(pll_block_header_t));
+  block_header.block_id   = block_id;
+  block_header.type       = PLLMOD_BIN_BLOCK_CUSTOM;
+  block_header.attributes = attributes;
+  block_header.block_len  = size;
+  block_header.alignment  = 0;
+
+  if (!bin_mwrite_func(attributes)(data, size, 1, &mem_stream))
+    return async_dump_error(async, &mem_stream);
+
+  return async_enqueue(async, &block_header, &mem_stream);
+}
+
+/**
+ *  Declare that no more blocks will be queued.
+ *
+ *  The writer thread finishes writing the pending blocks and renames the
+ *  temporary file to the final file name. This function does not block.
+ *
+ *  @param async asynchronous write handle
+ *
+ *  @return PLL_SUCCESS if OK
+ */
+PLL_EXPORT int pllmod_binary_async_commit(pll_binary_async_t * async)
+{
+  pthread_mutex_lock(&async->mutex);
+  async->committed = 1;
+  pthread_cond_broadcast(&async->cond);
+  pthread_mutex_unlock(&async->mutex);
+
+  return PLL_SUCCESS;
+}
+
+/**
+ *  Check whether an asynchronous write has finished.
+ *
+ *  @param async asynchronous write handle
+ *
+ *  @return 1 if the writer thread is done, 0 otherwise
+ */
+PLL_EXPORT int pllmod_binary_async_test(pll_binary_async_t * async)
+{
+  int finished;
+
+  pthread_mutex_lock(&async->mutex);
+  finished = async->finished;
+  pthread_mutex_unlock(&async->mutex);
+
+  return finished;
+}
+
+/**
+ *  Wait for an asynchronous write to finish and release the handle.
+ *
+ *  If the write was not committed yet, it is committed here. Errors raised
+ *  in the writer thread are reported through `pll_errno` in the calling
+ *  thread. If any block failed to be written or queued, the temporary file is
+ *  removed and any previous file named `filename` is left untouched.
+ *
+ *  @param async asynchronous write handle
+ *
+ *  @return PLL_SUCCESS if the file was completely written and renamed
+ */
+PLL_EXPORT int pllmod_binary_async_wait(pll_binary_async_t * async)
+{
+  int retval;
+
+  pllmod_binary_async_commit(async);
+  pthread_join(async->thread, NULL);
+
+  retval = async->status;
+  if (!retval)
+    pllmod_set_error(async->error_code, "%s", async->error_msg);
+
+  pthread_mutex_destroy(&async->mutex);
+  pthread_cond_destroy(&async->cond);
+  async_free(async);
+
+  return retval;
+}
+
+/* static functions */
+
+static void * async_writer(void * arg)
+{
+  pll_binary_async_t * async = (pll_binary_async_t *) arg;
+  async_block_t * block;
+  int retval = PLL_SUCCESS;
+  int dump_failed;
+
+  /* pll_errno is thread-local */
+  pll_errno = 0;
+
+  while (1)
+  {
+    pthread_mutex_lock(&async->mutex);
+    while (!async->head && !async->committed)
+      pthread_cond_wait(&async->cond, &async->mutex);
+    block = async->head;
+    if (block)
+    {
+      async->head = block->next;
+      if (!async->head)
+        async->tail = NULL;
+    }
+    pthread_mutex_unlock(&async->mutex);
+
+    if (!block)
+      break;
+
+    /* after a failure, keep draining the queue to release the buffers */
+    if (retval)
+      retval = async_write_block(async->bin_file, block);
+
+    free(block->data);
+    free(block);
+  }
+
+  if (retval)
+  {
+    if (fflush(async->bin_file) || fsync(fileno(async->bin_file)))
+    {
+      pllmod_set_error(PLLMOD_BIN_ERROR_BINARY_IO,
+                       "Error flushing binary file");
+      retval = PLL_FAILURE;
+    }
+  }
+
+  if (fclose(async->bin_file) && retval)
+  {
+    pllmod_set_error(PLLMOD_BIN_ERROR_BINARY_IO,
+                     "Error closing binary file");
+    retval = PLL_FAILURE;
+  }
+  async->bin_file = NULL;
+
+  /* a block missing from the file also invalidates it. The error was already
+     recorded by the dump call that failed */
+  pthread_mutex_lock(&async->mutex);
+  dump_failed = async->dump_failed;
+  pthread_mutex_unlock(&async->mutex);
+
+  /* atomically replace the final file */
+  if (retval && !dump_failed &&
+      rename(async->tmp_filename, async->filename))
+  {
+    pllmod_set_error(PLLMOD_BIN_ERROR_BINARY_IO,
+                     "Cannot rename temporary binary file");
+    retval = PLL_FAILURE;
+  }
+
+  /* keep the previous file and drop the incomplete one */
+  if (!retval || dump_failed)
+    unlink(async->tmp_filename);
+
+  pthread_mutex_lock(&async->mutex);
+  async->status = retval && !dump_failed;
+  if (!retval && !dump_failed)
+  {
+    async->error_code = pll_errno;
+    strncpy(async->error_msg, pll_errmsg, PLLMOD_ERRMSG_LEN - 1);
+    async->error_msg[PLLMOD_ERRMSG_LEN - 1] = '\0';
+  }
+  async->finished = 1;
+  pthread_mutex_unlock(&async->mutex);
+
+  return NULL;
+}
+
+static int async_write_block(FILE * bin_file, async_block_t * block)
+{
+  /* update main header */
+  if (!binary_update_header(bin_file, &block->header))
+    return PLL_FAILURE;
+
+  /* dump block header */
+  if (!binary_block_header_apply(bin_file, &block->header, &bin_fwrite))
+    return PLL_FAILURE;
+
+  if (!binary_block_padding_apply(bin_file, block->header.alignment,
+                                  &bin_fwrite))
+    return PLL_FAILURE;
+
+  /* dump serialized data */
+  if (block->len && !bin_fwrite(block->data, 1, block->len, bin_file))
+    return PLL_FAILURE;
+
+  return PLL_SUCCESS;
+}
+
+static int async_enqueue(pll_binary_async_t * async,
+                         pll_block_header_t * block_header,
+                         bin_mem_stream_t * mem_stream)
+{
+  async_block_t * block;
+
+  block = (async_block_t *) malloc(sizeof(async_block_t));
+  if (!block)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for binary block");
+    return async_dump_error(async, mem_stream);
+  }
+
+  block->header = *block_header;
+  block->data   = mem_stream->data;
+  block->len    = mem_stream->pos;
+  block->next   = NULL;
+
+  pthread_mutex_lock(&async->mutex);
+  if (async->committed)
+  {
+    pthread_mutex_unlock(&async->mutex);
+    free(block->data);
+    free(block);
+    pllmod_set_error(PLLMOD_BIN_ERROR_BINARY_IO,
+                     "Cannot add blocks to a committed binary file");
+    return PLL_FAILURE;
+  }
+  if (async->tail)
+    async->tail->next = block;
+  else
+    async->head = block;
+  async->tail = block;
+  pthread_cond_signal(&async->cond);
+  pthread_mutex_unlock(&async->mutex);
+
+  return PLL_SUCCESS;
+}
+
+/* a block that cannot be serialized invalidates the whole file */
+static int async_dump_error(pll_binary_async_t * async,
+                            bin_mem_stream_t * mem_stream)
+{
+  free(mem_stream->data);
+
+  pthread_mutex_lock(&async->mutex);
+  if (!async->dump_failed)
+  {
+    async->dump_failed = 1;
+    async->error_code = pll_errno;
+    strncpy(async->error_msg, pll_errmsg, PLLMOD_ERRMSG_LEN - 1);
+    async->error_msg[PLLMOD_ERRMSG_LEN - 1] = '\0';
+  }
+  pthread_mutex_unlock(&async->mutex);
+
+  return PLL_FAILURE;
+}
+
+static void async_free(pll_binary_async_t * async)
+{
+  free(async->filename);
+  free(async->tmp_filename);
+  free(async);
+}
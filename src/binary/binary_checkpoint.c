@@ -0,0 +1,698 @@
+/*
+ Copyright (C) 2017 Diego Darriba, Pierre Barbera
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+
+/**
+ * @file binary_checkpoint.c
+ *
+ * @brief Parallel checkpoint of a set of partitions and a tree
+ *
+ * All partitions (with their model parameters) and the tree are stored in a
+ * single random access file, readable also with the sequential functions in
+ * pll_binary.c. Partition `i` is stored with block id `i`, and the tree
+ * with block id `partition_count`.
+ *
+ * Dumping is done in two parallel phases: the length of each block is first
+ * measured without storing the data, such that the block offsets are known,
+ * and then every block is streamed concurrently with `pwrite` straight to its
+ * offset. Only the (small) tree block is serialized in memory. The blocks
+ * go to a temporary file that replaces `filename` only once every block was
+ * written and synced, such that a failed dump keeps the previous checkpoint.
+ * Loading reads each partition block with `pread` and deserializes it in
+ * parallel.
+ *
+ * @author Diego Darriba
+ */
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "pll_binary.h"
+#include "binary_io_operations.h"
+#include "../pllmod_common.h"
+
+#define CKP_TMP_SUFFIX ".tmp"
+
+/* shared state of a parallel checkpoint operation */
+typedef struct
+{
+  int fd;
+  pll_partition_t ** partitions;
+  unsigned int partition_count;
+  unsigned int attributes;
+  unsigned int n_threads;
+
+  size_t * lengths;            //! block lengths without header (dump)
+  long int * offsets;          //! block offsets
+  int * errors;                //! per-partition error code, 0 if OK
+  char (*errmsg)[PLLMOD_ERRMSG_LEN];
+} checkpoint_t;
+
+typedef struct
+{
+  checkpoint_t * ckp;
+  unsigned int thread_id;
+  int phase;
+} checkpoint_worker_t;
+
+#define CKP_PHASE_MEASURE   0
+#define CKP_PHASE_WRITE     1
+#define CKP_PHASE_READ      2
+
+static int checkpoint_run(checkpoint_t * ckp, int phase);
+static void * checkpoint_worker(void * arg);
+static int checkpoint_partition_stream(checkpoint_t * ckp,
+                                       unsigned int i,
+                                       bin_fd_stream_t * stream);
+static int checkpoint_partition_measure(checkpoint_t * ckp, unsigned int i);
+static int checkpoint_partition_write(checkpoint_t * ckp, unsigned int i);
+static int checkpoint_partition_read(checkpoint_t * ckp, unsigned int i);
+static int checkpoint_block_write(int fd,
+                                  long int offset,
+                                  pll_block_header_t * block_header,
+                                  bin_mem_stream_t * mem_stream);
+static int bin_pwrite(int fd, const void * data, size_t len, long int offset);
+static int bin_pread(int fd, void * data, size_t len, long int offset);
+static void checkpoint_free(checkpoint_t * ckp);
+
+/**
+ *  Dump a set of partitions and a tree into a random access file.
+ *
+ *  The file is written as `filename` followed by ".tmp", and renamed to
+ *  `filename` on success. On error, `filename` is left untouched.
+ *
+ *  @param filename file to write to
+ *  @param partitions the partitions (e.g., `treeinfo->partitions`)
+ *  @param partition_count number of partitions
+ *  @param tree the tree (an inner node), can be NULL
+ *  @param tip_count number of tips in the tree
+ *  @param attributes partition block attributes
+ *  @param n_threads number of threads used for measuring and writing
+ *
+ *  @return PLL_SUCCESS if OK
+ */
+PLL_EXPORT int pllmod_binary_checkpoint_dump(const char * filename,
+                                             pll_partition_t ** partitions,
+                                             unsigned int partition_count,
+                                             pll_unode_t * tree,
+                                             unsigned int tip_count,
+                                             unsigned int attributes,
+                                             unsigned int n_threads)
+{
+  checkpoint_t ckp;
+  pll_binary_header_t bin_header;
+  pll_block_map_t * map;
+  pll_block_header_t tree_header;
+  bin_mem_stream_t tree_stream = {NULL, 0, 0};
+  char * tmp_filename;
+  unsigned int i, n_blocks;
+  long int offset;
+  int retval = PLL_SUCCESS;
+
+  /* reset error */
+  pll_errno = 0;
+
+  memset(&ckp, 0, sizeof(checkpoint_t));
+  ckp.fd = -1;
+  ckp.partitions = partitions;
+  ckp.partition_count = partition_count;
+  ckp.attributes = attributes & ~PLLMOD_BIN_ATTRIB_UPDATE_MAP;
+  ckp.n_threads = n_threads ? n_threads : 1;
+  ckp.lengths = (size_t *) calloc(partition_count + 1, sizeof(size_t));
+  ckp.offsets = (long int *) calloc(partition_count + 1, sizeof(long int));
+  ckp.errors = (int *) calloc(partition_count + 1, sizeof(int));
+  ckp.errmsg = calloc(partition_count + 1, PLLMOD_ERRMSG_LEN);
+
+  n_blocks = partition_count + (tree ? 1 : 0);
+  map = (pll_block_map_t *) calloc(n_blocks + 1, sizeof(pll_block_map_t));
+
+  if (!ckp.lengths || !ckp.offsets || !ckp.errors || !ckp.errmsg || !map)
+  {
+    free(map);
+    checkpoint_free(&ckp);
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for checkpoint");
+    return PLL_FAILURE;
+  }
+
+  /* phase 1: measure the blocks */
+  if (!checkpoint_run(&ckp, CKP_PHASE_MEASURE))
+    retval = PLL_FAILURE;
+
+  if (retval && tree)
+  {
+    tree_header.block_id   = partition_count;
+    tree_header.type       = PLLMOD_BIN_BLOCK_TREE;
+    tree_header.attributes = PLLMOD_BIN_ATTRIB_UPDATE_MAP;
+    tree_header.block_len  = (tip_count + 3 * (tip_count - 2)) *
+                             sizeof(pll_unode_t);
+    tree_header.alignment  = 0;
+    retval = binary_utree_serialize(&tree_stream, tree, tip_count);
+  }
+
+  if (!retval)
+  {
+    free(map);
+    free(tree_stream.data);
+    checkpoint_free(&ckp);
+    return PLL_FAILURE;
+  }
+
+  /* compute block offsets */
+  memset(&bin_header, 0, sizeof(pll_binary_header_t));
+  bin_header.n_blocks    = n_blocks;
+  bin_header.max_blocks  = n_blocks;
+  bin_header.access_type = PLLMOD_BIN_ACCESS_RANDOM;
+  bin_header.map_offset  = n_blocks * sizeof(pll_block_map_t);
+
+  offset = sizeof(pll_binary_header_t) + bin_header.map_offset;
+  for (i = 0; i < partition_count; ++i)
+  {
+    ckp.offsets[i] = offset;
+    map[i].block_id = i;
+    map[i].block_offset = offset;
+    offset += sizeof(pll_block_header_t) + ckp.lengths[i];
+  }
+  if (tree)
+  {
+    map[partition_count].block_id = partition_count;
+    map[partition_count].block_offset = offset;
+  }
+
+  tmp_filename = (char *) malloc(strlen(filename) + sizeof(CKP_TMP_SUFFIX));
+  if (!tmp_filename)
+  {
+    free(map);
+    free(tree_stream.data);
+    checkpoint_free(&ckp);
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for checkpoint");
+    return PLL_FAILURE;
+  }
+  strcpy(tmp_filename, filename);
+  strcat(tmp_filename, CKP_TMP_SUFFIX);
+
+  ckp.fd = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (ckp.fd == -1)
+  {
+    free(tmp_filename);
+    free(map);
+    free(tree_stream.data);
+    checkpoint_free(&ckp);
+    pllmod_set_error(PLL_ERROR_FILE_OPEN, "Cannot open file for writing");
+    return PLL_FAILURE;
+  }
+
+  /* header and block map */
+  retval = bin_pwrite(ckp.fd, &bin_header, sizeof(pll_binary_header_t), 0) &&
+           bin_pwrite(ckp.fd, map, n_blocks * sizeof(pll_block_map_t),
+                      sizeof(pll_binary_header_t));
+
+  /* phase 2: stream the blocks to their offsets */
+  if (retval && !checkpoint_run(&ckp, CKP_PHASE_WRITE))
+    retval = PLL_FAILURE;
+
+  if (retval && tree)
+    retval = checkpoint_block_write(ckp.fd, offset, &tree_header,
+                                    &tree_stream);
+
+  if (retval && fsync(ckp.fd) == -1)
+  {
+    pllmod_set_error(PLLMOD_BIN_ERROR_BINARY_IO,
+                     "Error flushing binary file");
+    retval = PLL_FAILURE;
+  }
+
+  if (close(ckp.fd) == -1 && retval)
+  {
+    pllmod_set_error(PLLMOD_BIN_ERROR_BINARY_IO,
+                     "Error closing binary file");
+    retval = PLL_FAILURE;
+  }
+
+  /* replace the previous checkpoint only if everything was written */
+  if (retval && rename(tmp_filename, filename) == -1)
+  {
+    pllmod_set_error(PLLMOD_BIN_ERROR_BINARY_IO,
+                     "Cannot rename %s to %s", tmp_filename, filename);
+    retval = PLL_FAILURE;
+  }
+  if (!retval)
+    unlink(tmp_filename);
+
+  free(tmp_filename);
+  free(map);
+  free(tree_stream.data);
+  checkpoint_free(&ckp);
+
+  return retval;
+}
+
+/**
+ *  Load a set of partitions and a tree stored with
+ *  pllmod_binary_checkpoint_dump().
+ *
+ *  @param filename file to read from
+ *  @param[in,out] partitions array of `partition_count` partitions. NULL
+ *                 entries are created from the stored partitions
+ *  @param partition_count number of partitions
+ *  @param[out] tree loaded tree, can be NULL if the tree is not needed
+ *  @param n_threads number of threads used for reading
+ *
+ *  @return PLL_SUCCESS if OK
+ */
+PLL_EXPORT int pllmod_binary_checkpoint_load(const char * filename,
+                                             pll_partition_t ** partitions,
+                                             unsigned int partition_count,
+                                             pll_unode_t ** tree,
+                                             unsigned int n_threads)
+{
+  checkpoint_t ckp;
+  pll_binary_header_t bin_header;
+  pll_block_map_t * map;
+  unsigned int i, j, tree_attributes;
+  long int tree_offset = PLLMOD_BIN_INVALID_OFFSET;
+  int retval = PLL_SUCCESS;
+
+  /* reset error */
+  pll_errno = 0;
+
+  memset(&ckp, 0, sizeof(checkpoint_t));
+  ckp.partitions = partitions;
+  ckp.partition_count = partition_count;
+  ckp.n_threads = n_threads ? n_threads : 1;
+
+  ckp.fd = open(filename, O_RDONLY);
+  if (ckp.fd == -1)
+  {
+    pllmod_set_error(PLL_ERROR_FILE_OPEN, "Cannot open file for reading");
+    return PLL_FAILURE;
+  }
+
+  if (!bin_pread(ckp.fd, &bin_header, sizeof(pll_binary_header_t), 0))
+  {
+    close(ckp.fd);
+    return PLL_FAILURE;
+  }
+
+  if (bin_header.access_type != PLLMOD_BIN_ACCESS_RANDOM)
+  {
+    close(ckp.fd);
+    pllmod_set_error(PLLMOD_BIN_ERROR_BINARY_IO,
+                     "Checkpoint file must be created for random access");
+    return PLL_FAILURE;
+  }
+
+  map = (pll_block_map_t *) malloc((bin_header.n_blocks + 1) *
+                                   sizeof(pll_block_map_t));
+  ckp.offsets = (long int *) malloc((partition_count + 1) * sizeof(long int));
+  ckp.errors = (int *) calloc(partition_count + 1, sizeof(int));
+  ckp.errmsg = calloc(partition_count + 1, PLLMOD_ERRMSG_LEN);
+  if (!map || !ckp.offsets || !ckp.errors || !ckp.errmsg)
+  {
+    close(ckp.fd);
+    free(map);
+    checkpoint_free(&ckp);
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for checkpoint");
+    return PLL_FAILURE;
+  }
+
+  if (!bin_pread(ckp.fd, map, bin_header.n_blocks * sizeof(pll_block_map_t),
+                 sizeof(pll_binary_header_t)))
+  {
+    close(ckp.fd);
+    free(map);
+    checkpoint_free(&ckp);
+    return PLL_FAILURE;
+  }
+
+  /* resolve offsets */
+  for (i = 0; i < partition_count; ++i)
+    ckp.offsets[i] = PLLMOD_BIN_INVALID_OFFSET;
+  for (j = 0; j < bin_header.n_blocks; ++j)
+  {
+    if (map[j].block_id >= 0 && map[j].block_id < (long) partition_count &&
+        ckp.offsets[map[j].block_id] == PLLMOD_BIN_INVALID_OFFSET)
+      ckp.offsets[map[j].block_id] = map[j].block_offset;
+    else if (map[j].block_id == (long) partition_count &&
+             tree_offset == PLLMOD_BIN_INVALID_OFFSET)
+      tree_offset = map[j].block_offset;
+  }
+  free(map);
+
+  for (i = 0; i < partition_count; ++i)
+    if (ckp.offsets[i] == PLLMOD_BIN_INVALID_OFFSET)
+    {
+      close(ckp.fd);
+      checkpoint_free(&ckp);
+      pllmod_set_error(PLLMOD_BIN_ERROR_MISSING_BLOCK,
+                       "Missing block for partition %u", i);
+      return PLL_FAILURE;
+    }
+
+  retval = checkpoint_run(&ckp, CKP_PHASE_READ);
+
+  close(ckp.fd);
+  checkpoint_free(&ckp);
+
+  if (retval && tree)
+  {
+    FILE * bin_file;
+
+    if (tree_offset == PLLMOD_BIN_INVALID_OFFSET)
+    {
+      pllmod_set_error(PLLMOD_BIN_ERROR_MISSING_BLOCK,
+                       "Missing tree block");
+      return PLL_FAILURE;
+    }
+
+    bin_file = fopen(filename, "rb");
+    if (!bin_file)
+    {
+      pllmod_set_error(PLL_ERROR_FILE_OPEN, "Cannot open file for reading");
+      return PLL_FAILURE;
+    }
+    *tree = pllmod_binary_utree_load(bin_file, partition_count,
+                                     &tree_attributes, tree_offset);
+    fclose(bin_file);
+    if (!*tree)
+      retval = PLL_FAILURE;
+  }
+
+  return retval;
+}
+
+/* static functions */
+
+static int checkpoint_run(checkpoint_t * ckp, int phase)
+{
+  checkpoint_worker_t * workers;
+  pthread_t * threads;
+  unsigned int i, n_threads, n_started;
+  int retval = PLL_SUCCESS;
+
+  n_threads = ckp->n_threads < ckp->partition_count ?
+              ckp->n_threads : ckp->partition_count;
+  if (!n_threads)
+    return PLL_SUCCESS;
+
+  workers = (checkpoint_worker_t *) malloc(n_threads *
+                                           sizeof(checkpoint_worker_t));
+  threads = (pthread_t *) malloc(n_threads * sizeof(pthread_t));
+  if (!workers || !threads)
+  {
+    free(workers);
+    free(threads);
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for checkpoint threads");
+    return PLL_FAILURE;
+  }
+
+  for (i = 0; i < n_threads; ++i)
+  {
+    workers[i].ckp = ckp;
+    workers[i].thread_id = i;
+    workers[i].phase = phase;
+  }
+
+  /* the calling thread works as thread 0 */
+  for (n_started = 1; n_started < n_threads; ++n_started)
+    if (pthread_create(&threads[n_started], NULL, checkpoint_worker,
+                       &workers[n_started]))
+      break;
+
+  checkpoint_worker(&workers[0]);
+
+  for (i = 1; i < n_started; ++i)
+    pthread_join(threads[i], NULL);
+
+  /* threads that could not be started are replaced by the calling thread */
+  for (i = n_started; i < n_threads; ++i)
+    checkpoint_worker(&workers[i]);
+
+  free(workers);
+  free(threads);
+
+  /* report the first error, pll_errno is thread-local */
+  for (i = 0; i < ckp->partition_count; ++i)
+    if (ckp->errors[i])
+    {
+      pllmod_set_error(ckp->errors[i], "%s", ckp->errmsg[i]);
+      retval = PLL_FAILURE;
+      break;
+    }
+
+  return retval;
+}
+
+static void * checkpoint_worker(void * arg)
+{
+  checkpoint_worker_t * worker = (checkpoint_worker_t *) arg;
+  checkpoint_t * ckp = worker->ckp;
+  unsigned int n_threads = ckp->n_threads < ckp->partition_count ?
+                           ckp->n_threads : ckp->partition_count;
+  unsigned int i;
+  int retval;
+
+  for (i = worker->thread_id; i < ckp->partition_count; i += n_threads)
+  {
+    pll_errno = 0;
+    switch (worker->phase)
+    {
+      case CKP_PHASE_MEASURE:
+        retval = checkpoint_partition_measure(ckp, i);
+        break;
+      case CKP_PHASE_WRITE:
+        retval = checkpoint_partition_write(ckp, i);
+        break;
+      case CKP_PHASE_READ:
+        retval = checkpoint_partition_read(ckp, i);
+        break;
+      default:
+        assert(0);
+        retval = PLL_FAILURE;
+    }
+
+    if (!retval)
+    {
+      ckp->errors[i] = pll_errno ? pll_errno : PLLMOD_BIN_ERROR_BINARY_IO;
+      strncpy(ckp->errmsg[i], pll_errmsg, PLLMOD_ERRMSG_LEN - 1);
+    }
+  }
+
+  return NULL;
+}
+
+/* same layout as binary_partition_serialize */
+static int checkpoint_partition_stream(checkpoint_t * ckp,
+                                       unsigned int i,
+                                       bin_fd_stream_t * stream)
+{
+  return binary_partition_desc_apply(stream, ckp->partitions[i],
+                                     ckp->attributes, &bin_dwrite) &&
+         binary_partition_body_apply(stream, ckp->partitions[i],
+                                     ckp->attributes,
+                                     bin_dwrite_func(ckp->attributes));
+}
+
+static int checkpoint_partition_measure(checkpoint_t * ckp, unsigned int i)
+{
+  bin_fd_stream_t stream = {-1, 0, 0};
+
+  if (!checkpoint_partition_stream(ckp, i, &stream))
+    return PLL_FAILURE;
+
+  ckp->lengths[i] = stream.pos;
+
+  return PLL_SUCCESS;
+}
+
+static int checkpoint_partition_write(checkpoint_t * ckp, unsigned int i)
+{
+  pll_block_header_t block_header;
+  bin_fd_stream_t stream;
+
+  block_header.block_id   = i;
+  block_header.type       = PLLMOD_BIN_BLOCK_PARTITION;
+  block_header.attributes = ckp->attributes | PLLMOD_BIN_ATTRIB_UPDATE_MAP;
+  block_header.block_len  = sizeof(pll_block_header_t) + ckp->lengths[i];
+  block_header.alignment  = 0;
+
+  stream.fd     = ckp->fd;
+  stream.offset = ckp->offsets[i] + (long int) sizeof(pll_block_header_t);
+  stream.pos    = 0;
+
+  if (!bin_pwrite(ckp->fd, &block_header, sizeof(pll_block_header_t),
+                  ckp->offsets[i]) ||
+      !checkpoint_partition_stream(ckp, i, &stream))
+    return PLL_FAILURE;
+
+  /* the partition must not change between measuring and writing */
+  if (stream.pos != ckp->lengths[i])
+  {
+    pllmod_set_error(PLLMOD_BIN_ERROR_BLOCK_LENGTH,
+                     "Partition %u changed while being checkpointed", i);
+    return PLL_FAILURE;
+  }
+
+  return PLL_SUCCESS;
+}
+
+static int checkpoint_partition_read(checkpoint_t * ckp, unsigned int i)
+{
+  pll_block_header_t block_header;
+  pll_partition_t desc;
+  pll_partition_t * partition;
+  bin_mem_stream_t mem_stream;
+  int retval;
+
+  if (!bin_pread(ckp->fd, &block_header, sizeof(pll_block_header_t),
+                 ckp->offsets[i]))
+    return PLL_FAILURE;
+
+  if (block_header.type != PLLMOD_BIN_BLOCK_PARTITION ||
+      block_header.block_len < sizeof(pll_block_header_t))
+  {
+    pllmod_set_error(PLLMOD_BIN_ERROR_BLOCK_MISMATCH,
+                     "Block %u is not a valid partition block", i);
+    return PLL_FAILURE;
+  }
+
+  mem_stream.size = block_header.block_len - sizeof(pll_block_header_t);
+  mem_stream.pos  = 0;
+  mem_stream.data = (char *) malloc(mem_stream.size);
+  if (!mem_stream.data)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for partition block");
+    return PLL_FAILURE;
+  }
+
+  if (!bin_pread(ckp->fd, mem_stream.data, mem_stream.size,
+                 ckp->offsets[i] + (long int) sizeof(pll_block_header_t)) ||
+      !binary_partition_desc_apply(&mem_stream, &desc,
+                                   block_header.attributes, &bin_mread))
+  {
+    free(mem_stream.data);
+    return PLL_FAILURE;
+  }
+
+  partition = ckp->partitions[i];
+  if (!partition)
+  {
+    partition = binary_partition_create(&desc, 0);
+    if (!partition)
+    {
+      free(mem_stream.data);
+      return PLL_FAILURE;
+    }
+  }
+  else if (partition->tips != desc.tips ||
+           partition->clv_buffers != desc.clv_buffers ||
+           partition->states != desc.states ||
+           partition->sites != desc.sites ||
+           partition->rate_cats != desc.rate_cats)
+  {
+    free(mem_stream.data);
+    pllmod_set_error(PLLMOD_BIN_ERROR_BLOCK_MISMATCH,
+                     "Partition %u does not match the stored partition", i);
+    return PLL_FAILURE;
+  }
+
+  retval = binary_partition_body_apply(&mem_stream, partition,
+                                       block_header.attributes,
+                                       bin_mread_func(block_header.attributes));
+  free(mem_stream.data);
+
+  if (!retval)
+  {
+    if (!ckp->partitions[i])
+      pll_partition_destroy(partition);
+    return PLL_FAILURE;
+  }
+
+  ckp->partitions[i] = partition;
+
+  return PLL_SUCCESS;
+}
+
+static int checkpoint_block_write(int fd,
+                                  long int offset,
+                                  pll_block_header_t * block_header,
+                                  bin_mem_stream_t * mem_stream)
+{
+  return bin_pwrite(fd, block_header, sizeof(pll_block_header_t), offset) &&
+         bin_pwrite(fd, mem_stream->data, mem_stream->pos,
+                    offset + (long int) sizeof(pll_block_header_t));
+}
+
+static int bin_pwrite(int fd, const void * data, size_t len, long int offset)
+{
+  const char * bytes = (const char *) data;
+  ssize_t ret;
+
+  while (len)
+  {
+    ret = pwrite(fd, bytes, len, offset);
+    if (ret <= 0)
+    {
+      pllmod_set_error(PLLMOD_BIN_ERROR_LOADSTORE,
+                       "Binary file I/O error: write data");
+      return PLL_FAILURE;
+    }
+    bytes += ret;
+    len -= (size_t) ret;
+    offset += ret;
+  }
+
+  return PLL_SUCCESS;
+}
+
+static int bin_pread(int fd, void * data, size_t len, long int offset)
+{
+  char * bytes = (char *) data;
+  ssize_t ret;
+
+  while (len)
+  {
+    ret = pread(fd, bytes, len, offset);
+    if (ret <= 0)
+    {
+      pllmod_set_error(PLLMOD_BIN_ERROR_LOADSTORE,
+                       "Binary file I/O error: read data");
+      return PLL_FAILURE;
+    }
+    bytes += ret;
+    len -= (size_t) ret;
+    offset += ret;
+  }
+
+  return PLL_SUCCESS;
+}
+
+static void checkpoint_free(checkpoint_t * ckp)
+{
+  free(ckp->lengths);
+  free(ckp->offsets);
+  free(ckp->errors);
+  free(ckp->errmsg);
+}
@@ -0,0 +1,648 @@
+/*
+ Copyright (C) 2017 Diego Darriba, Pierre Barbera
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+
+/**
+ * @file binary_delta.c
+ *
+ * @brief Incremental (delta) partition checkpoints
+ *
+ * The first checkpoint of a partition is a full dump. Each of the following
+ * ones appends a new block with the same block id, containing only the model
+ * parameters (if any of them changed) and the CLVs and scale buffers that
+ * changed since the previous checkpoint. Changes are detected by comparing
+ * 64-bit checksums of the buffers, together with their lengths. Loading starts
+ * at the latest full block and applies all later deltas in file order.
+ *
+ * Block layout (after the block header):
+ *
+ *   partition descriptor
+ *   unsigned int flags (BIN_DELTA_FULL | BIN_DELTA_PARAMS)
+ *   partition body, if any flag is set (with CLVs if BIN_DELTA_FULL)
+ *   unsigned int n_clvs, followed by n_clvs x [unsigned int index, CLV]
+ *   unsigned int n_scalers, followed by n_scalers x [unsigned int index, scaler]
+ *
+ * @author Diego Darriba
+ */
+
+#include <stdint.h>
+
+#include "pll_binary.h"
+#include "binary_io_operations.h"
+#include "../pllmod_common.h"
+
+#define BIN_DELTA_FULL   (1<<0)
+#define BIN_DELTA_PARAMS (1<<1)
+
+struct pll_binary_delta_s
+{
+  unsigned int clv_count;      //! tips + clv_buffers of the tracked partition
+  unsigned int scale_buffers;  //! scale buffers of the tracked partition
+  size_t clv_size;             //! bytes per CLV of the tracked partition
+  size_t scaler_size;          //! bytes per scale buffer
+  int full_written;            //! a full block was already written
+  size_t params_len;           //! length of the serialized parameters
+  uint64_t params_checksum;
+  uint64_t * clv_checksum;
+  uint64_t * scaler_checksum;
+};
+
+static int delta_params_checksum(pll_partition_t * partition,
+                                 unsigned int attributes,
+                                 size_t * len,
+                                 uint64_t * checksum);
+static unsigned int * delta_changed_buffers(void ** buffers,
+                                            unsigned int first,
+                                            unsigned int count,
+                                            size_t size,
+                                            const char * valid,
+                                            uint64_t * checksum,
+                                            unsigned int * n_changed);
+static int delta_block_apply(FILE * bin_file,
+                             long int offset,
+                             pll_partition_t ** partition,
+                             unsigned int * attributes);
+static void delta_buffer_sizes(const pll_partition_t * partition,
+                               size_t * clv_size,
+                               size_t * scaler_size);
+static int delta_block_flags(FILE * bin_file,
+                             long int offset,
+                             unsigned int * flags);
+
+/**
+ *  Create the state for tracking changes of a partition between checkpoints.
+ *
+ *  The next pllmod_binary_partition_delta_dump() with a fresh state always
+ *  writes a full block.
+ *
+ *  @param partition the partition to be tracked
+ *
+ *  @return the delta state, NULL on error
+ */
+PLL_EXPORT pll_binary_delta_t * pllmod_binary_delta_create(
+                                          const pll_partition_t * partition)
+{
+  pll_binary_delta_t * delta;
+
+  delta = (pll_binary_delta_t *) calloc(1, sizeof(pll_binary_delta_t));
+  if (!delta)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for delta state");
+    return NULL;
+  }
+
+  delta->clv_count = partition->tips + partition->clv_buffers;
+  delta->scale_buffers = partition->scale_buffers;
+  delta_buffer_sizes(partition, &delta->clv_size, &delta->scaler_size);
+  delta->clv_checksum = (uint64_t *) calloc(delta->clv_count,
+                                            sizeof(uint64_t));
+  delta->scaler_checksum = (uint64_t *) calloc(delta->scale_buffers + 1,
+                                               sizeof(uint64_t));
+
+  if (!delta->clv_checksum || !delta->scaler_checksum)
+  {
+    pllmod_binary_delta_destroy(delta);
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for delta state");
+    return NULL;
+  }
+
+  return delta;
+}
+
+PLL_EXPORT void pllmod_binary_delta_destroy(pll_binary_delta_t * delta)
+{
+  if (delta)
+  {
+    free(delta->clv_checksum);
+    free(delta->scaler_checksum);
+    free(delta);
+  }
+}
+
+/**
+ *  Append a delta checkpoint of a partition.
+ *
+ *  Writes a full block the first time, and afterwards only the parameters,
+ *  CLVs and scale buffers that changed since the last call with the same
+ *  `delta` state. The file must be opened for random access with enough
+ *  room in the block map, and PLLMOD_BIN_ATTRIB_UPDATE_MAP must be set.
+ *
+ *  @param bin_file binary file, positioned at the end
+ *  @param block_id the block id (shared by all the deltas of the partition)
+ *  @param partition the partition
+ *  @param delta change tracking state (see pllmod_binary_delta_create)
+ *  @param clv_valid optional per-CLV validity flags (e.g., a partition
+ *                   entry of `treeinfo->clv_valid`). Invalid CLVs are not
+ *                   written. If NULL, all CLVs are checked.
+ *  @param attributes block attributes
+ *
+ *  @return PLL_SUCCESS if OK
+ */
+PLL_EXPORT int pllmod_binary_partition_delta_dump(FILE * bin_file,
+                                                  int block_id,
+                                                  pll_partition_t * partition,
+                                                  pll_binary_delta_t * delta,
+                                                  const char * clv_valid,
+                                                  unsigned int attributes)
+{
+  pll_block_header_t block_header;
+  size_t params_len;
+  uint64_t params_checksum;
+  size_t clv_bytes, scaler_bytes;
+  unsigned int * changed_clvs = NULL;
+  unsigned int * changed_scalers = NULL;
+  unsigned int n_clvs = 0, n_scalers = 0;
+  unsigned int flags = 0;
+  unsigned int i, first_clv;
+  unsigned int sites_alloc = partition->asc_bias_alloc ?
+                 partition->sites + partition->states :
+                 partition->sites;
+  size_t clv_size = sites_alloc * partition->states_padded *
+                    partition->rate_cats;
+  bin_func_t write_func = bin_fwrite_func(attributes);
+  long int start_pos, end_pos;
+  int retval = PLL_SUCCESS;
+
+  /* reset error */
+  pll_errno = 0;
+
+  delta_buffer_sizes(partition, &clv_bytes, &scaler_bytes);
+  if (delta->clv_count != partition->tips + partition->clv_buffers ||
+      delta->scale_buffers != partition->scale_buffers ||
+      delta->clv_size != clv_bytes ||
+      delta->scaler_size != scaler_bytes)
+  {
+    pllmod_set_error(PLLMOD_BIN_ERROR_BLOCK_MISMATCH,
+                     "Delta state does not match the partition");
+    return PLL_FAILURE;
+  }
+
+  if (!delta_params_checksum(partition, attributes, &params_len,
+                             &params_checksum))
+    return PLL_FAILURE;
+
+  first_clv = (partition->attributes & PLL_ATTRIB_PATTERN_TIP) ?
+              partition->tips : 0;
+
+  if (!delta->full_written)
+  {
+    flags = BIN_DELTA_FULL;
+
+    /* the full dump contains every buffer, record the current state */
+    changed_clvs = delta_changed_buffers((void **) partition->clv,
+                                         first_clv,
+                                         delta->clv_count,
+                                         clv_bytes,
+                                         NULL,
+                                         delta->clv_checksum,
+                                         &n_clvs);
+    changed_scalers = delta_changed_buffers((void **) partition->scale_buffer,
+                                            0,
+                                            delta->scale_buffers,
+                                            scaler_bytes,
+                                            NULL,
+                                            delta->scaler_checksum,
+                                            &n_scalers);
+    n_clvs = n_scalers = 0;
+  }
+  else
+  {
+    if (params_len != delta->params_len ||
+        params_checksum != delta->params_checksum)
+      flags = BIN_DELTA_PARAMS;
+
+    changed_clvs = delta_changed_buffers((void **) partition->clv,
+                                         first_clv,
+                                         delta->clv_count,
+                                         clv_bytes,
+                                         clv_valid,
+                                         delta->clv_checksum,
+                                         &n_clvs);
+    changed_scalers = delta_changed_buffers((void **) partition->scale_buffer,
+                                            0,
+                                            delta->scale_buffers,
+                                            scaler_bytes,
+                                            NULL,
+                                            delta->scaler_checksum,
+                                            &n_scalers);
+  }
+
+  if (!changed_clvs || !changed_scalers)
+  {
+    free(changed_clvs);
+    free(changed_scalers);
+    delta->full_written = 0;
+    return PLL_FAILURE;
+  }
+
+  start_pos = ftell(bin_file);
+
+  /* fill block header */
+  block_header.block_id   = block_id;
+  block_header.type       = PLLMOD_BIN_BLOCK_PARTITION_DELTA;
+  block_header.attributes = attributes;
+  block_header.block_len  = 0;
+  block_header.alignment  = 0;
+
+  /* the block is registered in the file header and map only after the whole
+     block was written, such that a failed dump leaves no dangling entry */
+  if (!binary_block_header_apply(bin_file, &block_header, &bin_fwrite) ||
+      !binary_partition_desc_apply(bin_file, partition, attributes,
+                                   &bin_fwrite) ||
+      !bin_fwrite(&flags, sizeof(unsigned int), 1, bin_file))
+  {
+    retval = PLL_FAILURE;
+  }
+
+  if (retval && flags)
+  {
+    unsigned int body_attributes = (flags & BIN_DELTA_FULL) ?
+                      attributes | PLLMOD_BIN_ATTRIB_PARTITION_DUMP_CLV :
+                      attributes & ~PLLMOD_BIN_ATTRIB_PARTITION_DUMP_CLV;
+    retval = binary_partition_body_apply(bin_file, partition,
+                                         body_attributes, write_func);
+  }
+
+  /* changed CLVs */
+  if (retval)
+    retval = bin_fwrite(&n_clvs, sizeof(unsigned int), 1, bin_file);
+  for (i = 0; retval && i < n_clvs; ++i)
+  {
+    retval = bin_fwrite(&changed_clvs[i], sizeof(unsigned int), 1,
+                        bin_file) &&
+             binary_clv_apply(bin_file, partition, changed_clvs[i],
+                              attributes, clv_size, write_func);
+  }
+
+  /* changed scale buffers */
+  if (retval)
+    retval = bin_fwrite(&n_scalers, sizeof(unsigned int), 1, bin_file);
+  for (i = 0; retval && i < n_scalers; ++i)
+  {
+    retval = bin_fwrite(&changed_scalers[i], sizeof(unsigned int), 1,
+                        bin_file) &&
+             write_func(partition->scale_buffer[changed_scalers[i]],
+                        sizeof(unsigned int), sites_alloc, bin_file);
+  }
+
+  free(changed_clvs);
+  free(changed_scalers);
+
+  if (retval)
+  {
+    /* update block length, then register the block as the last step */
+    end_pos = ftell(bin_file);
+    block_header.block_len = (size_t) (end_pos - start_pos);
+    if (fseek(bin_file, start_pos, SEEK_SET) == -1)
+    {
+      file_io_error(bin_file, start_pos, "update position to header");
+      retval = PLL_FAILURE;
+    }
+    else if (!binary_block_header_apply(bin_file, &block_header,
+                                        &bin_fwrite))
+    {
+      retval = PLL_FAILURE;
+    }
+    else if (fseek(bin_file, start_pos, SEEK_SET) == -1)
+    {
+      file_io_error(bin_file, start_pos, "update position to header");
+      retval = PLL_FAILURE;
+    }
+    else if (!binary_update_header(bin_file, &block_header))
+    {
+      retval = PLL_FAILURE;
+    }
+    else if (fseek(bin_file, end_pos, SEEK_SET) == -1)
+    {
+      file_io_error(bin_file, end_pos, "update position to end");
+      retval = PLL_FAILURE;
+    }
+  }
+
+  if (retval)
+  {
+    delta->params_len = params_len;
+    delta->params_checksum = params_checksum;
+    delta->full_written = 1;
+  }
+  else
+  {
+    /* checksums may already describe unwritten data */
+    assert(pll_errno);
+    delta->full_written = 0;
+
+    /* drop the partial block, the next dump overwrites it */
+    if (start_pos >= 0)
+      fseek(bin_file, start_pos, SEEK_SET);
+  }
+
+  return retval;
+}
+
+/**
+ *  Load a partition from a sequence of delta checkpoints.
+ *
+ *  Starts at the latest full block with id `block_id` and applies all the
+ *  later deltas with the same id, in file order.
+ *
+ *  @param bin_file binary file
+ *  @param block_id the block id
+ *  @param partition partition to load into. If NULL, a new one is created
+ *  @param[out] attributes attributes of the last applied block
+ *
+ *  @return the loaded partition, NULL on error
+ */
+PLL_EXPORT pll_partition_t * pllmod_binary_partition_delta_load(
+                                                 FILE * bin_file,
+                                                 int block_id,
+                                                 pll_partition_t * partition,
+                                                 unsigned int * attributes)
+{
+  pll_block_map_t * map;
+  pll_partition_t * local_partition = partition;
+  unsigned int n_blocks, flags;
+  int i, first = -1;
+
+  /* reset error */
+  pll_errno = 0;
+
+  map = pllmod_binary_get_map(bin_file, &n_blocks);
+  if (!map)
+  {
+    pllmod_set_error(PLLMOD_BIN_ERROR_BINARY_IO,
+                     "Cannot read block map");
+    return NULL;
+  }
+
+  /* find the latest full block */
+  for (i = (int) n_blocks - 1; i >= 0; --i)
+  {
+    if (map[i].block_id != block_id)
+      continue;
+    if (!delta_block_flags(bin_file, map[i].block_offset, &flags))
+    {
+      free(map);
+      return NULL;
+    }
+    if (flags & BIN_DELTA_FULL)
+    {
+      first = i;
+      break;
+    }
+  }
+
+  if (first < 0)
+  {
+    free(map);
+    pllmod_set_error(PLLMOD_BIN_ERROR_MISSING_BLOCK,
+                     "Cannot find a full delta block with id %d", block_id);
+    return NULL;
+  }
+
+  for (i = first; i < (int) n_blocks; ++i)
+  {
+    if (map[i].block_id != block_id)
+      continue;
+    if (!delta_block_apply(bin_file, map[i].block_offset,
+                           &local_partition, attributes))
+    {
+      if (local_partition && !partition)
+        pll_partition_destroy(local_partition);
+      free(map);
+      return NULL;
+    }
+  }
+
+  free(map);
+
+  return local_partition;
+}
+
+/* static functions */
+
+static void delta_buffer_sizes(const pll_partition_t * partition,
+                               size_t * clv_size,
+                               size_t * scaler_size)
+{
+  unsigned int sites_alloc = partition->asc_bias_alloc ?
+                 partition->sites + partition->states :
+                 partition->sites;
+
+  *clv_size = sites_alloc * partition->states_padded * partition->rate_cats *
+              sizeof(double);
+  *scaler_size = sites_alloc * sizeof(unsigned int);
+}
+
+static int delta_params_checksum(pll_partition_t * partition,
+                                 unsigned int attributes,
+                                 size_t * len,
+                                 uint64_t * checksum)
+{
+  bin_mem_stream_t mem_stream = {NULL, 0, 0};
+
+  if (!binary_partition_body_apply(&mem_stream,
+                             partition,
+                             attributes & ~PLLMOD_BIN_ATTRIB_PARTITION_DUMP_CLV,
+                             &bin_mwrite))
+  {
+    free(mem_stream.data);
+    return PLL_FAILURE;
+  }
+
+  *len = mem_stream.pos;
+  *checksum = binary_checksum(mem_stream.data, mem_stream.pos);
+  free(mem_stream.data);
+
+  return PLL_SUCCESS;
+}
+
+/* returns the indices of the buffers whose checksum changed, and updates
+   the stored checksums */
+static unsigned int * delta_changed_buffers(void ** buffers,
+                                            unsigned int first,
+                                            unsigned int count,
+                                            size_t size,
+                                            const char * valid,
+                                            uint64_t * checksum,
+                                            unsigned int * n_changed)
+{
+  unsigned int i;
+  uint64_t cur_checksum;
+  unsigned int * changed = (unsigned int *) malloc((count + 1) *
+                                                   sizeof(unsigned int));
+
+  if (!changed)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for changed buffers");
+    return NULL;
+  }
+
+  *n_changed = 0;
+  for (i = first; i < count; ++i)
+  {
+    if (!buffers[i] || (valid && !valid[i]))
+      continue;
+
+    cur_checksum = binary_checksum(buffers[i], size);
+    if (cur_checksum != checksum[i])
+    {
+      checksum[i] = cur_checksum;
+      changed[(*n_changed)++] = i;
+    }
+  }
+
+  return changed;
+}
+
+static int delta_block_flags(FILE * bin_file,
+                             long int offset,
+                             unsigned int * flags)
+{
+  pll_block_header_t block_header;
+  pll_partition_t desc;
+
+  if (fseek(bin_file, offset, SEEK_SET) == -1)
+  {
+    file_io_error(bin_file, offset, "update position to block");
+    return PLL_FAILURE;
+  }
+
+  if (!binary_block_header_apply(bin_file, &block_header, &bin_fread))
+    return PLL_FAILURE;
+
+  if (block_header.type != PLLMOD_BIN_BLOCK_PARTITION_DELTA)
+  {
+    pllmod_set_error(PLLMOD_BIN_ERROR_BLOCK_MISMATCH,
+                     "Block type is %d and should be %d",
+                     block_header.type, PLLMOD_BIN_BLOCK_PARTITION_DELTA);
+    return PLL_FAILURE;
+  }
+
+  return binary_partition_desc_apply(bin_file, &desc,
+                                     block_header.attributes, &bin_fread) &&
+         bin_fread(flags, sizeof(unsigned int), 1, bin_file);
+}
+
+static int delta_block_apply(FILE * bin_file,
+                             long int offset,
+                             pll_partition_t ** partition,
+                             unsigned int * attributes)
+{
+  pll_block_header_t block_header;
+  pll_partition_t desc;
+  pll_partition_t * local_partition;
+  unsigned int flags, n_clvs, n_scalers, index, i;
+  unsigned int sites_alloc;
+  size_t clv_size;
+  bin_func_t read_func;
+
+  if (fseek(bin_file, offset, SEEK_SET) == -1)
+  {
+    file_io_error(bin_file, offset, "update position to block");
+    return PLL_FAILURE;
+  }
+
+  if (!binary_block_header_apply(bin_file, &block_header, &bin_fread))
+    return PLL_FAILURE;
+
+  *attributes = block_header.attributes;
+  read_func = bin_fread_func(block_header.attributes);
+
+  if (!binary_partition_desc_apply(bin_file, &desc, block_header.attributes,
+                                   &bin_fread) ||
+      !bin_fread(&flags, sizeof(unsigned int), 1, bin_file))
+    return PLL_FAILURE;
+
+  if (!*partition)
+  {
+    *partition = binary_partition_create(&desc, 0);
+    if (!*partition)
+      return PLL_FAILURE;
+  }
+  local_partition = *partition;
+
+  if (local_partition->tips != desc.tips ||
+      local_partition->clv_buffers != desc.clv_buffers ||
+      local_partition->scale_buffers != desc.scale_buffers ||
+      local_partition->states != desc.states ||
+      local_partition->sites != desc.sites ||
+      local_partition->rate_cats != desc.rate_cats)
+  {
+    pllmod_set_error(PLLMOD_BIN_ERROR_BLOCK_MISMATCH,
+                     "Partition does not match the stored partition");
+    return PLL_FAILURE;
+  }
+
+  sites_alloc = local_partition->asc_bias_alloc ?
+                 local_partition->sites + local_partition->states :
+                 local_partition->sites;
+  clv_size = sites_alloc * local_partition->states_padded *
+             local_partition->rate_cats;
+
+  if (flags)
+  {
+    unsigned int body_attributes = (flags & BIN_DELTA_FULL) ?
+         block_header.attributes | PLLMOD_BIN_ATTRIB_PARTITION_DUMP_CLV :
+         block_header.attributes & ~PLLMOD_BIN_ATTRIB_PARTITION_DUMP_CLV;
+    if (!binary_partition_body_apply(bin_file, local_partition,
+                                     body_attributes, read_func))
+      return PLL_FAILURE;
+  }
+
+  if (!bin_fread(&n_clvs, sizeof(unsigned int), 1, bin_file))
+    return PLL_FAILURE;
+  for (i = 0; i < n_clvs; ++i)
+  {
+    if (!bin_fread(&index, sizeof(unsigned int), 1, bin_file))
+      return PLL_FAILURE;
+    if (index >= local_partition->tips + local_partition->clv_buffers ||
+        !local_partition->clv[index])
+    {
+      pllmod_set_error(PLLMOD_BIN_ERROR_INVALID_INDEX,
+                       "Invalid CLV index %u in delta block", index);
+      return PLL_FAILURE;
+    }
+    if (!binary_clv_apply(bin_file, local_partition, index,
+                          block_header.attributes, clv_size, read_func))
+      return PLL_FAILURE;
+  }
+
+  if (!bin_fread(&n_scalers, sizeof(unsigned int), 1, bin_file))
+    return PLL_FAILURE;
+  for (i = 0; i < n_scalers; ++i)
+  {
+    if (!bin_fread(&index, sizeof(unsigned int), 1, bin_file))
+      return PLL_FAILURE;
+    if (index >= local_partition->scale_buffers)
+    {
+      pllmod_set_error(PLLMOD_BIN_ERROR_INVALID_INDEX,
+                       "Invalid scaler index %u in delta block", index);
+      return PLL_FAILURE;
+    }
+    if (!read_func(local_partition->scale_buffer[index], sizeof(unsigned int),
+                   sites_alloc, bin_file))
+      return PLL_FAILURE;
+  }
+
+  return PLL_SUCCESS;
+}
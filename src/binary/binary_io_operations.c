@@ -27,11 +27,56 @@
   * @author Diego Darriba
   */
 
+#include <unistd.h>
+
 #include "binary_io_operations.h"
 #include "../pllmod_common.h"
 
-int bin_fwrite(void * data, size_t size, size_t count, FILE * file)
+/* maximum alignment supported for block data */
+#define BIN_MAX_ALIGNMENT 64
+
+/* initial capacity of growable memory streams */
+#define BIN_MIN_BUFFER 4096
+
+/* RLE codec: a control byte below BIN_RLE_REPEAT is followed by (ctrl+1)
+   literal bytes, otherwise the next byte is repeated (ctrl-BIN_RLE_REPEAT+3)
+   times */
+#define BIN_RLE_REPEAT      0x80
+#define BIN_RLE_MAX_LITERAL 128
+#define BIN_RLE_MIN_RUN     3
+#define BIN_RLE_MAX_RUN     130
+
+static void byte_shuffle(const unsigned char * in,
+                         unsigned char * out,
+                         size_t size,
+                         size_t count);
+static void byte_unshuffle(const unsigned char * in,
+                           unsigned char * out,
+                           size_t size,
+                           size_t count);
+static size_t rle_encode(const unsigned char * in,
+                         size_t len,
+                         unsigned char * out);
+static int rle_decode(const unsigned char * in,
+                      size_t in_len,
+                      unsigned char * out,
+                      size_t out_len);
+static int cb_full_traversal(pll_unode_t * node);
+static int apply_error(const char * element);
+static int bin_write_z(void * data,
+                       size_t size,
+                       size_t count,
+                       void * stream,
+                       bin_func_t write_func);
+static int bin_decode(const unsigned char * enc,
+                      size_t enc_len,
+                      void * data,
+                      size_t size,
+                      size_t count);
+
+int bin_fwrite(void * data, size_t size, size_t count, void * stream)
 {
+  FILE * file = (FILE *) stream;
   size_t ret = fwrite(data, size, count, file);
   if (ret != count)
   {
@@ -41,8 +86,9 @@ int bin_fwrite(void * data, size_t size, size_t count, FILE * file)
   return PLL_SUCCESS;
 }
 
-int bin_fread(void * data, size_t size, size_t count, FILE * file)
+int bin_fread(void * data, size_t size, size_t count, void * stream)
 {
+  FILE * file = (FILE *) stream;
   size_t ret = fread(data, size, count, file);
   if (ret != count)
   {
@@ -52,9 +98,201 @@ int bin_fread(void * data, size_t size, size_t count, FILE * file)
   return PLL_SUCCESS;
 }
 
+int bin_mread(void * data, size_t size, size_t count, void * stream)
+{
+  bin_mem_stream_t * mem_stream = (bin_mem_stream_t *) stream;
+  size_t len = size * count;
+
+  if (mem_stream->pos + len > mem_stream->size)
+  {
+    pllmod_set_error(PLLMOD_BIN_ERROR_LOADSTORE,
+                     "Binary file I/O error: read data beyond end of mapping");
+    return PLL_FAILURE;
+  }
+
+  memcpy(data, mem_stream->data + mem_stream->pos, len);
+  mem_stream->pos += len;
+
+  return PLL_SUCCESS;
+}
+
+int bin_mwrite(void * data, size_t size, size_t count, void * stream)
+{
+  bin_mem_stream_t * mem_stream = (bin_mem_stream_t *) stream;
+  size_t len = size * count;
+
+  /* grow the buffer geometrically */
+  if (mem_stream->pos + len > mem_stream->size)
+  {
+    size_t new_size = mem_stream->size ? mem_stream->size : BIN_MIN_BUFFER;
+    char * new_data;
+
+    while (new_size < mem_stream->pos + len)
+      new_size *= 2;
+
+    new_data = (char *) realloc(mem_stream->data, new_size);
+    if (!new_data)
+    {
+      pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                       "Cannot allocate memory for binary buffer");
+      return PLL_FAILURE;
+    }
+    mem_stream->data = new_data;
+    mem_stream->size = new_size;
+  }
+
+  memcpy(mem_stream->data + mem_stream->pos, data, len);
+  mem_stream->pos += len;
+
+  return PLL_SUCCESS;
+}
+
+int bin_dwrite(void * data, size_t size, size_t count, void * stream)
+{
+  bin_fd_stream_t * fd_stream = (bin_fd_stream_t *) stream;
+  const char * bytes = (const char *) data;
+  size_t len = size * count;
+  ssize_t ret;
+
+  if (fd_stream->fd < 0)
+  {
+    fd_stream->pos += len;
+    return PLL_SUCCESS;
+  }
+
+  while (len)
+  {
+    ret = pwrite(fd_stream->fd, bytes, len,
+                 fd_stream->offset + (long int) fd_stream->pos);
+    if (ret <= 0)
+    {
+      pllmod_set_error(PLLMOD_BIN_ERROR_LOADSTORE,
+                       "Binary file I/O error: write data");
+      return PLL_FAILURE;
+    }
+    bytes += ret;
+    len -= (size_t) ret;
+    fd_stream->pos += (size_t) ret;
+  }
+
+  return PLL_SUCCESS;
+}
+
+/*
+ * Compressed data is stored as a `size_t` with the encoded length, followed by
+ * the encoded bytes. Elements are byte-shuffled before RLE encoding, such that
+ * the (mostly equal) sign and exponent bytes of the doubles in CLVs and
+ * model parameters form long runs. An encoded length of 0 means that the data
+ * did not compress and was stored raw.
+ */
+
+int bin_fwrite_z(void * data, size_t size, size_t count, void * stream)
+{
+  return bin_write_z(data, size, count, stream, &bin_fwrite);
+}
+
+int bin_mwrite_z(void * data, size_t size, size_t count, void * stream)
+{
+  return bin_write_z(data, size, count, stream, &bin_mwrite);
+}
+
+int bin_dwrite_z(void * data, size_t size, size_t count, void * stream)
+{
+  return bin_write_z(data, size, count, stream, &bin_dwrite);
+}
+
+int bin_fread_z(void * data, size_t size, size_t count, void * stream)
+{
+  size_t len = size * count;
+  size_t enc_len;
+  unsigned char * encoded;
+  int retval;
+
+  if (!bin_fread(&enc_len, sizeof(size_t), 1, stream))
+    return PLL_FAILURE;
+
+  if (!enc_len)
+    return len ? bin_fread(data, size, count, stream) : PLL_SUCCESS;
+
+  if (enc_len > len + len / BIN_RLE_MAX_LITERAL + 1)
+  {
+    pllmod_set_error(PLLMOD_BIN_ERROR_LOADSTORE,
+                     "Binary file I/O error: invalid compressed data length");
+    return PLL_FAILURE;
+  }
+
+  encoded = (unsigned char *) malloc(enc_len);
+  if (!encoded)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for decompressing data");
+    return PLL_FAILURE;
+  }
+
+  retval = bin_fread(encoded, 1, enc_len, stream) &&
+           bin_decode(encoded, enc_len, data, size, count);
+
+  free(encoded);
+
+  return retval;
+}
+
+int bin_mread_z(void * data, size_t size, size_t count, void * stream)
+{
+  bin_mem_stream_t * mem_stream = (bin_mem_stream_t *) stream;
+  size_t enc_len;
+
+  if (!bin_mread(&enc_len, sizeof(size_t), 1, stream))
+    return PLL_FAILURE;
+
+  if (!enc_len)
+    return bin_mread(data, size, count, stream);
+
+  if (enc_len > mem_stream->size - mem_stream->pos)
+  {
+    pllmod_set_error(PLLMOD_BIN_ERROR_LOADSTORE,
+                     "Binary file I/O error: read data beyond end of mapping");
+    return PLL_FAILURE;
+  }
+
+  /* decode straight from the mapping */
+  if (!bin_decode((const unsigned char *) mem_stream->data + mem_stream->pos,
+                  enc_len, data, size, count))
+    return PLL_FAILURE;
+
+  mem_stream->pos += enc_len;
+
+  return PLL_SUCCESS;
+}
+
+bin_func_t bin_fread_func(unsigned int attributes)
+{
+  return (attributes & PLLMOD_BIN_ATTRIB_COMPRESS) ? &bin_fread_z : &bin_fread;
+}
+
+bin_func_t bin_fwrite_func(unsigned int attributes)
+{
+  return (attributes & PLLMOD_BIN_ATTRIB_COMPRESS) ? &bin_fwrite_z : &bin_fwrite;
+}
+
+bin_func_t bin_mread_func(unsigned int attributes)
+{
+  return (attributes & PLLMOD_BIN_ATTRIB_COMPRESS) ? &bin_mread_z : &bin_mread;
+}
+
+bin_func_t bin_mwrite_func(unsigned int attributes)
+{
+  return (attributes & PLLMOD_BIN_ATTRIB_COMPRESS) ? &bin_mwrite_z : &bin_mwrite;
+}
+
+bin_func_t bin_dwrite_func(unsigned int attributes)
+{
+  return (attributes & PLLMOD_BIN_ATTRIB_COMPRESS) ? &bin_dwrite_z : &bin_dwrite;
+}
+
 int binary_block_header_apply(FILE * bin_file,
                               pll_block_header_t * block_header,
-                              int (*bin_func)(void *, size_t, size_t, FILE *))
+                              bin_func_t bin_func)
 {
   strcpy(block_header->pad, "000");
 
@@ -66,6 +304,43 @@ int binary_block_header_apply(FILE * bin_file,
   return PLL_SUCCESS;
 }
 
+/* skip (read) or fill with zeros (write) the gap between the current position
+   and the next multiple of `alignment`, such that block data can be mapped
+   directly into aligned memory */
+int binary_block_padding_apply(FILE * bin_file,
+                               unsigned int alignment,
+                               bin_func_t bin_func)
+{
+  char padding[BIN_MAX_ALIGNMENT];
+  long int cur_position;
+  size_t pad_len;
+
+  if (alignment <= 1)
+    return PLL_SUCCESS;
+
+  if (alignment > BIN_MAX_ALIGNMENT)
+  {
+    pllmod_set_error(PLLMOD_BIN_ERROR_INVALID_SIZE,
+                     "Unsupported block alignment: %u", alignment);
+    return PLL_FAILURE;
+  }
+
+  cur_position = ftell(bin_file);
+  pad_len = (alignment - (size_t) cur_position % alignment) % alignment;
+
+  if (!pad_len)
+    return PLL_SUCCESS;
+
+  memset(padding, 0, pad_len);
+  if (!bin_func(padding, sizeof(char), pad_len, bin_file))
+  {
+    file_io_error(bin_file, cur_position, "block padding apply");
+    return PLL_FAILURE;
+  }
+
+  return PLL_SUCCESS;
+}
+
 int binary_update_header(FILE * bin_file,
                          pll_block_header_t * header)
 {
@@ -106,7 +381,11 @@ int binary_update_header(FILE * bin_file,
   if (header && (header->attributes & PLLMOD_BIN_ATTRIB_UPDATE_MAP))
  {
    /* update map */
-   assert(next_block < bin_header.max_blocks);
+   if (next_block >= bin_header.max_blocks)
+   {
+     file_io_error(bin_file, cur_position, "block map is full");
+     return PLL_FAILURE;
+   }
    if (fseek(bin_file, next_block * sizeof(pll_block_map_t), SEEK_CUR) == -1)
    {
      file_io_error(bin_file, next_block * sizeof(pll_block_map_t),
@@ -158,40 +437,46 @@ long int binary_get_offset(FILE *bin_file, int block_id)
   return offset;
 }
 
-int binary_partition_desc_apply (FILE * bin_file,
+int binary_partition_desc_apply (void * bin_stream,
                              pll_partition_t * partition,
                              unsigned int attributes,
-                             int (*bin_func)(void *, size_t, size_t, FILE *))
+                             bin_func_t bin_func)
 {
   UNUSED(attributes);
 
   /* partition descriptor */
-  bin_func (&partition->tips, sizeof(unsigned int), 1, bin_file);
-  bin_func (&partition->clv_buffers, sizeof(unsigned int), 1, bin_file);
-  bin_func (&partition->states, sizeof(unsigned int), 1, bin_file);
-  bin_func (&partition->sites, sizeof(unsigned int), 1, bin_file);
-  bin_func (&partition->rate_matrices, sizeof(unsigned int), 1, bin_file);
-  bin_func (&partition->prob_matrices, sizeof(unsigned int), 1, bin_file);
-  bin_func (&partition->rate_cats, sizeof(unsigned int), 1, bin_file);
-  bin_func (&partition->scale_buffers, sizeof(unsigned int), 1, bin_file);
-  bin_func (&partition->attributes, sizeof(unsigned int), 1, bin_file);
-  bin_func (&partition->states_padded, sizeof(unsigned int), 1, bin_file);
-  bin_func (&partition->asc_bias_alloc, sizeof(int), 1, bin_file);
+  if (!bin_func (&partition->tips, sizeof(unsigned int), 1, bin_stream) ||
+      !bin_func (&partition->clv_buffers, sizeof(unsigned int), 1, bin_stream) ||
+      !bin_func (&partition->states, sizeof(unsigned int), 1, bin_stream) ||
+      !bin_func (&partition->sites, sizeof(unsigned int), 1, bin_stream) ||
+      !bin_func (&partition->rate_matrices, sizeof(unsigned int), 1,
+                 bin_stream) ||
+      !bin_func (&partition->prob_matrices, sizeof(unsigned int), 1,
+                 bin_stream) ||
+      !bin_func (&partition->rate_cats, sizeof(unsigned int), 1, bin_stream) ||
+      !bin_func (&partition->scale_buffers, sizeof(unsigned int), 1,
+                 bin_stream) ||
+      !bin_func (&partition->attributes, sizeof(unsigned int), 1, bin_stream) ||
+      !bin_func (&partition->states_padded, sizeof(unsigned int), 1,
+                 bin_stream) ||
+      !bin_func (&partition->asc_bias_alloc, sizeof(int), 1, bin_stream))
+    return apply_error("partition descriptor");
 
   /* The variables below are used only if PATTERN_TIP is active. Otherwise
      they could be uninitialized and hence raise a valgrind error if we try
      to write them into the binary file. */
   if (!(partition->attributes & PLL_ATTRIB_PATTERN_TIP))
     partition->maxstates = 0;
-  bin_func (&partition->maxstates, sizeof(unsigned int), 1, bin_file);
+  if (!bin_func (&partition->maxstates, sizeof(unsigned int), 1, bin_stream))
+    return apply_error("partition descriptor");
 
   return PLL_SUCCESS;
 }
 
-int binary_partition_body_apply (FILE * bin_file,
+int binary_partition_body_apply (void * bin_stream,
                              pll_partition_t * partition,
                              unsigned int attributes,
-                             int (*bin_func)(void *, size_t, size_t, FILE *))
+                             bin_func_t bin_func)
 {
   unsigned int i;
   unsigned int tips = partition->tips;
@@ -205,29 +490,41 @@ int binary_partition_body_apply (FILE * bin_file,
   unsigned int sites_alloc = partition->asc_bias_alloc ?
                   partition->sites + partition->states : partition->sites;
 
-  bin_func (partition->eigen_decomp_valid, sizeof(int), rate_matrices,
-            bin_file);
+  if (!bin_func (partition->eigen_decomp_valid, sizeof(int), rate_matrices,
+                 bin_stream))
+    return apply_error("eigen decomposition flags");
   for (i = 0; i < rate_matrices; ++i)
-    bin_func (partition->eigenvecs[i], sizeof(double),
-              states * states_padded, bin_file);
+    if (!bin_func (partition->eigenvecs[i], sizeof(double),
+                   states * states_padded, bin_stream))
+      return apply_error("eigenvectors");
   for (i = 0; i < rate_matrices; ++i)
-    bin_func (partition->inv_eigenvecs[i], sizeof(double),
-              states * states_padded, bin_file);
+    if (!bin_func (partition->inv_eigenvecs[i], sizeof(double),
+                   states * states_padded, bin_stream))
+      return apply_error("inverse eigenvectors");
   for (i = 0; i < rate_matrices; ++i)
-    bin_func (partition->eigenvals[i], sizeof(double), states_padded,
-              bin_file);
-  bin_func (partition->pmatrix[0],
-            sizeof(double),
-            prob_matrices * states * states_padded * rate_cats, bin_file);
+    if (!bin_func (partition->eigenvals[i], sizeof(double), states_padded,
+                   bin_stream))
+      return apply_error("eigenvalues");
+  if (!bin_func (partition->pmatrix[0],
+                 sizeof(double),
+                 prob_matrices * states * states_padded * rate_cats,
+                 bin_stream))
+    return apply_error("probability matrices");
   for (i = 0; i < rate_matrices; ++i)
-    bin_func (partition->subst_params[i], sizeof(double),
-              n_subst_rates, bin_file);
+    if (!bin_func (partition->subst_params[i], sizeof(double),
+                   n_subst_rates, bin_stream))
+      return apply_error("substitution rates");
   for (i = 0; i < rate_matrices; ++i)
-    bin_func (partition->frequencies[i], sizeof(double), states_padded,
-              bin_file);
-  bin_func (partition->rates, sizeof(double), rate_cats, bin_file);
-  bin_func (partition->rate_weights, sizeof(double), rate_cats, bin_file);
-  bin_func (partition->prop_invar, sizeof(double), rate_matrices, bin_file);
+    if (!bin_func (partition->frequencies[i], sizeof(double), states_padded,
+                   bin_stream))
+      return apply_error("frequencies");
+  if (!bin_func (partition->rates, sizeof(double), rate_cats, bin_stream) ||
+      !bin_func (partition->rate_weights, sizeof(double), rate_cats,
+                 bin_stream))
+    return apply_error("rate categories");
+  if (!bin_func (partition->prop_invar, sizeof(double), rate_matrices,
+                 bin_stream))
+    return apply_error("proportion of invariant sites");
 
   if (attributes & PLLMOD_BIN_ATTRIB_PARTITION_DUMP_CLV)
   {
@@ -238,12 +535,15 @@ int binary_partition_body_apply (FILE * bin_file,
     {
       for (i = 0; i < tips; ++i)
       {
-        bin_func (partition->tipchars[i],
-                  sizeof(unsigned char),
-                  sites_alloc,
-                  bin_file);
+        if (!bin_func (partition->tipchars[i],
+                       sizeof(unsigned char),
+                       sites_alloc,
+                       bin_stream))
+          return apply_error("tip characters");
       }
-      bin_func (partition->charmap, sizeof(char), PLL_ASCII_SIZE, bin_file);
+      if (!bin_func (partition->charmap, sizeof(char), PLL_ASCII_SIZE,
+                     bin_stream))
+        return apply_error("character map");
       first_clv_index = tips;
 
       unsigned int l2_maxstates = (unsigned int) ceil(log2(
@@ -252,59 +552,61 @@ int binary_partition_body_apply (FILE * bin_file,
       /* allocate space for the precomputed tip-tip likelihood vector */
       size_t alloc_size = (1 << (2 * l2_maxstates)) *
                           (partition->states_padded * partition->rate_cats);
-      bin_func (partition->ttlookup, sizeof(double), alloc_size, bin_file);
-      bin_func (partition->tipmap, sizeof(char), PLL_ASCII_SIZE, bin_file);
+      if (!bin_func (partition->ttlookup, sizeof(double), alloc_size,
+                     bin_stream) ||
+          !bin_func (partition->tipmap, sizeof(char), PLL_ASCII_SIZE,
+                     bin_stream))
+        return apply_error("tip-tip lookup table");
     }
 
     /* dump CLVs and scalers*/
     for (i = first_clv_index; i < (partition->clv_buffers + tips); ++i)
     {
-      bin_func (partition->clv[i], sizeof(double),
-                states_padded * rate_cats * sites_alloc, bin_file);
+      if (!bin_func (partition->clv[i], sizeof(double),
+                     states_padded * rate_cats * sites_alloc, bin_stream))
+        return apply_error("CLV");
     }
     for (i = 0; i < partition->scale_buffers; ++i)
-      bin_func (partition->scale_buffer[i], sizeof(unsigned int), sites_alloc,
-                bin_file);
+      if (!bin_func (partition->scale_buffer[i], sizeof(unsigned int),
+                     sites_alloc, bin_stream))
+        return apply_error("scale buffer");
   }
 
   if (attributes & PLLMOD_BIN_ATTRIB_PARTITION_DUMP_WGT)
   {
     /* dump pattern weights */
-    bin_func (partition->pattern_weights, sizeof(unsigned int), sites_alloc,
-              bin_file);
+    if (!bin_func (partition->pattern_weights, sizeof(unsigned int),
+                   sites_alloc, bin_stream))
+      return apply_error("pattern weights");
   }
 
   for (i = 0; i < rate_matrices; ++i)
     if (partition->prop_invar[i] > 0)
     {
       if (!partition->invariant)
+      {
         partition->invariant = (int *)malloc(partition->sites * sizeof(int));
-      bin_func (partition->invariant, sizeof(int), sites, bin_file);
+        if (!partition->invariant)
+        {
+          pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                           "Cannot allocate memory for invariant sites");
+          return PLL_FAILURE;
+        }
+      }
+      if (!bin_func (partition->invariant, sizeof(int), sites, bin_stream))
+        return apply_error("invariant sites");
       break;
     }
 
   return PLL_SUCCESS;
 }
 
-int binary_partition_apply(FILE * bin_file,
-                       pll_partition_t * partition,
-                       unsigned int attributes,
-                       int (*bin_func)(void *, size_t, size_t, FILE *))
-{
-  if (!binary_partition_desc_apply(bin_file, partition, attributes, bin_func))
-    return PLL_FAILURE;
-  if (!binary_partition_body_apply(bin_file, partition, attributes, bin_func))
-    return PLL_FAILURE;
-
-  return PLL_SUCCESS;
-}
-
-int binary_clv_apply (FILE * bin_file,
+int binary_clv_apply (void * bin_stream,
                       pll_partition_t * partition,
                       unsigned int clv_index,
                       unsigned int attributes,
                       size_t clv_size,
-                      int (*bin_func)(void *, size_t, size_t, FILE *))
+                      bin_func_t bin_func)
 {
   UNUSED(attributes);
 
@@ -315,7 +617,7 @@ int binary_clv_apply (FILE * bin_file,
     return PLL_FAILURE;
   }
 
-  if (!bin_func(partition->clv[clv_index], sizeof(double), clv_size, bin_file))
+  if (!bin_func(partition->clv[clv_index], sizeof(double), clv_size, bin_stream))
   {
     pllmod_set_error(PLLMOD_BIN_ERROR_LOADSTORE,
                      "Error loading/storing CLV");
@@ -325,18 +627,22 @@ int binary_clv_apply (FILE * bin_file,
   return PLL_SUCCESS;
 }
 
-int binary_node_apply (FILE * bin_file,
+int binary_node_apply (void * bin_stream,
                        pll_unode_t * node,
                        int write,
-                       int (*bin_func)(void *, size_t, size_t, FILE *))
+                       bin_func_t bin_func)
 {
   char * label = 0;
   unsigned long label_len = 0;
 
-  bin_func(node, sizeof(pll_unode_t), 1, bin_file);
+  if (!bin_func(node, sizeof(pll_unode_t), 1, bin_stream))
+    return apply_error("tree node");
   if (write && node->label)
     label_len = strlen(node->label);
-  bin_func(&label_len, sizeof(unsigned long), 1, bin_file);
+  else if (!write)
+    node->label = NULL;
+  if (!bin_func(&label_len, sizeof(unsigned long), 1, bin_stream))
+    return apply_error("tree node");
   if (label_len)
   {
     if (write)
@@ -346,15 +652,280 @@ int binary_node_apply (FILE * bin_file,
     else
     {
       label = (char *) malloc(label_len+1);
+      if (!label)
+      {
+        pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                         "Cannot allocate memory for node label");
+        return PLL_FAILURE;
+      }
       node->label = label;
     }
-    bin_func(label, sizeof(char), label_len, bin_file);
+    if (!bin_func(label, sizeof(char), label_len, bin_stream))
+      return apply_error("node label");
     node->label[label_len] = '\0';
   }
 
   return PLL_SUCCESS;
 }
 
+int binary_partition_serialize(bin_mem_stream_t * mem_stream,
+                               pll_partition_t * partition,
+                               unsigned int attributes)
+{
+  return binary_partition_desc_apply(mem_stream, partition, attributes,
+                                     &bin_mwrite) &&
+         binary_partition_body_apply(mem_stream, partition, attributes,
+                                     bin_mwrite_func(attributes));
+}
+
+int binary_utree_serialize(bin_mem_stream_t * mem_stream,
+                           pll_unode_t * tree,
+                           unsigned int tip_count)
+{
+  pll_unode_t ** travbuffer;
+  unsigned int i, n_nodes, trav_size;
+  int retval = PLL_SUCCESS;
+
+  if (!tree->next)
+  {
+    pllmod_set_error(PLLMOD_BIN_ERROR_BINARY_IO,
+                     "Tree should not be a tip node");
+    return PLL_FAILURE;
+  }
+
+  n_nodes = 2 * tip_count - 2;
+
+  travbuffer = (pll_unode_t **)malloc(n_nodes* sizeof(pll_unode_t *));
+  if (!travbuffer)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for traversal buffer");
+    return PLL_FAILURE;
+  }
+
+  if (!pll_utree_traverse(tree,
+                          PLL_TREE_TRAVERSE_POSTORDER,
+                          cb_full_traversal,
+                          travbuffer,
+                          &trav_size))
+  {
+    free(travbuffer);
+    pllmod_set_error(PLLMOD_BIN_ERROR_BINARY_IO,
+                     "Error traversing utree");
+    return PLL_FAILURE;
+  }
+
+  assert (trav_size == n_nodes);
+
+  /* postorder, each inner node followed by its two other directions */
+  for (i=0; i<trav_size && retval; ++i)
+  {
+    retval = binary_node_apply(mem_stream, travbuffer[i], 1, &bin_mwrite);
+    if (retval && travbuffer[i]->next)
+    {
+      retval = binary_node_apply(mem_stream, travbuffer[i]->next, 1,
+                                 &bin_mwrite) &&
+               binary_node_apply(mem_stream, travbuffer[i]->next->next, 1,
+                                 &bin_mwrite);
+    }
+  }
+
+  free(travbuffer);
+
+  return retval;
+}
+
+/**
+ * Create a new partition with the dimensions of a loaded descriptor
+ *
+ * @param desc partition descriptor, as read by binary_partition_desc_apply
+ * @param load_skeleton if set, CLVs, tipchars and scalers are not allocated
+ *
+ * @return the new partition, or NULL in case of error
+ */
+pll_partition_t * binary_partition_create(const pll_partition_t * desc,
+                                          int load_skeleton)
+{
+  pll_partition_t * local_partition;
+  unsigned int sites_alloc;
+  unsigned int i;
+
+  unsigned int clv_buffers = load_skeleton ? 1 : desc->clv_buffers;
+  unsigned int tips = load_skeleton ? 0 : desc->tips;
+  unsigned int scale_buffers = load_skeleton ? 1 : desc->scale_buffers;
+
+  local_partition = pll_partition_create(
+      tips,
+      clv_buffers,
+      desc->states,
+      desc->sites,
+      desc->rate_matrices,
+      desc->prob_matrices,
+      desc->rate_cats,
+      scale_buffers,
+      desc->attributes);
+
+  if (!local_partition)
+    return NULL;
+
+  if (load_skeleton)
+  {
+    if (local_partition->clv)
+    {
+      size_t start = (local_partition->attributes & PLL_ATTRIB_PATTERN_TIP) ?
+                      local_partition->tips : 0;
+      for (i = start; i < local_partition->clv_buffers + local_partition->tips; ++i)
+        pll_aligned_free(local_partition->clv[i]);
+    }
+    free(local_partition->clv);
+    local_partition->clv_buffers = desc->clv_buffers;
+    local_partition->tips = desc->tips;
+    local_partition->clv = (double**) calloc(local_partition->clv_buffers +
+                                             local_partition->tips,
+                                             sizeof(double*));
+
+    if (local_partition->scale_buffer)
+      for (i = 0; i < local_partition->scale_buffers; ++i)
+    free(local_partition->scale_buffer[i]);
+    free(local_partition->scale_buffer);
+    local_partition->scale_buffers = desc->scale_buffers;
+    local_partition->scale_buffer = (unsigned int **) calloc(
+                                              local_partition->scale_buffers,
+                                              sizeof(unsigned int *));
+
+    // manually set the tips so that the rest of the code callocs correctly
+    local_partition->tips = desc->tips;
+  }
+
+  /* initialize extra variables */
+  local_partition->maxstates = desc->maxstates;
+  local_partition->asc_bias_alloc = desc->asc_bias_alloc;
+
+  sites_alloc = local_partition->asc_bias_alloc ?
+                 local_partition->sites + local_partition->states :
+                 local_partition->sites;
+  if (local_partition->attributes & PLL_ATTRIB_PATTERN_TIP)
+  {
+    /* allocate tip character arrays */
+    local_partition->tipchars =
+      (unsigned char **)calloc(local_partition->tips,
+                               sizeof(unsigned char *));
+    if (!local_partition->tipchars)
+    {
+      pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                "Cannot allocate space for storing tip characters.");
+      return NULL;
+    }
+
+    if (!(local_partition->charmap = (unsigned char *)calloc(PLL_ASCII_SIZE,
+                                                      sizeof(unsigned char))))
+    {
+      pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                "Cannot allocate charmap for tip-tip precomputation.");
+      return NULL;
+    }
+
+    if (!(local_partition->tipmap = (unsigned int *)calloc(PLL_ASCII_SIZE,
+                                                     sizeof(unsigned int))))
+    {
+      pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                "Cannot allocate tipmap for tip-tip precomputation.");
+      return NULL;
+    }
+
+    if (!load_skeleton)
+    {
+      for (i = 0; i < local_partition->tips ; ++i)
+      {
+        local_partition->tipchars[i] = (unsigned char *)malloc(sites_alloc *
+                                                         sizeof(unsigned char));
+        if (!local_partition->tipchars[i])
+        {
+          pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                    "Cannot allocate space for storing tip characters.");
+          return NULL;
+        }
+      }
+    }
+
+    if ((local_partition->states == 4) &&
+       (local_partition->attributes & PLL_ATTRIB_ARCH_AVX))
+    {
+      local_partition->ttlookup = pll_aligned_alloc(1024 *
+                                              local_partition->rate_cats *
+                                              sizeof(double),
+                                              local_partition->alignment);
+    }
+    else
+    {
+      unsigned int l2_maxstates =
+        (unsigned int) ceil(log2(local_partition->maxstates));
+      size_t alloc_size = (1 << (2 * l2_maxstates)) *
+                          (local_partition->states_padded *
+                          local_partition->rate_cats);
+      local_partition->ttlookup = pll_aligned_alloc(alloc_size *
+                                                    sizeof(double),
+                                                  local_partition->alignment);
+    }
+    if (!local_partition->ttlookup)
+    {
+      pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+              "Cannot allocate space for storing precomputed tip-tip CLVs.");
+      return NULL;
+    }
+  }
+
+  return local_partition;
+}
+
+#define CHECKSUM_PRIME1 0x9e3779b185ebca87ULL
+#define CHECKSUM_PRIME2 0xc2b2ae3d27d4eb4fULL
+#define CHECKSUM_PRIME3 0x165667b19e3779f9ULL
+#define CHECKSUM_PRIME4 0x85ebca77c2b2ae63ULL
+
+static inline uint64_t checksum_rotl(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t checksum_round(uint64_t acc, uint64_t word)
+{
+  acc ^= checksum_rotl(word * CHECKSUM_PRIME2, 31) * CHECKSUM_PRIME1;
+  return checksum_rotl(acc, 27) * CHECKSUM_PRIME1 + CHECKSUM_PRIME4;
+}
+
+uint64_t binary_checksum(const void * data, size_t len)
+{
+  /* multiply-rotate rounds over 64-bit words (as in xxHash64), seeded with
+     the length and followed by a full avalanche, such that any change in a
+     word, the word order or the length changes all output bits with high
+     probability */
+  const unsigned char * bytes = (const unsigned char *) data;
+  uint64_t hash = CHECKSUM_PRIME3 ^ ((uint64_t) len * CHECKSUM_PRIME1);
+  uint64_t word;
+  size_t i;
+
+  for (i = 0; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+  {
+    memcpy(&word, bytes + i, sizeof(uint64_t));
+    hash = checksum_round(hash, word);
+  }
+  if (i < len)
+  {
+    word = 0;
+    memcpy(&word, bytes + i, len - i);
+    hash = checksum_round(hash, word);
+  }
+
+  hash ^= hash >> 33;
+  hash *= CHECKSUM_PRIME2;
+  hash ^= hash >> 29;
+  hash *= CHECKSUM_PRIME3;
+  hash ^= hash >> 32;
+
+  return hash;
+}
+
 /* static functions */
 
 void file_io_error (FILE * bin_file, long int setp, const char * msg)
@@ -369,3 +940,228 @@ void file_io_error (FILE * bin_file, long int setp, const char * msg)
   pllmod_set_error(PLLMOD_BIN_ERROR_LOADSTORE,
                    "Binary file I/O error: %s", msg);
 }
+
+static void byte_shuffle(const unsigned char * in,
+                         unsigned char * out,
+                         size_t size,
+                         size_t count)
+{
+  size_t i, b;
+
+  if (size == 1)
+  {
+    memcpy(out, in, count);
+    return;
+  }
+
+  for (b = 0; b < size; ++b)
+    for (i = 0; i < count; ++i)
+      out[b*count + i] = in[i*size + b];
+}
+
+static void byte_unshuffle(const unsigned char * in,
+                           unsigned char * out,
+                           size_t size,
+                           size_t count)
+{
+  size_t i, b;
+
+  if (size == 1)
+  {
+    memcpy(out, in, count);
+    return;
+  }
+
+  for (b = 0; b < size; ++b)
+    for (i = 0; i < count; ++i)
+      out[i*size + b] = in[b*count + i];
+}
+
+/* returns the encoded length. `out` must hold at least
+   len + len/BIN_RLE_MAX_LITERAL + 1 bytes */
+static size_t rle_encode(const unsigned char * in,
+                         size_t len,
+                         unsigned char * out)
+{
+  size_t i = 0, o = 0;
+  size_t lit_start = 0, lit_len = 0;
+
+  while (i < len)
+  {
+    /* measure run at the current position */
+    size_t run = 1;
+    while (i + run < len && run < BIN_RLE_MAX_RUN && in[i + run] == in[i])
+      ++run;
+
+    if (run >= BIN_RLE_MIN_RUN)
+    {
+      /* flush pending literals */
+      if (lit_len)
+      {
+        out[o++] = (unsigned char) (lit_len - 1);
+        memcpy(out + o, in + lit_start, lit_len);
+        o += lit_len;
+        lit_len = 0;
+      }
+      out[o++] = (unsigned char) (BIN_RLE_REPEAT + run - BIN_RLE_MIN_RUN);
+      out[o++] = in[i];
+      i += run;
+    }
+    else
+    {
+      if (!lit_len)
+        lit_start = i;
+      ++lit_len;
+      ++i;
+
+      if (lit_len == BIN_RLE_MAX_LITERAL)
+      {
+        out[o++] = (unsigned char) (lit_len - 1);
+        memcpy(out + o, in + lit_start, lit_len);
+        o += lit_len;
+        lit_len = 0;
+      }
+    }
+  }
+
+  if (lit_len)
+  {
+    out[o++] = (unsigned char) (lit_len - 1);
+    memcpy(out + o, in + lit_start, lit_len);
+    o += lit_len;
+  }
+
+  return o;
+}
+
+static int rle_decode(const unsigned char * in,
+                      size_t in_len,
+                      unsigned char * out,
+                      size_t out_len)
+{
+  size_t i = 0, o = 0;
+
+  while (i < in_len)
+  {
+    unsigned int ctrl = in[i++];
+    if (ctrl < BIN_RLE_REPEAT)
+    {
+      size_t lit_len = ctrl + 1;
+      if (i + lit_len > in_len || o + lit_len > out_len)
+        return PLL_FAILURE;
+      memcpy(out + o, in + i, lit_len);
+      i += lit_len;
+      o += lit_len;
+    }
+    else
+    {
+      size_t run = ctrl - BIN_RLE_REPEAT + BIN_RLE_MIN_RUN;
+      if (i >= in_len || o + run > out_len)
+        return PLL_FAILURE;
+      memset(out + o, in[i++], run);
+      o += run;
+    }
+  }
+
+  return (o == out_len);
+}
+
+static int bin_decode(const unsigned char * enc,
+                      size_t enc_len,
+                      void * data,
+                      size_t size,
+                      size_t count)
+{
+  size_t len = size * count;
+  unsigned char * shuffled;
+  int retval;
+
+  if (size == 1)
+  {
+    shuffled = (unsigned char *) data;
+  }
+  else if (!(shuffled = (unsigned char *) malloc(len)))
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for decompressing data");
+    return PLL_FAILURE;
+  }
+
+  retval = rle_decode(enc, enc_len, shuffled, len);
+
+  if (!retval)
+    pllmod_set_error(PLLMOD_BIN_ERROR_LOADSTORE,
+                     "Binary file I/O error: corrupted compressed data");
+  else if (size != 1)
+    byte_unshuffle(shuffled, (unsigned char *) data, size, count);
+
+  if (size != 1)
+    free(shuffled);
+
+  return retval;
+}
+
+static int bin_write_z(void * data,
+                       size_t size,
+                       size_t count,
+                       void * stream,
+                       bin_func_t write_func)
+{
+  size_t len = size * count;
+  size_t enc_len;
+  unsigned char * shuffled;
+  unsigned char * encoded;
+  int retval;
+
+  if (!len)
+    return write_func(&len, sizeof(size_t), 1, stream);
+
+  shuffled = (unsigned char *) malloc(len);
+  encoded  = (unsigned char *) malloc(len + len / BIN_RLE_MAX_LITERAL + 1);
+  if (!shuffled || !encoded)
+  {
+    free(shuffled);
+    free(encoded);
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for compressing data");
+    return PLL_FAILURE;
+  }
+
+  byte_shuffle((const unsigned char *) data, shuffled, size, count);
+  enc_len = rle_encode(shuffled, len, encoded);
+
+  if (enc_len < len)
+  {
+    retval = write_func(&enc_len, sizeof(size_t), 1, stream) &&
+             write_func(encoded, 1, enc_len, stream);
+  }
+  else
+  {
+    /* store raw */
+    enc_len = 0;
+    retval = write_func(&enc_len, sizeof(size_t), 1, stream) &&
+             write_func(data, size, count, stream);
+  }
+
+  free(shuffled);
+  free(encoded);
+
+  return retval;
+}
+
+static int cb_full_traversal(pll_unode_t * node)
+{
+  UNUSED(node);
+  return 1;
+}
+
+/* prefixes the error set by a failed I/O function with the element name */
+static int apply_error(const char * element)
+{
+  char msg[PLLMOD_ERRMSG_LEN];
+
+  snprintf(msg, PLLMOD_ERRMSG_LEN, "%s", pll_errmsg);
+  pllmod_set_error(PLLMOD_BIN_ERROR_LOADSTORE,
+                   "Error loading/storing %s: %s", element, msg);
+  return PLL_FAILURE;
+}
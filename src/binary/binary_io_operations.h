@@ -21,47 +21,114 @@
 #ifndef BINARY_IO_OPERATIONS_H_
 #define BINARY_IO_OPERATIONS_H_
 
+#include <stdint.h>
+
 #include "pll_binary.h"
 
-int bin_fread(void * data, size_t size, size_t count, FILE * file);
+/* memory region accessed as a binary stream (e.g., a mapped file) */
+typedef struct
+{
+  char * data;
+  size_t size;
+  size_t pos;
+} bin_mem_stream_t;
+
+/* file region written with pwrite at `offset + pos`. With a negative `fd`
+   nothing is written, and the stream only measures the data */
+typedef struct
+{
+  int fd;
+  long int offset;
+  size_t pos;
+} bin_fd_stream_t;
+
+/* read/write callbacks. `stream` is either a `FILE *` or a `bin_mem_stream_t *`
+   depending on the function */
+typedef int (*bin_func_t)(void * data, size_t size, size_t count, void * stream);
+
+int bin_fread(void * data, size_t size, size_t count, void * stream);
+
+int bin_fwrite(void * data, size_t size, size_t count, void * stream);
+
+int bin_mread(void * data, size_t size, size_t count, void * stream);
+
+/* appends to a growable memory stream (`size` is the buffer capacity) */
+int bin_mwrite(void * data, size_t size, size_t count, void * stream);
+
+/* writes to a `bin_fd_stream_t` */
+int bin_dwrite(void * data, size_t size, size_t count, void * stream);
+
+/* compressed variants (byte-shuffle + RLE), see PLLMOD_BIN_ATTRIB_COMPRESS */
+int bin_fread_z(void * data, size_t size, size_t count, void * stream);
+
+int bin_fwrite_z(void * data, size_t size, size_t count, void * stream);
+
+int bin_mread_z(void * data, size_t size, size_t count, void * stream);
+
+int bin_mwrite_z(void * data, size_t size, size_t count, void * stream);
 
-int bin_fwrite(void * data, size_t size, size_t count, FILE * file);
+int bin_dwrite_z(void * data, size_t size, size_t count, void * stream);
+
+/* select the functions for block data according to the block attributes */
+bin_func_t bin_fread_func(unsigned int attributes);
+
+bin_func_t bin_fwrite_func(unsigned int attributes);
+
+bin_func_t bin_mread_func(unsigned int attributes);
+
+bin_func_t bin_mwrite_func(unsigned int attributes);
+
+bin_func_t bin_dwrite_func(unsigned int attributes);
 
 int binary_block_header_apply(FILE * bin_file,
                               pll_block_header_t * block_header,
-                              int (*bin_func)(void *, size_t, size_t, FILE *));
+                              bin_func_t bin_func);
+
+int binary_block_padding_apply(FILE * bin_file,
+                               unsigned int alignment,
+                               bin_func_t bin_func);
 
 int binary_update_header(FILE * bin_file,
                          pll_block_header_t * header);
 
 long int binary_get_offset(FILE *bin_file, int block_id);
 
-int binary_partition_apply(FILE * bin_file,
-                           pll_partition_t * partition,
-                           unsigned int attributes,
-                           int (*bin_func)(void *, size_t, size_t, FILE *));
-
-int binary_partition_body_apply (FILE * bin_file,
+int binary_partition_body_apply (void * bin_stream,
                              pll_partition_t * partition,
                              unsigned int attributes,
-                             int (*bin_func)(void *, size_t, size_t, FILE *));
+                             bin_func_t bin_func);
 
-int binary_partition_desc_apply (FILE * bin_file,
+int binary_partition_desc_apply (void * bin_stream,
                              pll_partition_t * partition,
                              unsigned int attributes,
-                             int (*bin_func)(void *, size_t, size_t, FILE *));
+                             bin_func_t bin_func);
 
-int binary_clv_apply (FILE * bin_file,
+int binary_clv_apply (void * bin_stream,
                   pll_partition_t * partition,
                   unsigned int clv_index,
                   unsigned int attributes,
                   size_t clv_size,
-                  int (*bin_func)(void *, size_t, size_t, FILE *));
+                  bin_func_t bin_func);
+
+/* serialize blocks into growable memory streams */
+int binary_partition_serialize(bin_mem_stream_t * mem_stream,
+                               pll_partition_t * partition,
+                               unsigned int attributes);
+
+int binary_utree_serialize(bin_mem_stream_t * mem_stream,
+                           pll_unode_t * tree,
+                           unsigned int tip_count);
+
+pll_partition_t * binary_partition_create(const pll_partition_t * desc,
+                                          int load_skeleton);
+
+/* checksum for detecting changes in data buffers */
+uint64_t binary_checksum(const void * data, size_t len);
 
-int binary_node_apply (FILE * bin_file,
+int binary_node_apply (void * bin_stream,
                        pll_unode_t * node,
                        int write,
-                       int (*bin_func)(void *, size_t, size_t, FILE *));
+                       bin_func_t bin_func);
 
 void file_io_error (FILE * bin_file, long int setp, const char * msg);
 
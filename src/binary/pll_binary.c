@@ -28,12 +28,22 @@
  * @author Pierre Barbera
  */
 
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "pll_binary.h"
 #include "binary_io_operations.h"
 #include "../pllmod_common.h"
 
 static unsigned int get_current_alignment( unsigned int attributes );
-static int cb_full_traversal(pll_unode_t * node);
+static int binary_mmap_block_seek(pll_binary_mmap_t * bin_map,
+                                  int block_id,
+                                  unsigned int type,
+                                  pll_block_header_t * block_header,
+                                  bin_mem_stream_t * mem_stream);
 
 /**
  *  Open file for writing
@@ -194,7 +204,8 @@ PLL_EXPORT int pllmod_binary_close(FILE * bin_file)
  *  @param[in] bin_file binary file
  *  @param[in] block_id id of the block for random access, or local id
  *  @param[in] partition the saved partition
- *  @param[in] attributes the dumped attributes
+ *  @param[in] attributes the dumped attributes. If PLLMOD_BIN_ATTRIB_COMPRESS
+ *             is set, partition data is stored compressed
  *
  * @return PLL_SUCCESS if the data was correctly saved
  *         PLL_FAILURE otherwise (check pll_errmsg for details)
@@ -232,7 +243,13 @@ PLL_EXPORT int pllmod_binary_partition_dump(FILE * bin_file,
   }
 
   /* dump data */
-  if (!binary_partition_apply(bin_file, partition, attributes, &bin_fwrite))
+  if (!binary_partition_desc_apply(bin_file, partition, attributes,
+                                   &bin_fwrite))
+  {
+    return PLL_FAILURE;
+  }
+  if (!binary_partition_body_apply(bin_file, partition, attributes,
+                                   bin_fwrite_func(attributes)))
   {
     return PLL_FAILURE;
   }
@@ -288,9 +305,8 @@ PLL_EXPORT pll_partition_t * pllmod_binary_partition_load(FILE * bin_file,
 {
   pll_block_header_t block_header;
   pll_partition_t * local_partition;
+  pll_partition_t aux_partition;
   assert(offset >= 0 || offset == PLLMOD_BIN_ACCESS_SEEK);
-  unsigned int sites_alloc;
-  unsigned int i;
 
   const int load_skeleton =
     *attributes & PLLMOD_BIN_ATTRIB_PARTITION_LOAD_SKELETON;
@@ -326,144 +342,34 @@ PLL_EXPORT pll_partition_t * pllmod_binary_partition_load(FILE * bin_file,
 
   *attributes = block_header.attributes;
 
+  /* the descriptor is read also when loading into an existing partition,
+     such that the stream is placed at the partition body */
+  if (!binary_partition_desc_apply (bin_file,
+                                    &aux_partition,
+                                    *attributes,
+                                    &bin_fread))
+  {
+    return NULL;
+  }
+
   if (partition)
   {
+    if (partition->tips != aux_partition.tips ||
+        partition->clv_buffers != aux_partition.clv_buffers ||
+        partition->states != aux_partition.states ||
+        partition->sites != aux_partition.sites ||
+        partition->rate_cats != aux_partition.rate_cats)
+    {
+      pllmod_set_error(PLLMOD_BIN_ERROR_BLOCK_MISMATCH,
+                       "Partition does not match the stored partition");
+      return NULL;
+    }
     local_partition = partition;
   }
   else
   {
     /* create new */
-    pll_partition_t aux_partition;
-    if (!binary_partition_desc_apply (bin_file,
-                                      &aux_partition,
-                                      *attributes,
-                                      &bin_fread))
-    {
-      return NULL;
-    }
-
-    unsigned int clv_buffers = load_skeleton ? 1 : aux_partition.clv_buffers;
-    unsigned int tips = load_skeleton ? 0 : aux_partition.tips;
-    unsigned int scale_buffers = load_skeleton ? 1 : aux_partition.scale_buffers;
-
-    local_partition = pll_partition_create(
-        tips,
-        clv_buffers,
-        aux_partition.states,
-        aux_partition.sites,
-        aux_partition.rate_matrices,
-        aux_partition.prob_matrices,
-        aux_partition.rate_cats,
-        scale_buffers,
-        aux_partition.attributes);
-
-    if (load_skeleton)
-    {
-      if (local_partition->clv)
-      {
-        size_t start = (local_partition->attributes & PLL_ATTRIB_PATTERN_TIP) ?
-                        local_partition->tips : 0;
-        for (i = start; i < local_partition->clv_buffers + local_partition->tips; ++i)
-          pll_aligned_free(local_partition->clv[i]);
-      }
-      free(local_partition->clv);
-      local_partition->clv_buffers = aux_partition.clv_buffers;
-      local_partition->tips = aux_partition.tips;
-      local_partition->clv = (double**) calloc(local_partition->clv_buffers +
-                                               local_partition->tips,
-                                               sizeof(double*));
-
-      if (local_partition->scale_buffer)
-        for (i = 0; i < local_partition->scale_buffers; ++i)
-      free(local_partition->scale_buffer[i]);
-      free(local_partition->scale_buffer);
-      local_partition->scale_buffers = aux_partition.scale_buffers;
-      local_partition->scale_buffer = (unsigned int **) calloc(
-                                                local_partition->scale_buffers,
-                                                sizeof(unsigned int *));
-
-      // manually set the tips so that the rest of the code callocs correctly
-      local_partition->tips = aux_partition.tips;
-    }
-
-    /* initialize extra variables */
-    local_partition->maxstates = aux_partition.maxstates;
-    local_partition->asc_bias_alloc = aux_partition.asc_bias_alloc;
-
-    sites_alloc = local_partition->asc_bias_alloc ?
-                   local_partition->sites + local_partition->states :
-                   local_partition->sites;
-    if (local_partition->attributes & PLL_ATTRIB_PATTERN_TIP)
-    {
-      /* allocate tip character arrays */
-      local_partition->tipchars =
-        (unsigned char **)calloc(local_partition->tips,
-                                 sizeof(unsigned char *));
-      if (!local_partition->tipchars)
-      {
-        pllmod_set_error(PLL_ERROR_MEM_ALLOC,
-                  "Cannot allocate space for storing tip characters.");
-        return PLL_FAILURE;
-      }
-
-      if (!(local_partition->charmap = (unsigned char *)calloc(PLL_ASCII_SIZE,
-                                                        sizeof(unsigned char))))
-      {
-        pllmod_set_error(PLL_ERROR_MEM_ALLOC,
-                  "Cannot allocate charmap for tip-tip precomputation.");
-        return PLL_FAILURE;
-      }
-
-      if (!(local_partition->tipmap = (unsigned int *)calloc(PLL_ASCII_SIZE,
-                                                       sizeof(unsigned int))))
-      {
-        pllmod_set_error(PLL_ERROR_MEM_ALLOC,
-                  "Cannot allocate tipmap for tip-tip precomputation.");
-        return PLL_FAILURE;
-      }
-
-      if (!load_skeleton)
-      {
-        for (i = 0; i < local_partition->tips ; ++i)
-        {
-          local_partition->tipchars[i] = (unsigned char *)malloc(sites_alloc *
-                                                           sizeof(unsigned char));
-          if (!local_partition->tipchars[i])
-          {
-            pllmod_set_error(PLL_ERROR_MEM_ALLOC,
-                      "Cannot allocate space for storing tip characters.");
-            return PLL_FAILURE;
-          }
-        }
-      }
-
-      if ((local_partition->states == 4) &&
-         (local_partition->attributes & PLL_ATTRIB_ARCH_AVX))
-      {
-        local_partition->ttlookup = pll_aligned_alloc(1024 *
-                                                local_partition->rate_cats *
-                                                sizeof(double),
-                                                local_partition->alignment);
-      }
-      else
-      {
-        unsigned int l2_maxstates =
-          (unsigned int) ceil(log2(local_partition->maxstates));
-        size_t alloc_size = (1 << (2 * l2_maxstates)) *
-                            (local_partition->states_padded *
-                            local_partition->rate_cats);
-        local_partition->ttlookup = pll_aligned_alloc(alloc_size *
-                                                      sizeof(double),
-                                                    local_partition->alignment);
-      }
-      if (!local_partition->ttlookup)
-      {
-        pllmod_set_error(PLL_ERROR_MEM_ALLOC,
-                "Cannot allocate space for storing precomputed tip-tip CLVs.");
-        return PLL_FAILURE;
-      }
-    }
-
+    local_partition = binary_partition_create(&aux_partition, load_skeleton);
     if (!local_partition)
     {
       return NULL;
@@ -473,9 +379,11 @@ PLL_EXPORT pll_partition_t * pllmod_binary_partition_load(FILE * bin_file,
   if (!binary_partition_body_apply (bin_file,
                                     local_partition,
                                     *attributes,
-                                    &bin_fread))
+                                    bin_fread_func(*attributes)))
   {
-    pll_partition_destroy(local_partition);
+    /* the caller's partition is left to the caller */
+    if (local_partition != partition)
+      pll_partition_destroy(local_partition);
     return NULL;
   }
 
@@ -489,7 +397,11 @@ PLL_EXPORT pll_partition_t * pllmod_binary_partition_load(FILE * bin_file,
  *  @param[in] block_id id of the block for random access, or local id
  *  @param[in] partition the partition containing the saved CLV
  *  @param[in] clv_index the index of the CLV
- *  @param[in] attributes the dumped attributes
+ *  @param[in] attributes the dumped attributes. If PLLMOD_BIN_ATTRIB_ALIGNED
+ *             is set, CLV data is placed at an offset aligned to the
+ *             partition memory alignment (see pllmod_binary_mmap_clv_load).
+ *             If PLLMOD_BIN_ATTRIB_COMPRESS is set, CLV data is stored
+ *             compressed and cannot be aligned
  *
  *  @return PLL_SUCCESS if the data was correctly saved
  *          PLL_FAILURE otherwise (check pll_errmsg for details)
@@ -514,7 +426,9 @@ PLL_EXPORT int pllmod_binary_clv_dump(FILE * bin_file,
   block_header.type       = PLLMOD_BIN_BLOCK_CLV;
   block_header.attributes = attributes;
   block_header.block_len  = clv_size * sizeof(double);
-  block_header.alignment  = 0;
+  block_header.alignment  = (attributes & PLLMOD_BIN_ATTRIB_ALIGNED &&
+                             !(attributes & PLLMOD_BIN_ATTRIB_COMPRESS)) ?
+                            (unsigned int) partition->alignment : 0;
 
   /* update main header */
   if(!binary_update_header(bin_file, &block_header))
@@ -526,13 +440,18 @@ PLL_EXPORT int pllmod_binary_clv_dump(FILE * bin_file,
   if (!binary_block_header_apply(bin_file, &block_header, &bin_fwrite))
     return PLL_FAILURE;
 
+  /* align CLV data within the file, such that it can be mapped directly */
+  if (!binary_block_padding_apply(bin_file, block_header.alignment,
+                                  &bin_fwrite))
+    return PLL_FAILURE;
+
   /* dump data */
   retval = binary_clv_apply (bin_file,
                              partition,
                              clv_index,
                              attributes,
                              clv_size,
-                             &bin_fwrite);
+                             bin_fwrite_func(attributes));
 
   return retval;
 }
@@ -612,12 +531,16 @@ PLL_EXPORT int pllmod_binary_clv_load(FILE * bin_file,
 
   *attributes = block_header.attributes;
 
+  if (!binary_block_padding_apply(bin_file, block_header.alignment,
+                                  &bin_fread))
+    return PLL_FAILURE;
+
   retval = binary_clv_apply (bin_file,
                          partition,
                          clv_index,
                          *attributes,
                          clv_size,
-                         &bin_fread);
+                         bin_fread_func(*attributes));
 
   return retval;
 }
@@ -640,92 +563,39 @@ PLL_EXPORT int pllmod_binary_utree_dump(FILE * bin_file,
                                         unsigned int tip_count,
                                         unsigned int attributes)
 {
-  pll_unode_t ** travbuffer;
   pll_block_header_t block_header;
-  unsigned int i, n_nodes, n_inner, n_utrees, trav_size;
+  bin_mem_stream_t mem_stream = {NULL, 0, 0};
+  unsigned int n_utrees;
   int retval;
 
   /* reset error */
   pll_errno = 0;
 
-  n_inner = tip_count - 2;
-  n_nodes = tip_count + n_inner;
-  n_utrees = tip_count + 3 * n_inner;
+  n_utrees = tip_count + 3 * (tip_count - 2);
 
-  travbuffer = (pll_unode_t **)malloc(n_nodes* sizeof(pll_unode_t *));
-
-  if (!tree->next)
+  /* traverse and serialize data */
+  if (!binary_utree_serialize(&mem_stream, tree, tip_count))
   {
-    pllmod_set_error(PLLMOD_BIN_ERROR_BINARY_IO,
-                     "Tree should not be a tip node");
-    return PLL_FAILURE;
-  }
-  if (!pll_utree_traverse(tree,
-                          PLL_TREE_TRAVERSE_POSTORDER,
-                          cb_full_traversal,
-                          travbuffer,
-                          &trav_size))
-  {
-    pllmod_set_error(PLLMOD_BIN_ERROR_BINARY_IO,
-                     "Error traversing utree");
+    free(mem_stream.data);
+    assert(pll_errno);
     return PLL_FAILURE;
   }
 
-  assert (trav_size == n_nodes);
-
   block_header.block_id   = block_id;
   block_header.type       = PLLMOD_BIN_BLOCK_TREE;
   block_header.attributes = attributes;
   block_header.block_len  = n_utrees * sizeof(pll_unode_t);
   block_header.alignment  = 0;
 
-  /* update main header */
-  if(!binary_update_header(bin_file, &block_header))
-  {
-    assert(pll_errno);
-    return PLL_FAILURE;
-  }
+  /* update main header, dump block header and data */
+  retval = binary_update_header(bin_file, &block_header) &&
+           binary_block_header_apply(bin_file, &block_header, &bin_fwrite) &&
+           bin_fwrite(mem_stream.data, 1, mem_stream.pos, bin_file);
 
-  /* dump block header */
-  if (!binary_block_header_apply(bin_file, &block_header, &bin_fwrite))
-  {
-    assert(pll_errno);
-    return PLL_FAILURE;
-  }
-
-  /* traverse and dump data */
-  for (i=0; i<trav_size; ++i)
-  {
-    if (!binary_node_apply (bin_file,
-                               travbuffer[i],
-                               1,
-                               bin_fwrite))
-    {
-      assert(pll_errno);
-      return PLL_FAILURE;
-    }
+  free(mem_stream.data);
 
-    if (travbuffer[i]->next)
-    {
-      retval = binary_node_apply (bin_file,
-                                travbuffer[i]->next,
-                                1,
-                                bin_fwrite);
-      retval &= binary_node_apply (bin_file,
-                                 travbuffer[i]->next->next,
-                                 1,
-                                 bin_fwrite);
-      if (!retval)
-      {
-        assert(pll_errno);
-        return PLL_FAILURE;
-      }
-    }
-  }
-
-  free(travbuffer);
-
-  return PLL_SUCCESS;
+  assert(retval || pll_errno);
+  return retval;
 }
 
 /**
@@ -899,7 +769,7 @@ PLL_EXPORT int pllmod_binary_custom_dump(FILE * bin_file,
     return PLL_FAILURE;
 
   /* dump data */
-  retval = bin_fwrite(data, size, 1, bin_file);
+  retval = bin_fwrite_func(attributes)(data, size, 1, bin_file);
 
   return retval;
 }
@@ -1006,7 +876,7 @@ PLL_EXPORT void * pllmod_binary_custom_load(FILE * bin_file,
     return PLL_FAILURE;
   }
 
-  if (!bin_fread (data, *size, 1, bin_file))
+  if (!bin_fread_func(*attributes)(data, *size, 1, bin_file))
   {
     pllmod_set_error(PLLMOD_BIN_ERROR_BINARY_IO, "Error reading data.");
     free(data);
@@ -1016,14 +886,330 @@ PLL_EXPORT void * pllmod_binary_custom_load(FILE * bin_file,
   return data;
 }
 
-/* static functions */
+/**
+ *  Map a random access binary file into memory
+ *
+ *  The block map is resolved once here, such that subsequent loads do not need
+ *  to read it again from the file.
+ *
+ *  @param[in] filename file to read from
+ *
+ *  @return the mapped file, or NULL in case of error
+ */
+PLL_EXPORT pll_binary_mmap_t * pllmod_binary_mmap_open(const char * filename)
+{
+  pll_binary_mmap_t * bin_map;
+  struct stat file_stat;
+  size_t map_end;
+  int fd;
+
+  fd = open(filename, O_RDONLY);
+  if (fd == -1)
+  {
+    pllmod_set_error(PLL_ERROR_FILE_OPEN, "Cannot open file for reading");
+    return NULL;
+  }
+
+  if (fstat(fd, &file_stat) == -1 ||
+      (size_t) file_stat.st_size < sizeof(pll_binary_header_t))
+  {
+    pllmod_set_error(PLLMOD_BIN_ERROR_BINARY_IO,
+                     "Error reading header from file");
+    close(fd);
+    return NULL;
+  }
+
+  bin_map = (pll_binary_mmap_t *) calloc(1, sizeof(pll_binary_mmap_t));
+  if (!bin_map)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for binary file mapping");
+    close(fd);
+    return NULL;
+  }
+
+  /* private mapping: buffers pointing into the file can be modified without
+     writing the changes back */
+  bin_map->size = (size_t) file_stat.st_size;
+  bin_map->data = (char *) mmap(NULL,
+                                bin_map->size,
+                                PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE,
+                                fd,
+                                0);
 
-static int cb_full_traversal(pll_unode_t * node)
+  /* the mapping remains valid after closing the descriptor */
+  close(fd);
+
+  if (bin_map->data == MAP_FAILED)
+  {
+    pllmod_set_error(PLLMOD_BIN_ERROR_BINARY_IO,
+                     "Cannot map binary file into memory");
+    free(bin_map);
+    return NULL;
+  }
+
+  memcpy(&bin_map->header, bin_map->data, sizeof(pll_binary_header_t));
+
+  if (bin_map->header.access_type != PLLMOD_BIN_ACCESS_RANDOM)
+  {
+    pllmod_set_error(PLLMOD_BIN_ERROR_BINARY_IO,
+                     "Binary file was not created for random access");
+    pllmod_binary_mmap_close(bin_map);
+    return NULL;
+  }
+
+  map_end = sizeof(pll_binary_header_t) +
+            bin_map->header.n_blocks * sizeof(pll_block_map_t);
+  if (bin_map->header.n_blocks > bin_map->header.max_blocks ||
+      map_end > bin_map->size)
+  {
+    pllmod_set_error(PLLMOD_BIN_ERROR_BINARY_IO,
+                     "Invalid block map in binary file");
+    pllmod_binary_mmap_close(bin_map);
+    return NULL;
+  }
+
+  bin_map->map = (pll_block_map_t *) (bin_map->data +
+                                      sizeof(pll_binary_header_t));
+
+  return bin_map;
+}
+
+/**
+ *  Unmap a binary file
+ *
+ *  CLVs loaded with zero copy (see pllmod_binary_mmap_clv_load) point into the
+ *  mapping, and must be detached from their partitions before calling this
+ *  function.
+ *
+ *  @param[in] bin_map the mapped file
+ *
+ *  @return PLL_SUCCESS if the file was unmapped
+ *          PLL_FAILURE otherwise (check pll_errmsg for details)
+ */
+PLL_EXPORT int pllmod_binary_mmap_close(pll_binary_mmap_t * bin_map)
+{
+  int retval = PLL_SUCCESS;
+
+  if (!bin_map)
+    return PLL_SUCCESS;
+
+  if (munmap(bin_map->data, bin_map->size) == -1)
+  {
+    pllmod_set_error(PLLMOD_BIN_ERROR_BINARY_IO,
+                     "Cannot unmap binary file");
+    retval = PLL_FAILURE;
+  }
+
+  free(bin_map);
+
+  return retval;
+}
+
+/**
+ *  Get the offset of a block in a mapped binary file
+ *
+ *  @param[in] bin_map the mapped file
+ *  @param[in] block_id id of the block
+ *
+ *  @return the offset of the block, or PLLMOD_BIN_INVALID_OFFSET if the block
+ *          is not in the block map
+ */
+PLL_EXPORT long int pllmod_binary_mmap_get_offset(
+                                             const pll_binary_mmap_t * bin_map,
+                                             int block_id)
+{
+  unsigned int i;
+
+  for (i = 0; i < bin_map->header.n_blocks; ++i)
+    if (bin_map->map[i].block_id == block_id)
+      return bin_map->map[i].block_offset;
+
+  return PLLMOD_BIN_INVALID_OFFSET;
+}
+
+/**
+ *  Load a partition from a mapped binary file
+ *
+ *  Data is copied directly from the mapping. See pllmod_binary_partition_load
+ *  for the description of the parameters.
+ *
+ *  @param[in] bin_map the mapped file
+ *  @param[in] block_id id of the block
+ *  @param[in,out] partition if NULL, creates a new partition
+ *  @param[in,out] attributes the loaded attributes
+ *
+ *  @return pointer to the updated (or new) partition
+ */
+PLL_EXPORT pll_partition_t * pllmod_binary_mmap_partition_load(
+                                                 pll_binary_mmap_t * bin_map,
+                                                 int block_id,
+                                                 pll_partition_t * partition,
+                                                 unsigned int * attributes)
+{
+  pll_block_header_t block_header;
+  pll_partition_t * local_partition;
+  pll_partition_t aux_partition;
+  bin_mem_stream_t mem_stream;
+
+  const int load_skeleton =
+    *attributes & PLLMOD_BIN_ATTRIB_PARTITION_LOAD_SKELETON;
+
+  if (!binary_mmap_block_seek(bin_map,
+                              block_id,
+                              PLLMOD_BIN_BLOCK_PARTITION,
+                              &block_header,
+                              &mem_stream))
+    return NULL;
+
+  *attributes = block_header.attributes;
+
+  /* the descriptor is read also when loading into an existing partition,
+     such that the stream is placed at the partition body */
+  if (!binary_partition_desc_apply (&mem_stream,
+                                    &aux_partition,
+                                    *attributes,
+                                    &bin_mread))
+  {
+    return NULL;
+  }
+
+  if (partition)
+  {
+    if (partition->tips != aux_partition.tips ||
+        partition->clv_buffers != aux_partition.clv_buffers ||
+        partition->states != aux_partition.states ||
+        partition->sites != aux_partition.sites ||
+        partition->rate_cats != aux_partition.rate_cats)
+    {
+      pllmod_set_error(PLLMOD_BIN_ERROR_BLOCK_MISMATCH,
+                       "Partition does not match the stored partition");
+      return NULL;
+    }
+    local_partition = partition;
+  }
+  else
+  {
+    /* create new */
+    local_partition = binary_partition_create(&aux_partition, load_skeleton);
+    if (!local_partition)
+    {
+      return NULL;
+    }
+  }
+
+  if (!binary_partition_body_apply (&mem_stream,
+                                    local_partition,
+                                    *attributes,
+                                    bin_mread_func(*attributes)))
+  {
+    /* the caller's partition is left to the caller */
+    if (local_partition != partition)
+      pll_partition_destroy(local_partition);
+    return NULL;
+  }
+
+  return local_partition;
+}
+
+/**
+ *  Load a CLV from a mapped binary file
+ *
+ *  If PLLMOD_BIN_ATTRIB_ALIGNED is passed in `attributes`, the target CLV
+ *  pointer is NULL (e.g., the partition was loaded with
+ *  PLLMOD_BIN_ATTRIB_PARTITION_LOAD_SKELETON) and the CLV was dumped aligned,
+ *  the CLV pointer is set to the mapped data instead of copying it. The caller
+ *  must then reset the pointer before destroying the partition or unmapping
+ *  the file.
+ *
+ *  @param[in] bin_map the mapped file
+ *  @param[in] block_id id of the block
+ *  @param[in,out] partition the partition where the CLV will be stored
+ *  @param[in] clv_index index of the CLV
+ *  @param[in,out] attributes the loaded attributes
+ *
+ *  @return PLL_SUCCESS if the data was correctly loaded
+ *          PLL_FAILURE otherwise (check pll_errmsg for details)
+ */
+PLL_EXPORT int pllmod_binary_mmap_clv_load(pll_binary_mmap_t * bin_map,
+                                           int block_id,
+                                           pll_partition_t * partition,
+                                           unsigned int clv_index,
+                                           unsigned int * attributes)
 {
-  UNUSED(node);
-  return 1;
+  pll_block_header_t block_header;
+  bin_mem_stream_t mem_stream;
+  char * clv_data;
+
+  assert (partition);
+
+  const int zero_copy = *attributes & PLLMOD_BIN_ATTRIB_ALIGNED;
+
+  unsigned int sites_alloc = partition->asc_bias_alloc ?
+                 partition->sites + partition->states :
+                 partition->sites;
+
+  size_t clv_size = sites_alloc * partition->states_padded *
+                    partition->rate_cats;
+
+  if (!binary_mmap_block_seek(bin_map,
+                              block_id,
+                              PLLMOD_BIN_BLOCK_CLV,
+                              &block_header,
+                              &mem_stream))
+    return PLL_FAILURE;
+
+  if (block_header.block_len != (clv_size * sizeof(double)))
+  {
+      pllmod_set_error(PLLMOD_BIN_ERROR_BLOCK_LENGTH,
+                    "Wrong block length");
+      return PLL_FAILURE;
+  }
+
+  *attributes = block_header.attributes;
+
+  /* skip padding */
+  if (block_header.alignment > 1)
+    mem_stream.pos = (mem_stream.pos + block_header.alignment - 1) /
+                     block_header.alignment * block_header.alignment;
+
+  if (clv_index >= (partition->tips + partition->clv_buffers))
+  {
+    pllmod_set_error(PLLMOD_BIN_ERROR_INVALID_INDEX,
+                     "Invalid CLV index");
+    return PLL_FAILURE;
+  }
+
+  clv_data = mem_stream.data + mem_stream.pos;
+
+  if (!partition->clv[clv_index])
+  {
+    if (zero_copy && block_header.alignment &&
+        !(block_header.attributes & PLLMOD_BIN_ATTRIB_COMPRESS) &&
+        !((uintptr_t) clv_data % partition->alignment) &&
+        mem_stream.pos + block_header.block_len <= mem_stream.size)
+    {
+      partition->clv[clv_index] = (double *) clv_data;
+      return PLL_SUCCESS;
+    }
+
+    pllmod_set_error(PLLMOD_BIN_ERROR_LOADSTORE,
+                     "CLV %u is not allocated and cannot be mapped",
+                     clv_index);
+    return PLL_FAILURE;
+  }
+
+  return binary_clv_apply (&mem_stream,
+                           partition,
+                           clv_index,
+                           *attributes,
+                           clv_size,
+                           bin_mread_func(*attributes));
 }
 
+/* static functions */
+
 /**
  * Notes:
  *     1. Memory alignment could be different when saving and loading the binary
@@ -1060,3 +1246,38 @@ static unsigned int get_current_alignment( unsigned int attributes )
 #endif
   return alignment;
 }
+
+/* locate a block in a mapped file, validate its header and place the stream
+   right after it */
+static int binary_mmap_block_seek(pll_binary_mmap_t * bin_map,
+                                  int block_id,
+                                  unsigned int type,
+                                  pll_block_header_t * block_header,
+                                  bin_mem_stream_t * mem_stream)
+{
+  long int offset = pllmod_binary_mmap_get_offset(bin_map, block_id);
+
+  if (offset == PLLMOD_BIN_INVALID_OFFSET)
+  {
+    pllmod_set_error(PLLMOD_BIN_ERROR_MISSING_BLOCK,
+                     "Cannot retrieve offset for block %d", block_id);
+    return PLL_FAILURE;
+  }
+
+  mem_stream->data = bin_map->data;
+  mem_stream->size = bin_map->size;
+  mem_stream->pos  = (size_t) offset;
+
+  if (!bin_mread(block_header, sizeof(pll_block_header_t), 1, mem_stream))
+    return PLL_FAILURE;
+
+  if (block_header->type != type)
+  {
+    pllmod_set_error(PLLMOD_BIN_ERROR_BLOCK_MISMATCH,
+                     "Block type is %d and should be %d",
+                     block_header->type, type);
+    return PLL_FAILURE;
+  }
+
+  return PLL_SUCCESS;
+}
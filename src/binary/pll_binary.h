@@ -30,6 +30,7 @@
 #define PLLMOD_BIN_BLOCK_CLV        1
 #define PLLMOD_BIN_BLOCK_TREE       2
 #define PLLMOD_BIN_BLOCK_CUSTOM     3
+#define PLLMOD_BIN_BLOCK_PARTITION_DELTA 4
 
 #define PLLMOD_BIN_ACCESS_SEQUENTIAL  0
 #define PLLMOD_BIN_ACCESS_RANDOM      1
@@ -42,6 +43,7 @@
 #define PLLMOD_BIN_ATTRIB_PARTITION_DUMP_WGT      (1<<2)
 #define PLLMOD_BIN_ATTRIB_ALIGNED                 (1<<3)
 #define PLLMOD_BIN_ATTRIB_PARTITION_LOAD_SKELETON (1<<4)
+#define PLLMOD_BIN_ATTRIB_COMPRESS                (1<<5)
 
 #define PLLMOD_BIN_ERROR_BLOCK_MISMATCH         4001
 #define PLLMOD_BIN_ERROR_BLOCK_LENGTH           4002
@@ -91,6 +93,33 @@ typedef struct
   size_t block_len;          //! block length
 } pll_block_header_t;
 
+/*
+ * Read-only view of a random access binary file mapped into memory.
+ * The block map is resolved once when the file is opened, and data blocks are
+ * copied (or referenced, see pllmod_binary_mmap_clv_load) directly from the
+ * mapping without going through the stdio buffers.
+ * The mapping is private, so that changes on referenced buffers are never
+ * written back to the file.
+ */
+typedef struct
+{
+  pll_binary_header_t header; //! file header
+  pll_block_map_t * map;      //! block map (points into the mapped data)
+  char * data;                //! mapped file contents
+  size_t size;                //! size of the mapping
+} pll_binary_mmap_t;
+
+/*
+ * Handle of a binary file written in the background (see binary_async.c).
+ */
+typedef struct pll_binary_async_s pll_binary_async_t;
+
+/*
+ * Change tracking state for delta checkpoints of a partition
+ * (see binary_delta.c).
+ */
+typedef struct pll_binary_delta_s pll_binary_delta_t;
+
 PLL_EXPORT FILE * pllmod_binary_create(const char * filename,
                                        pll_binary_header_t * header,
                                        unsigned int access_type,
@@ -155,4 +184,98 @@ PLL_EXPORT void * pllmod_binary_custom_load(FILE * bin_file,
                                            unsigned int * attributes,
                                            long int offset);
 
+/* memory-mapped random access */
+
+PLL_EXPORT pll_binary_mmap_t * pllmod_binary_mmap_open(const char * filename);
+
+PLL_EXPORT int pllmod_binary_mmap_close(pll_binary_mmap_t * bin_map);
+
+PLL_EXPORT long int pllmod_binary_mmap_get_offset(
+                                             const pll_binary_mmap_t * bin_map,
+                                             int block_id);
+
+PLL_EXPORT pll_partition_t * pllmod_binary_mmap_partition_load(
+                                                 pll_binary_mmap_t * bin_map,
+                                                 int block_id,
+                                                 pll_partition_t * partition,
+                                                 unsigned int * attributes);
+
+PLL_EXPORT int pllmod_binary_mmap_clv_load(pll_binary_mmap_t * bin_map,
+                                           int block_id,
+                                           pll_partition_t * partition,
+                                           unsigned int clv_index,
+                                           unsigned int * attributes);
+
+/* asynchronous write */
+
+PLL_EXPORT pll_binary_async_t * pllmod_binary_async_create(
+                                                   const char * filename,
+                                                   unsigned int access_type,
+                                                   unsigned int n_blocks);
+
+PLL_EXPORT int pllmod_binary_async_partition_dump(pll_binary_async_t * async,
+                                                  int block_id,
+                                                  pll_partition_t * partition,
+                                                  unsigned int attributes);
+
+PLL_EXPORT int pllmod_binary_async_clv_dump(pll_binary_async_t * async,
+                                            int block_id,
+                                            pll_partition_t * partition,
+                                            unsigned int clv_index,
+                                            unsigned int attributes);
+
+PLL_EXPORT int pllmod_binary_async_utree_dump(pll_binary_async_t * async,
+                                              int block_id,
+                                              pll_unode_t * tree,
+                                              unsigned int tip_count,
+                                              unsigned int attributes);
+
+PLL_EXPORT int pllmod_binary_async_custom_dump(pll_binary_async_t * async,
+                                               int block_id,
+                                               void * data,
+                                               size_t size,
+                                               unsigned int attributes);
+
+PLL_EXPORT int pllmod_binary_async_commit(pll_binary_async_t * async);
+
+PLL_EXPORT int pllmod_binary_async_test(pll_binary_async_t * async);
+
+PLL_EXPORT int pllmod_binary_async_wait(pll_binary_async_t * async);
+
+/* delta checkpoints */
+
+PLL_EXPORT pll_binary_delta_t * pllmod_binary_delta_create(
+                                          const pll_partition_t * partition);
+
+PLL_EXPORT void pllmod_binary_delta_destroy(pll_binary_delta_t * delta);
+
+PLL_EXPORT int pllmod_binary_partition_delta_dump(FILE * bin_file,
+                                                  int block_id,
+                                                  pll_partition_t * partition,
+                                                  pll_binary_delta_t * delta,
+                                                  const char * clv_valid,
+                                                  unsigned int attributes);
+
+PLL_EXPORT pll_partition_t * pllmod_binary_partition_delta_load(
+                                                 FILE * bin_file,
+                                                 int block_id,
+                                                 pll_partition_t * partition,
+                                                 unsigned int * attributes);
+
+/* parallel checkpoint of several partitions and a tree */
+
+PLL_EXPORT int pllmod_binary_checkpoint_dump(const char * filename,
+                                             pll_partition_t ** partitions,
+                                             unsigned int partition_count,
+                                             pll_unode_t * tree,
+                                             unsigned int tip_count,
+                                             unsigned int attributes,
+                                             unsigned int n_threads);
+
+PLL_EXPORT int pllmod_binary_checkpoint_load(const char * filename,
+                                             pll_partition_t ** partitions,
+                                             unsigned int partition_count,
+                                             pll_unode_t ** tree,
+                                             unsigned int n_threads);
+
 #endif /* PLLMOD_BIN_H_ */
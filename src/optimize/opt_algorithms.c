@@ -22,6 +22,8 @@
 #include "lbfgsb/lbfgsb.h"
 #include "../pllmod_common.h"
 
+#include <pthread.h>
+
 /**
  * @file opt_algorithms.c
  *
@@ -175,44 +177,268 @@ PLL_EXPORT double pllmod_opt_minimize_newton(double x1,
 /* L-BFGS-B OPTIMIZATION */
 /******************************************************************************/
 
-/**
- * Minimize a multi-parameter function using L-BFGS-B.
- *
- * The target function must compute the score at a certain state,
- * and it requires 2 parameters: (1) custom data (if needed),
- * and (2) the values at which score is computed.
- *
- * @param  x[in,out]   first guess and result of the minimization process
- * @param  xmin        lower bound for each of the variables
- * @param  xmax        upper bound for each of the variables
- * @param  bound       bound type (PLL_LBFGSB_BOUND_[NONE|LOWER|UPPER|BOTH]
- * @param  n           number of variables
- * @param  factr       convergence tolerance for L-BFGS-B relative to machine epsilon
- * @param  pgtol       absolute gradient tolerance for L-BFGS-B
- * @param  params      custom parameters required by the target function
- * @param  target_funk target function
- *
- * `factr` is a double precision variable. The iteration will stop when
- * (f^k - f^{k+1})/max{|f^k|,|f^{k+1}|,1} <= factr*epsmch
- * where epsmch is the machine epsilon
- *
- * `pgtol` is a double precision variable. The iteration will stop when
- * max{|proj g_i | i = 1, ..., n} <= pgtol
- * where pg_i is the ith component of the projected gradient.
- *
- * @return             the minimal score found
+/* finite differences worker for pllmod_opt_minimize_lbfgsb_mt */
+struct lbfgsb_fd_worker
+{
+  unsigned int id;
+  unsigned int n_threads;
+  unsigned int n;
+  const double * x;     /* current point (shared, read-only) */
+  double * xw;          /* private copy of the current point */
+  double * g;           /* gradient (shared, each worker writes its own) */
+  double score;         /* score at the current point */
+  void * params;        /* private evaluation context */
+  double (*target_funk)(void *, double *);
+};
+
+/* finite differences worker for pllmod_opt_minimize_lbfgsb_multi_mt */
+struct lbfgsb_multi_fd_worker
+{
+  unsigned int id;
+  unsigned int n_threads;
+  unsigned int xnum;
+  unsigned int nmax;
+  const unsigned int * n;
+  double ** x;          /* current points (shared, read-only) */
+  double ** xw;         /* private copies of the current points */
+  double ** g;          /* gradients (shared, each worker writes its own) */
+  const double * lh_old;/* per-set scores at the current points */
+  double * lh_new;      /* private per-set scores */
+  const int * skip;     /* sets to skip at the current iteration */
+  int * skip_w;         /* private copy of skip */
+  double * h;           /* private step sizes */
+  void * params;        /* private evaluation context */
+  double (*target_funk)(void *, double **, double *, int *);
+};
+
+static void * lbfgsb_fd_worker_run(void * arg)
+{
+  struct lbfgsb_fd_worker * w = (struct lbfgsb_fd_worker *) arg;
+  unsigned int i;
+  double h, temp;
+
+  memcpy(w->xw, w->x, w->n * sizeof(double));
+
+  for (i = w->id; i < w->n; i += w->n_threads)
+  {
+    temp = w->xw[i];
+    h = PLL_LBFGSB_ERROR * fabs (temp);
+    if (h < 1e-12)
+      h = PLL_LBFGSB_ERROR;
+
+    w->xw[i] = temp + h;
+    h = w->xw[i] - temp;
+    double lnderiv = w->target_funk(w->params, w->xw);
+
+    w->g[i] = (lnderiv - w->score) / h;
+
+    /* reset variable */
+    w->xw[i] = temp;
+  }
+
+  return NULL;
+}
+
+static void * lbfgsb_multi_fd_worker_run(void * arg)
+{
+  struct lbfgsb_multi_fd_worker * w = (struct lbfgsb_multi_fd_worker *) arg;
+  unsigned int i, p;
+
+  for (p = 0; p < w->xnum; ++p)
+  {
+    w->skip_w[p] = w->skip[p];
+    if (w->xw[p])
+      memcpy(w->xw[p], w->x[p], w->n[p] * sizeof(double));
+  }
+  w->skip_w[w->xnum] = w->skip[w->xnum];
+
+  for (i = w->id; i < w->nmax; i += w->n_threads)
+  {
+    for (p = 0; p < w->xnum; p++)
+    {
+      if (i >= w->n[p])
+      {
+        /* this set has less parameters than max -> skip it */
+        w->skip_w[p] = 1;
+      }
+
+      if (w->skip_w[p])
+        continue;
+
+      double temp = w->xw[p][i];
+      w->h[p] = PLL_LBFGSB_ERROR * fabs (temp);
+      if (w->h[p] < 1e-12)
+        w->h[p] = PLL_LBFGSB_ERROR;
+
+      w->xw[p][i] = temp + w->h[p];
+      w->h[p] = w->xw[p][i] - temp;
+    }
+
+    w->target_funk(w->params, w->xw, w->lh_new, w->skip_w);
+
+    for (p = 0; p < w->xnum; p++)
+    {
+      if (w->skip_w[p])
+        continue;
+
+      /* compute partial derivative and reset variable */
+      w->g[p][i] = (w->lh_new[p] - w->lh_old[p]) / w->h[p];
+      w->xw[p][i] = w->x[p][i];
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Run `n_threads` workers stored contiguously in `workers`. The calling
+ * thread runs worker 0, and any worker whose thread cannot be started.
  */
-PLL_EXPORT double pllmod_opt_minimize_lbfgsb (double * x,
-                                             double * xmin,
-                                             double * xmax,
-                                             int * bound,
-                                             unsigned int n,
-                                             double factr,
-                                             double pgtol,
-                                             void * params,
-                                             double (*target_funk)(
-                                                     void *,
-                                                     double *))
+static void run_fd_workers(void * workers,
+                           size_t worker_size,
+                           unsigned int n_threads,
+                           void * (*worker_run)(void *))
+{
+  char * worker_base = (char *) workers;
+  pthread_t * threads = (pthread_t *) calloc(n_threads, sizeof(pthread_t));
+  int * started = (int *) calloc(n_threads, sizeof(int));
+  unsigned int t;
+
+  for (t = 1; t < n_threads; ++t)
+  {
+    if (threads && started)
+      started[t] = !pthread_create(&threads[t], NULL, worker_run,
+                                   worker_base + t * worker_size);
+  }
+
+  worker_run(worker_base);
+
+  for (t = 1; t < n_threads; ++t)
+  {
+    if (started && started[t])
+      pthread_join(threads[t], NULL);
+    else
+      worker_run(worker_base + t * worker_size);
+  }
+
+  if (threads)
+    free(threads);
+  if (started)
+    free(started);
+}
+
+static void destroy_fd_workers(struct lbfgsb_fd_worker * workers,
+                               unsigned int count)
+{
+  unsigned int i;
+
+  for (i = 0; i < count; ++i)
+    if (workers[i].xw)
+      free(workers[i].xw);
+  free(workers);
+}
+
+static void destroy_multi_fd_workers(struct lbfgsb_multi_fd_worker * workers,
+                                     unsigned int count)
+{
+  unsigned int i, p;
+
+  for (i = 0; i < count; ++i)
+  {
+    if (workers[i].xw)
+    {
+      for (p = 0; p < workers[i].xnum; ++p)
+        if (workers[i].xw[p])
+          free(workers[i].xw[p]);
+      free(workers[i].xw);
+    }
+    if (workers[i].lh_new)
+      free(workers[i].lh_new);
+    if (workers[i].skip_w)
+      free(workers[i].skip_w);
+    if (workers[i].h)
+      free(workers[i].h);
+  }
+  free(workers);
+}
+
+static struct lbfgsb_multi_fd_worker * create_multi_fd_workers(
+                              unsigned int xnum,
+                              double ** x,
+                              const unsigned int * n,
+                              unsigned int nmax,
+                              double ** g,
+                              const double * lh_old,
+                              const int * skip,
+                              void ** params,
+                              unsigned int n_threads,
+                              double (*target_funk)(void *,
+                                                    double **,
+                                                    double *,
+                                                    int *))
+{
+  unsigned int i, p;
+  struct lbfgsb_multi_fd_worker * workers = (struct lbfgsb_multi_fd_worker *)
+                   calloc(n_threads, sizeof(struct lbfgsb_multi_fd_worker));
+
+  if (!workers)
+    return NULL;
+
+  for (i = 0; i < n_threads; ++i)
+  {
+    struct lbfgsb_multi_fd_worker * w = workers + i;
+
+    w->id          = i;
+    w->n_threads   = n_threads;
+    w->xnum        = xnum;
+    w->nmax        = nmax;
+    w->n           = n;
+    w->x           = x;
+    w->g           = g;
+    w->lh_old      = lh_old;
+    w->skip        = skip;
+    w->params      = params[i];
+    w->target_funk = target_funk;
+
+    w->xw     = (double **) calloc((size_t) xnum, sizeof(double *));
+    w->lh_new = (double *) calloc((size_t) xnum, sizeof(double));
+    w->skip_w = (int *) calloc((size_t) xnum + 1, sizeof(int));
+    w->h      = (double *) calloc((size_t) xnum, sizeof(double));
+
+    if (!w->xw || !w->lh_new || !w->skip_w || !w->h)
+    {
+      destroy_multi_fd_workers(workers, i + 1);
+      return NULL;
+    }
+
+    for (p = 0; p < xnum; ++p)
+    {
+      /* remote sets are never evaluated */
+      if (!x[p])
+        continue;
+
+      w->xw[p] = (double *) calloc((size_t) n[p], sizeof(double));
+      if (!w->xw[p])
+      {
+        destroy_multi_fd_workers(workers, i + 1);
+        return NULL;
+      }
+    }
+  }
+
+  return workers;
+}
+
+static double lbfgsb(double * x,
+                     double * xmin,
+                     double * xmax,
+                     int * bound,
+                     unsigned int n,
+                     double factr,
+                     double pgtol,
+                     void ** params,
+                     unsigned int n_threads,
+                     double (*target_funk)(void *, double *))
 {
   unsigned int i;
 
@@ -234,6 +460,8 @@ PLL_EXPORT double pllmod_opt_minimize_lbfgsb (double * x,
 
   int iprint = -1;
 
+  struct lbfgsb_fd_worker * workers = NULL;
+
   max_corrections = 5;
 
   /* reset errno */
@@ -250,10 +478,34 @@ PLL_EXPORT double pllmod_opt_minimize_lbfgsb (double * x,
           + 12 * (size_t)max_corrections * ((size_t)max_corrections + 1),
       sizeof(double));
 
-  if (!(wa && iwa && g))
+  if (n_threads > 1)
+  {
+    workers = (struct lbfgsb_fd_worker *) calloc(n_threads,
+                                                 sizeof(struct lbfgsb_fd_worker));
+    for (i = 0; workers && i < n_threads; ++i)
+    {
+      workers[i].id          = i;
+      workers[i].n_threads   = n_threads;
+      workers[i].n           = n;
+      workers[i].x           = x;
+      workers[i].g           = g;
+      workers[i].params      = params[i];
+      workers[i].target_funk = target_funk;
+      workers[i].xw          = (double *) calloc((size_t) n, sizeof(double));
+      if (!workers[i].xw)
+      {
+        destroy_fd_workers(workers, i);
+        workers = NULL;
+      }
+    }
+  }
+
+  if (!(wa && iwa && g) || (n_threads > 1 && !workers))
   {
     pllmod_set_error(PLL_ERROR_MEM_ALLOC,
                      "Cannot allocate memory for l-bfgs-b variables");
+    if (workers)
+      destroy_fd_workers(workers, n_threads);
     if (g)
       free (g);
     if (iwa)
@@ -279,11 +531,21 @@ PLL_EXPORT double pllmod_opt_minimize_lbfgsb (double * x,
        * Compute function value f for the sample problem.
        */
 
-      score = target_funk(params, x);
+      score = target_funk(params[0], x);
 
       if (is_nan(score) || d_equals(score, (double) -INFINITY))
         break;
 
+      if (workers)
+      {
+        /* evaluate the coordinate perturbations concurrently */
+        for (i = 0; i < n_threads; ++i)
+          workers[i].score = score;
+        run_fd_workers(workers, sizeof(struct lbfgsb_fd_worker), n_threads,
+                       lbfgsb_fd_worker_run);
+        continue;
+      }
+
       double h, temp;
       for (i = 0; i < n; i++)
       {
@@ -294,7 +556,7 @@ PLL_EXPORT double pllmod_opt_minimize_lbfgsb (double * x,
 
         x[i] = temp + h;
         h = x[i] - temp;
-        double lnderiv = target_funk(params, x);
+        double lnderiv = target_funk(params[0], x);
 
         g[i] = (lnderiv - score) / h;
 
@@ -307,11 +569,13 @@ PLL_EXPORT double pllmod_opt_minimize_lbfgsb (double * x,
   }
 
   /* fix optimal parameters */
-  score = target_funk(params, x);
+  score = target_funk(params[0], x);
 
   free (iwa);
   free (wa);
   free (g);
+  if (workers)
+    destroy_fd_workers(workers, n_threads);
 
   if (is_nan(score))
   {
@@ -324,7 +588,91 @@ PLL_EXPORT double pllmod_opt_minimize_lbfgsb (double * x,
   }
 
   return score;
-} /* pllmod_opt_minimize_lbfgsb */
+} /* lbfgsb */
+
+/**
+ * Minimize a multi-parameter function using L-BFGS-B.
+ *
+ * The target function must compute the score at a certain state,
+ * and it requires 2 parameters: (1) custom data (if needed),
+ * and (2) the values at which score is computed.
+ *
+ * @param  x[in,out]   first guess and result of the minimization process
+ * @param  xmin        lower bound for each of the variables
+ * @param  xmax        upper bound for each of the variables
+ * @param  bound       bound type (PLL_LBFGSB_BOUND_[NONE|LOWER|UPPER|BOTH]
+ * @param  n           number of variables
+ * @param  factr       convergence tolerance for L-BFGS-B relative to machine epsilon
+ * @param  pgtol       absolute gradient tolerance for L-BFGS-B
+ * @param  params      custom parameters required by the target function
+ * @param  target_funk target function
+ *
+ * `factr` is a double precision variable. The iteration will stop when
+ * (f^k - f^{k+1})/max{|f^k|,|f^{k+1}|,1} <= factr*epsmch
+ * where epsmch is the machine epsilon
+ *
+ * `pgtol` is a double precision variable. The iteration will stop when
+ * max{|proj g_i | i = 1, ..., n} <= pgtol
+ * where pg_i is the ith component of the projected gradient.
+ *
+ * @return             the minimal score found
+ */
+PLL_EXPORT double pllmod_opt_minimize_lbfgsb (double * x,
+                                             double * xmin,
+                                             double * xmax,
+                                             int * bound,
+                                             unsigned int n,
+                                             double factr,
+                                             double pgtol,
+                                             void * params,
+                                             double (*target_funk)(
+                                                     void *,
+                                                     double *))
+{
+  return lbfgsb(x, xmin, xmax, bound, n, factr, pgtol, &params, 1,
+                target_funk);
+}
+
+/**
+ * Minimize a multi-parameter function using L-BFGS-B, evaluating the
+ * finite differences gradient with multiple threads.
+ *
+ * Same as `pllmod_opt_minimize_lbfgsb`, but the coordinate perturbations of
+ * each gradient are distributed among `n_threads` threads. Thread `i` calls
+ * `target_funk` with `params[i]` only, so every element of `params` must be
+ * an independent evaluation context (e.g., its own copy of the partition).
+ * Model parameters affect every CLV, therefore the contexts cannot share
+ * likelihood buffers. The score and the final parameters are evaluated on
+ * `params[0]`.
+ *
+ * @param  params      array of `n_threads` evaluation contexts
+ * @param  n_threads   number of threads
+ *
+ * @return             the minimal score found
+ */
+PLL_EXPORT double pllmod_opt_minimize_lbfgsb_mt(double * x,
+                                                double * xmin,
+                                                double * xmax,
+                                                int * bound,
+                                                unsigned int n,
+                                                double factr,
+                                                double pgtol,
+                                                void ** params,
+                                                unsigned int n_threads,
+                                                double (*target_funk)(
+                                                        void *,
+                                                        double *))
+{
+  if (!params || !n_threads)
+  {
+    pllmod_set_error(PLLMOD_OPT_ERROR_PARAMETER,
+                     "At least one evaluation context is required");
+    return (double) -INFINITY;
+  }
+
+  return lbfgsb(x, xmin, xmax, bound, n, factr, pgtol, params, n_threads,
+                target_funk);
+}
 
 struct bfgs_multi_opt
 {
@@ -412,20 +760,25 @@ static int setulb_multi(struct bfgs_multi_opt * opt)
                  &opt->csave, opt->lsave, opt->isave, opt->dsave);
 }
 
-PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi(unsigned int xnum,
-                                                   double ** x,
-                                                   double ** xmin,
-                                                   double ** xmax,
-                                                   int ** bound,
-                                                   unsigned int * n,
-                                                   unsigned int nmax,
-                                                   double factr,
-                                                   double pgtol,
-                                                   void * params,
-                                                   double (*target_funk)(void *,
-                                                                         double **,
-                                                                         double *,
-                                                                         int *))
+static double lbfgsb_multi(unsigned int xnum,
+                           double ** x,
+                           double ** xmin,
+                           double ** xmax,
+                           int ** bound,
+                           unsigned int * n,
+                           unsigned int nmax,
+                           double factr,
+                           double pgtol,
+                           void ** params,
+                           unsigned int n_threads,
+                           double (*target_funk)(void *,
+                                                 double **,
+                                                 double *,
+                                                 int *),
+                           int (*grad_funk)(void *,
+                                            double **,
+                                            double **,
+                                            int *))
 {
   unsigned int i, p;
 
@@ -438,8 +791,12 @@ PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi(unsigned int xnum,
 
   struct bfgs_multi_opt ** opts = (struct bfgs_multi_opt **)
                            calloc((size_t) xnum, sizeof(struct bfgs_multi_opt *));
+  double ** grad = (double **) calloc((size_t) xnum, sizeof(double *));
+  int grad_failed = 0;
 
-  if (!lh_old || !lh_new || !converged || !skip || !opts)
+  struct lbfgsb_multi_fd_worker * workers = NULL;
+
+  if (!lh_old || !lh_new || !converged || !skip || !opts || !grad)
   {
     pllmod_set_error(PLL_ERROR_MEM_ALLOC,
                      "Cannot allocate memory for l-bfgs-b variables");
@@ -466,6 +823,20 @@ PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi(unsigned int xnum,
     if (!init_bfgs_opt(opts[p], n[p], x[p], xmin[p], xmax[p], bound[p], factr,
                        pgtol))
       goto cleanup;
+
+    grad[p] = opts[p]->g;
+  }
+
+  if (n_threads > 1 && !grad_funk)
+  {
+    workers = create_multi_fd_workers(xnum, x, n, nmax, grad, lh_old, skip,
+                                      params, n_threads, target_funk);
+    if (!workers)
+    {
+      pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                       "Cannot allocate memory for l-bfgs-b variables");
+      goto cleanup;
+    }
   }
 
   /* reset errno */
@@ -495,9 +866,9 @@ PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi(unsigned int xnum,
     }
 
     /* check if ALL partitions have converged, including remote ones */
-    target_funk (params, NULL, NULL, converged);
+    target_funk (params[0], NULL, NULL, converged);
     continue_opt = !converged[xnum];
-    target_funk (params, NULL, NULL, skip);
+    target_funk (params[0], NULL, NULL, skip);
     all_skip = converged[xnum];
 
     if (!all_skip && continue_opt)
@@ -507,7 +878,7 @@ PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi(unsigned int xnum,
        * function f and gradient g values at the current x.
        * Compute function value f for the sample problem.
        */
-      score = target_funk (params, x, lh_old, skip);
+      score = target_funk (params[0], x, lh_old, skip);
 
       if (is_nan(score) || d_equals(score, (double) -INFINITY))
         break;
@@ -518,6 +889,25 @@ PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi(unsigned int xnum,
           opts[p]->score = lh_old[p];
       }
 
+      if (grad_funk)
+      {
+        /* analytic gradients at the current point */
+        if (!grad_funk(params[0], x, grad, skip))
+        {
+          grad_failed = 1;
+          break;
+        }
+        continue;
+      }
+
+      if (workers)
+      {
+        /* evaluate the coordinate perturbations concurrently */
+        run_fd_workers(workers, sizeof(struct lbfgsb_multi_fd_worker),
+                       n_threads, lbfgsb_multi_fd_worker_run);
+        continue;
+      }
+
       for (i = 0; i < nmax; i++)
       {
         for (p = 0; p < xnum; p++)
@@ -540,7 +930,7 @@ PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi(unsigned int xnum,
           opts[p]->h = x[p][i] - opts[p]->temp;
         }
 
-        score = target_funk(params, x, lh_new, skip);
+        score = target_funk(params[0], x, lh_new, skip);
 
         for (p = 0; p < xnum; p++)
         {
@@ -562,7 +952,7 @@ PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi(unsigned int xnum,
   }
 
   /* fix optimal parameters */
-  score = target_funk (params, x, NULL, NULL);
+  score = target_funk (params[0], x, NULL, NULL);
 
 cleanup:
   if (lh_old)
@@ -573,6 +963,10 @@ cleanup:
     free(converged);
   if (skip)
     free(skip);
+  if (grad)
+    free(grad);
+  if (workers)
+    destroy_multi_fd_workers(workers, n_threads);
   if (opts)
   {
     for (p = 0; p < xnum; p++)
@@ -580,18 +974,147 @@ cleanup:
     free(opts);
   }
 
+  if (grad_failed)
+    score = (double) -INFINITY;
+
   if (is_nan(score))
   {
-    score = (double) -INFINITY;
-    /* set errno only if it was not set by some inner function */
-    if (!pll_errno)
-    {
-      pllmod_set_error(PLLMOD_OPT_ERROR_LBFGSB_UNKNOWN, "Unknown LBFGSB error");
-    }
+    score = (double) -INFINITY;
+    /* set errno only if it was not set by some inner function */
+    if (!pll_errno)
+    {
+      pllmod_set_error(PLLMOD_OPT_ERROR_LBFGSB_UNKNOWN, "Unknown LBFGSB error");
+    }
+  }
+
+  return score;
+} /* lbfgsb_multi */
+
+/**
+ * Minimize multiple independent multi-parameter functions using L-BFGS-B
+ * algorithm.
+ *
+ * Each of the `xnum` sets of variables (e.g., one per partition) is optimized
+ * by its own L-BFGS-B instance, but the target function is evaluated for all
+ * of them at once. Gradients are estimated by forward finite differences.
+ *
+ * @param  xnum        number of independent sets of variables
+ * @param  x[in,out]   first guess and result for each set (NULL for remote)
+ * @param  xmin        lower bounds for each set
+ * @param  xmax        upper bounds for each set
+ * @param  bound       bound types for each set
+ * @param  n           number of variables in each set
+ * @param  nmax        maximum number of variables among all sets (and threads)
+ * @param  factr       convergence tolerance relative to machine epsilon
+ * @param  pgtol       absolute gradient tolerance
+ * @param  params      custom parameters required by the target function
+ * @param  target_funk target function
+ *
+ * @return             the minimal score found
+ */
+PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi(unsigned int xnum,
+                                                   double ** x,
+                                                   double ** xmin,
+                                                   double ** xmax,
+                                                   int ** bound,
+                                                   unsigned int * n,
+                                                   unsigned int nmax,
+                                                   double factr,
+                                                   double pgtol,
+                                                   void * params,
+                                                   double (*target_funk)(void *,
+                                                                         double **,
+                                                                         double *,
+                                                                         int *))
+{
+  return lbfgsb_multi(xnum, x, xmin, xmax, bound, n, nmax, factr, pgtol,
+                      &params, 1, target_funk, NULL);
+}
+
+/**
+ * Minimize multiple independent multi-parameter functions using L-BFGS-B
+ * algorithm and analytic gradients.
+ *
+ * Same as `pllmod_opt_minimize_lbfgsb_multi`, but the gradients are provided
+ * by `grad_funk` instead of being estimated by finite differences.
+ *
+ * `grad_funk` is called right after `target_funk` was evaluated at the same
+ * point, with the same `skip` array, and must fill `g[i]` with the gradient
+ * of the score of every set `i` for which `skip[i]` is 0. It returns
+ * PLL_SUCCESS, or PLL_FAILURE (and sets pll_errno) if the gradient could not
+ * be computed, in which case the optimization is aborted.
+ *
+ * @param  grad_funk   gradient function
+ *
+ * @return             the minimal score found, or -INFINITY on failure
+ */
+PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi_grad(unsigned int xnum,
+                                                   double ** x,
+                                                   double ** xmin,
+                                                   double ** xmax,
+                                                   int ** bound,
+                                                   unsigned int * n,
+                                                   unsigned int nmax,
+                                                   double factr,
+                                                   double pgtol,
+                                                   void * params,
+                                                   double (*target_funk)(void *,
+                                                                         double **,
+                                                                         double *,
+                                                                         int *),
+                                                   int (*grad_funk)(void *,
+                                                                    double **,
+                                                                    double **,
+                                                                    int *))
+{
+  return lbfgsb_multi(xnum, x, xmin, xmax, bound, n, nmax, factr, pgtol,
+                      &params, 1, target_funk, grad_funk);
+}
+
+/**
+ * Minimize multiple independent multi-parameter functions using L-BFGS-B
+ * algorithm, evaluating the finite differences gradients with multiple
+ * threads.
+ *
+ * Same as `pllmod_opt_minimize_lbfgsb_multi`, but the coordinate
+ * perturbations of each gradient are distributed among `n_threads` threads.
+ * Thread `i` calls `target_funk` with `params[i]` only, so every element of
+ * `params` must be an independent evaluation context (e.g., its own copy of
+ * the partitions and tree). Model parameters affect every CLV, therefore the
+ * contexts cannot share likelihood buffers. Convergence checks, scores and
+ * the final parameters are evaluated on `params[0]`.
+ *
+ * @param  params      array of `n_threads` evaluation contexts
+ * @param  n_threads   number of threads
+ *
+ * @return             the minimal score found
+ */
+PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi_mt(unsigned int xnum,
+                                                   double ** x,
+                                                   double ** xmin,
+                                                   double ** xmax,
+                                                   int ** bound,
+                                                   unsigned int * n,
+                                                   unsigned int nmax,
+                                                   double factr,
+                                                   double pgtol,
+                                                   void ** params,
+                                                   unsigned int n_threads,
+                                                   double (*target_funk)(void *,
+                                                                         double **,
+                                                                         double *,
+                                                                         int *))
+{
+  if (!params || !n_threads)
+  {
+    pllmod_set_error(PLLMOD_OPT_ERROR_PARAMETER,
+                     "At least one evaluation context is required");
+    return (double) -INFINITY;
   }
 
-  return score;
-} /* pllmod_opt_minimize_lbfgsb */
+  return lbfgsb_multi(xnum, x, xmin, xmax, bound, n, nmax, factr, pgtol,
+                      params, n_threads, target_funk, NULL);
+}
 
 /******************************************************************************/
 /* BRENT'S OPTIMIZATION */
@@ -1036,6 +1559,211 @@ static int brent_opt_alt (int xnum,
   return PLL_SUCCESS;
 }
 
+/*
+ * Batch version of brent_opt_alt: all variables are bracketed and refined
+ * together, and variables that do not need a new score are passed to
+ * target_funk as "converged", so that their partitions are skipped.
+ */
+static int brent_opt_batch (int xnum,
+                            const double * xmin,
+                            double * xguess,
+                            const double * xmax,
+                            double xtol,
+                            double * xopt,
+                            double * fx,
+                            unsigned int * eval_counts,
+                            void * params,
+                            double (*target_funk)(
+                                    void *,
+                                    double *,
+                                    double *,
+                                    int *),
+                            int global_range)
+{
+  struct opt_params * brent_params = NULL;
+  double * ax = NULL;
+  double * cx = NULL;
+  double * fa = NULL;
+  double * fb = NULL;
+  double * fc = NULL;
+  double * u = NULL;
+  double * fu = NULL;
+  double * last_x = NULL;
+  int * skip = NULL;
+  int * converged = NULL;
+  int retval = PLL_FAILURE;
+  int iterate = 1;
+  int iter_num = 0;
+  int i;
+
+  for (i = 0; i < xnum; ++i)
+  {
+    const double l_xmin = global_range ? *xmin : xmin[i];
+
+    /* lower bound must be > 0., seems to be a requirement for Brent */
+    if (!(l_xmin > 0.))
+    {
+      pllmod_set_error(PLLMOD_ERROR_INVALID_RANGE,
+                       "BRENT: lower bound has to be greater than 0!");
+      return PLL_FAILURE;
+    }
+  }
+
+  brent_params = (struct opt_params *) calloc(xnum, sizeof(struct opt_params));
+  ax = (double *) calloc(xnum, sizeof(double));
+  cx = (double *) calloc(xnum, sizeof(double));
+  fa = (double *) calloc(xnum, sizeof(double));
+  fb = (double *) calloc(xnum, sizeof(double));
+  fc = (double *) calloc(xnum, sizeof(double));
+  u = (double *) calloc(xnum, sizeof(double));
+  fu = (double *) calloc(xnum, sizeof(double));
+  last_x = (double *) calloc(xnum, sizeof(double));
+  skip = (int *) calloc(xnum+1, sizeof(int));
+  converged = (int *) calloc(xnum+1, sizeof(int));
+
+  if (!brent_params || !ax || !cx || !fa || !fb || !fc || !u || !fu ||
+      !last_x || !skip || !converged)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for BRENT parameters");
+    goto cleanup;
+  }
+
+  if (eval_counts)
+    memset(eval_counts, 0, xnum * sizeof(unsigned int));
+
+  /* first attempt to bracketize minimum around the initial guesses */
+  for (i = 0; i < xnum; ++i)
+  {
+    const double l_xmin = global_range ? *xmin : xmin[i];
+    const double l_xmax = global_range ? *xmax : xmax[i];
+    double eps;
+
+    if (xguess[i] < l_xmin)
+      xguess[i] = l_xmin;
+    if (xguess[i] > l_xmax)
+      xguess[i] = l_xmax;
+    eps = xguess[i] * xtol * 50.0;
+    ax[i] = xguess[i] - eps;
+    if (ax[i] < l_xmin)
+      ax[i] = l_xmin;
+    cx[i] = xguess[i] + eps;
+    if (cx[i] > l_xmax)
+      cx[i] = l_xmax;
+  }
+
+  target_funk (params, ax, fa, NULL);
+  target_funk (params, cx, fc, NULL);
+  target_funk (params, xguess, fb, NULL);
+
+  /* if it does not work, be conservative and use the whole range; only the
+     variables with a failed bracket are evaluated at the bounds */
+  for (i = 0; i < xnum; ++i)
+  {
+    skip[i] = !((fa[i] < fb[i]) || (fc[i] < fb[i]));
+    last_x[i] = xguess[i];
+    if (eval_counts)
+      eval_counts[i] += 3;
+  }
+
+  /* target_funk may involve collective operations: it is called on all
+     threads, and tells whether any variable needs the bounds */
+  target_funk (params, NULL, NULL, skip);
+  if (!skip[xnum])
+  {
+    for (i = 0; i < xnum; ++i)
+      u[i] = skip[i] ? last_x[i] : (global_range ? *xmin : xmin[i]);
+    target_funk (params, u, fu, skip);
+    for (i = 0; i < xnum; ++i)
+    {
+      if (!skip[i])
+      {
+        ax[i] = u[i];
+        fa[i] = fu[i];
+      }
+    }
+
+    for (i = 0; i < xnum; ++i)
+      u[i] = skip[i] ? last_x[i] : (global_range ? *xmax : xmax[i]);
+    target_funk (params, u, fu, skip);
+    for (i = 0; i < xnum; ++i)
+    {
+      if (!skip[i])
+      {
+        cx[i] = u[i];
+        fc[i] = fu[i];
+        last_x[i] = u[i];
+        if (eval_counts)
+          eval_counts[i] += 2;
+      }
+    }
+  }
+
+  /* a variable whose bracket is already within tolerance has converged */
+  for (i = 0; i < xnum; ++i)
+  {
+    converged[i] = !brent_opt_init(ax[i], xguess[i], cx[i], xtol, NULL, NULL,
+                                   fa[i], fb[i], fc[i], &brent_params[i]);
+  }
+
+  while (iterate)
+  {
+    for (i = 0; i < xnum; ++i)
+      u[i] = converged[i] ? last_x[i] : brent_params[i].u;
+
+    target_funk (params, u, fu, converged);
+
+    /* last element in converged[] array is "all converged" flag */
+    iterate = !converged[xnum];
+    for (i = 0; i < xnum; ++i)
+    {
+      if (!converged[i])
+      {
+        last_x[i] = u[i];
+        if (eval_counts)
+          eval_counts[i]++;
+        brent_params[i].fu = fu[i];
+        converged[i] = !brent_opt_post_loop(&brent_params[i]);
+      }
+    }
+
+    iter_num++;
+    iterate &= (iter_num <= ITMAX);
+  }
+
+  /* if new score is worse, return initial value; the final evaluation only
+     recomputes the variables which were last evaluated elsewhere */
+  for (i = 0; i < xnum; ++i)
+  {
+    xopt[i] = (brent_params[i].fx > brent_params[i].fstartx) ?
+        brent_params[i].startx : brent_params[i].x;
+    skip[i] = (last_x[i] == xopt[i]);
+    if (eval_counts && !skip[i])
+      eval_counts[i]++;
+  }
+
+  target_funk (params, xopt, fu, skip);
+
+  if (fx)
+    memcpy(fx, fu, xnum * sizeof(double));
+
+  retval = PLL_SUCCESS;
+
+cleanup:
+  free(brent_params);
+  free(ax);
+  free(cx);
+  free(fa);
+  free(fb);
+  free(fc);
+  free(u);
+  free(fu);
+  free(last_x);
+  free(skip);
+  free(converged);
+  return retval;
+}
+
 // TODO: remove at some point (not used anymore)
 #if 0
 static double brent_opt (double ax, double bx, double cx, double tol,
@@ -1249,6 +1977,53 @@ PLL_EXPORT int pllmod_opt_minimize_brent_multi(int xnum,
                           target_funk, global_range);
 }
 
+/**
+ * Run brent optimization for multiple variables in a batch
+ *
+ * All variables are bracketed and refined together, as in
+ * `pllmod_opt_minimize_brent_multi`. Variables which do not need a new score
+ * (converged, or with a good initial bracket when the bounds are evaluated)
+ * are flagged in the convergence array passed to `target_funk`, which is
+ * expected to skip their partitions.
+ *
+ * @param xnum number of variables/partitions
+ * @param xmin minimum value(s) (see @param global_range)
+ * @param xguess array of staring values
+ * @param xmax maximum value(s) (see @param global_range)
+ * @param xtol tolerance
+ * @param xopt optimal variable values [out]
+ * @param fx scores at the optimal values (can be NULL) [out]
+ * @param eval_counts number of score evaluations of each variable
+ * (can be NULL) [out]
+ * @param params parameters to be passed to target_funk
+ * @param target_funk target function, parameters: 1) params, 2) array of x values,
+ * 3) array of scores [out], 4) convergence flags. If x is NULL, the function is
+ * called solely to check convergence (no scores are computed)
+ * @param global_range 0=xmin/xmax point to arrays of size xnum with individual
+ * per-variable ranges; 1=xmin/xmax is a global range for all variables
+ *
+ * @return PLL_SUCCESS or PLL_FAILURE
+ */
+PLL_EXPORT int pllmod_opt_minimize_brent_batch(int xnum,
+                                               const double * xmin,
+                                               double * xguess,
+                                               const double * xmax,
+                                               double xtol,
+                                               double * xopt,
+                                               double * fx,
+                                               unsigned int * eval_counts,
+                                               void * params,
+                                               double (*target_funk)(
+                                                       void *,
+                                                      double *,
+                                                      double *,
+                                                      int *),
+                                               int global_range)
+{
+  return brent_opt_batch (xnum, xmin, xguess, xmax, xtol, xopt, fx,
+                          eval_counts, params, target_funk, global_range);
+}
+
 /******************************************************************************/
 /* EXPECTATION-MAXIMIZATION (EM)     */
 /* Wang, Li, Susko, and Roger (2008) */
@@ -1327,3 +2102,344 @@ PLL_EXPORT void pllmod_opt_minimize_em(double *w,
   free(ratio_prop);
   free(new_prop);
 }
+
+/* number of sites processed at once by each EM worker */
+#define EM_BLOCK_SIZE 256
+
+/* minimum number of sites per EM worker thread */
+#define EM_MIN_SITES_PER_THREAD 4096
+
+struct em_multi_worker
+{
+  unsigned int id;
+  unsigned int n_threads;
+  unsigned int xnum;
+  unsigned int wmax;
+  double * const * w;
+  const unsigned int * w_count;
+  const double * const * sitecat_lh;
+  const unsigned int * const * site_w;
+  const unsigned int * l;
+  const int * done;
+  double * acc;         /* private accumulators, xnum x wmax */
+  double * loglh;       /* private log-likelihoods, xnum */
+  double block[2*EM_BLOCK_SIZE];
+};
+
+/*
+ * E-step over the sites assigned to one worker. The loops are kept free of
+ * branches and run over contiguous memory so that they vectorize.
+ */
+static void * em_multi_worker_run(void * arg)
+{
+  struct em_multi_worker * wk = (struct em_multi_worker *) arg;
+  unsigned int p, s, c, b;
+
+  for (p = 0; p < wk->xnum; ++p)
+  {
+    const unsigned int cats = wk->w_count[p];
+    const double * w        = wk->w[p];
+    double * acc            = wk->acc + (size_t) p * wk->wmax;
+    double * site_lh        = wk->block;
+    double * site_ratio     = wk->block + EM_BLOCK_SIZE;
+    double loglh            = 0.;
+
+    wk->loglh[p] = 0.;
+    if (!w || wk->done[p])
+      continue;
+
+    for (c = 0; c < cats; ++c)
+      acc[c] = 0.;
+
+    unsigned int start = (unsigned int)
+                          (((size_t) wk->l[p] * wk->id) / wk->n_threads);
+    unsigned int end   = (unsigned int)
+                          (((size_t) wk->l[p] * (wk->id+1)) / wk->n_threads);
+
+    for (s = start; s < end; s += EM_BLOCK_SIZE)
+    {
+      const unsigned int span = (end - s < EM_BLOCK_SIZE) ?
+                                 end - s : EM_BLOCK_SIZE;
+      const double * lk = wk->sitecat_lh[p] + (size_t) s * cats;
+      const unsigned int * sw = wk->site_w[p] + s;
+
+      /* site likelihoods under the current weights */
+      for (b = 0; b < span; ++b)
+      {
+        double sum = 0.;
+        for (c = 0; c < cats; ++c)
+          sum += w[c] * lk[(size_t) b * cats + c];
+        site_lh[b] = sum;
+      }
+
+      for (b = 0; b < span; ++b)
+      {
+        site_ratio[b] = sw[b] / site_lh[b];
+        loglh += sw[b] * log(site_lh[b]);
+      }
+
+      /* expected category counts (scaled by the current weights below) */
+      for (b = 0; b < span; ++b)
+        for (c = 0; c < cats; ++c)
+          acc[c] += lk[(size_t) b * cats + c] * site_ratio[b];
+    }
+
+    wk->loglh[p] = loglh;
+  }
+
+  return NULL;
+}
+
+/**
+ * Optimize the mixture weights of multiple independent sets using the
+ * Expectation-Maximization algorithm.
+ *
+ * For each set `p`, `sitecat_lh[p]` holds the likelihood of every site
+ * conditional on every category (not multiplied by the weights), laid out
+ * as `l[p]` rows of `w_count[p]` values. The weights are iterated until the
+ * log-likelihood improves by less than `tolerance`, or `max_steps` E-steps
+ * were performed. The returned weights are always those at which
+ * `loglh[p]` was evaluated.
+ *
+ * If `min_ratio` is positive, the weights are kept at or above `min_ratio`
+ * times the highest weight of their set after every M-step, as the weight
+ * ratio bounds used with L-BFGS-B.
+ *
+ * Sites are split among `n_threads` threads, if there are enough of them.
+ *
+ * If `parallel_reduce_cb` is set, the sites of each set are distributed
+ * among several processes, which must call this function collectively with
+ * the same initial weights. The expected category counts and the
+ * log-likelihoods are reduced on every E-step, so that all processes iterate
+ * the same weights. A process that holds no sites of a set passes NULL as
+ * its weights, and still takes part in the reductions.
+ *
+ * @param  xnum        number of independent sets
+ * @param  w[in,out]   first guess and result for each set (NULL to skip it)
+ * @param  w_count     number of weights of each set
+ * @param  sitecat_lh  per-site, per-category likelihoods of each set
+ * @param  site_w      site weights of each set
+ * @param  l           number of sites of each set
+ * @param  min_ratio   minimum ratio of any weight to the highest one
+ * @param  tolerance   log-likelihood improvement for convergence
+ * @param  max_steps   maximum number of iterations
+ * @param  n_threads   maximum number of threads
+ * @param  parallel_context    context passed to `parallel_reduce_cb`
+ * @param  parallel_reduce_cb  reduction across processes (NULL if the sites
+ *                             are not distributed)
+ * @param  loglh[out]  log-likelihood of each set over the local sites,
+ *                     without the site scalers (can be NULL)
+ *
+ * @return             PLL_SUCCESS, or PLL_FAILURE on error
+ */
+PLL_EXPORT int pllmod_opt_minimize_em_multi(unsigned int xnum,
+                                            double ** w,
+                                            const unsigned int * w_count,
+                                            const double * const * sitecat_lh,
+                                            const unsigned int * const * site_w,
+                                            const unsigned int * l,
+                                            double min_ratio,
+                                            double tolerance,
+                                            unsigned int max_steps,
+                                            unsigned int n_threads,
+                                            void * parallel_context,
+                                            void (*parallel_reduce_cb)(void *,
+                                                                       double *,
+                                                                       size_t,
+                                                                       int),
+                                            double * loglh)
+{
+  unsigned int p, c, t, step;
+  unsigned int wmax = 0;
+  size_t total_sites = 0;
+  size_t stride;
+  int retval = PLL_SUCCESS;
+
+  for (p = 0; p < xnum; ++p)
+  {
+    if (!w[p])
+      continue;
+    if (!w_count[p] || !l[p])
+    {
+      pllmod_set_error(PLLMOD_OPT_ERROR_PARAMETER,
+                       "Invalid number of weights or sites for set %u", p);
+      return PLL_FAILURE;
+    }
+    if (w_count[p] > wmax)
+      wmax = w_count[p];
+    total_sites += l[p];
+  }
+
+  /* the accumulators of all processes must have the same layout */
+  if (parallel_reduce_cb)
+  {
+    double max_count = wmax;
+    parallel_reduce_cb(parallel_context, &max_count, 1,
+                       1 /*PLLMOD_TREE_REDUCE_MAX*/);
+    wmax = (unsigned int) max_count;
+  }
+  stride = (size_t) wmax + 1;
+
+  if (!n_threads)
+    n_threads = 1;
+  if (total_sites / n_threads < EM_MIN_SITES_PER_THREAD)
+    n_threads = (unsigned int) (total_sites / EM_MIN_SITES_PER_THREAD) + 1;
+
+  struct em_multi_worker * workers = (struct em_multi_worker *)
+                                calloc(n_threads, sizeof(struct em_multi_worker));
+  double * acc = (double *) calloc((size_t) n_threads * xnum * stride,
+                                   sizeof(double));
+  double * stats = (double *) calloc(xnum * stride, sizeof(double));
+  double * sum_w = (double *) calloc(xnum, sizeof(double));
+  double * cur_loglh = (double *) calloc(xnum, sizeof(double));
+  double * prev_loglh = (double *) calloc(xnum, sizeof(double));
+  double * local_loglh = (double *) calloc(xnum, sizeof(double));
+  int * done = (int *) calloc(xnum, sizeof(int));
+
+  if (!workers || !acc || !stats || !sum_w || !cur_loglh || !prev_loglh ||
+      !local_loglh || !done)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for EM variables");
+    retval = PLL_FAILURE;
+    goto cleanup;
+  }
+
+  for (t = 0; t < n_threads; ++t)
+  {
+    workers[t].id         = t;
+    workers[t].n_threads  = n_threads;
+    workers[t].xnum       = xnum;
+    workers[t].wmax       = wmax;
+    workers[t].w          = w;
+    workers[t].w_count    = w_count;
+    workers[t].sitecat_lh = sitecat_lh;
+    workers[t].site_w     = site_w;
+    workers[t].l          = l;
+    workers[t].done       = done;
+    workers[t].acc        = acc + (size_t) t * xnum * stride;
+    workers[t].loglh      = workers[t].acc + (size_t) xnum * wmax;
+  }
+
+  for (p = 0; p < xnum; ++p)
+  {
+    unsigned int s;
+    if (!w[p])
+      continue;
+    for (s = 0; s < l[p]; ++s)
+      sum_w[p] += site_w[p][s];
+  }
+
+  /* sets without local sites are iterated along with the other processes */
+  if (parallel_reduce_cb)
+    parallel_reduce_cb(parallel_context, sum_w, xnum,
+                       0 /*PLLMOD_TREE_REDUCE_SUM*/);
+  else
+    for (p = 0; p < xnum; ++p)
+      done[p] = !w[p];
+
+  for (step = 0; step < max_steps; ++step)
+  {
+    int active = 0;
+
+    /* Expectation */
+    run_fd_workers(workers, sizeof(struct em_multi_worker), n_threads,
+                   em_multi_worker_run);
+
+    /* sufficient statistics: expected category counts and log-likelihood */
+    memset(stats, 0, xnum * stride * sizeof(double));
+    for (p = 0; p < xnum; ++p)
+    {
+      double * sp = stats + p * stride;
+
+      if (!w[p] || done[p])
+        continue;
+
+      for (t = 0; t < n_threads; ++t)
+      {
+        const double * acct = workers[t].acc + (size_t) p * wmax;
+        for (c = 0; c < w_count[p]; ++c)
+          sp[c] += acct[c];
+        sp[wmax] += workers[t].loglh[p];
+      }
+      local_loglh[p] = sp[wmax];
+    }
+
+    if (parallel_reduce_cb)
+      parallel_reduce_cb(parallel_context, stats, xnum * stride,
+                         0 /*PLLMOD_TREE_REDUCE_SUM*/);
+
+    /* Maximization */
+    for (p = 0; p < xnum; ++p)
+    {
+      const double * sp = stats + p * stride;
+
+      if (done[p])
+        continue;
+
+      cur_loglh[p] = sp[wmax];
+
+      /* keep the weights the log-likelihood was computed for */
+      if ((step && fabs(cur_loglh[p] - prev_loglh[p]) < tolerance) ||
+          step + 1 == max_steps)
+      {
+        done[p] = 1;
+        continue;
+      }
+
+      prev_loglh[p] = cur_loglh[p];
+      active = 1;
+
+      if (!w[p])
+        continue;
+
+      double max_w = 0.;
+      for (c = 0; c < w_count[p]; ++c)
+      {
+        w[p][c] *= sp[c] / sum_w[p];
+        if (w[p][c] > max_w)
+          max_w = w[p][c];
+      }
+
+      if (min_ratio > 0.)
+      {
+        double sum = 0.;
+        for (c = 0; c < w_count[p]; ++c)
+        {
+          if (w[p][c] < min_ratio * max_w)
+            w[p][c] = min_ratio * max_w;
+          sum += w[p][c];
+        }
+        for (c = 0; c < w_count[p]; ++c)
+          w[p][c] /= sum;
+      }
+    }
+
+    if (!active)
+      break;
+  }
+
+  if (loglh)
+    for (p = 0; p < xnum; ++p)
+      loglh[p] = w[p] ? local_loglh[p] : 0.;
+
+cleanup:
+  if (workers)
+    free(workers);
+  if (acc)
+    free(acc);
+  if (stats)
+    free(stats);
+  if (sum_w)
+    free(sum_w);
+  if (cur_loglh)
+    free(cur_loglh);
+  if (prev_loglh)
+    free(prev_loglh);
+  if (local_loglh)
+    free(local_loglh);
+  if (done)
+    free(done);
+
+  return retval;
+}
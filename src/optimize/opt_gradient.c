@@ -0,0 +1,627 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+
+ /**
+  * @file opt_gradient.c
+  *
+  * @brief Likelihood terms for model parameter optimization
+  *
+  * This file implements the analytic gradient of the log-likelihood w.r.t.
+  * the model, and the per-site and per-category likelihoods at an edge.
+  *
+  * The likelihood at any edge `e` of an unrooted tree is
+  * `L_s = sum_k w_k sum_ij pi_i A_ik P_k(t_e)_ij B_jk`, where `A` and `B` are
+  * the CLVs at both ends of the edge. Since L is linear in every P-matrix,
+  * the derivative w.r.t. any rate matrix entry is the sum over all edges of
+  * `<G_ek, dP_k(t_e)>`, with `G_ek = sum_s w_s/L_s w_k (pi o A_sk) B_sk^T`.
+  * The derivative of `P = U exp(lambda t) W` is obtained from the
+  * eigen-decomposition already stored in the partition, such that a single
+  * pass over all edges yields the gradient for every substitution rate and
+  * equilibrium frequency at once.
+  *
+  * @author Diego Darriba
+  */
+
+#include "pll_optimize.h"
+#include "../pllmod_common.h"
+
+/* below this eigenvalue difference, the divided difference of exp() is
+   replaced by its derivative */
+#define GRADIENT_EIGEN_EPSILON 1e-12
+
+struct model_gradient
+{
+  pll_partition_t * partition;
+  const unsigned int * params_indices;
+  unsigned int params_index;
+  double brlen_scaler;
+
+  double * m;          /* sum over edges of (U^T G W^T) o Phi   [states^2] */
+  double * g;          /* per-category G of the current edge    [(cats+1)*states^2] */
+  double * h;          /* scratch                               [states^2] */
+  double * tmp;        /* scratch                               [states^2] */
+  double * a;          /* CLV at the edge parent for one site   [cats*states] */
+  double * b;          /* CLV at the edge child for one site    [cats*states] */
+  double * pb;         /* P * b for one site                    [cats*states] */
+  double * expd;       /* exponentiated eigenvalues             [states] */
+  double * root_freqs; /* explicit frequency term at the root   [states] */
+};
+
+static void gradient_load_clv(const pll_partition_t * partition,
+                              const pll_unode_t * node,
+                              unsigned int site,
+                              double * buf);
+static void gradient_update_clv(pll_partition_t * partition,
+                                const pll_unode_t * node);
+static void gradient_edge(struct model_gradient * mg,
+                          const pll_unode_t * edge,
+                          int root_edge);
+static void gradient_traverse(struct model_gradient * mg,
+                              pll_unode_t * edge,
+                              int accumulate);
+static void gradient_finalize(struct model_gradient * mg,
+                              double * subst_grad,
+                              double * freqs_grad);
+
+/**
+ * Compute the gradient of the log-likelihood w.r.t. the substitution rates
+ * and the equilibrium frequencies of one model.
+ *
+ * The CLVs must be up to date for the post-order traversal from `root`, as
+ * left by the likelihood computation at the edge `root`-`root->back`. CLVs
+ * in the other directions are computed on the way, and all CLVs and scalers
+ * are restored before returning.
+ *
+ * The frequencies are treated as independent variables (i.e., the gradient
+ * does not account for the constraint that they sum to 1). Only the rate
+ * categories whose parameter index in `params_indices` matches `params_index`
+ * are taken into account.
+ *
+ * The gradient is not available for models with invariant sites or
+ * ascertainment bias correction, nor for partitions with per-rate scalers
+ * (PLL_ATTRIB_RATE_SCALERS).
+ *
+ * @param  partition       the partition
+ * @param  root            inner node where the likelihood was computed
+ * @param  params_indices  the indices of the parameter sets per rate category
+ * @param  params_index    the model to compute the gradient for
+ * @param  brlen_scaler    scaler applied to the branch lengths in `root`
+ * @param  subst_grad[out] derivatives w.r.t. the `states*(states-1)/2`
+ *                         substitution rates (if NULL, it is omitted)
+ * @param  freqs_grad[out] derivatives w.r.t. the `states` frequencies
+ *                         (if NULL, it is omitted)
+ *
+ * @return PLL_SUCCESS if the gradient was computed, PLL_FAILURE otherwise
+ */
+PLL_EXPORT int pllmod_opt_compute_model_gradient(pll_partition_t * partition,
+                                          pll_unode_t * root,
+                                          const unsigned int * params_indices,
+                                          unsigned int params_index,
+                                          double brlen_scaler,
+                                          double * subst_grad,
+                                          double * freqs_grad)
+{
+  struct model_gradient mg;
+  unsigned int states = partition->states;
+  unsigned int rate_cats = partition->rate_cats;
+  size_t sq = (size_t) states * states;
+  size_t buffer_size;
+  double * buffer;
+  unsigned int k;
+
+  if (!root || !root->next)
+  {
+    pllmod_set_error(PLLMOD_OPT_ERROR_PARAMETER,
+                     "Gradient must be computed at an inner node");
+    return PLL_FAILURE;
+  }
+
+  for (k = 0; k < rate_cats; ++k)
+    if (partition->prop_invar[params_indices[k]] > 0.)
+      break;
+
+  if (k < rate_cats || partition->asc_bias_alloc)
+  {
+    pllmod_set_error(PLLMOD_OPT_ERROR_PARAMETER,
+                     "Analytic gradient is not available for models with "
+                     "invariant sites or ascertainment bias correction");
+    return PLL_FAILURE;
+  }
+
+#ifdef PLL_ATTRIB_RATE_SCALERS
+  /* the scaling factors of a site differ across categories, such that they do
+     not cancel out in the per-site terms */
+  if (partition->attributes & PLL_ATTRIB_RATE_SCALERS)
+  {
+    pllmod_set_error(PLLMOD_OPT_ERROR_PARAMETER,
+                     "Analytic gradient is not available for partitions with "
+                     "per-rate scalers");
+    return PLL_FAILURE;
+  }
+#endif
+
+  if (!partition->eigen_decomp_valid[params_index])
+  {
+    pllmod_set_error(PLLMOD_OPT_ERROR_PARAMETER,
+                     "Eigen decomposition of model %u is not up to date",
+                     params_index);
+    return PLL_FAILURE;
+  }
+
+  buffer_size = 3 * sq + (rate_cats + 1) * sq + 3 * (size_t) rate_cats * states
+                + 2 * (size_t) states;
+  buffer = (double *) calloc(buffer_size, sizeof(double));
+  if (!buffer)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for gradient buffers");
+    return PLL_FAILURE;
+  }
+
+  mg.partition      = partition;
+  mg.params_indices = params_indices;
+  mg.params_index   = params_index;
+  mg.brlen_scaler   = brlen_scaler;
+
+  mg.m          = buffer;
+  mg.h          = mg.m + sq;
+  mg.tmp        = mg.h + sq;
+  mg.g          = mg.tmp + sq;
+  mg.a          = mg.g + (rate_cats + 1) * sq;
+  mg.b          = mg.a + rate_cats * states;
+  mg.pb         = mg.b + rate_cats * states;
+  mg.expd       = mg.pb + rate_cats * states;
+  mg.root_freqs = mg.expd + states;
+
+  /* the root edge carries the explicit frequencies term */
+  gradient_edge(&mg, root, 1);
+
+  /* visit the remaining edges on both sides of the root edge */
+  gradient_traverse(&mg, root, 0);
+  gradient_traverse(&mg, root->back, 0);
+
+  gradient_finalize(&mg, subst_grad, freqs_grad);
+
+  free(buffer);
+
+  return PLL_SUCCESS;
+}
+
+/**
+ * Compute the per-site and per-category likelihoods at an edge.
+ *
+ * The rate category weights are not applied, such that the log-likelihood
+ * for any weights `w` is `sum_s pattern_weights[s] * (log(sum_k w[k] *
+ * sitecat_lh[s*rate_cats+k]) + site_logscale[s])`. Since the CLVs do not
+ * depend on the weights, this allows to evaluate new weights in
+ * O(sites x categories) without traversing the tree.
+ *
+ * The CLVs at both ends of the edge and the P-matrix of the edge must be up
+ * to date. The decomposition is not available for models with invariant sites
+ * or ascertainment bias correction, nor for partitions with per-rate scalers
+ * (PLL_ATTRIB_RATE_SCALERS).
+ *
+ * @param  partition          the partition
+ * @param  edge               the edge (`edge`-`edge->back`)
+ * @param  params_indices     the indices of the parameter sets per category
+ * @param  sitecat_lh[out]    per-site, per-category likelihoods
+ *                            (`sites` x `rate_cats`, scaled)
+ * @param  site_logscale[out] per-site log of the scaling factor
+ *                            (if NULL, it is omitted)
+ *
+ * @return PLL_SUCCESS if the likelihoods were computed, PLL_FAILURE otherwise
+ */
+PLL_EXPORT int pllmod_opt_compute_edge_sitecat_lk(pll_partition_t * partition,
+                                          const pll_unode_t * edge,
+                                          const unsigned int * params_indices,
+                                          double * sitecat_lh,
+                                          double * site_logscale)
+{
+  unsigned int states = partition->states;
+  unsigned int states_padded = partition->states_padded;
+  unsigned int rate_cats = partition->rate_cats;
+  unsigned int s, i, j, k;
+  double * a, * b;
+
+  for (k = 0; k < rate_cats; ++k)
+    if (partition->prop_invar[params_indices[k]] > 0.)
+      break;
+
+  if (k < rate_cats || partition->asc_bias_alloc)
+  {
+    pllmod_set_error(PLLMOD_OPT_ERROR_PARAMETER,
+                     "Per-category likelihoods are not available for models "
+                     "with invariant sites or ascertainment bias correction");
+    return PLL_FAILURE;
+  }
+
+#ifdef PLL_ATTRIB_RATE_SCALERS
+  /* a single scaling factor per site cannot represent per-rate scalers */
+  if (partition->attributes & PLL_ATTRIB_RATE_SCALERS)
+  {
+    pllmod_set_error(PLLMOD_OPT_ERROR_PARAMETER,
+                     "Per-category likelihoods are not available for "
+                     "partitions with per-rate scalers");
+    return PLL_FAILURE;
+  }
+#endif
+
+  a = (double *) malloc(2 * (size_t) rate_cats * states * sizeof(double));
+  if (!a)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for per-category likelihoods");
+    return PLL_FAILURE;
+  }
+  b = a + rate_cats * states;
+
+  const double * pmatrix = partition->pmatrix[edge->pmatrix_index];
+  const unsigned int * parent_scaler =
+      (edge->scaler_index == PLL_SCALE_BUFFER_NONE) ?
+          NULL : partition->scale_buffer[edge->scaler_index];
+  const unsigned int * child_scaler =
+      (edge->back->scaler_index == PLL_SCALE_BUFFER_NONE) ?
+          NULL : partition->scale_buffer[edge->back->scaler_index];
+
+  for (s = 0; s < partition->sites; ++s)
+  {
+    gradient_load_clv(partition, edge, s, a);
+    gradient_load_clv(partition, edge->back, s, b);
+
+    for (k = 0; k < rate_cats; ++k)
+    {
+      const double * pmat = pmatrix + (size_t) k * states * states_padded;
+      const double * freqs = partition->frequencies[params_indices[k]];
+      const double * a_k = a + k * states;
+      const double * b_k = b + k * states;
+      double cat_lh = 0.;
+
+      for (i = 0; i < states; ++i)
+      {
+        double term = 0.;
+        for (j = 0; j < states; ++j)
+          term += pmat[i * states_padded + j] * b_k[j];
+        cat_lh += freqs[i] * a_k[i] * term;
+      }
+      sitecat_lh[(size_t) s * rate_cats + k] = cat_lh;
+    }
+
+    if (site_logscale)
+    {
+      unsigned int scale_factors = 0;
+      if (parent_scaler)
+        scale_factors += parent_scaler[s];
+      if (child_scaler)
+        scale_factors += child_scaler[s];
+      site_logscale[s] = scale_factors * log(PLL_SCALE_THRESHOLD);
+    }
+  }
+
+  free(a);
+
+  return PLL_SUCCESS;
+}
+
+/* static functions */
+
+static void gradient_load_clv(const pll_partition_t * partition,
+                              const pll_unode_t * node,
+                              unsigned int site,
+                              double * buf)
+{
+  unsigned int i, k;
+  unsigned int states = partition->states;
+  unsigned int states_padded = partition->states_padded;
+  unsigned int rate_cats = partition->rate_cats;
+
+  if (!node->next && (partition->attributes & PLL_ATTRIB_PATTERN_TIP))
+  {
+    unsigned int state_map =
+            partition->tipmap[partition->tipchars[node->clv_index][site]];
+
+    for (i = 0; i < states; ++i)
+      buf[i] = ((state_map >> i) & 1) ? 1. : 0.;
+    for (k = 1; k < rate_cats; ++k)
+      memcpy(buf + k * states, buf, states * sizeof(double));
+  }
+  else
+  {
+    const double * clv = partition->clv[node->clv_index] +
+                         (size_t) site * rate_cats * states_padded;
+
+    for (k = 0; k < rate_cats; ++k)
+      for (i = 0; i < states; ++i)
+        buf[k * states + i] = clv[k * states_padded + i];
+  }
+}
+
+/* compute the CLV at `node` looking away from `node->back` */
+static void gradient_update_clv(pll_partition_t * partition,
+                                const pll_unode_t * node)
+{
+  pll_operation_t op;
+
+  op.parent_clv_index    = node->clv_index;
+  op.parent_scaler_index = node->scaler_index;
+  op.child1_clv_index    = node->next->back->clv_index;
+  op.child1_matrix_index = node->next->back->pmatrix_index;
+  op.child1_scaler_index = node->next->back->scaler_index;
+  op.child2_clv_index    = node->next->next->back->clv_index;
+  op.child2_matrix_index = node->next->next->back->pmatrix_index;
+  op.child2_scaler_index = node->next->next->back->scaler_index;
+
+  pll_update_partials(partition, &op, 1);
+}
+
+static void gradient_edge(struct model_gradient * mg,
+                          const pll_unode_t * edge,
+                          int root_edge)
+{
+  const pll_partition_t * partition = mg->partition;
+  unsigned int states = partition->states;
+  unsigned int states_padded = partition->states_padded;
+  unsigned int rate_cats = partition->rate_cats;
+  unsigned int params_index = mg->params_index;
+  size_t sq = (size_t) states * states;
+  unsigned int s, i, j, k, l;
+
+  const double * pmatrix = partition->pmatrix[edge->pmatrix_index];
+  const double * freqs = partition->frequencies[params_index];
+  const double * evecs = partition->eigenvecs[params_index];
+  const double * inv_evecs = partition->inv_eigenvecs[params_index];
+  const double * evals = partition->eigenvals[params_index];
+  const double brlen = edge->length * mg->brlen_scaler;
+
+  memset(mg->g, 0, rate_cats * sq * sizeof(double));
+
+  for (s = 0; s < partition->sites; ++s)
+  {
+    double site_lh = 0.;
+
+    gradient_load_clv(partition, edge, s, mg->a);
+    gradient_load_clv(partition, edge->back, s, mg->b);
+
+    for (k = 0; k < rate_cats; ++k)
+    {
+      const double * pmat = pmatrix + (size_t) k * states * states_padded;
+      const double * cat_freqs =
+                          partition->frequencies[mg->params_indices[k]];
+      const double * a = mg->a + k * states;
+      const double * b = mg->b + k * states;
+      double * pb = mg->pb + k * states;
+      double cat_lh = 0.;
+
+      for (i = 0; i < states; ++i)
+      {
+        double term = 0.;
+        for (j = 0; j < states; ++j)
+          term += pmat[i * states_padded + j] * b[j];
+        pb[i] = term;
+        cat_lh += cat_freqs[i] * a[i] * term;
+      }
+      site_lh += cat_lh * partition->rate_weights[k];
+    }
+
+    /* scalers are the same for all terms of the site and cancel out */
+    if (!(site_lh > 0.))
+      continue;
+
+    const double site_factor = partition->pattern_weights[s] / site_lh;
+
+    for (k = 0; k < rate_cats; ++k)
+    {
+      if (mg->params_indices[k] != params_index)
+        continue;
+
+      const double cat_factor = site_factor * partition->rate_weights[k];
+      const double * a = mg->a + k * states;
+      const double * b = mg->b + k * states;
+      const double * pb = mg->pb + k * states;
+      double * g = mg->g + k * sq;
+
+      for (i = 0; i < states; ++i)
+      {
+        const double ai = cat_factor * freqs[i] * a[i];
+        if (ai == 0.)
+          continue;
+        for (j = 0; j < states; ++j)
+          g[i * states + j] += ai * b[j];
+      }
+
+      if (root_edge)
+        for (i = 0; i < states; ++i)
+          mg->root_freqs[i] += cat_factor * a[i] * pb[i];
+    }
+  }
+
+  /* P = U exp(lambda r t) W, hence <G, dP> = <U^T G W^T o Phi, W dQ U> */
+  for (k = 0; k < rate_cats; ++k)
+  {
+    if (mg->params_indices[k] != params_index)
+      continue;
+
+    const double * g = mg->g + k * sq;
+    const double t = partition->rates[k] * brlen;
+
+    /* tmp = G W^T */
+    for (i = 0; i < states; ++i)
+      for (j = 0; j < states; ++j)
+      {
+        double term = 0.;
+        for (l = 0; l < states; ++l)
+          term += g[i * states + l] * evecs[j * states_padded + l];
+        mg->tmp[i * states + j] = term;
+      }
+
+    /* h = U^T tmp */
+    for (i = 0; i < states; ++i)
+      for (j = 0; j < states; ++j)
+      {
+        double term = 0.;
+        for (l = 0; l < states; ++l)
+          term += inv_evecs[l * states_padded + i] * mg->tmp[l * states + j];
+        mg->h[i * states + j] = term;
+      }
+
+    for (i = 0; i < states; ++i)
+      mg->expd[i] = exp(evals[i] * t);
+
+    /* Phi_ij = (exp(lambda_i t) - exp(lambda_j t)) / (lambda_i - lambda_j) */
+    for (i = 0; i < states; ++i)
+      for (j = 0; j < states; ++j)
+      {
+        const double diff = evals[i] - evals[j];
+        const double phi = (fabs(diff) < GRADIENT_EIGEN_EPSILON) ?
+                               t * mg->expd[j] :
+                               mg->expd[j] * expm1(diff * t) / diff;
+        mg->m[i * states + j] += mg->h[i * states + j] * phi;
+      }
+  }
+}
+
+/*
+ * Accumulate all edges below `edge->back`. On entry, the CLVs at `edge` and
+ * `edge->back` must be valid. On exit, the CLV at `edge->back` is restored.
+ */
+static void gradient_traverse(struct model_gradient * mg,
+                              pll_unode_t * edge,
+                              int accumulate)
+{
+  pll_unode_t * node = edge->back;
+
+  if (accumulate)
+    gradient_edge(mg, edge, 0);
+
+  if (!node->next)
+    return;
+
+  gradient_update_clv(mg->partition, node->next);
+  gradient_traverse(mg, node->next, 1);
+
+  gradient_update_clv(mg->partition, node->next->next);
+  gradient_traverse(mg, node->next->next, 1);
+
+  /* restore the CLV pointing towards the root */
+  gradient_update_clv(mg->partition, node);
+}
+
+static void gradient_finalize(struct model_gradient * mg,
+                              double * subst_grad,
+                              double * freqs_grad)
+{
+  const pll_partition_t * partition = mg->partition;
+  unsigned int states = partition->states;
+  unsigned int states_padded = partition->states_padded;
+  unsigned int params_index = mg->params_index;
+  unsigned int i, j, l, n;
+
+  const double * evecs = partition->eigenvecs[params_index];
+  const double * inv_evecs = partition->inv_eigenvecs[params_index];
+  const double * subst_params = partition->subst_params[params_index];
+  const double * freqs = partition->frequencies[params_index];
+
+  /* the gradient of Q is R = W^T M U^T; store M U^T in tmp */
+  double * r = mg->h;
+  double * q = mg->g;
+  double * rates = mg->g + (size_t) states * states;
+
+  for (i = 0; i < states; ++i)
+    for (j = 0; j < states; ++j)
+    {
+      double term = 0.;
+      for (l = 0; l < states; ++l)
+        term += mg->m[i * states + l] * inv_evecs[j * states_padded + l];
+      mg->tmp[i * states + j] = term;
+    }
+
+  for (i = 0; i < states; ++i)
+    for (j = 0; j < states; ++j)
+    {
+      double term = 0.;
+      for (l = 0; l < states; ++l)
+        term += evecs[l * states_padded + i] * mg->tmp[l * states + j];
+      r[i * states + j] = term;
+    }
+
+  /* unnormalized rate matrix q_ij = s_ij pi_j and its mean rate mu */
+  n = 0;
+  for (i = 0; i < states; ++i)
+  {
+    rates[i * states + i] = 0.;
+    for (j = i + 1; j < states; ++j)
+    {
+      rates[i * states + j] = rates[j * states + i] = subst_params[n++];
+    }
+  }
+
+  double mu = 0.;
+  double c = 0.;
+  for (i = 0; i < states; ++i)
+  {
+    double row_sum = 0.;
+    for (j = 0; j < states; ++j)
+    {
+      q[i * states + j] = rates[i * states + j] * freqs[j];
+      row_sum += q[i * states + j];
+    }
+    q[i * states + i] = -row_sum;
+    mu += freqs[i] * row_sum;
+  }
+
+  for (i = 0; i < states * states; ++i)
+    c += r[i] * q[i];
+
+  /*
+   * Q = q / mu, thus dlnL = sum_ij R_ij dq_ij / mu - c dmu / mu^2, where
+   * dq_ii = -sum_j dq_ij and c = sum_ij R_ij q_ij
+   */
+  if (subst_grad)
+  {
+    n = 0;
+    for (i = 0; i < states; ++i)
+      for (j = i + 1; j < states; ++j)
+      {
+        const double d_ij = r[i * states + j] - r[i * states + i];
+        const double d_ji = r[j * states + i] - r[j * states + j];
+        subst_grad[n++] = (d_ij * freqs[j] + d_ji * freqs[i]) / mu
+                          - 2 * c * freqs[i] * freqs[j] / (mu * mu);
+      }
+  }
+
+  if (freqs_grad)
+  {
+    for (j = 0; j < states; ++j)
+    {
+      double sum_r = 0.;
+      double sum_mu = 0.;
+      for (i = 0; i < states; ++i)
+      {
+        if (i == j)
+          continue;
+        sum_r  += (r[i * states + j] - r[i * states + i]) *
+                  rates[i * states + j];
+        sum_mu += rates[i * states + j] * freqs[i];
+      }
+      freqs_grad[j] = sum_r / mu - 2 * c * sum_mu / (mu * mu)
+                      + mg->root_freqs[j];
+    }
+  }
+}
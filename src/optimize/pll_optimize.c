@@ -37,6 +37,8 @@
 #include "lbfgsb/lbfgsb.h"
 #include "../pllmod_common.h"
 
+#include <pthread.h>
+
 /* evaluate the likelihood score after each single branch optimization and
  * reset to the original branch if it is not improved */
 #ifndef NOCHECK_PERBRANCH_IMPR
@@ -738,6 +740,16 @@ PLL_EXPORT double pllmod_opt_optimize_multidim (pll_optimize_options_t * params,
 /* GENERIC */
 /******************************************************************************/
 
+/* size of a CLV, or of a sumtable */
+static size_t partition_clv_size(const pll_partition_t * partition)
+{
+  size_t sites_alloc = partition->sites;
+  if (partition->attributes & PLL_ATTRIB_AB_FLAG)
+    sites_alloc += partition->states;
+
+  return sites_alloc * partition->rate_cats * partition->states_padded;
+}
+
 static void update_partials_and_scalers(pll_partition_t ** partitions,
                                         size_t partition_count,
                                         pll_unode_t * parent,
@@ -767,6 +779,108 @@ static void update_partials_and_scalers(pll_partition_t ** partitions,
   }
 }
 
+/*
+ * Sumtable cache for recomp_iterative_multi(), see pllmod_sumtable_cache_t.
+ * The epochs are kept by the caller across calls, so only the P-matrices and
+ * CLVs changed here are tracked.
+ */
+static void sumtable_cache_pmatrix_updated(
+                                      pll_newton_tree_params_multi_t * params,
+                                      const pll_unode_t * edge)
+{
+  pllmod_sumtable_cache_t * cache = params->sumtable_cache;
+
+  if (cache)
+    cache->pmatrix_epoch[edge->pmatrix_index] = ++(*cache->epoch);
+}
+
+/* same as update_partials_and_scalers(), keeping track of the CLV epochs */
+static void update_partials_tracked(pll_newton_tree_params_multi_t * params,
+                                    pll_unode_t * parent,
+                                    pll_unode_t * right_child,
+                                    pll_unode_t * left_child)
+{
+  pllmod_sumtable_cache_t * cache = params->sumtable_cache;
+
+  update_partials_and_scalers(params->partitions,
+                              params->partition_count,
+                              parent,
+                              right_child,
+                              left_child);
+
+  if (cache)
+  {
+    uint64_t * inputs = cache->clv_inputs + 4 * (size_t) parent->node_index;
+    uint64_t new_inputs[4];
+
+    new_inputs[0] = cache->clv_epoch[right_child->back->node_index];
+    new_inputs[1] = cache->pmatrix_epoch[right_child->back->pmatrix_index];
+    new_inputs[2] = cache->clv_epoch[left_child->back->node_index];
+    new_inputs[3] = cache->pmatrix_epoch[left_child->back->pmatrix_index];
+
+    if (memcmp(inputs, new_inputs, sizeof(new_inputs)))
+    {
+      memcpy(inputs, new_inputs, sizeof(new_inputs));
+      cache->clv_epoch[parent->node_index] = ++(*cache->epoch);
+    }
+  }
+}
+
+/*
+ * Compute the sumtable for `edge`, or reuse the cached one. Returns the
+ * per-partition sumtable buffers to use for the derivatives.
+ */
+static double ** update_sumtable_cached(pll_newton_tree_params_multi_t * params,
+                                        const pll_unode_t * edge)
+{
+  pllmod_sumtable_cache_t * cache = params->sumtable_cache;
+  double ** precomp_buffers = params->precomp_buffers;
+  int cached = 0;
+  size_t p;
+
+  if (cache && params->sumtable_slots)
+  {
+    unsigned int slot = edge->pmatrix_index % cache->slots;
+    uint64_t * tag = cache->tags + 3 * (size_t) slot;
+    uint64_t new_tag[3];
+
+    new_tag[0] = edge->pmatrix_index + 1;
+    new_tag[1] = cache->clv_epoch[edge->node_index];
+    new_tag[2] = cache->clv_epoch[edge->back->node_index];
+
+    cached = !memcmp(tag, new_tag, sizeof(new_tag));
+    memcpy(tag, new_tag, sizeof(new_tag));
+
+    for (p = 0; p < params->partition_count; ++p)
+    {
+      if (params->partitions[p])
+        params->sumtable_slots[p] = cache->buffers[p] +
+                      slot * partition_clv_size(params->partitions[p]);
+    }
+    precomp_buffers = params->sumtable_slots;
+  }
+
+  if (cached)
+    return precomp_buffers;
+
+  for (p = 0; p < params->partition_count; ++p)
+  {
+    /* skip remote partitions */
+    if (!params->partitions[p])
+      continue;
+
+    pll_update_sumtable (params->partitions[p],
+                         edge->clv_index,
+                         edge->back->clv_index,
+                         edge->scaler_index,
+                         edge->back->scaler_index,
+                         params->params_indices[p],
+                         precomp_buffers[p]);
+  }
+
+  return precomp_buffers;
+}
+
 /* if keep_update, P-matrices are updated after each branch length opt */
 static int recomp_iterative (pll_newton_tree_params_t * params,
                               int radius,
@@ -1271,6 +1385,7 @@ static int recomp_iterative_multi (pll_newton_tree_params_multi_t * params,
                                    int keep_update)
 {
   pll_unode_t *tr_p, *tr_q, *tr_z;
+  pll_newton_tree_params_multi_t nr_params;
   size_t p;
   double xmin,    /* min branch length */
          xguess,  /* initial guess */
@@ -1296,20 +1411,8 @@ static int recomp_iterative_multi (pll_newton_tree_params_multi_t * params,
   assert(d_equals(tr_p->length, tr_p->back->length));
 
   /* prepare sumtable for current branch */
-  for (p = 0; p < params->partition_count; ++p)
-  {
-    /* skip remote partitions */
-    if (!params->partitions[p])
-      continue;
-
-    pll_update_sumtable (params->partitions[p],
-                         tr_p->clv_index,
-                         tr_p->back->clv_index,
-                         tr_p->scaler_index,
-                         tr_p->back->scaler_index,
-                         params->params_indices[p],
-                         params->precomp_buffers[p]);
-  }
+  nr_params = *params;
+  nr_params.precomp_buffers = update_sumtable_cached(params, tr_p);
 
   /* set N-R parameters */
   xmin = params->branch_length_min;
@@ -1318,7 +1421,7 @@ static int recomp_iterative_multi (pll_newton_tree_params_multi_t * params,
   xguess = tr_p->length;
 
   xres = pllmod_opt_minimize_newton (xmin, xguess, xmax, xtol,
-                                     max_newton_iters, params,
+                                     max_newton_iters, &nr_params,
                                      utree_derivative_func_multi);
 
   if (pll_errno == PLLMOD_OPT_ERROR_NEWTON_LIMIT)
@@ -1363,6 +1466,7 @@ static int recomp_iterative_multi (pll_newton_tree_params_multi_t * params,
                                &(tr_p->pmatrix_index),
                                &p_brlen, 1);
     }
+    sumtable_cache_pmatrix_updated(params, tr_p);
 
 #if(CHECK_PERBRANCH_IMPR)
     /* check and compare likelihood */
@@ -1414,6 +1518,7 @@ static int recomp_iterative_multi (pll_newton_tree_params_multi_t * params,
                                  &(tr_p->pmatrix_index),
                                  &p_brlen, 1);
       }
+      sumtable_cache_pmatrix_updated(params, tr_p);
     }
 #endif
   }
@@ -1434,11 +1539,7 @@ static int recomp_iterative_multi (pll_newton_tree_params_multi_t * params,
      * CLV at P is recomputed with children P->back and Z->back
      * Scaler is updated by subtracting Q->back and adding P->back
      */
-    update_partials_and_scalers(params->partitions,
-                                params->partition_count,
-                                tr_q,
-                                tr_p,
-                                tr_z);
+    update_partials_tracked(params, tr_q, tr_p, tr_z);
 
     /* eval */
     pll_newton_tree_params_multi_t params_cpy;
@@ -1454,11 +1555,7 @@ static int recomp_iterative_multi (pll_newton_tree_params_multi_t * params,
      * CLV at P is recomputed with children P->back and Q->back
      * Scaler is updated by subtracting Z->back and adding Q->back
      */
-    update_partials_and_scalers(params->partitions,
-                                params->partition_count,
-                                tr_z,
-                                tr_q,
-                                tr_p);
+    update_partials_tracked(params, tr_z, tr_q, tr_p);
 
    /* eval */
     params_cpy.tree = tr_z->back;
@@ -1472,39 +1569,14 @@ static int recomp_iterative_multi (pll_newton_tree_params_multi_t * params,
      * CLV at P is recomputed with children Q->back and Z->back
      * Scaler is updated by subtracting P->back and adding Z->back
      */
-    update_partials_and_scalers(params->partitions,
-                                params->partition_count,
-                                tr_p,
-                                tr_z,
-                                tr_q);
+    update_partials_tracked(params, tr_p, tr_z, tr_q);
   }
 
   return PLL_SUCCESS;
 
 } /* recomp_iterative */
 
-/**
- * Optimize branch lengths locally around a given edge using Newton-Raphson
- * minimization algorithm on a multiple partition.
- *
- * Check `pllmod_opt_optimize_branch_lengths_local` documentation.
- *
- * @param[in,out]  partitions    list of partitions
- * @param  partition_count   number of partitions in `partitions`
- * @param[in,out]  tree          the PLL unrotted tree structure
- * @param  params_indices    the indices of the parameter sets
- * @param  branch_length_min lower bound for branch lengths
- * @param  branch_length_max upper bound for branch lengths
- * @param  tolerance         tolerance for Newton-Raphson algorithm
- * @param  smoothings        number of iterations over the branches
- * * @param  radius            radius from the virtual root
- * @param  keep_update       if true, branch lengths are iteratively updated in the tree structure
- * @param  parallel_context      context for parallel computation
- * @param  parallel_reduce_cb    callback function for parallel reduction
- *
- * @return                   the likelihood score after optimizing branch lengths
- */
-PLL_EXPORT double pllmod_opt_optimize_branch_lengths_local_multi (
+static double branch_lengths_local_multi (
                                               pll_partition_t ** partitions,
                                               size_t partition_count,
                                               pll_unode_t * tree,
@@ -1517,6 +1589,7 @@ PLL_EXPORT double pllmod_opt_optimize_branch_lengths_local_multi (
                                               int smoothings,
                                               int radius,
                                               int keep_update,
+                                              pllmod_sumtable_cache_t * sumtable_cache,
                                               void * parallel_context,
                                               void (*parallel_reduce_cb)(void *,
                                                                          double *,
@@ -1579,6 +1652,30 @@ PLL_EXPORT double pllmod_opt_optimize_branch_lengths_local_multi (
   params.parallel_context = parallel_context;
   params.parallel_reduce_cb = parallel_reduce_cb;
 
+  /* the epochs of the CLVs and P-matrices changed here are always tracked,
+     but the cached sumtables are only used if there is a buffer for every
+     local partition (and the slot pointers can be allocated) */
+  params.sumtable_cache = NULL;
+  params.sumtable_slots = NULL;
+  if (sumtable_cache && sumtable_cache->clv_epoch &&
+      sumtable_cache->clv_inputs && sumtable_cache->pmatrix_epoch &&
+      sumtable_cache->epoch)
+  {
+    int usable = sumtable_cache->slots && sumtable_cache->tags &&
+                 sumtable_cache->buffers;
+
+    params.sumtable_cache = sumtable_cache;
+    for (p = 0; p < partition_count && usable; ++p)
+    {
+      if (partitions[p] && !sumtable_cache->buffers[p])
+        usable = 0;
+    }
+
+    if (usable)
+      params.sumtable_slots = (double **) calloc(partition_count,
+                                                 sizeof(double *));
+  }
+
   /* allocate the sumtable if needed */
   if (!params.precomp_buffers)
   {
@@ -1671,6 +1768,9 @@ PLL_EXPORT double pllmod_opt_optimize_branch_lengths_local_multi (
   result = -1*loglikelihood;
 
 cleanup:
+  if (params.sumtable_slots)
+    free(params.sumtable_slots);
+
   /* deallocate sumtable */
   if (!precomp_buffers)
   {
@@ -1684,3 +1784,1406 @@ cleanup:
 
   return result;
 } /* pllmod_opt_optimize_branch_lengths_local */
+
+/**
+ * Optimize branch lengths locally around a given edge using Newton-Raphson
+ * minimization algorithm on a multiple partition.
+ *
+ * Check `pllmod_opt_optimize_branch_lengths_local` documentation.
+ *
+ * @param[in,out]  partitions    list of partitions
+ * @param  partition_count   number of partitions in `partitions`
+ * @param[in,out]  tree          the PLL unrotted tree structure
+ * @param  params_indices    the indices of the parameter sets
+ * @param  branch_length_min lower bound for branch lengths
+ * @param  branch_length_max upper bound for branch lengths
+ * @param  tolerance         tolerance for Newton-Raphson algorithm
+ * @param  smoothings        number of iterations over the branches
+ * * @param  radius            radius from the virtual root
+ * @param  keep_update       if true, branch lengths are iteratively updated in the tree structure
+ * @param  parallel_context      context for parallel computation
+ * @param  parallel_reduce_cb    callback function for parallel reduction
+ *
+ * @return                   the likelihood score after optimizing branch lengths
+ */
+PLL_EXPORT double pllmod_opt_optimize_branch_lengths_local_multi (
+                                              pll_partition_t ** partitions,
+                                              size_t partition_count,
+                                              pll_unode_t * tree,
+                                              unsigned int ** params_indices,
+                                              double ** precomp_buffers,
+                                              double * brlen_scalers,
+                                              double branch_length_min,
+                                              double branch_length_max,
+                                              double tolerance,
+                                              int smoothings,
+                                              int radius,
+                                              int keep_update,
+                                              void * parallel_context,
+                                              void (*parallel_reduce_cb)(void *,
+                                                                         double *,
+                                                                         size_t,
+                                                                         int))
+{
+  return branch_lengths_local_multi(partitions, partition_count, tree,
+                                    params_indices, precomp_buffers,
+                                    brlen_scalers, branch_length_min,
+                                    branch_length_max, tolerance, smoothings,
+                                    radius, keep_update, NULL,
+                                    parallel_context, parallel_reduce_cb);
+}
+
+/**
+ * Optimize branch lengths locally around a given edge using Newton-Raphson
+ * minimization algorithm on a multiple partition, reusing sumtables.
+ *
+ * Same as `pllmod_opt_optimize_branch_lengths_local_multi`, but the sumtable
+ * of a branch is kept in `sumtable_cache` and only recomputed if the CLV at
+ * either end of the branch has changed since it was computed, e.g. in
+ * successive smoothings over a converged region of the tree, or in the next
+ * call on a neighbouring region.
+ *
+ * `sumtable_cache->buffers[p]` must hold `sumtable_cache->slots` sumtables of
+ * partition `p`. Branches are mapped to slots by P-matrix index. The epochs
+ * must cover every node and P-matrix index of the tree, and be updated by the
+ * caller whenever it changes CLVs or P-matrices (e.g., with the treeinfo
+ * invalidation functions). If the cache has no slots or a local partition
+ * has no buffer, sumtables are not cached, but the epochs are still updated.
+ *
+ * @param  sumtable_cache        sumtable cache, or NULL
+ *
+ * @return                   the likelihood score after optimizing branch lengths
+ */
+PLL_EXPORT double pllmod_opt_optimize_branch_lengths_local_multi_cached (
+                                              pll_partition_t ** partitions,
+                                              size_t partition_count,
+                                              pll_unode_t * tree,
+                                              unsigned int ** params_indices,
+                                              double ** precomp_buffers,
+                                              double * brlen_scalers,
+                                              double branch_length_min,
+                                              double branch_length_max,
+                                              double tolerance,
+                                              int smoothings,
+                                              int radius,
+                                              int keep_update,
+                                              pllmod_sumtable_cache_t * sumtable_cache,
+                                              void * parallel_context,
+                                              void (*parallel_reduce_cb)(void *,
+                                                                         double *,
+                                                                         size_t,
+                                                                         int))
+{
+  return branch_lengths_local_multi(partitions, partition_count, tree,
+                                    params_indices, precomp_buffers,
+                                    brlen_scalers, branch_length_min,
+                                    branch_length_max, tolerance, smoothings,
+                                    radius, keep_update, sumtable_cache,
+                                    parallel_context, parallel_reduce_cb);
+}
+
+/* maximum number of step halvings in the joint branch length update */
+#define BRLEN_ALL_MAX_HALVINGS 8
+
+struct brlen_all_params
+{
+  pll_partition_t ** partitions;
+  size_t partition_count;
+  unsigned int ** params_indices;
+  double ** precomp_buffers;
+  double * brlen_scalers;
+  pll_unode_t ** edges;
+  double * derivs;                /* df and ddf for each edge */
+  unsigned int edge_count;
+  unsigned int * matrix_indices;  /* buffer for the P-matrix updates */
+  double * brlen_buffer;          /* buffer for the P-matrix updates */
+};
+
+static unsigned int count_subtree_edges(const pll_unode_t * node)
+{
+  if (!node->next)
+    return 0;
+
+  return 2 + count_subtree_edges(node->next->back)
+           + count_subtree_edges(node->next->next->back);
+}
+
+/* compute the derivatives of the negative log-likelihood at edge `node` */
+static void brlen_all_edge_derivatives(struct brlen_all_params * params,
+                                       pll_unode_t * node)
+{
+  double * d = params->derivs + 2 * params->edge_count;
+  size_t p;
+
+  d[0] = d[1] = 0.;
+  for (p = 0; p < params->partition_count; ++p)
+  {
+    /* skip remote partitions */
+    if (!params->partitions[p])
+      continue;
+
+    double p_df, p_ddf;
+    double s = params->brlen_scalers ? params->brlen_scalers[p] : 1.;
+
+    pll_update_sumtable (params->partitions[p],
+                         node->clv_index,
+                         node->back->clv_index,
+                         node->scaler_index,
+                         node->back->scaler_index,
+                         params->params_indices[p],
+                         params->precomp_buffers[p]);
+
+    pll_compute_likelihood_derivatives (params->partitions[p],
+                                        node->scaler_index,
+                                        node->back->scaler_index,
+                                        s * node->length,
+                                        params->params_indices[p],
+                                        params->precomp_buffers[p],
+                                        &p_df, &p_ddf);
+
+    /* chain rule! */
+    d[0] += s * p_df;
+    d[1] += s * s * p_ddf;
+  }
+
+  params->edges[params->edge_count++] = node;
+}
+
+/*
+ * Visit the edges in the subtree of `node`, moving the CLVs along so that
+ * both ends of every edge point towards each other when it is visited.
+ * CLVs are restored on the way back. If `record`, edge `node` is visited too.
+ */
+static void brlen_all_sweep(struct brlen_all_params * params,
+                            pll_unode_t * node,
+                            int record)
+{
+  pll_unode_t * q, * z;
+
+  if (record)
+    brlen_all_edge_derivatives(params, node);
+
+  if (!node->next)
+    return;
+
+  q = node->next;
+  z = q->next;
+
+  update_partials_and_scalers(params->partitions, params->partition_count,
+                              q, node, z);
+  brlen_all_sweep(params, q->back, 1);
+
+  update_partials_and_scalers(params->partitions, params->partition_count,
+                              z, q, node);
+  brlen_all_sweep(params, z->back, 1);
+
+  update_partials_and_scalers(params->partitions, params->partition_count,
+                              node, z, q);
+}
+
+/* recompute the CLVs in the subtree of `node` (postorder) */
+static void brlen_all_update_clvs(struct brlen_all_params * params,
+                                  pll_unode_t * node)
+{
+  if (!node->next)
+    return;
+
+  brlen_all_update_clvs(params, node->next->back);
+  brlen_all_update_clvs(params, node->next->next->back);
+
+  update_partials_and_scalers(params->partitions, params->partition_count,
+                              node, node->next, node->next->next);
+}
+
+/* set all branch lengths and update the P-matrices and CLVs accordingly */
+static void brlen_all_set_lengths(struct brlen_all_params * params,
+                                  pll_unode_t * tree,
+                                  const double * lengths)
+{
+  unsigned int k;
+  size_t p;
+
+  for (k = 0; k < params->edge_count; ++k)
+  {
+    params->edges[k]->length = params->edges[k]->back->length = lengths[k];
+    params->matrix_indices[k] = params->edges[k]->pmatrix_index;
+  }
+
+  for (p = 0; p < params->partition_count; ++p)
+  {
+    /* skip remote partitions */
+    if (!params->partitions[p])
+      continue;
+
+    double s = params->brlen_scalers ? params->brlen_scalers[p] : 1.;
+    for (k = 0; k < params->edge_count; ++k)
+      params->brlen_buffer[k] = s * lengths[k];
+
+    pll_update_prob_matrices(params->partitions[p],
+                             params->params_indices[p],
+                             params->matrix_indices,
+                             params->brlen_buffer,
+                             params->edge_count);
+  }
+
+  brlen_all_update_clvs(params, tree);
+  brlen_all_update_clvs(params, tree->back);
+}
+
+/**
+ * Optimize all branch lengths simultaneously on a multiple partition.
+ *
+ * Unlike `pllmod_opt_optimize_branch_lengths_local_multi`, which runs a
+ * Newton-Raphson loop for every branch in turn, each iteration computes the
+ * first and second derivatives of all branches in a single sweep over the
+ * tree, and takes a joint Newton step using the diagonal of the Hessian.
+ * Branches with a non-positive curvature are doubled or halved according
+ * to the sign of their derivative. The step is halved until the likelihood
+ * improves; if it does not, the previous branch lengths are kept and the
+ * optimization stops.
+ *
+ * Preconditions are the same as for
+ * `pllmod_opt_optimize_branch_lengths_local_multi`: CLVs must be updated
+ * towards `tree`, and P-matrix indices must be unique for each branch.
+ * On return, CLVs are updated towards `tree` for the final branch lengths.
+ *
+ * @param[in,out]  partitions    list of partitions
+ * @param  partition_count   number of partitions in `partitions`
+ * @param[in,out]  tree          the PLL unrooted tree structure
+ * @param  params_indices    the indices of the parameter sets
+ * @param  precomp_buffers   sumtable buffer for each partition (can be NULL)
+ * @param  brlen_scalers     branch length scaler for each partition (can be NULL)
+ * @param  branch_length_min lower bound for branch lengths
+ * @param  branch_length_max upper bound for branch lengths
+ * @param  tolerance         log-likelihood improvement for convergence
+ * @param  max_iters         maximum number of joint Newton steps
+ * @param  parallel_context      context for parallel computation
+ * @param  parallel_reduce_cb    callback function for parallel reduction
+ *
+ * @return                   the negative likelihood score after optimizing
+ *                           branch lengths, or PLL_FAILURE on error
+ */
+PLL_EXPORT double pllmod_opt_optimize_branch_lengths_all_multi (
+                                              pll_partition_t ** partitions,
+                                              size_t partition_count,
+                                              pll_unode_t * tree,
+                                              unsigned int ** params_indices,
+                                              double ** precomp_buffers,
+                                              double * brlen_scalers,
+                                              double branch_length_min,
+                                              double branch_length_max,
+                                              double tolerance,
+                                              int max_iters,
+                                              void * parallel_context,
+                                              void (*parallel_reduce_cb)(void *,
+                                                                         double *,
+                                                                         size_t,
+                                                                         int))
+{
+  struct brlen_all_params params;
+  double loglikelihood, new_loglikelihood;
+  double * lengths = NULL, * steps = NULL, * new_lengths = NULL;
+  unsigned int edge_count, k;
+  unsigned int sites_alloc;
+  int iter, halvings;
+  size_t p;
+  double result = (double) PLL_FAILURE;
+
+  const double xmin = (branch_length_min>0) ? branch_length_min :
+                                              PLLMOD_OPT_MIN_BRANCH_LEN;
+  const double xmax = (branch_length_max>0) ? branch_length_max :
+                                              PLLMOD_OPT_MAX_BRANCH_LEN;
+
+  pllmod_reset_error();
+
+  if (!tree->next && !tree->back->next)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Tree must have at least one inner node");
+    return (double) PLL_FAILURE;
+  }
+
+  edge_count = 1 + count_subtree_edges(tree) + count_subtree_edges(tree->back);
+
+  memset(&params, 0, sizeof(params));
+  params.partitions      = partitions;
+  params.partition_count = partition_count;
+  params.params_indices  = params_indices;
+  params.precomp_buffers = precomp_buffers;
+  params.brlen_scalers   = brlen_scalers;
+
+  params.edges = (pll_unode_t **) malloc(edge_count * sizeof(pll_unode_t *));
+  params.derivs = (double *) malloc(2 * edge_count * sizeof(double));
+  params.matrix_indices = (unsigned int *) malloc(edge_count *
+                                                  sizeof(unsigned int));
+  params.brlen_buffer = (double *) malloc(edge_count * sizeof(double));
+  lengths = (double *) malloc(edge_count * sizeof(double));
+  steps = (double *) malloc(edge_count * sizeof(double));
+  new_lengths = (double *) malloc(edge_count * sizeof(double));
+
+  if (!params.edges || !params.derivs || !params.matrix_indices ||
+      !params.brlen_buffer || !lengths || !steps || !new_lengths)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for bl opt variables");
+    goto cleanup;
+  }
+
+  /* allocate the sumtable if needed */
+  if (!precomp_buffers)
+  {
+    params.precomp_buffers = (double **) calloc(partition_count,
+                                                sizeof(double *));
+    if (!params.precomp_buffers)
+    {
+      pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                       "Cannot allocate memory for bl opt variables");
+      goto cleanup;
+    }
+
+    for (p = 0; p < partition_count; ++p)
+    {
+      const pll_partition_t * partition = partitions[p];
+
+      /* skip remote partitions */
+      if (!partition)
+        continue;
+
+      sites_alloc = partition->sites;
+      if (partition->attributes & PLL_ATTRIB_AB_FLAG)
+        sites_alloc += partition->states;
+
+      if ((params.precomp_buffers[p] = (double *) pll_aligned_alloc(
+           sites_alloc * partition->rate_cats * partition->states_padded *
+           sizeof(double), partition->alignment)) == NULL)
+      {
+        pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                         "Cannot allocate memory for bl opt variables");
+        goto cleanup;
+      }
+    }
+  }
+
+  /* get the initial likelihood score */
+  loglikelihood = pllmod_opt_compute_edge_loglikelihood_multi (
+                                                      partitions,
+                                                      partition_count,
+                                                      tree->back->clv_index,
+                                                      tree->back->scaler_index,
+                                                      tree->clv_index,
+                                                      tree->scaler_index,
+                                                      tree->pmatrix_index,
+                                                      params_indices,
+                                                      NULL,
+                                                      parallel_context,
+                                                      parallel_reduce_cb);
+
+  for (iter = 0; iter < max_iters; ++iter)
+  {
+    /* derivatives for all branches */
+    params.edge_count = 0;
+    brlen_all_sweep(&params, tree, 1);
+    brlen_all_sweep(&params, tree->back, 0);
+    assert(params.edge_count == edge_count);
+
+    if (parallel_reduce_cb)
+      parallel_reduce_cb(parallel_context, params.derivs, 2 * edge_count,
+                         0 /*PLLMOD_TREE_REDUCE_SUM*/);
+
+    for (k = 0; k < edge_count; ++k)
+    {
+      double df  = params.derivs[2*k];
+      double ddf = params.derivs[2*k+1];
+
+      if (!isfinite(df) || !isfinite(ddf))
+      {
+        pllmod_set_error(PLLMOD_OPT_ERROR_NEWTON_DERIV,
+                         "wrong likelihood derivatives");
+        goto cleanup;
+      }
+
+      lengths[k] = params.edges[k]->length;
+      if (ddf > 0.)
+        steps[k] = -df / ddf;
+      else
+        steps[k] = (df < 0.) ? lengths[k] : -0.5 * lengths[k];
+    }
+
+    /* joint Newton step with step halving */
+    new_loglikelihood = loglikelihood;
+    for (halvings = 0; halvings <= BRLEN_ALL_MAX_HALVINGS; ++halvings)
+    {
+      double factor = ldexp(1., -halvings);
+      for (k = 0; k < edge_count; ++k)
+      {
+        double x = lengths[k] + factor * steps[k];
+        new_lengths[k] = (x < xmin) ? xmin : ((x > xmax) ? xmax : x);
+      }
+
+      brlen_all_set_lengths(&params, tree, new_lengths);
+
+      new_loglikelihood = pllmod_opt_compute_edge_loglikelihood_multi (
+                                                      partitions,
+                                                      partition_count,
+                                                      tree->back->clv_index,
+                                                      tree->back->scaler_index,
+                                                      tree->clv_index,
+                                                      tree->scaler_index,
+                                                      tree->pmatrix_index,
+                                                      params_indices,
+                                                      NULL,
+                                                      parallel_context,
+                                                      parallel_reduce_cb);
+
+      if (new_loglikelihood > loglikelihood)
+        break;
+    }
+
+    DBG("BLO_all: iteration %d, old LH: %.9f, new LH: %.9f\n",
+        iter, loglikelihood, new_loglikelihood);
+
+    if (!(new_loglikelihood > loglikelihood))
+    {
+      /* no improvement: revert and stop */
+      brlen_all_set_lengths(&params, tree, lengths);
+      break;
+    }
+
+    if (new_loglikelihood - loglikelihood < tolerance)
+    {
+      loglikelihood = new_loglikelihood;
+      break;
+    }
+
+    loglikelihood = new_loglikelihood;
+  }
+
+  result = -1*loglikelihood;
+
+cleanup:
+  if (!precomp_buffers && params.precomp_buffers)
+  {
+    for (p = 0; p < partition_count; ++p)
+    {
+      if (params.precomp_buffers[p])
+        pll_aligned_free(params.precomp_buffers[p]);
+    }
+    free(params.precomp_buffers);
+  }
+
+  if (params.edges)
+    free(params.edges);
+  if (params.derivs)
+    free(params.derivs);
+  if (params.matrix_indices)
+    free(params.matrix_indices);
+  if (params.brlen_buffer)
+    free(params.brlen_buffer);
+  if (lengths)
+    free(lengths);
+  if (steps)
+    free(steps);
+  if (new_lengths)
+    free(new_lengths);
+
+  return result;
+} /* pllmod_opt_optimize_branch_lengths_all_multi */
+
+/* minimum number of branches in a region optimized by a separate thread */
+#define BRLEN_REGION_MIN_EDGES 3
+
+/* number of regions per thread, for load balancing */
+#define BRLEN_REGIONS_PER_THREAD 2
+
+/* maximum number of values reduced at once by a region thread */
+#define BRLEN_BATCH_SLOT_SIZE 2
+
+/*
+ * A region is the subtree below `root`, including edge `root`. It is
+ * optimized on private shallow copies of the partitions, in which the CLV
+ * (and scaler) of `root->back` point to a private snapshot of the rest of
+ * the tree, so that regions do not share any buffer.
+ */
+struct brlen_region
+{
+  pll_unode_t * root;
+  pll_partition_t * copies;
+  pll_partition_t ** copy_ptrs;     /* NULL for remote partitions */
+};
+
+/*
+ * Reduction shared by the region threads. Each value to reduce waits until
+ * every other thread has a value as well (or has finished its regions), and
+ * the last thread to arrive reduces the whole batch with a single call to the
+ * caller's reduction. Threads optimize a fixed sequence of regions, so the
+ * batches are the same on every process.
+ */
+struct brlen_batch_reduce
+{
+  unsigned int n_threads;
+  unsigned int arrived;
+  unsigned int finished;
+  unsigned int generation;
+  double ** data;                   /* pending values of each thread */
+  size_t * size;
+  int * op;
+  double * buffer;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+struct brlen_parallel_params
+{
+  pll_partition_t ** partitions;
+  size_t partition_count;
+  pll_unode_t * tree;
+  unsigned int ** params_indices;
+  double * brlen_scalers;
+  double branch_length_min;
+  double branch_length_max;
+  double tolerance;
+  void * parallel_context;
+  void (*parallel_reduce_cb)(void *, double *, size_t, int);
+
+  struct brlen_region * regions;
+  unsigned int region_count;
+  unsigned int region_max_edges;
+
+  unsigned int next_region;
+  pthread_mutex_t lock;
+
+  struct brlen_batch_reduce batch;  /* used with parallel_reduce_cb */
+};
+
+struct brlen_parallel_worker
+{
+  struct brlen_parallel_params * params;
+  unsigned int id;
+  double ** precomp_buffers;
+  int error;
+  char errmsg[PLLMOD_ERRMSG_LEN];
+};
+
+static struct brlen_region * find_region(
+                                   const struct brlen_parallel_params * params,
+                                   const pll_unode_t * node)
+{
+  unsigned int i;
+
+  for (i = 0; i < params->region_count; ++i)
+    if (params->regions[i].root == node)
+      return params->regions + i;
+
+  return NULL;
+}
+
+static size_t partition_scaler_size(const pll_partition_t * partition)
+{
+  size_t sites_alloc = partition->sites;
+  if (partition->attributes & PLL_ATTRIB_AB_FLAG)
+    sites_alloc += partition->states;
+
+#ifdef PLL_ATTRIB_RATE_SCALERS
+  if (partition->attributes & PLL_ATTRIB_RATE_SCALERS)
+    sites_alloc *= partition->rate_cats;
+#endif
+
+  return sites_alloc;
+}
+
+/* add the subtrees of `node`'s children small enough to be a region */
+static unsigned int brlen_select_regions(struct brlen_parallel_params * params,
+                                         pll_unode_t * node,
+                                         int is_root)
+{
+  unsigned int i;
+  unsigned int size = is_root ? 0 : 1;
+  unsigned int child_size[2];
+  pll_unode_t * child[2];
+
+  if (!node->next)
+    return size;
+
+  child[0] = node->next->back;
+  child[1] = node->next->next->back;
+
+  for (i = 0; i < 2; ++i)
+  {
+    child_size[i] = brlen_select_regions(params, child[i], 0);
+    size += child_size[i];
+  }
+
+  if (is_root || size > params->region_max_edges)
+  {
+    for (i = 0; i < 2; ++i)
+    {
+      if (child_size[i] <= params->region_max_edges &&
+          child_size[i] >= BRLEN_REGION_MIN_EDGES)
+        params->regions[params->region_count++].root = child[i];
+    }
+  }
+
+  return size;
+}
+
+static void brlen_destroy_regions(struct brlen_parallel_params * params)
+{
+  unsigned int i;
+  size_t p;
+
+  for (i = 0; i < params->region_count; ++i)
+  {
+    struct brlen_region * region = params->regions + i;
+
+    for (p = 0; region->copies && region->copy_ptrs &&
+                p < params->partition_count; ++p)
+    {
+      pll_partition_t * copy = region->copies + p;
+      const pll_unode_t * outer = region->root->back;
+
+      if (!region->copy_ptrs[p])
+        continue;
+
+      if (copy->clv)
+      {
+        if (copy->clv[outer->clv_index] !=
+            params->partitions[p]->clv[outer->clv_index])
+          pll_aligned_free(copy->clv[outer->clv_index]);
+        free(copy->clv);
+      }
+
+      if (copy->scale_buffer)
+      {
+        if (outer->scaler_index != PLL_SCALE_BUFFER_NONE &&
+            copy->scale_buffer[outer->scaler_index] !=
+            params->partitions[p]->scale_buffer[outer->scaler_index])
+          free(copy->scale_buffer[outer->scaler_index]);
+        free(copy->scale_buffer);
+      }
+    }
+
+    if (region->copies)
+      free(region->copies);
+    if (region->copy_ptrs)
+      free(region->copy_ptrs);
+  }
+
+  free(params->regions);
+}
+
+static int brlen_create_region_copies(struct brlen_parallel_params * params,
+                                      struct brlen_region * region)
+{
+  const pll_unode_t * outer = region->root->back;
+  size_t p;
+
+  region->copies = (pll_partition_t *) calloc(params->partition_count,
+                                              sizeof(pll_partition_t));
+  region->copy_ptrs = (pll_partition_t **) calloc(params->partition_count,
+                                                  sizeof(pll_partition_t *));
+  if (!region->copies || !region->copy_ptrs)
+    return PLL_FAILURE;
+
+  for (p = 0; p < params->partition_count; ++p)
+  {
+    const pll_partition_t * partition = params->partitions[p];
+    pll_partition_t * copy = region->copies + p;
+    unsigned int clv_count;
+
+    /* skip remote partitions */
+    if (!partition)
+      continue;
+
+    *copy = *partition;
+    copy->clv = NULL;
+    copy->scale_buffer = NULL;
+    region->copy_ptrs[p] = copy;
+
+    clv_count = partition->tips + partition->clv_buffers;
+    copy->clv = (double **) malloc(clv_count * sizeof(double *));
+    if (!copy->clv)
+      return PLL_FAILURE;
+    memcpy(copy->clv, partition->clv, clv_count * sizeof(double *));
+
+    copy->clv[outer->clv_index] = (double *) pll_aligned_alloc(
+                         partition_clv_size(partition) * sizeof(double),
+                         partition->alignment);
+    if (!copy->clv[outer->clv_index])
+    {
+      copy->clv[outer->clv_index] = partition->clv[outer->clv_index];
+      return PLL_FAILURE;
+    }
+
+    if (partition->scale_buffers)
+    {
+      copy->scale_buffer = (unsigned int **) malloc(partition->scale_buffers *
+                                                    sizeof(unsigned int *));
+      if (!copy->scale_buffer)
+        return PLL_FAILURE;
+      memcpy(copy->scale_buffer, partition->scale_buffer,
+             partition->scale_buffers * sizeof(unsigned int *));
+
+      if (outer->scaler_index != PLL_SCALE_BUFFER_NONE)
+      {
+        copy->scale_buffer[outer->scaler_index] = (unsigned int *) malloc(
+                     partition_scaler_size(partition) * sizeof(unsigned int));
+        if (!copy->scale_buffer[outer->scaler_index])
+        {
+          copy->scale_buffer[outer->scaler_index] =
+                              partition->scale_buffer[outer->scaler_index];
+          return PLL_FAILURE;
+        }
+      }
+    }
+  }
+
+  return PLL_SUCCESS;
+}
+
+/*
+ * Take a snapshot of the CLVs pointing towards each region. Regions are not
+ * entered, and CLVs are restored on the way back.
+ */
+static void brlen_save_region_clvs(struct brlen_parallel_params * params,
+                                   pll_unode_t * node)
+{
+  struct brlen_region * region = find_region(params, node);
+  pll_unode_t * q, * z;
+  size_t p;
+
+  if (region)
+  {
+    const pll_unode_t * outer = node->back;
+
+    for (p = 0; p < params->partition_count; ++p)
+    {
+      const pll_partition_t * partition = params->partitions[p];
+
+      /* skip remote partitions */
+      if (!partition)
+        continue;
+
+      memcpy(region->copies[p].clv[outer->clv_index],
+             partition->clv[outer->clv_index],
+             partition_clv_size(partition) * sizeof(double));
+
+      if (outer->scaler_index != PLL_SCALE_BUFFER_NONE)
+        memcpy(region->copies[p].scale_buffer[outer->scaler_index],
+               partition->scale_buffer[outer->scaler_index],
+               partition_scaler_size(partition) * sizeof(unsigned int));
+    }
+    return;
+  }
+
+  if (!node->next)
+    return;
+
+  q = node->next;
+  z = q->next;
+
+  update_partials_and_scalers(params->partitions, params->partition_count,
+                              q, node, z);
+  brlen_save_region_clvs(params, q->back);
+
+  update_partials_and_scalers(params->partitions, params->partition_count,
+                              z, q, node);
+  brlen_save_region_clvs(params, z->back);
+
+  update_partials_and_scalers(params->partitions, params->partition_count,
+                              node, z, q);
+}
+
+/* recompute the CLVs outside the regions (postorder) */
+static void brlen_update_core_clvs(struct brlen_parallel_params * params,
+                                   pll_unode_t * node)
+{
+  if (!node->next || find_region(params, node))
+    return;
+
+  brlen_update_core_clvs(params, node->next->back);
+  brlen_update_core_clvs(params, node->next->next->back);
+
+  update_partials_and_scalers(params->partitions, params->partition_count,
+                              node, node->next, node->next->next);
+}
+
+static void brlen_newton_params(struct brlen_parallel_params * params,
+                                pll_newton_tree_params_multi_t * newton_params,
+                                pll_partition_t ** partitions,
+                                double ** precomp_buffers,
+                                int reduce)
+{
+  newton_params->partitions        = partitions;
+  newton_params->partition_count   = params->partition_count;
+  newton_params->tree              = params->tree;
+  newton_params->params_indices    = params->params_indices;
+  newton_params->precomp_buffers   = precomp_buffers;
+  newton_params->brlen_scalers     = params->brlen_scalers;
+  newton_params->branch_length_min = params->branch_length_min;
+  newton_params->branch_length_max = params->branch_length_max;
+  newton_params->tolerance         = params->tolerance;
+  newton_params->parallel_context  = reduce ? params->parallel_context : NULL;
+  newton_params->parallel_reduce_cb = reduce ? params->parallel_reduce_cb :
+                                               NULL;
+  newton_params->sumtable_cache    = NULL;
+  newton_params->sumtable_slots    = NULL;
+}
+
+/* reduce the pending values of all threads (batch lock held) */
+static void brlen_batch_flush(struct brlen_parallel_params * params)
+{
+  struct brlen_batch_reduce * batch = &params->batch;
+  unsigned int t;
+  int op;
+
+  /* one reduction per operation, always in the same order */
+  for (op = 0; op < 3; ++op)
+  {
+    size_t total = 0;
+
+    for (t = 0; t < batch->n_threads; ++t)
+    {
+      if (batch->data[t] && batch->op[t] == op)
+      {
+        memcpy(batch->buffer + total, batch->data[t],
+               batch->size[t] * sizeof(double));
+        total += batch->size[t];
+      }
+    }
+
+    if (!total)
+      continue;
+
+    params->parallel_reduce_cb(params->parallel_context, batch->buffer,
+                               total, op);
+
+    total = 0;
+    for (t = 0; t < batch->n_threads; ++t)
+    {
+      if (batch->data[t] && batch->op[t] == op)
+      {
+        memcpy(batch->data[t], batch->buffer + total,
+               batch->size[t] * sizeof(double));
+        total += batch->size[t];
+      }
+    }
+  }
+
+  for (t = 0; t < batch->n_threads; ++t)
+    batch->data[t] = NULL;
+
+  batch->arrived = 0;
+  batch->generation++;
+  pthread_cond_broadcast(&batch->cond);
+}
+
+/* parallel_reduce_cb of the region threads (context is the worker) */
+static void brlen_batch_reduce_cb(void * context,
+                                  double * data,
+                                  size_t size,
+                                  int op)
+{
+  struct brlen_parallel_worker * worker =
+                                  (struct brlen_parallel_worker *) context;
+  struct brlen_parallel_params * params = worker->params;
+  struct brlen_batch_reduce * batch = &params->batch;
+
+  assert(size <= BRLEN_BATCH_SLOT_SIZE);
+
+  pthread_mutex_lock(&batch->lock);
+  batch->data[worker->id] = data;
+  batch->size[worker->id] = size;
+  batch->op[worker->id]   = op;
+
+  if (++batch->arrived + batch->finished == batch->n_threads)
+    brlen_batch_flush(params);
+  else
+  {
+    unsigned int generation = batch->generation;
+    while (generation == batch->generation)
+      pthread_cond_wait(&batch->cond, &batch->lock);
+  }
+  pthread_mutex_unlock(&batch->lock);
+}
+
+/* the worker does not take part in the following batches */
+static void brlen_batch_finish(struct brlen_parallel_worker * worker)
+{
+  struct brlen_batch_reduce * batch = &worker->params->batch;
+
+  pthread_mutex_lock(&batch->lock);
+  if (++batch->finished + batch->arrived == batch->n_threads &&
+      batch->arrived)
+    brlen_batch_flush(worker->params);
+  pthread_mutex_unlock(&batch->lock);
+}
+
+static void * brlen_parallel_worker_run(void * arg)
+{
+  struct brlen_parallel_worker * worker = (struct brlen_parallel_worker *) arg;
+  struct brlen_parallel_params * params = worker->params;
+  pll_newton_tree_params_multi_t newton_params;
+  const int reduce = (params->parallel_reduce_cb != NULL);
+  unsigned int i = worker->id;
+
+  while (!worker->error)
+  {
+    /* with the parallel reduction, every process must optimize the same
+       regions in the same order on each thread */
+    if (!reduce)
+    {
+      pthread_mutex_lock(&params->lock);
+      i = params->next_region++;
+      pthread_mutex_unlock(&params->lock);
+    }
+
+    if (i >= params->region_count)
+      break;
+
+    struct brlen_region * region = params->regions + i;
+    pll_unode_t * root = region->root;
+
+    brlen_newton_params(params, &newton_params, region->copy_ptrs,
+                        worker->precomp_buffers, 0);
+    newton_params.tree = root;
+    if (reduce)
+    {
+      newton_params.parallel_context   = worker;
+      newton_params.parallel_reduce_cb = brlen_batch_reduce_cb;
+    }
+
+    double loglikelihood = pllmod_opt_compute_edge_loglikelihood_multi(
+                                          newton_params.partitions,
+                                          newton_params.partition_count,
+                                          root->back->clv_index,
+                                          root->back->scaler_index,
+                                          root->clv_index,
+                                          root->scaler_index,
+                                          root->pmatrix_index,
+                                          newton_params.params_indices,
+                                          NULL,
+                                          newton_params.parallel_context,
+                                          newton_params.parallel_reduce_cb);
+
+    if (!recomp_iterative_multi(&newton_params,
+                                PLLMOD_OPT_BRLEN_OPTIMIZE_ALL,
+                                &loglikelihood,
+                                1))
+    {
+      worker->error = pll_errno;
+      strncpy(worker->errmsg, pll_errmsg, PLLMOD_ERRMSG_LEN - 1);
+      worker->errmsg[PLLMOD_ERRMSG_LEN - 1] = '\0';
+    }
+
+    i += params->batch.n_threads;
+  }
+
+  if (reduce)
+    brlen_batch_finish(worker);
+
+  return NULL;
+}
+
+/*
+ * Optimize the branches outside the regions. CLVs are moved along and
+ * restored as in recomp_iterative_multi.
+ */
+static int brlen_optimize_core(struct brlen_parallel_params * params,
+                               pll_newton_tree_params_multi_t * newton_params,
+                               pll_unode_t * node,
+                               int record,
+                               double * loglikelihood)
+{
+  pll_unode_t * q, * z;
+
+  if (find_region(params, node))
+    return PLL_SUCCESS;
+
+  if (record)
+  {
+    newton_params->tree = node;
+    if (!recomp_iterative_multi(newton_params, 0, loglikelihood, 1))
+      return PLL_FAILURE;
+  }
+
+  if (!node->next)
+    return PLL_SUCCESS;
+
+  q = node->next;
+  z = q->next;
+
+  update_partials_and_scalers(params->partitions, params->partition_count,
+                              q, node, z);
+  if (!brlen_optimize_core(params, newton_params, q->back, 1, loglikelihood))
+    return PLL_FAILURE;
+
+  update_partials_and_scalers(params->partitions, params->partition_count,
+                              z, q, node);
+  if (!brlen_optimize_core(params, newton_params, z->back, 1, loglikelihood))
+    return PLL_FAILURE;
+
+  update_partials_and_scalers(params->partitions, params->partition_count,
+                              node, z, q);
+
+  return PLL_SUCCESS;
+}
+
+static void destroy_precomp_buffers(double ** precomp_buffers,
+                                    size_t partition_count)
+{
+  size_t p;
+
+  if (!precomp_buffers)
+    return;
+
+  for (p = 0; p < partition_count; ++p)
+    if (precomp_buffers[p])
+      pll_aligned_free(precomp_buffers[p]);
+
+  free(precomp_buffers);
+}
+
+static double ** create_precomp_buffers(pll_partition_t ** partitions,
+                                        size_t partition_count)
+{
+  double ** precomp_buffers = (double **) calloc(partition_count,
+                                                 sizeof(double *));
+  size_t p;
+
+  if (!precomp_buffers)
+    return NULL;
+
+  for (p = 0; p < partition_count; ++p)
+  {
+    /* skip remote partitions */
+    if (!partitions[p])
+      continue;
+
+    precomp_buffers[p] = (double *) pll_aligned_alloc(
+                          partition_clv_size(partitions[p]) * sizeof(double),
+                          partitions[p]->alignment);
+    if (!precomp_buffers[p])
+    {
+      destroy_precomp_buffers(precomp_buffers, partition_count);
+      return NULL;
+    }
+  }
+
+  return precomp_buffers;
+}
+
+/**
+ * Optimize all branch lengths on a multiple partition, optimizing
+ * independent regions of the tree concurrently.
+ *
+ * The tree is decomposed into disjoint subtrees (regions) of bounded size
+ * and a core containing the remaining branches, including `tree`. In each
+ * smoothing, the CLVs pointing into every region are saved, the regions are
+ * optimized as in `pllmod_opt_optimize_branch_lengths_local_multi` by
+ * `n_threads` threads, and the core branches are then optimized in the
+ * calling thread. Each region sees the rest of the tree as it was at the
+ * beginning of the smoothing.
+ *
+ * If `parallel_reduce_cb` is set, each thread optimizes a fixed sequence of
+ * regions, and the values the threads reduce at the same time are reduced
+ * together with one call to `parallel_reduce_cb`, from whichever thread
+ * arrives last. All processes must use the same number of threads.
+ *
+ * Preconditions are the same as for
+ * `pllmod_opt_optimize_branch_lengths_local_multi`. On return, CLVs are
+ * updated towards `tree`.
+ *
+ * @param[in,out]  partitions    list of partitions
+ * @param  partition_count   number of partitions in `partitions`
+ * @param[in,out]  tree          the PLL unrooted tree structure
+ * @param  params_indices    the indices of the parameter sets
+ * @param  brlen_scalers     branch length scaler for each partition (can be NULL)
+ * @param  branch_length_min lower bound for branch lengths
+ * @param  branch_length_max upper bound for branch lengths
+ * @param  tolerance         tolerance for the log-likelihood improvement
+ * @param  smoothings        number of iterations over the branches
+ * @param  n_threads         number of threads
+ * @param  parallel_context      context for parallel computation
+ * @param  parallel_reduce_cb    callback function for parallel reduction
+ *
+ * @return                   the negative likelihood score after optimizing
+ *                           branch lengths, or PLL_FAILURE on error
+ */
+PLL_EXPORT double pllmod_opt_optimize_branch_lengths_parallel_multi (
+                                              pll_partition_t ** partitions,
+                                              size_t partition_count,
+                                              pll_unode_t * tree,
+                                              unsigned int ** params_indices,
+                                              double * brlen_scalers,
+                                              double branch_length_min,
+                                              double branch_length_max,
+                                              double tolerance,
+                                              int smoothings,
+                                              unsigned int n_threads,
+                                              void * parallel_context,
+                                              void (*parallel_reduce_cb)(void *,
+                                                                         double *,
+                                                                         size_t,
+                                                                         int))
+{
+  struct brlen_parallel_params params;
+  struct brlen_parallel_worker * workers = NULL;
+  pthread_t * threads = NULL;
+  int * started = NULL;
+  pll_newton_tree_params_multi_t newton_params;
+  double ** core_precomp_buffers = NULL;
+  double loglikelihood, new_loglikelihood;
+  unsigned int edge_count, i, t, iters;
+  unsigned int max_regions;
+  size_t p;
+  double result = (double) PLL_FAILURE;
+
+  pllmod_reset_error();
+
+  if (!n_threads)
+    n_threads = 1;
+
+  memset(&params, 0, sizeof(params));
+  params.partitions        = partitions;
+  params.partition_count   = partition_count;
+  params.tree              = tree;
+  params.params_indices    = params_indices;
+  params.brlen_scalers     = brlen_scalers;
+  params.branch_length_min = (branch_length_min>0)?
+                              branch_length_min:
+                              PLLMOD_OPT_MIN_BRANCH_LEN;
+  params.branch_length_max = (branch_length_max>0)?
+                              branch_length_max:
+                              PLLMOD_OPT_MAX_BRANCH_LEN;
+  params.tolerance         = (branch_length_min>0)?
+                              branch_length_min/10.0:
+                              PLLMOD_OPT_TOL_BRANCH_LEN;
+  params.parallel_context   = parallel_context;
+  params.parallel_reduce_cb = parallel_reduce_cb;
+  params.batch.n_threads    = n_threads;
+  pthread_mutex_init(&params.lock, NULL);
+  pthread_mutex_init(&params.batch.lock, NULL);
+  pthread_cond_init(&params.batch.cond, NULL);
+
+  /* the eigen decompositions are shared by all threads */
+  for (p = 0; p < partition_count; ++p)
+  {
+    pll_partition_t * partition = partitions[p];
+
+    /* skip remote partitions */
+    if (!partition)
+      continue;
+
+    for (i = 0; i < partition->rate_cats; ++i)
+    {
+      if (!partition->eigen_decomp_valid[params_indices[p][i]])
+        pll_update_eigen(partition, params_indices[p][i]);
+    }
+  }
+
+  /* decompose the tree */
+  edge_count = 1 + count_subtree_edges(tree) + count_subtree_edges(tree->back);
+  max_regions = edge_count / BRLEN_REGION_MIN_EDGES + 4;
+  params.region_max_edges = edge_count / (n_threads * BRLEN_REGIONS_PER_THREAD);
+  if (params.region_max_edges < BRLEN_REGION_MIN_EDGES)
+    params.region_max_edges = BRLEN_REGION_MIN_EDGES;
+
+  params.regions = (struct brlen_region *) calloc(max_regions,
+                                                  sizeof(struct brlen_region));
+  if (!params.regions)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for bl opt variables");
+    goto cleanup;
+  }
+
+  brlen_select_regions(&params, tree, 1);
+  brlen_select_regions(&params, tree->back, 1);
+  assert(params.region_count <= max_regions);
+
+  for (i = 0; i < params.region_count; ++i)
+  {
+    if (!brlen_create_region_copies(&params, params.regions + i))
+    {
+      pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                       "Cannot allocate memory for bl opt variables");
+      goto cleanup;
+    }
+  }
+
+  workers = (struct brlen_parallel_worker *) calloc(n_threads,
+                                        sizeof(struct brlen_parallel_worker));
+  threads = (pthread_t *) calloc(n_threads, sizeof(pthread_t));
+  started = (int *) calloc(n_threads, sizeof(int));
+  params.batch.data = (double **) calloc(n_threads, sizeof(double *));
+  params.batch.size = (size_t *) calloc(n_threads, sizeof(size_t));
+  params.batch.op = (int *) calloc(n_threads, sizeof(int));
+  params.batch.buffer = (double *) malloc((size_t) n_threads *
+                                          BRLEN_BATCH_SLOT_SIZE *
+                                          sizeof(double));
+  core_precomp_buffers = create_precomp_buffers(partitions, partition_count);
+  if (!workers || !threads || !started || !params.batch.data ||
+      !params.batch.size || !params.batch.op || !params.batch.buffer ||
+      !core_precomp_buffers)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for bl opt variables");
+    goto cleanup;
+  }
+
+  for (t = 0; t < n_threads; ++t)
+  {
+    workers[t].params = &params;
+    workers[t].id     = t;
+    workers[t].precomp_buffers = create_precomp_buffers(partitions,
+                                                        partition_count);
+    if (!workers[t].precomp_buffers)
+    {
+      pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                       "Cannot allocate memory for bl opt variables");
+      goto cleanup;
+    }
+  }
+
+  brlen_newton_params(&params, &newton_params, partitions,
+                      core_precomp_buffers, 1);
+
+  /* get the initial likelihood score */
+  loglikelihood = pllmod_opt_compute_edge_loglikelihood_multi (
+                                                      partitions,
+                                                      partition_count,
+                                                      tree->back->clv_index,
+                                                      tree->back->scaler_index,
+                                                      tree->clv_index,
+                                                      tree->scaler_index,
+                                                      tree->pmatrix_index,
+                                                      params_indices,
+                                                      NULL,
+                                                      parallel_context,
+                                                      parallel_reduce_cb);
+
+  iters = (unsigned int) smoothings;
+  while (iters)
+  {
+    /* optimize the regions */
+    brlen_save_region_clvs(&params, tree);
+    brlen_save_region_clvs(&params, tree->back);
+
+    params.next_region = 0;
+    params.batch.finished = 0;
+    for (t = 1; t < n_threads; ++t)
+      started[t] = !pthread_create(&threads[t], NULL,
+                                   brlen_parallel_worker_run, workers + t);
+
+    /* threads that could not be created take no part in the batches, and
+       this thread optimizes their regions afterwards */
+    for (t = 1; t < n_threads; ++t)
+      if (!started[t] && parallel_reduce_cb)
+        brlen_batch_finish(workers + t);
+
+    brlen_parallel_worker_run(workers);
+
+    for (t = 1; t < n_threads; ++t)
+    {
+      if (started[t])
+        pthread_join(threads[t], NULL);
+    }
+
+    for (t = 1; t < n_threads; ++t)
+    {
+      if (!started[t])
+      {
+        if (parallel_reduce_cb)
+          params.batch.finished--;
+        brlen_parallel_worker_run(workers + t);
+      }
+      started[t] = 0;
+    }
+
+    for (t = 0; t < n_threads; ++t)
+    {
+      if (workers[t].error)
+      {
+        pllmod_set_error(workers[t].error, "%s", workers[t].errmsg);
+        goto cleanup;
+      }
+    }
+
+    /* optimize the core */
+    brlen_update_core_clvs(&params, tree);
+    brlen_update_core_clvs(&params, tree->back);
+
+    new_loglikelihood = pllmod_opt_compute_edge_loglikelihood_multi (
+                                                      partitions,
+                                                      partition_count,
+                                                      tree->back->clv_index,
+                                                      tree->back->scaler_index,
+                                                      tree->clv_index,
+                                                      tree->scaler_index,
+                                                      tree->pmatrix_index,
+                                                      params_indices,
+                                                      NULL,
+                                                      parallel_context,
+                                                      parallel_reduce_cb);
+
+    if (!brlen_optimize_core(&params, &newton_params, tree, 1,
+                             &new_loglikelihood) ||
+        !brlen_optimize_core(&params, &newton_params, tree->back, 0,
+                             &new_loglikelihood))
+      goto cleanup;
+
+    /* compute likelihood after optimization */
+    new_loglikelihood = pllmod_opt_compute_edge_loglikelihood_multi (
+                                                      partitions,
+                                                      partition_count,
+                                                      tree->back->clv_index,
+                                                      tree->back->scaler_index,
+                                                      tree->clv_index,
+                                                      tree->scaler_index,
+                                                      tree->pmatrix_index,
+                                                      params_indices,
+                                                      NULL,
+                                                      parallel_context,
+                                                      parallel_reduce_cb);
+
+    DBG("BLO_parallel: iteration %u, old LH: %.9f, new LH: %.9f\n",
+        (unsigned int) smoothings - iters, loglikelihood, new_loglikelihood);
+
+    iters --;
+
+    /* check convergence */
+    if (fabs (new_loglikelihood - loglikelihood) < tolerance) iters = 0;
+
+    loglikelihood = new_loglikelihood;
+  }
+
+  result = -1*loglikelihood;
+
+cleanup:
+  if (workers)
+  {
+    for (t = 0; t < n_threads; ++t)
+      destroy_precomp_buffers(workers[t].precomp_buffers, partition_count);
+    free(workers);
+  }
+  if (threads)
+    free(threads);
+  if (started)
+    free(started);
+  if (params.batch.data)
+    free(params.batch.data);
+  if (params.batch.size)
+    free(params.batch.size);
+  if (params.batch.op)
+    free(params.batch.op);
+  if (params.batch.buffer)
+    free(params.batch.buffer);
+  destroy_precomp_buffers(core_precomp_buffers, partition_count);
+  if (params.regions)
+    brlen_destroy_regions(&params);
+  pthread_mutex_destroy(&params.lock);
+  pthread_mutex_destroy(&params.batch.lock);
+  pthread_cond_destroy(&params.batch.cond);
+
+  return result;
+} /* pllmod_opt_optimize_branch_lengths_parallel_multi */
@@ -24,6 +24,8 @@
 #ifndef PLL_H_
 #define PLL_H_
 #include "pll.h"
+
+#include <stdint.h>
 #endif
 
 /* Parameters mask */
@@ -137,6 +139,22 @@ typedef struct
   double * sumtable;
 } pll_optimize_options_t;
 
+/* Sumtable cache for the branch length optimization. Buffers and epochs are
+ * owned by the caller and kept across calls: every directed node (by node
+ * index) and every P-matrix has an epoch that changes when its CLV or
+ * P-matrix changes, and a cached sumtable is reused while the epochs of the
+ * CLVs at both ends of its branch are unchanged. */
+typedef struct pllmod_sumtable_cache
+{
+  double ** buffers;         /* per partition: slots x sumtable size */
+  unsigned int slots;
+  uint64_t * tags;           /* per slot: P-matrix index + 1, 2 CLV epochs */
+  uint64_t * clv_epoch;      /* per directed node */
+  uint64_t * clv_inputs;     /* per directed node: 4 input epochs */
+  uint64_t * pmatrix_epoch;  /* per P-matrix */
+  uint64_t * epoch;          /* last epoch handed out */
+} pllmod_sumtable_cache_t;
+
 /* Custom parameters structure provided by PLL for the
  * high level optimization functions (Newton-Raphson). */
  typedef struct
@@ -166,6 +184,10 @@ typedef struct
                              double *,
                              size_t,
                              int);
+  pllmod_sumtable_cache_t * sumtable_cache; /* NULL if not used */
+  double ** sumtable_slots;                 /* per partition: current slot,
+                                               NULL if sumtables are not
+                                               cached */
 } pll_newton_tree_params_multi_t;
 
 /******************************************************************************/
@@ -195,6 +217,19 @@ PLL_EXPORT double pllmod_opt_minimize_lbfgsb(double *x,
                                                     void *,
                                                     double *));
 
+PLL_EXPORT double pllmod_opt_minimize_lbfgsb_mt(double *x,
+                                                double *xmin,
+                                                double *xmax,
+                                                int *bound,
+                                                unsigned int n,
+                                                double factr,
+                                                double pgtol,
+                                                void **params,
+                                                unsigned int n_threads,
+                                                double (*target_funk)(
+                                                        void *,
+                                                        double *));
+
 /* core Brent optimization function */
 PLL_EXPORT double pllmod_opt_minimize_brent(double xmin,
                                            double xguess,
@@ -218,6 +253,23 @@ PLL_EXPORT void pllmod_opt_minimize_em(double *w,
                                            void *,
                                            double *));
 
+PLL_EXPORT int pllmod_opt_minimize_em_multi(unsigned int xnum,
+                                            double ** w,
+                                            const unsigned int * w_count,
+                                            const double * const * sitecat_lh,
+                                            const unsigned int * const * site_w,
+                                            const unsigned int * l,
+                                            double min_ratio,
+                                            double tolerance,
+                                            unsigned int max_steps,
+                                            unsigned int n_threads,
+                                            void * parallel_context,
+                                            void (*parallel_reduce_cb)(void *,
+                                                                       double *,
+                                                                       size_t,
+                                                                       int),
+                                            double * loglh);
+
 /******************************************************************************/
 
 /* functions in pll_optimize.c */
@@ -275,6 +327,60 @@ PLL_EXPORT double pllmod_opt_optimize_branch_lengths_local_multi (
                                                                          size_t,
                                                                          int));
 
+PLL_EXPORT double pllmod_opt_optimize_branch_lengths_local_multi_cached (
+                                              pll_partition_t ** partitions,
+                                              size_t partition_count,
+                                              pll_unode_t * tree,
+                                              unsigned int ** params_indices,
+                                              double ** sumtable_buffers,
+                                              double * brlen_scalers,
+                                              double branch_length_min,
+                                              double branch_length_max,
+                                              double tolerance,
+                                              int smoothings,
+                                              int radius,
+                                              int keep_update,
+                                              pllmod_sumtable_cache_t * sumtable_cache,
+                                              void * parallel_context,
+                                              void (*parallel_reduce_cb)(void *,
+                                                                         double *,
+                                                                         size_t,
+                                                                         int));
+
+PLL_EXPORT double pllmod_opt_optimize_branch_lengths_all_multi (
+                                              pll_partition_t ** partitions,
+                                              size_t partition_count,
+                                              pll_unode_t * tree,
+                                              unsigned int ** params_indices,
+                                              double ** precomp_buffers,
+                                              double * brlen_scalers,
+                                              double branch_length_min,
+                                              double branch_length_max,
+                                              double tolerance,
+                                              int max_iters,
+                                              void * parallel_context,
+                                              void (*parallel_reduce_cb)(void *,
+                                                                         double *,
+                                                                         size_t,
+                                                                         int));
+
+PLL_EXPORT double pllmod_opt_optimize_branch_lengths_parallel_multi (
+                                              pll_partition_t ** partitions,
+                                              size_t partition_count,
+                                              pll_unode_t * tree,
+                                              unsigned int ** params_indices,
+                                              double * brlen_scalers,
+                                              double branch_length_min,
+                                              double branch_length_max,
+                                              double tolerance,
+                                              int smoothings,
+                                              unsigned int n_threads,
+                                              void * parallel_context,
+                                              void (*parallel_reduce_cb)(void *,
+                                                                         double *,
+                                                                         size_t,
+                                                                         int));
+
 PLL_EXPORT int pllmod_opt_minimize_brent_multi(int xnum,
                                                double * xmin,
                                                double * xguess,
@@ -291,6 +397,22 @@ PLL_EXPORT int pllmod_opt_minimize_brent_multi(int xnum,
                                                       int *),
                                                int global_range);
 
+PLL_EXPORT int pllmod_opt_minimize_brent_batch(int xnum,
+                                               const double * xmin,
+                                               double * xguess,
+                                               const double * xmax,
+                                               double xtol,
+                                               double * xopt,
+                                               double * fx,
+                                               unsigned int * eval_counts,
+                                               void * params,
+                                               double (*target_funk)(
+                                                       void *,
+                                                      double *,
+                                                      double *,
+                                                      int *),
+                                               int global_range);
+
 PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi(unsigned int xnum,
                                                    double ** x,
                                                    double ** xmin,
@@ -306,6 +428,56 @@ PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi(unsigned int xnum,
                                                                          double *,
                                                                          int *));
 
+PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi_grad(unsigned int xnum,
+                                                   double ** x,
+                                                   double ** xmin,
+                                                   double ** xmax,
+                                                   int ** bound,
+                                                   unsigned int * n,
+                                                   unsigned int nmax,
+                                                   double factr,
+                                                   double pgtol,
+                                                   void * params,
+                                                   double (*target_funk)(void *,
+                                                                         double **,
+                                                                         double *,
+                                                                         int *),
+                                                   int (*grad_funk)(void *,
+                                                                    double **,
+                                                                    double **,
+                                                                    int *));
+
+PLL_EXPORT double pllmod_opt_minimize_lbfgsb_multi_mt(unsigned int xnum,
+                                                   double ** x,
+                                                   double ** xmin,
+                                                   double ** xmax,
+                                                   int ** bound,
+                                                   unsigned int * n,
+                                                   unsigned int nmax,
+                                                   double factr,
+                                                   double pgtol,
+                                                   void ** params,
+                                                   unsigned int n_threads,
+                                                   double (*target_funk)(void *,
+                                                                         double **,
+                                                                         double *,
+                                                                         int *));
+
+/* functions in opt_gradient.c */
+PLL_EXPORT int pllmod_opt_compute_model_gradient(pll_partition_t * partition,
+                                          pll_unode_t * root,
+                                          const unsigned int * params_indices,
+                                          unsigned int params_index,
+                                          double brlen_scaler,
+                                          double * subst_grad,
+                                          double * freqs_grad);
+
+PLL_EXPORT int pllmod_opt_compute_edge_sitecat_lk(pll_partition_t * partition,
+                                          const pll_unode_t * edge,
+                                          const unsigned int * params_indices,
+                                          double * sitecat_lh,
+                                          double * site_logscale);
+
 
 
 #endif /* PLL_OPTIMIZE_H_ */
@@ -5,11 +5,44 @@
 
 #define EPSILON 1e-12
 
+/* child of a cluster in the tree built from a split system */
+typedef struct split_child_s
+{
+  unsigned int node;
+  unsigned int group;             /* linked after its parent, or before */
+  unsigned int level;             /* earlier ancestors it moved through */
+  unsigned int time;              /* position in the split system */
+} split_child_t;
+
+/* cluster tree built from a split system */
+typedef struct split_tree_s
+{
+  unsigned int * time;
+  unsigned int * child_start;     /* children of node i are child_list */
+  unsigned int * child_list;      /* [child_start[i]..child_start[i+1]) */
+  split_child_t * order;
+  unsigned int * stack;
+} split_tree_t;
+
+/* node of the cluster tree used for building the MRE consensus */
+typedef struct mre_node_s
+{
+  struct mre_node_s * parent;
+  struct mre_node_s * child;      /* first child */
+  struct mre_node_s * prev;       /* siblings */
+  struct mre_node_s * next;
+  unsigned int size;              /* number of taxa in the cluster */
+  unsigned int count;             /* taxa of the candidate split covered */
+} mre_node_t;
+
+/* candidate split of the MRE consensus */
+typedef struct mre_candidate_s
+{
+  const bitv_hash_entry_t * entry;
+  unsigned int split_len;
+} mre_candidate_t;
+
 static int cb_set_indices(pll_unode_t * node, void *data);
-static pll_split_t * read_splits(FILE * file,
-                                 int * n_chunks,
-                                 unsigned int * tip_count,
-                                 string_hashtable_t * string_hashtable);
 static pll_utree_t * read_tree(FILE * file,
                               int * n_chunks,
                               unsigned int * tip_count,
@@ -19,26 +52,31 @@ static FILE *get_number_of_trees(unsigned int *tree_count,
 static int sort_by_weight(const void *a, const void *b);
 static void mre(bitv_hashtable_t *h,
                 pll_split_system_t *consensus,
+                unsigned int tip_count,
                 unsigned int split_len,
                 unsigned int max_splits);
+static mre_node_t * mre_tree_create(unsigned int taxa_count,
+                                    unsigned int max_splits);
+static int mre_tree_add(mre_node_t * nodes,
+                        unsigned int * node_count,
+                        mre_node_t ** queue,
+                        const pll_split_t split,
+                        unsigned int split_len);
 static void reverse_split(pll_split_t split, unsigned int tip_count);
 static int is_subsplit(pll_split_t child,
                        pll_split_t parent,
                        unsigned int split_len);
 static unsigned int setbit_count(pll_split_t split,
                                  unsigned int split_len);
-static pll_unode_t * find_splitnode_recurse(pll_split_t split,
-                                            pll_unode_t * root,
-                                            unsigned int split_len);
 static int get_split_id(pll_split_t split,
                         unsigned int split_len);
 static pll_unode_t * create_consensus_node(pll_unode_t * parent,
                                            pll_split_t split,
                                            double support,
                                            unsigned int split_len);
-static pll_unode_t * find_splitnode_recurse(pll_split_t split,
-                                            pll_unode_t * root,
-                                            unsigned int split_len);
+static pll_unode_t * build_split_tree(const pll_split_system_t * split_system,
+                                     unsigned int tip_count,
+                                     unsigned int split_len);
 static pll_split_t clone_split(const pll_split_t from,
                                unsigned int split_len);
 static void recursive_assign_indices(pll_unode_t * node,
@@ -98,16 +136,13 @@ PLL_EXPORT pll_consensus_utree_t * pllmod_utree_from_splits(
                                       unsigned int tip_count,
                                       char * const * tip_labels)
 {
-  const pll_split_t * splits = split_system->splits;
   unsigned int split_size = sizeof(pll_split_base_t) * 8;
   unsigned int split_offset = tip_count % split_size;
   unsigned int split_len  = tip_count / split_size + (split_offset>0);
   unsigned int i;
-  pll_unode_t * tree, * next_parent;
+  pll_unode_t * tree;
   pll_consensus_utree_t * return_tree;
   pll_split_t rootsplit1, rootsplit2, next_split;
-  double * support_values;
-  pll_split_t * all_splits;
 
   return_tree = (pll_consensus_utree_t *) malloc (sizeof(pll_consensus_utree_t));
   return_tree->tip_count = tip_count;
@@ -144,85 +179,15 @@ PLL_EXPORT pll_consensus_utree_t * pllmod_utree_from_splits(
   }
   else
   {
-    all_splits = (pll_split_t *) malloc((split_system->split_count + tip_count) *
-                                                      sizeof(pll_split_t));
-    support_values = (double *) malloc((split_system->split_count + tip_count) *
-                                                      sizeof(double));
-    memcpy(all_splits, splits, split_system->split_count * sizeof(pll_split_t));
-
-    /* fill trivial splits */
-    for (i=0; i<tip_count; ++i)
+    tree = build_split_tree(split_system, tip_count, split_len);
+    if (!tree)
     {
-      support_values[split_system->split_count+i] = 1.0;
-      all_splits[split_system->split_count+i] = (pll_split_t) calloc(split_len,
-                                                 sizeof(pll_split_base_t));
-      {
-        unsigned int split_id   = i / split_size;
-        all_splits[split_system->split_count+i][split_id] = (1 << (i % split_size));
-      }
+      free(return_tree->branch_data);
+      free(return_tree);
+      return NULL;
     }
 
-    /* compute support for other splits */
-    if (split_system->support)
-      for (i=0; i<split_system->split_count; ++i)
-        support_values[i] = 1.0 * split_system->support[i] / split_system->max_support;
-    else
-      for (i=0; i<split_system->split_count; ++i)
-        support_values[i] = 1.0 * split_system->max_support;
-
-    /* create initial tree with 2 connected nodes of degree 1 */
-    rootsplit1 = clone_split(all_splits[0], split_len);
-    rootsplit2 = clone_split(all_splits[0], split_len);
-    reverse_split(rootsplit2, tip_count);
-
-    /* build tree out of the first split */
-    tree = create_consensus_node(NULL, rootsplit1, support_values[0], split_len);
-    tree->back = create_consensus_node(NULL, rootsplit2, support_values[0], split_len);
-    tree->back->back = tree;
-
     return_tree->tree = tree;
-
-    /* add splits individually */
-    for (i=1; i<(split_system->split_count+tip_count); ++i)
-    {
-      next_split = clone_split(all_splits[i], split_len);
-
-      /* select branch */
-      if (is_subsplit(next_split, rootsplit1, split_len))
-        next_parent = tree;
-      else if (is_subsplit(next_split, rootsplit2, split_len))
-        next_parent = tree->back;
-      else
-      {
-        reverse_split(next_split, tip_count);
-        if (is_subsplit(next_split, rootsplit1, split_len))
-          next_parent = tree;
-        else if (is_subsplit(next_split, rootsplit2, split_len))
-          next_parent = tree->back;
-        else
-        {
-          pllmod_set_error(PLLMOD_TREE_ERROR_INVALID_SPLIT,
-                           "Splits are incompatible");
-          free(return_tree);
-          return_tree = NULL;
-          break;
-        }
-      }
-
-      /* select node */
-      next_parent = find_splitnode_recurse(next_split, next_parent, split_len);
-      assert(next_parent);
-
-      /* create new node for the split*/
-      create_consensus_node(next_parent, next_split, support_values[i], split_len);
-    }
-
-    /* clean */
-    for (i=0; i<tip_count; ++i)
-      free(all_splits[split_system->split_count+i]);
-    free(all_splits);
-    free(support_values);
-    free(rootsplit1);
   }
 
   build_tips_recurse(tree, tip_labels, split_len);
@@ -262,9 +227,8 @@ PLL_EXPORT pll_split_system_t * pllmod_utree_split_consensus(
 
   for (i=0; i<splits_hash->table_size; ++i)
   {
-    bitv_hash_entry_t * e =  splits_hash->table[i];
-    bitv_hash_entry_t ** e_ptr = &(splits_hash->table[i]);
-    while (e != NULL)
+    bitv_hash_entry_t * e = hash_entry_at(splits_hash, i);
+    if (e != NULL)
     {
       int delete_split = e->support < min_support || e->support >= thr_support;
       if (e->support >= thr_support)
@@ -278,14 +242,7 @@ PLL_EXPORT pll_split_system_t * pllmod_utree_split_consensus(
       if (delete_split)
       {
         /* remove entry */
-        hash_remove(splits_hash, e_ptr, e);
-
-        e = *e_ptr;
-      }
-      else
-      {
-        e_ptr = &(e->next);
-        e = e->next;
+        hash_remove(splits_hash, i);
       }
     }
   }
@@ -294,6 +251,7 @@ PLL_EXPORT pll_split_system_t * pllmod_utree_split_consensus(
   {
     mre(splits_hash,
         split_system,
+        tip_count,
         split_len,
         max_splits);
   }
@@ -302,6 +260,346 @@ PLL_EXPORT pll_split_system_t * pllmod_utree_split_consensus(
   return split_system;
 }
 
+/**
+ * Create a builder for computing a weighted consensus tree incrementally
+ *
+ * Trees and split sets are added one by one with their weights, and only
+ * the support of the distinct splits is kept. Supports are normalized by
+ * the total weight when the consensus tree is built.
+ *
+ * @param  tip_count        number of tips
+ * @param  tip_labels       labels of the tips, indexed by tip index. Can be
+ *                          NULL if the trees are not added in NEWICK format
+ * @return                  consensus builder, or NULL on error
+ */
+PLL_EXPORT pll_consensus_builder_t * pllmod_utree_consensus_builder_create(
+                                                unsigned int tip_count,
+                                                char * const * tip_labels)
+{
+  pll_consensus_builder_t * builder;
+  unsigned int i;
+
+  if (tip_count < 4)
+  {
+    pllmod_set_error(PLLMOD_TREE_ERROR_INVALID_TREE_SIZE,
+                     "Consensus needs at least 4 tips");
+    return NULL;
+  }
+
+  builder = (pll_consensus_builder_t *) calloc(1,
+                                              sizeof(pll_consensus_builder_t));
+  if (!builder)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for consensus builder");
+    return NULL;
+  }
+
+  builder->tip_count = tip_count;
+  builder->split_len = bitv_length(tip_count);
+  builder->splits_hash = hash_init(tip_count * 10, tip_count);
+  builder->split_buffer = (pll_split_t) malloc(builder->split_len *
+                                               sizeof(pll_split_base_t));
+
+  if (tip_labels)
+  {
+    builder->names_hash = string_hash_init(10 * tip_count, tip_count);
+    for (i=0; i<tip_count; ++i)
+    {
+      if (!string_hash_insert(tip_labels[i], builder->names_hash, (int) i))
+      {
+        pllmod_set_error(PLLMOD_TREE_ERROR_INVALID_TREE,
+                         "Repeated tip label (%s)", tip_labels[i]);
+        pllmod_utree_consensus_builder_destroy(builder);
+        return NULL;
+      }
+    }
+  }
+
+  if (!builder->splits_hash || !builder->split_buffer)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for consensus builder");
+    pllmod_utree_consensus_builder_destroy(builder);
+    return NULL;
+  }
+
+  return builder;
+}
+
+static int builder_check_weight(const pll_consensus_builder_t * builder,
+                                double weight)
+{
+  if (!builder->splits_hash)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Consensus tree has already been built");
+    return PLL_FAILURE;
+  }
+
+  if (!(weight >= 0))
+  {
+    pllmod_set_error(PLLMOD_TREE_ERROR_INVALID_TREE,
+                     "Invalid tree weight (%f)", weight);
+    return PLL_FAILURE;
+  }
+
+  return PLL_SUCCESS;
+}
+
+/* adds the support of a set of normalized splits */
+static int builder_insert(pll_consensus_builder_t * builder,
+                          pll_split_t * splits,
+                          unsigned int split_count,
+                          double weight)
+{
+  unsigned int i;
+
+  for (i=0; i<split_count; ++i)
+  {
+    if (!hash_insert(splits[i], builder->splits_hash, i, weight))
+      return PLL_FAILURE;
+  }
+
+  builder->total_weight += weight;
+  builder->tree_count++;
+
+  return PLL_SUCCESS;
+}
+
+/**
+ * Add the splits of a tree to a consensus builder
+ *
+ * The tree is not referenced after the call, so it can be destroyed right
+ * away. Tips must be indexed as given to
+ * `pllmod_utree_consensus_builder_create`.
+ *
+ * @param  builder          consensus builder
+ * @param  tree             unrooted tree
+ * @param  weight           weight of the tree
+ * @return                  PLL_SUCCESS or PLL_FAILURE
+ */
+PLL_EXPORT int pllmod_utree_consensus_builder_add_tree(
+                                            pll_consensus_builder_t * builder,
+                                            const pll_utree_t * tree,
+                                            double weight)
+{
+  pll_split_t * tree_splits;
+  unsigned int i, n_splits;
+  int retval;
+
+  if (!builder_check_weight(builder, weight))
+    return PLL_FAILURE;
+
+  if (tree->tip_count != builder->tip_count)
+  {
+    pllmod_set_error(PLLMOD_TREE_ERROR_INVALID_TREE_SIZE,
+                     "Tree has %u tips instead of %u",
+                     tree->tip_count, builder->tip_count);
+    return PLL_FAILURE;
+  }
+
+  n_splits = builder->tip_count - 3;
+  tree_splits = pllmod_utree_split_create(tree->nodes[tree->tip_count +
+                                                      tree->inner_count - 1],
+                                          builder->tip_count,
+                                          NULL);
+  if (!tree_splits)
+    return PLL_FAILURE;
+
+  for (i=0; i<n_splits; ++i)
+    bitv_normalize(tree_splits[i], builder->tip_count);
+
+  retval = builder_insert(builder, tree_splits, n_splits, weight);
+  pllmod_utree_split_destroy(tree_splits);
+
+  return retval;
+}
+
+/**
+ * Add the splits of a tree in NEWICK format to a consensus builder
+ *
+ * The splits are read directly from the string, without building the tree.
+ * The builder must have been created with tip labels.
+ *
+ * @param  builder          consensus builder
+ * @param  newick           unrooted binary tree in NEWICK format
+ * @param  weight           weight of the tree
+ * @return                  PLL_SUCCESS or PLL_FAILURE
+ */
+PLL_EXPORT int pllmod_utree_consensus_builder_add_newick(
+                                            pll_consensus_builder_t * builder,
+                                            const char * newick,
+                                            double weight)
+{
+  pll_split_t * tree_splits;
+  int retval;
+
+  if (!builder_check_weight(builder, weight))
+    return PLL_FAILURE;
+
+  if (!builder->names_hash)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Consensus builder has no tip labels");
+    return PLL_FAILURE;
+  }
+
+  tree_splits = pllmod_utree_split_newick_parse(newick,
+                                                builder->tip_count,
+                                                builder->names_hash);
+  if (!tree_splits)
+    return PLL_FAILURE;
+
+  retval = builder_insert(builder,
+                          tree_splits,
+                          builder->tip_count - 3,
+                          weight);
+  pllmod_utree_split_destroy(tree_splits);
+
+  return retval;
+}
+
+/**
+ * Add a set of splits to a consensus builder
+ *
+ * The splits are counted as one tree with the given weight. They need not
+ * be normalized, and they are not modified.
+ *
+ * @param  builder          consensus builder
+ * @param  splits           non-trivial splits of a tree
+ * @param  split_count      number of splits, at most `tip_count - 3`
+ * @param  weight           weight of the tree
+ * @return                  PLL_SUCCESS or PLL_FAILURE
+ */
+PLL_EXPORT int pllmod_utree_consensus_builder_add_splits(
+                                            pll_consensus_builder_t * builder,
+                                            const pll_split_t * splits,
+                                            unsigned int split_count,
+                                            double weight)
+{
+  unsigned int i;
+
+  if (!builder_check_weight(builder, weight))
+    return PLL_FAILURE;
+
+  if (split_count > builder->tip_count - 3)
+  {
+    pllmod_set_error(PLLMOD_TREE_ERROR_INVALID_SPLIT,
+                     "Too many splits (%u)", split_count);
+    return PLL_FAILURE;
+  }
+
+  for (i=0; i<split_count; ++i)
+  {
+    memcpy(builder->split_buffer, splits[i],
+           builder->split_len * sizeof(pll_split_base_t));
+    bitv_normalize(builder->split_buffer, builder->tip_count);
+
+    if (!hash_insert(builder->split_buffer, builder->splits_hash, i, weight))
+      return PLL_FAILURE;
+  }
+
+  builder->total_weight += weight;
+  builder->tree_count++;
+
+  return PLL_SUCCESS;
+}
+
+/**
+ * Build the consensus tree from the splits added to a builder
+ *
+ * The split supports are released, so no more trees can be added afterwards.
+ * The builder must still be destroyed with
+ * `pllmod_utree_consensus_builder_destroy`.
+ *
+ * @param  builder          consensus builder
+ * @param  threshold        consensus threshold in [0,1].
+ *                          1.0 -> strict
+ *                          0.5 -> majority rule
+ *                          0.0 -> extended majority rule
+ * @return                  consensus unrooted tree structure
+ */
+PLL_EXPORT pll_consensus_utree_t * pllmod_utree_consensus_builder_finalize(
+                                            pll_consensus_builder_t * builder,
+                                            double threshold)
+{
+  pll_consensus_utree_t * consensus_tree;
+  pll_split_system_t * split_system;
+  unsigned int i;
+
+  /* validate threshold */
+  if (threshold > 1 || threshold < 0)
+  {
+    pllmod_set_error(
+      PLLMOD_TREE_ERROR_INVALID_THRESHOLD,
+      "Invalid consensus threshold (%f). Should be in range [0.0,1.0]",
+      threshold);
+    return NULL;
+  }
+
+  if (!builder_check_weight(builder, 0))
+    return NULL;
+
+  if (!(builder->total_weight > 0))
+  {
+    pllmod_set_error(PLLMOD_TREE_ERROR_INVALID_TREE,
+                     "Invalid tree weights");
+    return NULL;
+  }
+
+  /* normalize supports */
+  if (builder->total_weight != 1.0)
+  {
+    for (i=0; i<builder->splits_hash->table_size; ++i)
+    {
+      bitv_hash_entry_t * e = hash_entry_at(builder->splits_hash, i);
+      if (e != NULL)
+        e->support /= builder->total_weight;
+    }
+  }
+
+  /* build final split system, releasing the hashtable */
+  split_system = pllmod_utree_split_consensus(builder->splits_hash,
+                                              builder->tip_count,
+                                              threshold,
+                                              builder->split_len);
+  builder->splits_hash = NULL;
+
+  /* buld tree from splits */
+  consensus_tree = pllmod_utree_from_splits(split_system,
+                                      builder->tip_count,
+                                      builder->names_hash ?
+                                        builder->names_hash->labels : NULL);
+
+  for (i=0; i<split_system->split_count; ++i)
+    free(split_system->splits[i]);
+  free(split_system->splits);
+  free(split_system->support);
+  free(split_system);
+
+  return consensus_tree;
+}
+
+/**
+ * Destroy a consensus builder
+ *
+ * @param  builder          consensus builder
+ */
+PLL_EXPORT void pllmod_utree_consensus_builder_destroy(
+                                            pll_consensus_builder_t * builder)
+{
+  if (!builder)
+    return;
+
+  if (builder->splits_hash)
+    hash_destroy(builder->splits_hash);
+  if (builder->names_hash)
+    string_hash_destroy(builder->names_hash);
+  free(builder->split_buffer);
+  free(builder);
+}
+
 /**
  * Build a consensus tree out of a list of trees and weights
  *
@@ -323,16 +621,11 @@ PLL_EXPORT pll_consensus_utree_t * pllmod_utree_weight_consensus(
 
   const pll_utree_t * reference_tree = trees[0]; /* reference tree for consistency */
   pll_consensus_utree_t * consensus_tree = NULL;     /* final consensus tree */
+  pll_consensus_builder_t * builder;
   pll_unode_t ** tipnodes;                 /* tips from reference tree */
-  bitv_hashtable_t * splits_hash = NULL;
-  string_hashtable_t * string_hashtable = NULL;
-  pll_split_t * tree_splits;
-  unsigned int i, j,
-               tip_count = reference_tree->tip_count,
-               n_splits,
-               split_size = sizeof(pll_split_base_t) * 8,
-               split_offset,
-               split_len;
+  char ** tip_labels;
+  unsigned int i,
+               tip_count = reference_tree->tip_count;
 
   /* validate threshold */
   if (threshold > 1 || threshold < 0)
@@ -367,86 +660,43 @@ PLL_EXPORT pll_consensus_utree_t * pllmod_utree_weight_consensus(
   /* store taxa names */
   tipnodes = reference_tree->nodes;
 
-  string_hashtable = string_hash_init(10 * tip_count, tip_count);
-
-  for (i=0; i<tip_count; ++i)
+  tip_labels = (char **) malloc(tip_count * sizeof(char *));
+  if (!tip_labels)
   {
-    string_hash_insert(tipnodes[i]->label,
-                       string_hashtable,
-                       (int) tipnodes[i]->node_index);
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for tip labels");
+    return NULL;
   }
+  for (i=0; i<tip_count; ++i)
+    tip_labels[tipnodes[i]->node_index] = tipnodes[i]->label;
 
-  split_offset = tip_count % split_size;
-  split_len  = tip_count / split_size + (split_offset>0);
-
-  /* create hashtable */
-  splits_hash = hash_init(tip_count * 10, tip_count);
+  builder = pllmod_utree_consensus_builder_create(tip_count, tip_labels);
+  free(tip_labels);
 
-  pll_errno = 0;
+  if (!builder)
+    return NULL;
 
   for (i=0; i<tree_count; ++i)
   {
-    const pll_utree_t * current_tree = trees[i];
-    if (current_tree->tip_count != tip_count)
+    if (!pllmod_utree_consensus_builder_add_tree(builder,
+                                                 trees[i],
+                                                 weights[i]))
     {
-      /*TODO: error */
+      /* cleanup and spread error */
+      char * aux_errmsg = (char *) malloc(strlen(pll_errmsg) + 1);
+      strcpy(aux_errmsg, pll_errmsg);
+      snprintf(pll_errmsg, PLLMOD_ERRMSG_LEN, "%s [tree #%d]",
+                                              aux_errmsg,
+                                              i);
+      free(aux_errmsg);
+      pllmod_utree_consensus_builder_destroy(builder);
       return NULL;
     }
-
-    n_splits = tip_count - 3;
-    tree_splits = pllmod_utree_split_create(current_tree->nodes[
-                                                current_tree->tip_count +
-                                                current_tree->inner_count - 1],
-                                             tip_count,
-                                             NULL);
-
-    /* insert normalized splits */
-    for (j=0; j<n_splits; ++j)
-    {
-      bitv_normalize(tree_splits[j], tip_count);
-
-      hash_insert(tree_splits[j],
-                  splits_hash,
-                  j,
-                  HASH_KEY_UNDEF,
-                  weights[i],
-                  0);
-    }
-    pllmod_utree_split_destroy(tree_splits);
-  }
-
-  if (pll_errno)
-  {
-    /* cleanup and spread error */
-    char * aux_errmsg = (char *) malloc(strlen(pll_errmsg) + 1);
-    strcpy(aux_errmsg, pll_errmsg);
-    snprintf(pll_errmsg, PLLMOD_ERRMSG_LEN, "%s [tree #%d]",
-                                            aux_errmsg,
-                                            i);
-    free(aux_errmsg);
-    string_hash_destroy(string_hashtable);
-    hash_destroy(splits_hash);
-    return NULL;
   }
 
-  /* build final split system */
-  pll_split_system_t * split_system = pllmod_utree_split_consensus(splits_hash,
-                                                                   tip_count,
-                                                                   threshold,
-                                                                   split_len);
-
-  /* buld tree from splits */
-  consensus_tree = pllmod_utree_from_splits(split_system,
-                                      tip_count,
-                                      string_hashtable->labels);
-
-  /* cleanup */
-  string_hash_destroy(string_hashtable);
-  for (i=0; i<split_system->split_count; ++i)
-    free(split_system->splits[i]);
-  free(split_system->splits);
-  free(split_system->support);
-  free(split_system);
+  consensus_tree = pllmod_utree_consensus_builder_finalize(builder,
+                                                           threshold);
+  pllmod_utree_consensus_builder_destroy(builder);
 
   return consensus_tree;
 }
@@ -465,6 +715,33 @@ PLL_EXPORT pll_consensus_utree_t * pllmod_utree_weight_consensus(
 PLL_EXPORT pll_consensus_utree_t * pllmod_utree_consensus(
                                                 const char * trees_filename,
                                                 double threshold,
+                                                unsigned int * tree_count)
+{
+  return pllmod_utree_consensus_parallel(trees_filename,
+                                         threshold,
+                                         1,
+                                         tree_count);
+}
+
+/**
+ * Build a consensus tree out of a set of trees in a file in NEWICK format,
+ * parsing the trees with several threads
+ *
+ * The result does not depend on the number of threads.
+ *
+ * @param  trees_filename   trees filename
+ * @param  threshold        consensus threshold in [0,1].
+ *                          1.0 -> strict
+ *                          0.5 -> majority rule
+ *                          0.0 -> extended majority rule
+ * @param  n_threads        number of threads parsing the trees
+ * @param[out] tree_count   number of trees parsed
+ * @return                  consensus unrooted tree structure
+ */
+PLL_EXPORT pll_consensus_utree_t * pllmod_utree_consensus_parallel(
+                                                const char * trees_filename,
+                                                double threshold,
+                                                unsigned int n_threads,
                                                 unsigned int * _tree_count)
 {
   FILE * trees_file;
@@ -474,15 +751,12 @@ PLL_EXPORT pll_consensus_utree_t * pllmod_utree_consensus(
   bitv_hashtable_t * splits_hash = NULL;
   string_hashtable_t * string_hashtable = NULL;
   int  n_chunks = 1; /* chunks for reading newick trees */
-  pll_split_t * tree_splits;
   unsigned int i,
                tip_count,
-               n_splits,
                split_size = sizeof(pll_split_base_t) * 8,
                split_offset,
                split_len,
-               tree_count,         /* number of trees */
-               current_tree_index; /* for error management */
+               tree_count;         /* number of trees */
   double individual_support;
 
   /* validate threshold */
@@ -509,11 +783,11 @@ PLL_EXPORT pll_consensus_utree_t * pllmod_utree_consensus(
 
   /* read first tree */
   reference_tree = read_tree(trees_file, &n_chunks, &tip_count, NULL);
+  fclose(trees_file);
 
   if(!reference_tree)
   {
     assert(pll_errno);
-    fclose(trees_file);
     return NULL;
   }
 
@@ -535,48 +809,17 @@ PLL_EXPORT pll_consensus_utree_t * pllmod_utree_consensus(
   /* create hashtable */
   splits_hash = hash_init(tip_count * 10, tip_count);
 
-  pll_errno = 0;
-  current_tree_index = 1;
-  n_splits = tip_count - 3;
-
-  tree_splits = pllmod_utree_split_create(reference_tree->nodes[
-                                              reference_tree->tip_count +
-                                              reference_tree->inner_count - 1],
-                                          tip_count,
-                                          NULL);
-
-  while (tree_splits)
-  {
-    ++current_tree_index;
-
-    /* insert normalized splits */
-    for (i=0; i<n_splits; ++i)
-    {
-      bitv_normalize(tree_splits[i], tip_count);
-
-      hash_insert(tree_splits[i],
-                  splits_hash,
-                  i,
-                  HASH_KEY_UNDEF,
-                  individual_support,
-                  0);
-    }
-    pllmod_utree_split_destroy(tree_splits);
-
-    /* parse next tree */
-    tree_splits = read_splits(trees_file, &n_chunks, &tip_count, string_hashtable);
-  }
-  fclose(trees_file);
-
-  if (pll_errno)
+  /* insert the normalized splits of every tree, including the first one */
+  if (!pllmod_utree_split_hashtable_insert_file(splits_hash,
+                                                trees_filename,
+                                                tip_count,
+                                                string_hashtable,
+                                                individual_support,
+                                                0,
+                                                n_threads,
+                                                NULL))
   {
     /* cleanup and spread error */
-    char * aux_errmsg = (char *) malloc(strlen(pll_errmsg) + 1);
-    strcpy(aux_errmsg, pll_errmsg);
-    snprintf(pll_errmsg, PLLMOD_ERRMSG_LEN, "%s [tree #%d]",
-                                            aux_errmsg,
-                                            current_tree_index);
-    free(aux_errmsg);
     string_hash_destroy(string_hashtable);
     hash_destroy(splits_hash);
     pll_utree_destroy(reference_tree, NULL);
@@ -668,42 +911,6 @@ static int cb_set_indices(pll_unode_t * node, void *data)
 
 #define FCHUNK_LEN 2000
 
-static pll_split_t * read_splits(FILE * file,
-                                 int * n_chunks,
-                                 unsigned int * tip_count,
-                                 string_hashtable_t * string_hashtable)
-{
-  int line_size = *n_chunks * FCHUNK_LEN;
-  char * tree_str = (char *) malloc((size_t)line_size);
-  char * tree_str_ptr = tree_str;
-  char * read;
-  pll_split_t * splits;
-
-  while ((read = fgets(tree_str_ptr, line_size, file)) &&
-         tree_str_ptr[strlen(tree_str_ptr) - 1] != '\n')
-  {
-    /* increase line size */
-    ++*n_chunks;
-    tree_str = (char *) realloc(tree_str, (size_t)*n_chunks * FCHUNK_LEN);
-    tree_str_ptr = tree_str + strlen(tree_str);
-    line_size = FCHUNK_LEN;
-  }
-
-  if (read == NULL)
-  {
-    splits = NULL;
-  }
-  else
-  {
-      splits = pll_utree_split_newick_string(tree_str,
-                                             *tip_count,
-                                             string_hashtable);
-  }
-  free(tree_str);
-
-  return splits;
-}
-
 static pll_utree_t * read_tree(FILE * file,
                                int * n_chunks,
                                unsigned int * tip_count,
@@ -786,27 +993,199 @@ static FILE *get_number_of_trees(unsigned int *tree_count,
   return f;
 }
 
-/* reverse sort splits by weight */
+/*
+ * reverse sort splits by weight. Ties are sorted by increasing split words
+ * (first word first), so that they do not depend on the hashtable layout
+ */
 static int sort_by_weight(const void *a, const void *b)
 {
-  int ca,
-      cb;
+  const mre_candidate_t * ca = (const mre_candidate_t *) a;
+  const mre_candidate_t * cb = (const mre_candidate_t *) b;
+  unsigned int i;
 
-  ca = ((*((bitv_hash_entry_t **)a))->support);
-  cb = ((*((bitv_hash_entry_t **)b))->support);
+  if (ca->entry->support != cb->entry->support)
+    return ((ca->entry->support < cb->entry->support)?1:-1);
 
-  if (ca == cb)
-    return 0;
+  for (i = 0; i < ca->split_len; ++i)
+  {
+    pll_split_base_t wa = ca->entry->bit_vector[i];
+    pll_split_base_t wb = cb->entry->bit_vector[i];
 
-  return ((ca<cb)?1:-1);
+    if (wa != wb)
+      return ((wa < wb)?-1:1);
+  }
+
+  return 0;
+}
+
+static void mre_node_unlink(mre_node_t * node)
+{
+  if (node->prev)
+    node->prev->next = node->next;
+  else
+    node->parent->child = node->next;
+  if (node->next)
+    node->next->prev = node->prev;
+}
+
+static void mre_node_link(mre_node_t * node, mre_node_t * parent)
+{
+  node->parent = parent;
+  node->prev = NULL;
+  node->next = parent->child;
+  if (parent->child)
+    parent->child->prev = node;
+  parent->child = node;
+}
+
+/*
+ * The clusters of the accepted splits (see split_to_cluster) form a laminar
+ * family: every two of them are either disjoint or nested. We store them as
+ * a rooted tree with one leaf per bit position and a root for the full set of
+ * taxa.
+ */
+static mre_node_t * mre_tree_create(unsigned int taxa_count,
+                                    unsigned int max_splits)
+{
+  unsigned int i;
+  mre_node_t * nodes = (mre_node_t *) calloc(taxa_count + max_splits + 1,
+                                             sizeof(mre_node_t));
+  mre_node_t * root;
+
+  if (!nodes)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for consensus tree\n");
+    return NULL;
+  }
+
+  root = nodes + taxa_count;
+  root->size = taxa_count;
+  for (i = taxa_count; i > 0; --i)
+  {
+    nodes[i-1].size = 1;
+    mre_node_link(nodes + i - 1, root);
+  }
+
+  return nodes;
+}
+
+/*
+ * Adds a split to the cluster tree if it is compatible with all the splits
+ * already there. The maximal clusters contained in the split are found
+ * bottom-up from its taxa: a cluster is covered when its covered children
+ * sum up to its size. The split is compatible iff all the maximal covered
+ * clusters are children of the same node, in which case it becomes their new
+ * parent. Runs in O(split_len + number of taxa in the split).
+ */
+static int mre_tree_add(mre_node_t * nodes,
+                        unsigned int * node_count,
+                        mre_node_t ** queue,
+                        const pll_split_t split,
+                        unsigned int split_len)
+{
+  unsigned int split_size = sizeof(pll_split_base_t) * 8;
+  unsigned int i, queue_len = 0, taxa = 0;
+  mre_node_t * parent = NULL;
+  mre_node_t * node;
+  int compatible = 1;
+
+  for (i = 0; i < split_len; ++i)
+  {
+    pll_split_base_t bits = split[i];
+    while (bits)
+    {
+      queue[queue_len++] = nodes + i * split_size
+                                 + (unsigned int) __builtin_ctz(bits);
+      bits &= bits - 1;
+    }
+  }
+  taxa = queue_len;
+
+  /* an empty split is compatible with everything */
+  if (!taxa)
+    return 1;
+
+  /* propagate coverage up to the root (which is never covered) */
+  for (i = 0; i < queue_len; ++i)
+  {
+    mre_node_t * up = queue[i]->parent;
+    up->count += queue[i]->size;
+    if (up->count == up->size && up->parent)
+      queue[queue_len++] = up;
+  }
+
+  /* maximal covered clusters must share the same parent */
+  for (i = 0; i < queue_len && compatible; ++i)
+  {
+    mre_node_t * up = queue[i]->parent;
+    if (up->count == up->size && up->parent)
+      continue;
+    if (!parent)
+      parent = up;
+    else if (up != parent)
+      compatible = 0;
+  }
+
+  if (compatible)
+  {
+    node = nodes + (*node_count)++;
+    node->size = taxa;
+    for (i = 0; i < queue_len; ++i)
+    {
+      mre_node_t * up = queue[i]->parent;
+      if (up == parent)
+      {
+        mre_node_unlink(queue[i]);
+        mre_node_link(queue[i], node);
+      }
+    }
+    mre_node_link(node, parent);
+  }
+
+  /* reset counters */
+  for (i = 0; i < queue_len; ++i)
+    if (queue[i]->parent != NULL)
+      queue[i]->parent->count = 0;
+  if (compatible)
+    parent->count = 0;
+
+  return compatible;
+}
+
+/*
+ * Normalized splits all contain the first taxon, so two compatible splits are
+ * not necessarily nested. Their complements, which do not contain it, are
+ * either nested or disjoint iff the splits are compatible. These are the
+ * clusters added to the cluster tree.
+ */
+static void split_to_cluster(pll_split_t cluster,
+                             const pll_split_t split,
+                             unsigned int tip_count,
+                             unsigned int split_len)
+{
+  unsigned int split_offset = tip_count % (sizeof(pll_split_base_t) * 8);
+  unsigned int i;
+
+  for (i = 0; i < split_len; ++i)
+    cluster[i] = ~split[i];
+
+  if (split_offset)
+    cluster[split_len - 1] &= (1u << split_offset) - 1;
 }
 
 static void mre(bitv_hashtable_t *h,
                 pll_split_system_t *consensus,
+                unsigned int tip_count,
                 unsigned int split_len,
                 unsigned int max_splits)
 {
-  bitv_hash_entry_t **split_list;
+  mre_candidate_t * split_list;
+  mre_node_t * cluster_tree;
+  mre_node_t ** queue;
+  pll_split_t cluster;
+  unsigned int taxa_count = split_len * sizeof(pll_split_base_t) * 8;
+  unsigned int node_count = taxa_count + 1;
 
   unsigned int
     i = 0,
@@ -814,49 +1193,65 @@ static void mre(bitv_hashtable_t *h,
 
   /* queue all splits */
 
-  split_list = (bitv_hash_entry_t **) malloc(sizeof(bitv_hash_entry_t *) *
-                                             h->entry_count);
+  split_list = (mre_candidate_t *) malloc(sizeof(mre_candidate_t) *
+                                          h->entry_count);
+  cluster_tree = mre_tree_create(taxa_count, max_splits);
+  queue = (mre_node_t **) malloc(sizeof(mre_node_t *) *
+                                 (taxa_count + max_splits + 1));
+  cluster = (pll_split_t) malloc(sizeof(pll_split_base_t) * split_len);
+  if (!split_list || !cluster_tree || !queue || !cluster)
+  {
+    free(split_list);
+    free(cluster_tree);
+    free(queue);
+    free(cluster);
+    return;
+  }
 
   j = 0;
   for(i = 0; i < h->table_size; i++) /* copy hashtable h to list sbw */
   {
-    bitv_hash_entry_t * e =  h->table[i];
-    while (e != NULL)
+    bitv_hash_entry_t * e = hash_entry_at(h, i);
+    if (e != NULL)
     {
-      split_list[j] = e;
+      split_list[j].entry = e;
+      split_list[j].split_len = split_len;
       ++j;
-      e = e->next;
     }
   }
   assert(h->entry_count == j);
 
   /* sort by weight descending */
-  qsort(split_list, h->entry_count, sizeof(bitv_hash_entry_t *), sort_by_weight);
+  qsort(split_list, h->entry_count, sizeof(mre_candidate_t), sort_by_weight);
+
+  /* majority splits are already in the consensus and pairwise compatible */
+  for (j=0; j<consensus->split_count; ++j)
+  {
+    int compatible;
+    split_to_cluster(cluster, consensus->splits[j], tip_count, split_len);
+    compatible = mre_tree_add(cluster_tree, &node_count, queue,
+                              cluster, split_len);
+    assert(compatible);
+    (void) compatible;
+  }
 
   for(i = 0; i < h->entry_count && (consensus->split_count) < max_splits; i++)
   {
-    int compatible = 1;
-    bitv_hash_entry_t * split_candidate = split_list[i];
-    for (j=0; j<consensus->split_count; ++j)
-    {
-      pll_split_t split_consolidated = consensus->splits[j];
-      if (!pllmod_utree_compatible_splits(split_candidate->bit_vector,
-                                          split_consolidated,
-                                          split_len))
-      {
-        compatible = 0;
-        break;
-      }
-    }
+    const bitv_hash_entry_t * split_candidate = split_list[i].entry;
 
-    if(compatible)
+    split_to_cluster(cluster, split_candidate->bit_vector, tip_count,
+                     split_len);
+    if (mre_tree_add(cluster_tree, &node_count, queue, cluster, split_len))
     {
       consensus->splits[consensus->split_count] = clone_split(split_candidate->bit_vector, split_len);
-      consensus->support[consensus->split_count] = split_list[i]->support;
+      consensus->support[consensus->split_count] = split_candidate->support;
       ++(consensus->split_count);
     }
   }
 
+  free(cluster);
+  free(queue);
+  free(cluster_tree);
   free(split_list);
 
   return;
@@ -949,35 +1344,6 @@ static void build_tips_recurse(pll_unode_t * tree,
   }
 }
 
-static pll_unode_t * find_splitnode_recurse(pll_split_t split,
-                                            pll_unode_t * root,
-                                            unsigned int split_len)
-{
-  pll_unode_t * next_root, * ret_node;
-  pll_consensus_data_t * data = (pll_consensus_data_t *) root->data;
-
-  if (is_subsplit(split, data->split, split_len))
-  {
-    /* check children */
-    next_root = root->next;
-    while(next_root != root)
-    {
-      if ((ret_node = find_splitnode_recurse(split,
-                                 next_root->back,
-                                 split_len)) != NULL)
-      {
-        return ret_node;
-      }
-      next_root = next_root->next;
-    }
-    return root;
-  }
-  else
-  {
-    return NULL;
-  }
-}
-
 static void connect_consensus_node(pll_unode_t * parent,
                                    pll_unode_t * child,
                                    unsigned int split_len,
@@ -1062,6 +1428,356 @@ static pll_unode_t * create_consensus_node(pll_unode_t * parent,
   return new_node;
 }
 
+static unsigned int count_less(const unsigned int * values,
+                               unsigned int n,
+                               unsigned int x)
+{
+  unsigned int lo = 0, hi = n;
+
+  /* values are sorted in increasing order */
+  while (lo < hi)
+  {
+    unsigned int mid = lo + (hi - lo) / 2;
+    if (values[mid] < x)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static int cmp_split_child(const void * a, const void * b)
+{
+  const split_child_t * x = (const split_child_t *) a;
+  const split_child_t * y = (const split_child_t *) b;
+
+  if (x->group != y->group)
+    return x->group < y->group ? -1 : 1;
+
+  if (x->level != y->level)
+  {
+    if (x->group == 1)
+      return x->level < y->level ? -1 : 1;
+    else
+      return x->level > y->level ? -1 : 1;
+  }
+
+  if (x->time == y->time)
+    return 0;
+  if (x->group == 2)
+    return x->time < y->time ? -1 : 1;
+  return x->time > y->time ? -1 : 1;
+}
+
+/*
+ * Sorts the children of every cluster in the order in which inserting the
+ * splits one by one (create_consensus_node) would have linked them. A new
+ * node is linked first among its siblings, and takes over the children it
+ * contains in reverse order. Children created after their parent are thus
+ * sorted by decreasing time. Children created before it were moved through
+ * the chain of nearest earlier-created ancestors, each move reversing their
+ * order; 'stack' holds the creation times of that chain.
+ */
+static void order_children_recurse(split_tree_t * st,
+                                   unsigned int node,
+                                   unsigned int stack_len)
+{
+  unsigned int time = st->time[node];
+  unsigned int pos = count_less(st->stack, stack_len, time);
+  unsigned int saved = st->stack[pos];
+  unsigned int begin = st->child_start[node];
+  unsigned int end = st->child_start[node+1];
+  unsigned int i;
+
+  for (i = begin; i < end; ++i)
+  {
+    split_child_t * child = st->order + i;
+    child->node = st->child_list[i];
+    child->time = st->time[child->node];
+    if (child->time > time)
+    {
+      child->group = 0;
+      child->level = 0;
+    }
+    else
+    {
+      child->level = 1 + pos - count_less(st->stack, pos, child->time);
+      child->group = (child->level % 2) ? 2 : 1;
+    }
+  }
+  qsort(st->order + begin, end - begin, sizeof(split_child_t),
+        cmp_split_child);
+
+  st->stack[pos] = time;
+  for (i = begin; i < end; ++i)
+  {
+    st->child_list[i] = st->order[i].node;
+    order_children_recurse(st, st->child_list[i], pos + 1);
+  }
+  st->stack[pos] = saved;
+}
+
+static unsigned int uf_find(unsigned int * uf, unsigned int x)
+{
+  while (uf[x] != x)
+  {
+    uf[x] = uf[uf[x]];
+    x = uf[x];
+  }
+  return x;
+}
+
+/*
+ * Builds the tree for a compatible split system. Splits are oriented on
+ * either side of the first one, and sorted by increasing size. Each one
+ * then collects the largest clusters already built on its taxa, which are
+ * found through a union-find over the taxa. This takes O(n * split_len) for
+ * n splits, and yields the same tree as inserting the splits one by one.
+ */
+static pll_unode_t * build_split_tree(const pll_split_system_t * split_system,
+                                     unsigned int tip_count,
+                                     unsigned int split_len)
+{
+  unsigned int split_size = sizeof(pll_split_base_t) * 8;
+  unsigned int split_count = split_system->split_count;
+  unsigned int root2 = split_count + tip_count;
+  unsigned int node_count = root2 + 1;
+  unsigned int none = node_count;
+  unsigned int i, j, w;
+  pll_split_t * splits;
+  pll_split_t work;
+  double * support_values;
+  unsigned int * parent, * sorted, * size_start, * uf, * top;
+  pll_unode_t ** nodes;
+  pll_unode_t * tree = NULL;
+  split_tree_t st;
+  int valid = 1;
+
+  splits = (pll_split_t *) calloc(node_count, sizeof(pll_split_t));
+  support_values = (double *) malloc(node_count * sizeof(double));
+  work = (pll_split_t) malloc(split_len * sizeof(pll_split_base_t));
+  parent = (unsigned int *) malloc(node_count * sizeof(unsigned int));
+  sorted = (unsigned int *) malloc(node_count * sizeof(unsigned int));
+  size_start = (unsigned int *) calloc(tip_count + 2, sizeof(unsigned int));
+  uf = (unsigned int *) malloc(tip_count * sizeof(unsigned int));
+  top = (unsigned int *) malloc(tip_count * sizeof(unsigned int));
+  nodes = (pll_unode_t **) calloc(node_count, sizeof(pll_unode_t *));
+  st.time = (unsigned int *) malloc(node_count * sizeof(unsigned int));
+  st.child_start = (unsigned int *) calloc(node_count + 1,
+                                           sizeof(unsigned int));
+  st.child_list = (unsigned int *) malloc(node_count * sizeof(unsigned int));
+  st.order = (split_child_t *) malloc(node_count * sizeof(split_child_t));
+  st.stack = (unsigned int *) calloc(node_count + 1, sizeof(unsigned int));
+
+  if (!splits || !support_values || !work || !parent || !sorted ||
+      !size_start || !uf || !top || !nodes || !st.time || !st.child_start ||
+      !st.child_list || !st.order || !st.stack)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for consensus tree\n");
+    valid = 0;
+    goto cleanup;
+  }
+
+  /* the first split and its complement are the two roots */
+  splits[0] = clone_split(split_system->splits[0], split_len);
+  splits[root2] = clone_split(split_system->splits[0], split_len);
+  reverse_split(splits[root2], tip_count);
+
+  /* orient every other split on either side of the first one */
+  for (i=1; i<split_count && valid; ++i)
+  {
+    splits[i] = clone_split(split_system->splits[i], split_len);
+    if (!is_subsplit(splits[i], splits[0], split_len) &&
+        !is_subsplit(splits[i], splits[root2], split_len))
+    {
+      reverse_split(splits[i], tip_count);
+      if (!is_subsplit(splits[i], splits[0], split_len) &&
+          !is_subsplit(splits[i], splits[root2], split_len))
+        valid = 0;
+    }
+  }
+
+  /* trivial splits */
+  for (i=0; i<tip_count && valid; ++i)
+  {
+    splits[split_count+i] = (pll_split_t) calloc(split_len,
+                                                 sizeof(pll_split_base_t));
+    splits[split_count+i][i / split_size] = (1u << (i % split_size));
+  }
+
+  /* compute support for other splits */
+  for (i=0; i<split_count; ++i)
+  {
+    if (split_system->support)
+      support_values[i] = 1.0 * split_system->support[i] / split_system->max_support;
+    else
+      support_values[i] = 1.0 * split_system->max_support;
+  }
+  for (i=0; i<tip_count; ++i)
+    support_values[split_count+i] = 1.0;
+  support_values[root2] = support_values[0];
+
+  /* splits are inserted in order; both roots come first */
+  for (i=0; i<root2; ++i)
+    st.time[i] = i;
+  st.time[root2] = 0;
+
+  /* sort non-trivial splits by increasing size, and decreasing time on
+     ties, such that duplicates end up below the ones inserted earlier */
+  for (i=0; i<node_count && valid; ++i)
+  {
+    parent[i] = none;
+    if (i < split_count || i == root2)
+    {
+      unsigned int size = setbit_count(splits[i], split_len);
+      if (size > tip_count)
+        valid = 0;
+      else
+        ++size_start[size+1];
+    }
+  }
+  for (i=1; i<=tip_count+1 && valid; ++i)
+    size_start[i] += size_start[i-1];
+  for (i=node_count; i>0 && valid; --i)
+  {
+    unsigned int node = (i == node_count) ? root2 : i - 1;
+    if (node < split_count || node == root2)
+    {
+      unsigned int size = setbit_count(splits[node], split_len);
+      sorted[size_start[size]++] = node;
+    }
+  }
+
+  for (i=0; i<tip_count; ++i)
+  {
+    uf[i] = i;
+    top[i] = split_count + i;
+  }
+
+  /* each split collects the largest clusters built so far on its taxa */
+  for (j=0; j<split_count+1 && valid; ++j)
+  {
+    unsigned int node = sorted[j];
+    unsigned int rep = none;
+
+    memcpy(work, splits[node], split_len * sizeof(pll_split_base_t));
+    for (w=0; w<split_len && valid; ++w)
+    {
+      while (work[w])
+      {
+        unsigned int taxon = w * split_size
+                             + (unsigned int) __builtin_ctz(work[w]);
+        unsigned int r, child;
+
+        if (taxon >= tip_count)
+        {
+          valid = 0;
+          break;
+        }
+
+        r = uf_find(uf, taxon);
+        child = top[r];
+        if (!is_subsplit(splits[child], splits[node], split_len))
+        {
+          valid = 0;
+          break;
+        }
+
+        parent[child] = node;
+        for (i=w; i<split_len; ++i)
+          work[i] &= ~splits[child][i];
+
+        if (rep == none)
+          rep = r;
+        else
+          uf[r] = rep;
+      }
+    }
+
+    if (rep == none)
+      valid = 0;
+    else
+      top[rep] = node;
+  }
+
+  if (!valid)
+  {
+    pllmod_set_error(PLLMOD_TREE_ERROR_INVALID_SPLIT,
+                     "Splits are incompatible");
+    goto cleanup;
+  }
+
+  /* children lists */
+  for (i=0; i<node_count; ++i)
+    if (parent[i] != none)
+      ++st.child_start[parent[i]+1];
+  for (i=1; i<=node_count; ++i)
+    st.child_start[i] += st.child_start[i-1];
+  for (i=0; i<node_count; ++i)
+    if (parent[i] != none)
+      st.child_list[st.child_start[parent[i]]++] = i;
+  for (i=node_count; i>0; --i)
+    st.child_start[i] = st.child_start[i-1];
+  st.child_start[0] = 0;
+
+  order_children_recurse(&st, 0, 0);
+  order_children_recurse(&st, root2, 0);
+
+  /* create the nodes and link the children in order */
+  for (i=0; i<node_count; ++i)
+    nodes[i] = create_consensus_node(NULL, splits[i], support_values[i],
+                                     split_len);
+
+  for (i=0; i<node_count; ++i)
+  {
+    pll_unode_t * prev = nodes[i];
+    for (j=st.child_start[i]; j<st.child_start[i+1]; ++j)
+    {
+      pll_unode_t * child = nodes[st.child_list[j]];
+      pll_unode_t * new_node = (pll_unode_t *) malloc(sizeof(pll_unode_t));
+
+      new_node->data = nodes[i]->data;
+      new_node->label = NULL;
+      new_node->back = child;
+      child->back = new_node;
+      prev->next = new_node;
+      prev = new_node;
+    }
+    prev->next = nodes[i];
+  }
+
+  tree = nodes[0];
+  tree->back = nodes[root2];
+  tree->back->back = tree;
+
+  /* the split of the first root is not kept */
+  free(splits[0]);
+
+cleanup:
+  if (!tree && splits)
+  {
+    for (i=0; i<node_count; ++i)
+      free(splits[i]);
+  }
+  free(splits);
+  free(support_values);
+  free(work);
+  free(parent);
+  free(sorted);
+  free(size_start);
+  free(uf);
+  free(top);
+  free(nodes);
+  free(st.time);
+  free(st.child_start);
+  free(st.child_list);
+  free(st.order);
+  free(st.stack);
+
+  return tree;
+}
+
 static int is_subsplit(pll_split_t child,
                        pll_split_t parent,
                        unsigned int split_len)
@@ -1085,8 +1801,11 @@ static void reverse_split(pll_split_t split, unsigned int tip_count)
   for (i=0; i<split_len; ++i)
     split[i] = ~split[i];
 
-  unsigned int mask = (1<<split_offset) - 1;
-  split[split_len - 1] &= mask;
+  if (split_offset)
+  {
+    unsigned int mask = (1<<split_offset) - 1;
+    split[split_len - 1] &= mask;
+  }
 }
 
 static pll_split_t clone_split(const pll_split_t from,
@@ -26,6 +26,8 @@
 #include "pll.h"
 #endif
 
+#include <stdint.h>
+
 /**
  * PLL Tree utils module
  * Prefix: pll_tree_, pll_utree_, pll_rtree_
@@ -83,27 +85,50 @@ typedef struct split_system_t
   double max_support;
 } pll_split_system_t;
 
+/* splits of a tree in a contiguous matrix of 64-bit words */
+typedef struct split_set_t
+{
+  unsigned int tip_count;
+  unsigned int split_count;
+  unsigned int stride;          /* words per split */
+  uint64_t * words;             /* split i starts at words[i * stride] */
+} pll_split_set_t;
+
 typedef unsigned int hash_key_t;
+typedef uint64_t bitv_hash_key_t;
 
 typedef struct bitv_hash_entry
 {
-  hash_key_t key;
+  bitv_hash_key_t key;
   pll_split_t bit_vector;
   unsigned int *tree_vector;
   unsigned int tip_count;
   double support;
   unsigned int bip_number;
-
-  struct bitv_hash_entry *next;
 } bitv_hash_entry_t;
 
+/* block of pooled entries, with their bit vectors stored inline */
+typedef struct bitv_hash_chunk
+{
+  struct bitv_hash_chunk * next;
+  unsigned int capacity;
+  unsigned int used;
+  pll_split_base_t * bitv_slab;
+  bitv_hash_entry_t entries[];
+} bitv_hash_chunk_t;
+
+/* open addressing with linear probing; the table grows automatically */
 typedef struct
 {
-  unsigned int table_size;
-  bitv_hash_entry_t **table;
+  unsigned int table_size;    /* number of slots (power of 2) */
+  bitv_hash_entry_t **table;  /* NULL: empty slot */
   unsigned int entry_count;
+  unsigned int deleted_count; /* slots of removed entries */
   unsigned int bit_count;     /* number of bits per entry */
   unsigned int bitv_len;      /* bitv length */
+  bitv_hash_chunk_t * chunks; /* entry pool, most recent chunk first */
+  unsigned int pool_size;     /* total number of pooled entries */
+  void * lock;                /* NULL unless concurrent */
 } bitv_hashtable_t;
 
 typedef struct consensus_data_t
@@ -124,20 +149,35 @@ typedef struct consensus_utree_t
 
 typedef struct string_hash_entry
 {
-  hash_key_t key;
+  hash_key_t key;               /* of the label without the common prefix */
+  unsigned int length;
   int node_number;
-  char * word;
-  struct string_hash_entry *next;
+  char * word;                  /* NULL: empty slot */
 } string_hash_entry_t;
 
+/* open addressing with linear probing; read-only once built */
 typedef struct
 {
   char **labels;
-  unsigned int table_size;
-  string_hash_entry_t **table;
+  unsigned int table_size;      /* number of slots (power of 2) */
+  string_hash_entry_t *table;
   unsigned int entry_count;
+  unsigned int max_labels;
+  const char * prefix;          /* any label, for the common prefix */
+  unsigned int prefix_length;   /* prefix shared by all labels */
 } string_hashtable_t;
 
+typedef struct consensus_builder_t
+{
+  unsigned int tip_count;
+  unsigned int split_len;
+  unsigned int tree_count;
+  double total_weight;
+  bitv_hashtable_t * splits_hash;     /* NULL once the consensus is built */
+  string_hashtable_t * names_hash;    /* NULL if created without labels */
+  pll_split_t split_buffer;
+} pll_consensus_builder_t;
+
 typedef struct pll_tree_edge
 {
   union
@@ -220,10 +260,34 @@ typedef struct treeinfo
   /* precomputation buffers for derivatives (aka "sumtable") */
   double ** deriv_precomp;
 
+  /* per-partition sumtable cache for branch length optimization (NULL if
+     not used, see pllmod_treeinfo_set_sumtable_cache) */
+  double ** sumtable_cache;
+  unsigned int sumtable_cache_slots;
+
+  /* sumtable cache validity: every directed node and P-matrix gets a new
+     epoch whenever its CLV or P-matrix is invalidated, such that cached
+     sumtables are reused across optimization calls only as long as the CLVs
+     at both ends of their branch are unchanged */
+  uint64_t * sumtable_tags;      /* per slot: P-matrix index + 1, 2 epochs */
+  uint64_t * clv_epoch;          /* per directed node */
+  uint64_t * clv_inputs;         /* per directed node: 4 input epochs */
+  uint64_t * pmatrix_epoch;      /* per P-matrix */
+  uint64_t sumtable_epoch;       /* last epoch handed out */
+
   // invalidation flags
   char ** clv_valid;
   char ** pmatrix_valid;
 
+  /* per-partition flags: 1 if the model parameters or branch lengths changed
+     since the last likelihood computation (see
+     pllmod_treeinfo_compute_loglh_dirty) */
+  char * model_dirty;
+
+  /* per-partition log-likelihoods of the local partitions, before the
+     parallel reduction */
+  double * local_loglh;
+
   // buffers
   pll_unode_t ** travbuffer;
   unsigned int * matrix_indices;
@@ -391,6 +455,46 @@ PLL_EXPORT pll_split_t * pll_utree_split_newick_string(char * s,
                                                        unsigned int tip_count,
                                                        string_hashtable_t * names_hash);
 
+PLL_EXPORT pll_split_t * pllmod_utree_split_newick_parse(
+                                             const char * newick,
+                                             unsigned int tip_count,
+                                             string_hashtable_t * names_hash);
+
+PLL_EXPORT pll_split_set_t * pllmod_utree_split_set_create(
+                                                    pll_unode_t * tree,
+                                                    unsigned int tip_count);
+
+PLL_EXPORT pll_split_set_t * pllmod_utree_split_set_from_splits(
+                                                  const pll_split_t * splits,
+                                                  unsigned int split_count,
+                                                  unsigned int tip_count);
+
+PLL_EXPORT int pllmod_utree_split_set_sort(pll_split_set_t * set);
+
+PLL_EXPORT unsigned int pllmod_utree_split_set_rf_distance(
+                                                  const pll_split_set_t * s1,
+                                                  const pll_split_set_t * s2);
+
+PLL_EXPORT void pllmod_utree_split_set_destroy(pll_split_set_t * set);
+
+/* functions at tree_quartets.c */
+
+PLL_EXPORT uint64_t pllmod_utree_quartet_distance(pll_unode_t * t1,
+                                                  pll_unode_t * t2,
+                                                  unsigned int tip_count);
+
+PLL_EXPORT uint64_t pllmod_rtree_triplet_distance(pll_rnode_t * t1,
+                                                  pll_rnode_t * t2,
+                                                  unsigned int tip_count);
+
+PLL_EXPORT int pllmod_utree_quartet_distance_matrix(pll_utree_t * const * trees,
+                                                    unsigned int tree_count,
+                                                    unsigned int n_threads,
+                                                    uint64_t * distances);
+
+PLL_EXPORT bitv_hashtable_t *
+pllmod_utree_split_hashtable_create(unsigned int tip_count, int concurrent);
+
 PLL_EXPORT bitv_hashtable_t *
 pllmod_utree_split_hashtable_insert(bitv_hashtable_t * splits_hash,
                                     pll_split_t * splits,
@@ -399,6 +503,16 @@ pllmod_utree_split_hashtable_insert(bitv_hashtable_t * splits_hash,
                                     const double * support,
                                     int update_only);
 
+PLL_EXPORT int
+pllmod_utree_split_hashtable_insert_file(bitv_hashtable_t * splits_hash,
+                                         const char * trees_filename,
+                                         unsigned int tip_count,
+                                         string_hashtable_t * names_hash,
+                                         double support,
+                                         int update_only,
+                                         unsigned int n_threads,
+                                         unsigned int * tree_count);
+
 PLL_EXPORT bitv_hash_entry_t *
 pllmod_utree_split_hashtable_lookup(bitv_hashtable_t * splits_hash,
                                     pll_split_t split,
@@ -436,6 +550,39 @@ PLL_EXPORT pll_consensus_utree_t * pllmod_utree_consensus(
                                                     double threshold,
                                                     unsigned int * tree_count);
 
+PLL_EXPORT pll_consensus_utree_t * pllmod_utree_consensus_parallel(
+                                                    const char * trees_filename,
+                                                    double threshold,
+                                                    unsigned int n_threads,
+                                                    unsigned int * tree_count);
+
+PLL_EXPORT pll_consensus_builder_t * pllmod_utree_consensus_builder_create(
+                                                    unsigned int tip_count,
+                                                    char * const * tip_labels);
+
+PLL_EXPORT int pllmod_utree_consensus_builder_add_tree(
+                                            pll_consensus_builder_t * builder,
+                                            const pll_utree_t * tree,
+                                            double weight);
+
+PLL_EXPORT int pllmod_utree_consensus_builder_add_newick(
+                                            pll_consensus_builder_t * builder,
+                                            const char * newick,
+                                            double weight);
+
+PLL_EXPORT int pllmod_utree_consensus_builder_add_splits(
+                                            pll_consensus_builder_t * builder,
+                                            const pll_split_t * splits,
+                                            unsigned int split_count,
+                                            double weight);
+
+PLL_EXPORT pll_consensus_utree_t * pllmod_utree_consensus_builder_finalize(
+                                            pll_consensus_builder_t * builder,
+                                            double threshold);
+
+PLL_EXPORT void pllmod_utree_consensus_builder_destroy(
+                                            pll_consensus_builder_t * builder);
+
 PLL_EXPORT void pllmod_utree_consensus_destroy(pll_consensus_utree_t * tree);
 
 /* Additional utilities */
@@ -511,6 +658,9 @@ PLL_EXPORT int pllmod_treeinfo_init_partition(pllmod_treeinfo_t * treeinfo,
                                            const unsigned int * param_indices,
                                            const int * subst_matrix_symmetries);
 
+PLL_EXPORT int pllmod_treeinfo_set_sumtable_cache(pllmod_treeinfo_t * treeinfo,
+                                                  size_t max_bytes);
+
 PLL_EXPORT int pllmod_treeinfo_set_active_partition(pllmod_treeinfo_t * treeinfo,
                                                     int partition_index);
 
@@ -541,9 +691,14 @@ PLL_EXPORT void pllmod_treeinfo_invalidate_pmatrix(pllmod_treeinfo_t * treeinfo,
 PLL_EXPORT void pllmod_treeinfo_invalidate_clv(pllmod_treeinfo_t * treeinfo,
                                                const pll_unode_t * edge);
 
+PLL_EXPORT void pllmod_treeinfo_invalidate_loglh(pllmod_treeinfo_t * treeinfo);
+
 PLL_EXPORT double pllmod_treeinfo_compute_loglh(pllmod_treeinfo_t * treeinfo,
                                                 int incremental);
 
+PLL_EXPORT double pllmod_treeinfo_compute_loglh_dirty(
+                                                  pllmod_treeinfo_t * treeinfo);
+
 PLL_EXPORT
 int pllmod_treeinfo_normalize_brlen_scalers(pllmod_treeinfo_t * treeinfo);
 
@@ -22,17 +22,21 @@
 #include "tree_hashtable.h"
 #include "../pllmod_common.h"
 
+#include <pthread.h>
+
+#define HASH_MIN_SIZE     64
+#define HASH_MIN_CHUNK    64
+
+/* marks the slot of a removed entry, so that probing continues past it */
+static bitv_hash_entry_t hash_deleted_entry;
+#define HASH_DELETED (&hash_deleted_entry)
+
 bitv_hashtable_t *hash_init(unsigned int n,
                             unsigned int bit_count)
 {
-  /* init with powers of two */
-  static const unsigned int init_table[] = {
-                64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384,
-					      32768, 65536, 131072, 262144, 524288, 1048576, 2097152,
-					      4194304, 8388608, 16777216, 33554432, 67108864, 134217728,
-					      268435456, 536870912, 1073741824, 2147483648U};
-
-  bitv_hashtable_t *h = (bitv_hashtable_t*) malloc(sizeof(bitv_hashtable_t));
+  unsigned int table_size = HASH_MIN_SIZE;
+
+  bitv_hashtable_t *h = (bitv_hashtable_t*) calloc(1, sizeof(bitv_hashtable_t));
   if (!h)
   {
     pllmod_set_error(PLL_ERROR_MEM_ALLOC,
@@ -40,30 +44,18 @@ bitv_hashtable_t *hash_init(unsigned int n,
     return NULL;
   }
 
-  unsigned int
-    table_size,
-    i,
-    init_table_size = sizeof(init_table)/sizeof(init_table[0]),
-    maxSize = (unsigned int)-1;
-
-  assert(n <= maxSize);
-
-  i = 0;
-
-  while(init_table[i] < n && i < init_table_size)
-    ++i;
-
-  assert(i < init_table_size);
-
-  table_size = init_table[i];
-
-  /* printf("Hash table init with size %u\n", table_size); */
+  /* powers of two, with room for n entries at load factor 1/2 */
+  while (table_size / 2 < n && table_size < (1U << 31))
+    table_size <<= 1;
 
   h->table = (bitv_hash_entry_t**)calloc(table_size, sizeof(bitv_hash_entry_t*));
   h->table_size = table_size;
   h->entry_count = 0;
+  h->deleted_count = 0;
   h->bit_count = bit_count;
   h->bitv_len = bitv_length(bit_count);
+  h->chunks = NULL;
+  h->pool_size = 0;
 
   if (!h->table)
   {
@@ -76,15 +68,82 @@ bitv_hashtable_t *hash_init(unsigned int n,
   return h;
 }
 
-void hash_destroy_entry(bitv_hash_entry_t *e)
+/*
+ * In concurrent mode, lookups and support increments of existing splits run
+ * in parallel under a shared lock, with atomic increments of the support.
+ * New splits, which may grow the table, take the lock exclusively. Pooled
+ * entries never move, so returned entries stay valid.
+ */
+int hash_set_concurrent(bitv_hashtable_t *h)
 {
-  if(e->bit_vector)
-    free(e->bit_vector);
+  pthread_rwlock_t * lock;
+
+  if (h->lock)
+    return PLL_SUCCESS;
+
+  lock = (pthread_rwlock_t *) malloc(sizeof(pthread_rwlock_t));
+  if (!lock || pthread_rwlock_init(lock, NULL))
+  {
+    free(lock);
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot initialize hashtable lock\n");
+    return PLL_FAILURE;
+  }
+
+  h->lock = lock;
+  return PLL_SUCCESS;
+}
 
+static void hash_lock_shared(const bitv_hashtable_t *h)
+{
+  if (h->lock)
+    pthread_rwlock_rdlock((pthread_rwlock_t *) h->lock);
+}
+
+static void hash_lock_exclusive(const bitv_hashtable_t *h)
+{
+  if (h->lock)
+    pthread_rwlock_wrlock((pthread_rwlock_t *) h->lock);
+}
+
+static void hash_unlock(const bitv_hashtable_t *h)
+{
+  if (h->lock)
+    pthread_rwlock_unlock((pthread_rwlock_t *) h->lock);
+}
+
+static void hash_add_support(const bitv_hashtable_t *h,
+                             bitv_hash_entry_t *e,
+                             double support)
+{
+  uint64_t old_bits, new_bits;
+  double value;
+
+  if (!h->lock)
+  {
+    e->support = e->support + support;
+    return;
+  }
+
+  /* atomic add of a double, through its bit pattern */
+  old_bits = __atomic_load_n((uint64_t *) &e->support, __ATOMIC_RELAXED);
+  do
+  {
+    memcpy(&value, &old_bits, sizeof(double));
+    value += support;
+    memcpy(&new_bits, &value, sizeof(double));
+  }
+  while (!__atomic_compare_exchange_n((uint64_t *) &e->support, &old_bits,
+                                      new_bits, 1, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED));
+}
+
+void hash_destroy_entry(bitv_hash_entry_t *e)
+{
+  /* the entry and its bit vector belong to the pool */
   if(e->tree_vector)
     free(e->tree_vector);
-
-  free(e);
+  e->tree_vector = NULL;
 }
 
 void hash_destroy(bitv_hashtable_t *h)
@@ -93,161 +152,299 @@ void hash_destroy(bitv_hashtable_t *h)
     i,
     entry_count = 0;
 
-
   for(i = 0; i < h->table_size; ++i)
   {
-    if(h->table[i] != NULL)
-  	{
-  	  bitv_hash_entry_t *e = h->table[i];
-  	  bitv_hash_entry_t *previous;
-
-  	  do
-	    {
-	      previous = e;
-	      e = e->next;
-
-        hash_destroy_entry(previous);
-	      ++entry_count;
-	    }
-  	  while(e != NULL);
-  	}
+    bitv_hash_entry_t *e = hash_entry_at(h, i);
+    if (e)
+    {
+      hash_destroy_entry(e);
+      ++entry_count;
+    }
   }
 
   assert(entry_count == h->entry_count);
 
+  while (h->chunks)
+  {
+    bitv_hash_chunk_t * chunk = h->chunks;
+    h->chunks = chunk->next;
+    free(chunk);
+  }
+
+  if (h->lock)
+  {
+    pthread_rwlock_destroy((pthread_rwlock_t *) h->lock);
+    free(h->lock);
+  }
+
   free(h->table);
   free(h);
 }
 
-bitv_hash_entry_t *entry_init(double support)
+bitv_hash_entry_t *hash_entry_at(const bitv_hashtable_t *h, unsigned int slot)
+{
+  bitv_hash_entry_t *e = h->table[slot];
+  return (e == HASH_DELETED) ? NULL : e;
+}
+
+/* take a new entry from the pool, growing it geometrically */
+static bitv_hash_entry_t *entry_init(bitv_hashtable_t *h, double support)
 {
-  bitv_hash_entry_t *e = (bitv_hash_entry_t*)malloc(sizeof(bitv_hash_entry_t));
+  bitv_hash_chunk_t * chunk = h->chunks;
+  bitv_hash_entry_t * e;
 
-  e->bit_vector     = (pll_split_t)NULL;
+  if (!chunk || chunk->used == chunk->capacity)
+  {
+    unsigned int capacity = h->pool_size > HASH_MIN_CHUNK ?
+                                              h->pool_size : HASH_MIN_CHUNK;
+    size_t entries_size = sizeof(bitv_hash_chunk_t) +
+                          capacity * sizeof(bitv_hash_entry_t);
+
+    chunk = (bitv_hash_chunk_t *) malloc(entries_size +
+                     (size_t) capacity * h->bitv_len * sizeof(pll_split_base_t));
+    if (!chunk)
+    {
+      pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                       "Cannot allocate memory for hashtable entries\n");
+      return NULL;
+    }
+
+    chunk->capacity = capacity;
+    chunk->used = 0;
+    chunk->bitv_slab = (pll_split_base_t *) ((char *) chunk + entries_size);
+    chunk->next = h->chunks;
+    h->chunks = chunk;
+    h->pool_size += capacity;
+  }
+
+  e = &chunk->entries[chunk->used];
+  e->bit_vector     = chunk->bitv_slab + (size_t) chunk->used * h->bitv_len;
   e->tree_vector    = (unsigned int*)NULL;
+  e->tip_count      = 0;
   e->support        = support;
   e->bip_number     = 0;
-  e->next       = (bitv_hash_entry_t*)NULL;
+  ++chunk->used;
 
   return e;
 }
 
-hash_key_t hash_get_key(pll_split_t s, int len)
+bitv_hash_key_t hash_get_key(const pll_split_t s, unsigned int len)
 {
-  hash_key_t h = 0;
-  int i;
+  bitv_hash_key_t h = 0x9E3779B97F4A7C15ULL ^ len;
+  unsigned int i;
 
   for(i = 0; i < len; ++i)
   {
-    h += s[i];
-    h += ( h << 10 );
-    h ^= ( h >> 6 );
+    h ^= s[i];
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 32;
   }
 
-  h += ( h << 3 );
-  h ^= ( h >> 11 );
-  h += ( h << 15 );
+  /* 64-bit finalizer (MurmurHash3) */
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 33;
 
   return h;
 }
 
-/* this function only increments support for existing splits,
- * but never adds new splits to the hashtable */
-int hash_update(pll_split_t bit_vector,
-                bitv_hashtable_t *h,
-                hash_key_t key,
-                double support,
-                unsigned int position)
+/* returns the slot holding the split, or the first free slot of its probe
+   sequence (preferring a deleted one) if it is not in the table */
+static unsigned int hash_find_slot(const bitv_hashtable_t *h,
+                                   const pll_split_t bit_vector,
+                                   bitv_hash_key_t key,
+                                   int * found)
 {
-  if (key == HASH_KEY_UNDEF)
-  {
-      key = hash_get_key(bit_vector, (int)h->bitv_len);
-      position = key % h->table_size;
-  }
+  const unsigned int mask = h->table_size - 1;
+  unsigned int position = (unsigned int) key & mask;
+  unsigned int free_slot = h->table_size;
 
-  if(h->table[position] != NULL)
+  *found = 0;
+
+  for (;;)
   {
     bitv_hash_entry_t *e = h->table[position];
-    do
+
+    if (!e)
+      return free_slot < h->table_size ? free_slot : position;
+
+    if (e == HASH_DELETED)
     {
-      unsigned int i = 0;
+      if (free_slot == h->table_size)
+        free_slot = position;
+    }
+    else if (e->key == key &&
+             !memcmp(e->bit_vector, bit_vector,
+                     h->bitv_len * sizeof(pll_split_base_t)))
+    {
+      *found = 1;
+      return position;
+    }
 
-      /* check for identity of bipartitions */
+    position = (position + 1) & mask;
+  }
+}
 
-      if (e->key == key)
-        for(i = 0; i < h->bitv_len; ++i)
-          if(bit_vector[i] != e->bit_vector[i])
-            break;
+static int hash_resize(bitv_hashtable_t *h, unsigned int table_size)
+{
+  const unsigned int mask = table_size - 1;
+  bitv_hash_entry_t **table;
+  unsigned int i;
 
-      if(i == h->bitv_len)
-      {
-        e->support = e->support + support;
-        return PLL_SUCCESS;
-      }
+  table = (bitv_hash_entry_t**)calloc(table_size, sizeof(bitv_hash_entry_t*));
+  if (!table)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for hashtable entries\n");
+    return PLL_FAILURE;
+  }
 
-      /* otherwise keep searching */
-      e = e->next;
+  /* rehash live entries only, dropping removed ones */
+  for (i = 0; i < h->table_size; ++i)
+  {
+    bitv_hash_entry_t *e = hash_entry_at(h, i);
+    if (e)
+    {
+      unsigned int position = (unsigned int) e->key & mask;
+      while (table[position])
+        position = (position + 1) & mask;
+      table[position] = e;
     }
-    while(e != (bitv_hash_entry_t*)NULL);
   }
 
-  return PLL_FAILURE;
+  free(h->table);
+  h->table = table;
+  h->table_size = table_size;
+  h->deleted_count = 0;
+
+  return PLL_SUCCESS;
 }
 
-void hash_insert(pll_split_t bit_vector,
-                 bitv_hashtable_t *h,
-                 unsigned int bip_number,
-                 hash_key_t key,
-                 double support,
-                 unsigned int position)
+static bitv_hash_entry_t *hash_lookup_key(const bitv_hashtable_t *h,
+                                          const pll_split_t bit_vector,
+                                          bitv_hash_key_t key)
 {
+  int found;
+  unsigned int position = hash_find_slot(h, bit_vector, key, &found);
+
+  return found ? h->table[position] : NULL;
+}
+
+bitv_hash_entry_t *hash_lookup(const bitv_hashtable_t *h,
+                               const pll_split_t bit_vector)
+{
+  bitv_hash_key_t key = hash_get_key(bit_vector, h->bitv_len);
+  bitv_hash_entry_t *e;
+
+  hash_lock_shared(h);
+  e = hash_lookup_key(h, bit_vector, key);
+  hash_unlock(h);
+
+  return e;
+}
+
+/* this function only increments support for existing splits,
+ * but never adds new splits to the hashtable */
+int hash_update(const pll_split_t bit_vector,
+                bitv_hashtable_t *h,
+                double support)
+{
+  bitv_hash_key_t key = hash_get_key(bit_vector, h->bitv_len);
   bitv_hash_entry_t *e;
 
-  if (key == HASH_KEY_UNDEF)
+  hash_lock_shared(h);
+  e = hash_lookup_key(h, bit_vector, key);
+  if (e)
+    hash_add_support(h, e, support);
+  hash_unlock(h);
+
+  return e ? PLL_SUCCESS : PLL_FAILURE;
+}
+
+bitv_hash_entry_t *hash_insert(const pll_split_t bit_vector,
+                               bitv_hashtable_t *h,
+                               unsigned int bip_number,
+                               double support)
+{
+  bitv_hash_entry_t *e;
+  bitv_hash_key_t key = hash_get_key(bit_vector, h->bitv_len);
+  unsigned int position;
+  int found;
+
+  if (h->lock)
   {
-      key = hash_get_key(bit_vector, (int)h->bitv_len);
-      position = key % h->table_size;
+    /* most splits are already there: try without the exclusive lock */
+    hash_lock_shared(h);
+    e = hash_lookup_key(h, bit_vector, key);
+    if (e)
+      hash_add_support(h, e, support);
+    hash_unlock(h);
+
+    if (e)
+      return e;
   }
 
-  if(h->table[position] != NULL)
-    {
-      /* search for this split in hashtable, and increment its support if found */
-      if (hash_update(bit_vector, h, key, support, position))
-        return;
+  hash_lock_exclusive(h);
 
-      /* add new split to the hashtable */
-      e = entry_init(support);
-      e->key = key;
-      e->bip_number = bip_number;
+  /* keep the load factor (including removed entries) below 1/2 */
+  if (2 * (h->entry_count + h->deleted_count + 1) > h->table_size)
+  {
+    unsigned int table_size = h->table_size;
+    while (4 * (h->entry_count + 1) > table_size)
+      table_size <<= 1;
+    if (!hash_resize(h, table_size))
+    {
+      hash_unlock(h);
+      return NULL;
+    }
+  }
 
-      e->bit_vector = (pll_split_t) calloc(h->bitv_len, sizeof(pll_split_base_t));
-      memcpy(e->bit_vector, bit_vector, sizeof(pll_split_base_t) * h->bitv_len);
+  position = hash_find_slot(h, bit_vector, key, &found);
 
-      e->next = h->table[position];
-      h->table[position] = e;
-    }
-  else
+  if (found)
   {
-    e = entry_init(support);
-    e->key = key;
-    e->bip_number = bip_number;
-    e->bit_vector = (pll_split_t) calloc(h->bitv_len, sizeof(pll_split_base_t));
-    memcpy(e->bit_vector, bit_vector, sizeof(pll_split_base_t) * h->bitv_len);
+    /* increment support of the existing split */
+    e = h->table[position];
+    hash_add_support(h, e, support);
+    hash_unlock(h);
+    return e;
+  }
 
-    h->table[position] = e;
+  /* add new split to the hashtable */
+  e = entry_init(h, support);
+  if (!e)
+  {
+    hash_unlock(h);
+    return NULL;
   }
 
-  h->entry_count =  h->entry_count + 1;
+  e->key = key;
+  e->bip_number = bip_number;
+  memcpy(e->bit_vector, bit_vector, sizeof(pll_split_base_t) * h->bitv_len);
+
+  if (h->table[position] == HASH_DELETED)
+    --h->deleted_count;
+  h->table[position] = e;
+
+  h->entry_count = h->entry_count + 1;
+
+  hash_unlock(h);
+
+  return e;
 }
 
-void hash_remove(bitv_hashtable_t *h,
-                 bitv_hash_entry_t ** prev_ptr,
-                 bitv_hash_entry_t * e)
+void hash_remove(bitv_hashtable_t *h, unsigned int slot)
 {
-  *prev_ptr = e->next;
+  bitv_hash_entry_t *e = hash_entry_at(h, slot);
+
+  assert(e);
+
   hash_destroy_entry(e);
+  h->table[slot] = HASH_DELETED;
+  ++h->deleted_count;
   --h->entry_count;
-  assert(h->entry_count >= 0);
 }
 
 void hash_print(bitv_hashtable_t *h)
@@ -255,12 +452,11 @@ void hash_print(bitv_hashtable_t *h)
   unsigned int i;
   for (i=0; i<h->table_size; ++i)
   {
-    bitv_hash_entry_t * e =  h->table[i];
-    while (e != NULL)
+    bitv_hash_entry_t * e = hash_entry_at(h, i);
+    if (e)
     {
       pllmod_utree_split_show(e->bit_vector, h->bit_count);
       printf(" %f\n", e->support);
-      e = e->next;
     }
   }
 }
@@ -281,8 +477,11 @@ void bitv_normalize(pll_split_t bitv, unsigned int bit_count)
       bitv[i] = ~bitv[i];
     }
 
-    unsigned int mask = (1<<split_offset) - 1;
-    bitv[split_len - 1] &= mask;
+    if (split_offset)
+    {
+      unsigned int mask = (1u<<split_offset) - 1;
+      bitv[split_len - 1] &= mask;
+    }
   }
 }
 
@@ -301,41 +500,90 @@ unsigned int bitv_length(unsigned int bit_count)
 
 /* string */
 
-string_hashtable_t *string_hash_init(unsigned int n, unsigned int max_labels)
+/*
+ * Open addressing with linear probing. The table is built once and it is
+ * only read afterwards, so it can be shared among threads. Keys and
+ * comparisons skip the prefix that all labels have in common, which is
+ * checked once for each lookup.
+ */
+
+#define STRING_HASH_MIN_SIZE 64
+
+static hash_key_t string_hash_key_n(const char * s, size_t len)
 {
-  /* init with primes */
-  static const hash_key_t init_table[] = {
-                                  53, 97, 193, 389, 769, 1543, 3079, 6151,
-                                  12289, 24593, 49157, 98317, 196613, 393241,
-                                  786433, 1572869, 3145739, 6291469, 12582917,
-                                  25165843, 50331653, 100663319, 201326611,
-                                  402653189, 805306457, 1610612741};
-
-  string_hashtable_t *h = (string_hashtable_t*)malloc(sizeof(string_hashtable_t));
-  assert(h);
+  /* FNV-1a */
+  hash_key_t h = 2166136261u;
+  size_t i;
 
-  unsigned int
-    table_size,
-    i,
-    prime_table_length = sizeof(init_table)/sizeof(hash_key_t),
-    max_size = (hash_key_t)-1;
+  for (i = 0; i < len; ++i)
+  {
+    h ^= (unsigned char) s[i];
+    h *= 16777619u;
+  }
+
+  return h;
+}
+
+static void string_hash_place(string_hashtable_t *h,
+                              const string_hash_entry_t *e)
+{
+  unsigned int mask = h->table_size - 1;
+  unsigned int i = e->key & mask;
+
+  while (h->table[i].word)
+    i = (i + 1) & mask;
+
+  h->table[i] = *e;
+}
+
+/* recomputes the keys after the common prefix gets shorter */
+static void string_hash_rekey(string_hashtable_t *h)
+{
+  string_hash_entry_t *old_table = h->table;
+  unsigned int prefix_length = h->prefix_length;
+  unsigned int i;
 
-  assert(n <= max_size);
+  h->table = (string_hash_entry_t*)calloc(h->table_size,
+                                          sizeof(string_hash_entry_t));
+  assert(h->table);
 
-  i = 0;
+  for (i = 0; i < h->table_size; ++i)
+  {
+    string_hash_entry_t *e = old_table + i;
+    if (e->word)
+    {
+      e->key = string_hash_key_n(e->word + prefix_length,
+                                 e->length - prefix_length);
+      string_hash_place(h, e);
+    }
+  }
+
+  free(old_table);
+}
+
+string_hashtable_t *string_hash_init(unsigned int n, unsigned int max_labels)
+{
+  unsigned int table_size = STRING_HASH_MIN_SIZE;
 
-  while(init_table[i] < n && i < prime_table_length)
-    ++i;
+  string_hashtable_t *h = (string_hashtable_t*)calloc(1,
+                                                     sizeof(string_hashtable_t));
+  assert(h);
 
-  assert(i < prime_table_length);
+  /* powers of two, at most half full */
+  while ((table_size < n || table_size / 2 < max_labels) &&
+         table_size < (1U << 31))
+    table_size <<= 1;
 
-  table_size = init_table[i];
+  h->table = (string_hash_entry_t*)calloc(table_size,
+                                          sizeof(string_hash_entry_t));
+  h->labels = (char **) calloc(max_labels, sizeof(char *));
+  assert(h->table && h->labels);
 
-  h->table = (string_hash_entry_t**)calloc(table_size,
-                                           sizeof(string_hash_entry_t*));
-  h->labels = (char **) malloc(max_labels * sizeof(char *));
   h->table_size = table_size;
   h->entry_count = 0;
+  h->max_labels = max_labels;
+  h->prefix = NULL;
+  h->prefix_length = 0;
 
   return h;
 }
@@ -346,24 +594,11 @@ void string_hash_destroy(string_hashtable_t *h)
 
   for(i = 0; i < h->table_size; ++i)
   {
-    if(h->table[i] != NULL)
-  	{
-  	  string_hash_entry_t *e = h->table[i];
-  	  string_hash_entry_t *previous;
-
-  	  do
-	    {
-	      previous = e;
-	      e = e->next;
-
-	      if(previous->word)
-		      free(previous->word);
-
-	      free(previous);
-	      ++entry_count;
-	    }
-  	  while(e != NULL);
-  	}
+    if (h->table[i].word)
+    {
+      free(h->table[i].word);
+      ++entry_count;
+    }
   }
 
   assert(entry_count == h->entry_count);
@@ -375,37 +610,54 @@ void string_hash_destroy(string_hashtable_t *h)
 
 hash_key_t string_hash_get_key(const char * s)
 {
-  hash_key_t h = 0;
-
-  for(; *s; ++s)
-    h = 31 * h + (unsigned int)*s;
-
-  return h;
+  return string_hash_key_n(s, strlen(s));
 }
 
 int string_hash_insert(const char *s,
                 string_hashtable_t *h,
                 int node_number)
 {
-  hash_key_t position = string_hash_get_key(s) % h->table_size;
-  string_hash_entry_t *p = h->table[position];
+  string_hash_entry_t e;
+  size_t len = strlen(s);
+  unsigned int prefix_length;
 
-  for(; p!= NULL; p = p->next)
+  assert(node_number >= 0 && (unsigned int) node_number < h->max_labels);
+
+  if (string_hash_lookup_n(s, len, h) != -1)
+    return PLL_FAILURE;
+
+  assert(h->entry_count < h->table_size / 2);
+
+  e.word = (char *) malloc((len + 1) * sizeof(char));
+  assert(e.word);
+  memcpy(e.word, s, len + 1);
+  e.length = (unsigned int) len;
+  e.node_number = node_number;
+  h->labels[node_number] = e.word;
+
+  /* shorten the common prefix */
+  if (!h->prefix)
   {
-    if(strcmp(s, p->word) == 0)
-	    return PLL_FAILURE;
+    h->prefix = e.word;
+    h->prefix_length = e.length;
   }
+  else
+  {
+    for (prefix_length = 0;
+         prefix_length < h->prefix_length &&
+         h->prefix[prefix_length] == s[prefix_length];
+         ++prefix_length);
 
-  p = (string_hash_entry_t *)malloc(sizeof(string_hash_entry_t));
-  assert(p);
-
-  h->labels[node_number] = (char *) malloc((strlen(s) + 1) * sizeof(char));
-  p->node_number = node_number;
-  p->word = h->labels[node_number];
-  strcpy(p->word, s);
+    if (prefix_length < h->prefix_length)
+    {
+      h->prefix_length = prefix_length;
+      string_hash_rekey(h);
+    }
+  }
 
-  p->next =  h->table[position];
-  h->table[position] = p;
+  e.key = string_hash_key_n(e.word + h->prefix_length,
+                            e.length - h->prefix_length);
+  string_hash_place(h, &e);
   ++h->entry_count;
 
   return PLL_SUCCESS;
@@ -413,13 +665,30 @@ int string_hash_insert(const char *s,
 
 int string_hash_lookup(char *s, string_hashtable_t *h)
 {
-  hash_key_t position = string_hash_get_key(s) % h->table_size;
-  string_hash_entry_t *p = h->table[position];
+  return string_hash_lookup_n(s, strlen(s), h);
+}
+
+/* lookup of a string that is not null-terminated */
+int string_hash_lookup_n(const char *s, size_t len, string_hashtable_t *h)
+{
+  unsigned int prefix_length = h->prefix_length;
+  unsigned int mask = h->table_size - 1;
+  unsigned int i;
+  hash_key_t key;
+
+  if (!h->entry_count || len < prefix_length ||
+      memcmp(s, h->prefix, prefix_length))
+    return -1;
+
+  key = string_hash_key_n(s + prefix_length, len - prefix_length);
 
-  for(; p!= NULL; p = p->next)
+  for (i = key & mask; h->table[i].word; i = (i + 1) & mask)
   {
-    if(strcmp(s, p->word) == 0)
-      return p->node_number;
+    const string_hash_entry_t *e = h->table + i;
+    if (e->key == key && e->length == len &&
+        !memcmp(e->word + prefix_length, s + prefix_length,
+                len - prefix_length))
+      return e->node_number;
   }
 
   return -1;
@@ -29,30 +29,30 @@
 bitv_hashtable_t *hash_init(unsigned int n,
                             unsigned int bit_count);
 
+int hash_set_concurrent(bitv_hashtable_t *h);
+
 void hash_destroy_entry(bitv_hash_entry_t *e);
 
 void hash_destroy(bitv_hashtable_t *h);
 
-bitv_hash_entry_t *entry_init(double support);
+/* entry at a table slot, or NULL if the slot is empty */
+bitv_hash_entry_t *hash_entry_at(const bitv_hashtable_t *h, unsigned int slot);
+
+bitv_hash_key_t hash_get_key(const pll_split_t s, unsigned int len);
 
-hash_key_t hash_get_key(pll_split_t s, int len);
+bitv_hash_entry_t *hash_lookup(const bitv_hashtable_t *h,
+                               const pll_split_t bit_vector);
 
-int hash_update(pll_split_t bit_vector,
-                 bitv_hashtable_t *h,
-                 hash_key_t key,
-                 double support,
-                 unsigned int position);
+int hash_update(const pll_split_t bit_vector,
+                bitv_hashtable_t *h,
+                double support);
 
-void hash_insert(pll_split_t bit_vector,
-                 bitv_hashtable_t *h,
-                 unsigned int bip_number,
-                 hash_key_t key,
-                 double support,
-                 unsigned int position);
+bitv_hash_entry_t *hash_insert(const pll_split_t bit_vector,
+                               bitv_hashtable_t *h,
+                               unsigned int bip_number,
+                               double support);
 
-void hash_remove(bitv_hashtable_t *h,
-                 bitv_hash_entry_t ** prev_ptr,
-                 bitv_hash_entry_t * e);
+void hash_remove(bitv_hashtable_t *h, unsigned int slot);
 
 void hash_print(bitv_hashtable_t *h);
 
@@ -78,4 +78,6 @@ int string_hash_insert(const char *s,
 
 int string_hash_lookup(char *s, string_hashtable_t *h);
 
+int string_hash_lookup_n(const char *s, size_t len, string_hashtable_t *h);
+
 #endif
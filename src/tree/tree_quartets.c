@@ -0,0 +1,738 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+
+ /**
+  * @file tree_quartets.c
+  *
+  * @brief Quartet distances for unrooted trees and triplet distances for
+  *        rooted trees
+  *
+  * Both distances are computed in O(n^2) time by counting, for every pair of
+  * inner nodes (u,v) of the two trees, the topologies that are resolved at u
+  * and at v. A quartet ab|cd of a binary tree is resolved at the node u of the
+  * path a-b closest to the path c-d, that is, a and b are in two different
+  * subtrees around u and c,d are both in the third one. Given the number of
+  * shared taxa between the subtrees around u and v, the number of quartets
+  * resolved as ab|cd at both nodes follows directly. Each shared quartet is
+  * counted twice (once from each side). Triplets ab|c are resolved at the
+  * lowest common ancestor of a and b and are counted once.
+  *
+  * Trees are flattened into postorder arrays, such that the shared taxa
+  * between one subtree of the first tree and all the subtrees of the second
+  * one are computed in a single pass.
+  *
+  * @author Diego Darriba
+  */
+
+#include <pthread.h>
+
+#include "pll_tree.h"
+
+#include "../pllmod_common.h"
+
+/* binary tree flattened in postorder, rooted at a tip or at the root */
+typedef struct quartet_tree_s
+{
+  unsigned int tip_count;
+  unsigned int node_count;
+  int * taxon;              /* taxon at each tip, -1 for inner nodes */
+  unsigned int * left;
+  unsigned int * right;
+  unsigned int * first;     /* first node of the subtree in postorder */
+  unsigned int * size;      /* number of taxa in the subtree */
+  char * seen;
+} quartet_tree_t;
+
+/* per-thread working memory */
+typedef struct quartet_buffer_s
+{
+  unsigned char * side;     /* subtree of the current node containing a taxon */
+  uint64_t * count1;        /* shared taxa with the left subtree */
+  uint64_t * count2;        /* shared taxa with the right subtree */
+} quartet_buffer_t;
+
+typedef struct quartet_matrix_s
+{
+  quartet_tree_t ** trees;
+  unsigned int tree_count;
+  uint64_t * distances;
+  uint64_t next_pair;
+  uint64_t pair_count;
+  int concurrent;
+  pthread_mutex_t mutex;
+} quartet_matrix_t;
+
+typedef struct quartet_worker_s
+{
+  quartet_matrix_t * m;
+  quartet_buffer_t buffer;
+} quartet_worker_t;
+
+static quartet_tree_t * quartet_tree_alloc(unsigned int tip_count,
+                                           unsigned int node_count);
+static void quartet_tree_destroy(quartet_tree_t * t);
+static quartet_tree_t * quartet_tree_from_utree(pll_unode_t * tree,
+                                                unsigned int tip_count);
+static quartet_tree_t * quartet_tree_from_rtree(pll_rnode_t * root,
+                                                unsigned int tip_count);
+static int quartet_buffer_init(quartet_buffer_t * b,
+                               unsigned int tip_count);
+static void quartet_buffer_free(quartet_buffer_t * b);
+static uint64_t quartet_shared(const quartet_tree_t * t1,
+                               const quartet_tree_t * t2,
+                               int triplets,
+                               quartet_buffer_t * b);
+static uint64_t quartet_distance(const quartet_tree_t * t1,
+                                 const quartet_tree_t * t2,
+                                 quartet_buffer_t * b);
+static void * quartet_matrix_worker(void * data);
+
+/**
+ * Computes the quartet distance between two unrooted binary trees
+ *
+ * The quartet distance is the number of sets of 4 taxa whose induced
+ * topologies differ between the trees. Taxa are identified by the node
+ * indices at the tips. Time complexity is O(n^2).
+ *
+ * @param t1        any node of the first tree
+ * @param t2        any node of the second tree
+ * @param tip_count number of tips
+ *
+ * @returns the quartet distance, or 0 on error (check pll_errno)
+ */
+PLL_EXPORT uint64_t pllmod_utree_quartet_distance(pll_unode_t * t1,
+                                                  pll_unode_t * t2,
+                                                  unsigned int tip_count)
+{
+  quartet_tree_t * q1 = NULL, * q2 = NULL;
+  quartet_buffer_t buffer;
+  uint64_t distance = 0;
+
+  /* reset error */
+  pll_errno = 0;
+
+  if (!t1 || !t2 || tip_count < 4)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Invalid parameters for computing quartet distance");
+    return 0;
+  }
+
+  if ((q1 = quartet_tree_from_utree(t1, tip_count)) &&
+      (q2 = quartet_tree_from_utree(t2, tip_count)) &&
+      quartet_buffer_init(&buffer, tip_count))
+  {
+    distance = quartet_distance(q1, q2, &buffer);
+    quartet_buffer_free(&buffer);
+  }
+
+  quartet_tree_destroy(q1);
+  quartet_tree_destroy(q2);
+
+  return distance;
+}
+
+/**
+ * Computes the triplet distance between two rooted binary trees
+ *
+ * The triplet distance is the number of sets of 3 taxa whose induced rooted
+ * topologies differ between the trees. Taxa are identified by the node
+ * indices at the tips. Time complexity is O(n^2).
+ *
+ * @param t1        root of the first tree
+ * @param t2        root of the second tree
+ * @param tip_count number of tips
+ *
+ * @returns the triplet distance, or 0 on error (check pll_errno)
+ */
+PLL_EXPORT uint64_t pllmod_rtree_triplet_distance(pll_rnode_t * t1,
+                                                  pll_rnode_t * t2,
+                                                  unsigned int tip_count)
+{
+  quartet_tree_t * q1 = NULL, * q2 = NULL;
+  quartet_buffer_t buffer;
+  uint64_t distance = 0;
+  uint64_t n = tip_count;
+
+  /* reset error */
+  pll_errno = 0;
+
+  if (!t1 || !t2 || tip_count < 3)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Invalid parameters for computing triplet distance");
+    return 0;
+  }
+
+  if ((q1 = quartet_tree_from_rtree(t1, tip_count)) &&
+      (q2 = quartet_tree_from_rtree(t2, tip_count)) &&
+      quartet_buffer_init(&buffer, tip_count))
+  {
+    distance = n * (n - 1) * (n - 2) / 6 -
+               quartet_shared(q1, q2, 1, &buffer);
+    quartet_buffer_free(&buffer);
+  }
+
+  quartet_tree_destroy(q1);
+  quartet_tree_destroy(q2);
+
+  return distance;
+}
+
+/**
+ * Computes the quartet distances between all pairs of trees in a set
+ *
+ * All trees must be binary and share the same taxa, identified by the node
+ * indices at the tips. Pairs of trees are distributed among `n_threads`
+ * threads.
+ *
+ * @param trees      array of trees
+ * @param tree_count number of trees
+ * @param n_threads  number of threads (0 or 1 for a sequential run)
+ * @param distances  [out] tree_count x tree_count symmetric matrix, row-major
+ *
+ * @returns PLL_SUCCESS, or PLL_FAILURE on error (check pll_errmsg)
+ */
+PLL_EXPORT int pllmod_utree_quartet_distance_matrix(pll_utree_t * const * trees,
+                                                    unsigned int tree_count,
+                                                    unsigned int n_threads,
+                                                    uint64_t * distances)
+{
+  quartet_matrix_t m;
+  quartet_worker_t * workers = NULL;
+  pthread_t * threads = NULL;
+  unsigned int tip_count;
+  unsigned int i, thread_count = 0;
+  int retval = PLL_FAILURE;
+
+  /* reset error */
+  pll_errno = 0;
+
+  if (!trees || !distances || !tree_count)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Invalid parameters for computing quartet distances");
+    return PLL_FAILURE;
+  }
+
+  tip_count = trees[0]->tip_count;
+  if (tip_count < 4)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Quartet distances require at least 4 tips");
+    return PLL_FAILURE;
+  }
+
+  for (i = 0; i < tree_count; ++i)
+  {
+    if (trees[i]->tip_count != tip_count)
+    {
+      pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                       "Tree #%u has %u tips (expected %u)",
+                       i, trees[i]->tip_count, tip_count);
+      return PLL_FAILURE;
+    }
+  }
+
+  if (n_threads < 1)
+    n_threads = 1;
+
+  memset(&m, 0, sizeof(quartet_matrix_t));
+  m.tree_count = tree_count;
+  m.distances = distances;
+  m.pair_count = (uint64_t) tree_count * (tree_count - 1) / 2;
+  if (m.pair_count < n_threads)
+    n_threads = m.pair_count ? (unsigned int) m.pair_count : 1;
+
+  m.trees = (quartet_tree_t **) calloc(tree_count, sizeof(quartet_tree_t *));
+  workers = (quartet_worker_t *) calloc(n_threads, sizeof(quartet_worker_t));
+  threads = (pthread_t *) malloc(n_threads * sizeof(pthread_t));
+  if (!m.trees || !workers || !threads)
+  {
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for quartet distances");
+    goto cleanup;
+  }
+
+  /* flatten the trees once, all failures happen before the threads start */
+  for (i = 0; i < tree_count; ++i)
+  {
+    pll_utree_t * tree = trees[i];
+    m.trees[i] = quartet_tree_from_utree(tree->nodes[tree->tip_count +
+                                                     tree->inner_count - 1],
+                                         tip_count);
+    if (!m.trees[i])
+    {
+      char msg[PLLMOD_ERRMSG_LEN];
+      strncpy(msg, pll_errmsg, PLLMOD_ERRMSG_LEN - 1);
+      msg[PLLMOD_ERRMSG_LEN - 1] = '\0';
+      pllmod_set_error(pll_errno, "%s [tree #%u]", msg, i);
+      goto cleanup;
+    }
+  }
+
+  for (i = 0; i < n_threads; ++i)
+  {
+    workers[i].m = &m;
+    if (!quartet_buffer_init(&workers[i].buffer, tip_count))
+      goto cleanup;
+  }
+
+  for (i = 0; i < tree_count; ++i)
+    distances[(size_t) i * tree_count + i] = 0;
+
+  if (n_threads == 1)
+    quartet_matrix_worker(workers);
+  else
+  {
+    m.concurrent = 1;
+    pthread_mutex_init(&m.mutex, NULL);
+    for (thread_count = 0; thread_count < n_threads; ++thread_count)
+    {
+      if (pthread_create(threads + thread_count, NULL, quartet_matrix_worker,
+                         workers + thread_count))
+        break;
+    }
+
+    /* if some threads could not be created, this thread does their work */
+    if (thread_count < n_threads)
+      quartet_matrix_worker(workers + thread_count);
+
+    for (i = 0; i < thread_count; ++i)
+      pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&m.mutex);
+  }
+
+  retval = PLL_SUCCESS;
+
+cleanup:
+  if (m.trees)
+    for (i = 0; i < tree_count; ++i)
+      quartet_tree_destroy(m.trees[i]);
+  if (workers)
+    for (i = 0; i < n_threads; ++i)
+      quartet_buffer_free(&workers[i].buffer);
+  free(m.trees);
+  free(workers);
+  free(threads);
+
+  return retval;
+}
+
+/******************************************************************************/
+/* static functions */
+
+static quartet_tree_t * quartet_tree_alloc(unsigned int tip_count,
+                                           unsigned int node_count)
+{
+  quartet_tree_t * t = (quartet_tree_t *) calloc(1, sizeof(quartet_tree_t));
+
+  if (t)
+  {
+    t->tip_count = tip_count;
+    t->taxon = (int *) malloc(node_count * sizeof(int));
+    t->left = (unsigned int *) malloc(node_count * sizeof(unsigned int));
+    t->right = (unsigned int *) malloc(node_count * sizeof(unsigned int));
+    t->first = (unsigned int *) malloc(node_count * sizeof(unsigned int));
+    t->size = (unsigned int *) malloc(node_count * sizeof(unsigned int));
+    t->seen = (char *) calloc(tip_count, sizeof(char));
+    if (!t->taxon || !t->left || !t->right || !t->first || !t->size ||
+        !t->seen)
+    {
+      quartet_tree_destroy(t);
+      t = NULL;
+    }
+  }
+
+  if (!t)
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for quartet tree");
+
+  return t;
+}
+
+static void quartet_tree_destroy(quartet_tree_t * t)
+{
+  if (t)
+  {
+    free(t->taxon);
+    free(t->left);
+    free(t->right);
+    free(t->first);
+    free(t->size);
+    free(t->seen);
+    free(t);
+  }
+}
+
+/* appends a tip to the flattened tree, returns its position */
+static int quartet_tree_add_tip(quartet_tree_t * t,
+                                unsigned int tip_index,
+                                unsigned int max_nodes,
+                                unsigned int * pos)
+{
+  unsigned int i = t->node_count;
+
+  if (tip_index >= t->tip_count)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Tip index %u out of range (%u tips)",
+                     tip_index, t->tip_count);
+    return PLL_FAILURE;
+  }
+  if (t->seen[tip_index])
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Tip index %u appears more than once", tip_index);
+    return PLL_FAILURE;
+  }
+  if (i == max_nodes)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Tree has more than %u tips", t->tip_count);
+    return PLL_FAILURE;
+  }
+
+  t->seen[tip_index] = 1;
+  t->taxon[i] = (int) tip_index;
+  t->first[i] = i;
+  t->size[i] = 1;
+  ++t->node_count;
+
+  *pos = i;
+  return PLL_SUCCESS;
+}
+
+/* appends an inner node after its children, returns its position */
+static int quartet_tree_add_inner(quartet_tree_t * t,
+                                  unsigned int left,
+                                  unsigned int right,
+                                  unsigned int max_nodes,
+                                  unsigned int * pos)
+{
+  unsigned int i = t->node_count;
+
+  if (i == max_nodes)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Tree has more than %u tips", t->tip_count);
+    return PLL_FAILURE;
+  }
+
+  t->taxon[i] = -1;
+  t->left[i] = left;
+  t->right[i] = right;
+  t->first[i] = t->first[left];
+  t->size[i] = t->size[left] + t->size[right];
+  ++t->node_count;
+
+  *pos = i;
+  return PLL_SUCCESS;
+}
+
+static int quartet_flatten_unode(quartet_tree_t * t,
+                                 pll_unode_t * node,
+                                 unsigned int max_nodes,
+                                 unsigned int * pos)
+{
+  unsigned int left, right;
+
+  if (pllmod_utree_is_tip(node))
+    return quartet_tree_add_tip(t, node->node_index, max_nodes, pos);
+
+  if (node->next->next->next != node)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Quartet distances require binary trees");
+    return PLL_FAILURE;
+  }
+
+  if (!quartet_flatten_unode(t, node->next->back, max_nodes, &left) ||
+      !quartet_flatten_unode(t, node->next->next->back, max_nodes, &right))
+    return PLL_FAILURE;
+
+  return quartet_tree_add_inner(t, left, right, max_nodes, pos);
+}
+
+static int quartet_flatten_rnode(quartet_tree_t * t,
+                                 pll_rnode_t * node,
+                                 unsigned int max_nodes,
+                                 unsigned int * pos)
+{
+  unsigned int left, right;
+
+  if (!node->left && !node->right)
+    return quartet_tree_add_tip(t, node->node_index, max_nodes, pos);
+
+  if (!node->left || !node->right)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Triplet distances require binary trees");
+    return PLL_FAILURE;
+  }
+
+  if (!quartet_flatten_rnode(t, node->left, max_nodes, &left) ||
+      !quartet_flatten_rnode(t, node->right, max_nodes, &right))
+    return PLL_FAILURE;
+
+  return quartet_tree_add_inner(t, left, right, max_nodes, pos);
+}
+
+/* checks that all taxa are in the tree, missing_count are left out */
+static int quartet_tree_check(quartet_tree_t * t, unsigned int missing_count)
+{
+  unsigned int found = t->size[t->node_count - 1] + missing_count;
+
+  if (found != t->tip_count)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Tree has %u tips (expected %u)", found, t->tip_count);
+    return PLL_FAILURE;
+  }
+  return PLL_SUCCESS;
+}
+
+/* flattens an unrooted tree rooted at one of its tips, which is left out */
+static quartet_tree_t * quartet_tree_from_utree(pll_unode_t * tree,
+                                                unsigned int tip_count)
+{
+  quartet_tree_t * t;
+  unsigned int max_nodes = 2 * tip_count - 3;
+  unsigned int root_pos;
+
+  if (!(t = quartet_tree_alloc(tip_count, max_nodes)))
+    return NULL;
+
+  /* walk down to a tip, which becomes the root */
+  while (!pllmod_utree_is_tip(tree))
+    tree = tree->next->back;
+
+  if (tree->node_index >= tip_count || pllmod_utree_is_tip(tree->back))
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Invalid tree for computing quartet distances");
+    quartet_tree_destroy(t);
+    return NULL;
+  }
+  t->seen[tree->node_index] = 1;
+
+  if (!quartet_flatten_unode(t, tree->back, max_nodes, &root_pos) ||
+      !quartet_tree_check(t, 1))
+  {
+    quartet_tree_destroy(t);
+    return NULL;
+  }
+
+  return t;
+}
+
+static quartet_tree_t * quartet_tree_from_rtree(pll_rnode_t * root,
+                                                unsigned int tip_count)
+{
+  quartet_tree_t * t;
+  unsigned int max_nodes = 2 * tip_count - 1;
+  unsigned int root_pos;
+
+  if (!(t = quartet_tree_alloc(tip_count, max_nodes)))
+    return NULL;
+
+  if (!quartet_flatten_rnode(t, root, max_nodes, &root_pos) ||
+      !quartet_tree_check(t, 0))
+  {
+    quartet_tree_destroy(t);
+    return NULL;
+  }
+
+  return t;
+}
+
+static int quartet_buffer_init(quartet_buffer_t * b,
+                               unsigned int tip_count)
+{
+  size_t node_count = 2 * (size_t) tip_count;
+
+  b->side = (unsigned char *) malloc(tip_count * sizeof(unsigned char));
+  b->count1 = (uint64_t *) malloc(node_count * sizeof(uint64_t));
+  b->count2 = (uint64_t *) malloc(node_count * sizeof(uint64_t));
+  if (!b->side || !b->count1 || !b->count2)
+  {
+    quartet_buffer_free(b);
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for quartet distances");
+    return PLL_FAILURE;
+  }
+  return PLL_SUCCESS;
+}
+
+static void quartet_buffer_free(quartet_buffer_t * b)
+{
+  free(b->side);
+  free(b->count1);
+  free(b->count2);
+  b->side = NULL;
+  b->count1 = b->count2 = NULL;
+}
+
+/*
+  Counts the topologies resolved at the same pair of nodes in both trees.
+
+  For each inner node u of t1, with subtrees X1 (left), X2 (right) and X3 (the
+  rest of the taxa), the taxa are labeled with their side and a postorder pass
+  over t2 computes |X1 ∩ Y| and |X2 ∩ Y| for every subtree Y. For each inner
+  node v of t2 this gives the 3x3 matrix of shared taxa between the subtrees
+  around u and v.
+
+  For quartets the result is twice the number of shared quartets. For
+  triplets it is the number of shared triplets.
+ */
+static uint64_t quartet_shared(const quartet_tree_t * t1,
+                               const quartet_tree_t * t2,
+                               int triplets,
+                               quartet_buffer_t * b)
+{
+  uint64_t n = t1->tip_count;
+  uint64_t shared = 0;
+  uint64_t * c1 = b->count1;
+  uint64_t * c2 = b->count2;
+  unsigned int u, v, x;
+
+  for (u = 0; u < t1->node_count; ++u)
+  {
+    unsigned int ul = t1->left[u];
+    unsigned int ur = t1->right[u];
+    uint64_t s1, s2;
+
+    if (t1->taxon[u] >= 0)
+      continue;
+
+    s1 = t1->size[ul];
+    s2 = t1->size[ur];
+
+    memset(b->side, 0, t1->tip_count);
+    for (x = t1->first[ul]; x <= ul; ++x)
+      if (t1->taxon[x] >= 0)
+        b->side[t1->taxon[x]] = 1;
+    for (x = t1->first[ur]; x <= ur; ++x)
+      if (t1->taxon[x] >= 0)
+        b->side[t1->taxon[x]] = 2;
+
+    for (v = 0; v < t2->node_count; ++v)
+    {
+      unsigned int vl, vr;
+
+      if (t2->taxon[v] >= 0)
+      {
+        unsigned char side = b->side[t2->taxon[v]];
+        c1[v] = side == 1;
+        c2[v] = side == 2;
+        continue;
+      }
+
+      vl = t2->left[v];
+      vr = t2->right[v];
+      c1[v] = c1[vl] + c1[vr];
+      c2[v] = c2[vl] + c2[vr];
+
+      if (triplets)
+      {
+        /* ab|c with a, b on different sides and c outside both subtrees */
+        uint64_t out = n - s1 - s2 - t2->size[v] + c1[v] + c2[v];
+        shared += (c1[vl] * c2[vr] + c1[vr] * c2[vl]) * out;
+      }
+      else
+      {
+        uint64_t m[3][3];
+        unsigned int k, r;
+
+        m[0][0] = c1[vl];
+        m[0][1] = c1[vr];
+        m[0][2] = s1 - c1[v];
+        m[1][0] = c2[vl];
+        m[1][1] = c2[vr];
+        m[1][2] = s2 - c2[v];
+        m[2][0] = t2->size[vl] - c1[vl] - c2[vl];
+        m[2][1] = t2->size[vr] - c1[vr] - c2[vr];
+        m[2][2] = n - s1 - s2 - t2->size[v] + c1[v] + c2[v];
+
+        /* ab|cd with c, d in subtrees k (t1) and r (t2) */
+        for (k = 0; k < 3; ++k)
+        {
+          unsigned int i = (k + 1) % 3;
+          unsigned int j = (k + 2) % 3;
+
+          for (r = 0; r < 3; ++r)
+          {
+            unsigned int p = (r + 1) % 3;
+            unsigned int q = (r + 2) % 3;
+            uint64_t cd = m[k][r] * (m[k][r] - 1) / 2;
+
+            if (cd)
+              shared += (m[i][p] * m[j][q] + m[i][q] * m[j][p]) * cd;
+          }
+        }
+      }
+    }
+  }
+
+  return shared;
+}
+
+static uint64_t quartet_distance(const quartet_tree_t * t1,
+                                 const quartet_tree_t * t2,
+                                 quartet_buffer_t * b)
+{
+  uint64_t n = t1->tip_count;
+
+  return n * (n - 1) / 2 * (n - 2) / 3 * (n - 3) / 4 -
+         quartet_shared(t1, t2, 0, b) / 2;
+}
+
+static void * quartet_matrix_worker(void * data)
+{
+  quartet_worker_t * w = (quartet_worker_t *) data;
+  quartet_matrix_t * m = w->m;
+
+  while (1)
+  {
+    uint64_t pair;
+    unsigned int i, j;
+
+    if (m->concurrent)
+      pthread_mutex_lock(&m->mutex);
+    pair = m->next_pair++;
+    if (m->concurrent)
+      pthread_mutex_unlock(&m->mutex);
+
+    if (pair >= m->pair_count)
+      break;
+
+    /* pair index to (i,j) with i < j, row by row */
+    for (i = 0; pair >= m->tree_count - 1 - i; ++i)
+      pair -= m->tree_count - 1 - i;
+    j = i + 1 + (unsigned int) pair;
+
+    m->distances[(size_t) i * m->tree_count + j] =
+    m->distances[(size_t) j * m->tree_count + i] =
+        quartet_distance(m->trees[i], m->trees[j], &w->buffer);
+  }
+
+  return NULL;
+}
@@ -71,6 +71,10 @@ static int cb_partial_traversal(pll_unode_t * node)
     return (treeinfo->clv_valid[treeinfo->active_partition][node->node_index] == 0);
 }
 
+static double treeinfo_compute_loglh(pllmod_treeinfo_t * treeinfo,
+                                     int incremental,
+                                     int dirty_only);
+
 static int treeinfo_partition_active(pllmod_treeinfo_t * treeinfo,
                                      unsigned int partition_index)
 {
@@ -78,6 +82,114 @@ static int treeinfo_partition_active(pllmod_treeinfo_t * treeinfo,
           treeinfo->active_partition == (int) partition_index);
 }
 
+static unsigned int treeinfo_clv_count(const pllmod_treeinfo_t * treeinfo)
+{
+  return treeinfo->tip_count + (treeinfo->tip_count - 2) * 3;
+}
+
+static size_t treeinfo_sumtable_size(const pll_partition_t * partition)
+{
+  size_t sites_alloc = partition->sites;
+  if (partition->attributes & PLL_ATTRIB_AB_FLAG)
+    sites_alloc += partition->states;
+
+  return sites_alloc * partition->rate_cats * partition->states_padded;
+}
+
+static void treeinfo_free_sumtable_cache(pllmod_treeinfo_t * treeinfo)
+{
+  unsigned int p;
+
+  if (!treeinfo->sumtable_cache)
+    return;
+
+  for (p = 0; p < treeinfo->partition_count; ++p)
+  {
+    if (treeinfo->sumtable_cache[p])
+      pll_aligned_free(treeinfo->sumtable_cache[p]);
+  }
+
+  free(treeinfo->sumtable_cache);
+  free(treeinfo->sumtable_tags);
+  free(treeinfo->clv_epoch);
+  free(treeinfo->clv_inputs);
+  free(treeinfo->pmatrix_epoch);
+
+  treeinfo->sumtable_cache = NULL;
+  treeinfo->sumtable_cache_slots = 0;
+  treeinfo->sumtable_tags = NULL;
+  treeinfo->clv_epoch = NULL;
+  treeinfo->clv_inputs = NULL;
+  treeinfo->pmatrix_epoch = NULL;
+}
+
+/* (re)allocate the sumtable cache buffer of one partition */
+static int treeinfo_alloc_sumtable_buffer(pllmod_treeinfo_t * treeinfo,
+                                          unsigned int partition_index)
+{
+  const pll_partition_t * partition = treeinfo->partitions[partition_index];
+  double ** buffer = &treeinfo->sumtable_cache[partition_index];
+
+  if (*buffer)
+  {
+    pll_aligned_free(*buffer);
+    *buffer = NULL;
+  }
+
+  /* skip remote partitions */
+  if (!partition)
+    return PLL_SUCCESS;
+
+  *buffer = (double *) pll_aligned_alloc(treeinfo->sumtable_cache_slots *
+                                         treeinfo_sumtable_size(partition) *
+                                         sizeof(double),
+                                         partition->alignment);
+  if (!*buffer)
+  {
+    treeinfo_free_sumtable_cache(treeinfo);
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for sumtable cache\n");
+    return PLL_FAILURE;
+  }
+
+  return PLL_SUCCESS;
+}
+
+/* the origin of the current CLVs is unknown: drop all cached sumtables and
+   give every CLV a distinct epoch */
+static void treeinfo_reset_sumtable_cache(pllmod_treeinfo_t * treeinfo)
+{
+  unsigned int i;
+  unsigned int clv_count = treeinfo_clv_count(treeinfo);
+
+  if (!treeinfo->clv_epoch)
+    return;
+
+  memset(treeinfo->sumtable_tags, 0,
+         3 * (size_t) treeinfo->sumtable_cache_slots * sizeof(uint64_t));
+  for (i = 0; i < clv_count; ++i)
+    treeinfo->clv_epoch[i] = ++treeinfo->sumtable_epoch;
+  memset(treeinfo->clv_inputs, 0xFF, 4 * (size_t) clv_count * sizeof(uint64_t));
+}
+
+static void treeinfo_clv_changed(pllmod_treeinfo_t * treeinfo,
+                                 unsigned int node_index)
+{
+  if (!treeinfo->clv_epoch)
+    return;
+
+  treeinfo->clv_epoch[node_index] = ++treeinfo->sumtable_epoch;
+  memset(treeinfo->clv_inputs + 4 * (size_t) node_index, 0xFF,
+         4 * sizeof(uint64_t));
+}
+
+static void treeinfo_pmatrix_changed(pllmod_treeinfo_t * treeinfo,
+                                     unsigned int pmatrix_index)
+{
+  if (treeinfo->pmatrix_epoch)
+    treeinfo->pmatrix_epoch[pmatrix_index] = ++treeinfo->sumtable_epoch;
+}
+
 PLL_EXPORT pllmod_treeinfo_t * pllmod_treeinfo_create(pll_unode_t * root,
                                                       unsigned int tips,
                                                       unsigned int partitions,
@@ -156,6 +268,8 @@ PLL_EXPORT pllmod_treeinfo_t * pllmod_treeinfo_create(pll_unode_t * root,
   treeinfo->clv_valid = (char **) calloc(partitions, sizeof(char*));
   treeinfo->pmatrix_valid = (char **) calloc(partitions, sizeof(char*));
   treeinfo->partition_loglh = (double *) calloc(partitions, sizeof(double));
+  treeinfo->model_dirty = (char *) malloc(partitions * sizeof(char));
+  treeinfo->local_loglh = (double *) calloc(partitions, sizeof(double));
 
   /* allocate array for storing linked/average branch lengths */
   treeinfo->linked_branch_lengths = (double *) malloc(branch_count * sizeof(double));
@@ -171,7 +285,8 @@ PLL_EXPORT pllmod_treeinfo_t * pllmod_treeinfo_create(pll_unode_t * root,
       !treeinfo->subst_matrix_symmetries || !treeinfo->branch_lengths ||
       !treeinfo->deriv_precomp || !treeinfo->clv_valid || !treeinfo->pmatrix_valid ||
       !treeinfo->linked_branch_lengths || !treeinfo->partition_loglh ||
-      !treeinfo->gamma_mode ||
+      !treeinfo->gamma_mode || !treeinfo->model_dirty ||
+      !treeinfo->local_loglh ||
       (brlen_linkage == PLLMOD_TREE_BRLEN_SCALED && !treeinfo->brlen_scalers))
   {
     pllmod_set_error(PLL_ERROR_MEM_ALLOC,
@@ -185,6 +300,9 @@ PLL_EXPORT pllmod_treeinfo_t * pllmod_treeinfo_create(pll_unode_t * root,
     /* use mean GAMMA rates per default */
     treeinfo->gamma_mode[p] = PLL_GAMMA_RATES_MEAN;
 
+    /* likelihood was never computed */
+    treeinfo->model_dirty[p] = 1;
+
     /* allocate arrays for storing the per-partition branch lengths */
     if (brlen_linkage == PLLMOD_TREE_BRLEN_UNLINKED)
       treeinfo->branch_lengths[p] =
@@ -337,6 +455,95 @@ PLL_EXPORT int pllmod_treeinfo_init_partition(pllmod_treeinfo_t * treeinfo,
     return PLL_FAILURE;
   }
 
+  /* sumtables cached for the previous partition (if any) are stale */
+  if (treeinfo->sumtable_cache)
+  {
+    if (!treeinfo_alloc_sumtable_buffer(treeinfo, partition_index))
+      return PLL_FAILURE;
+
+    treeinfo_reset_sumtable_cache(treeinfo);
+  }
+
+  return PLL_SUCCESS;
+}
+
+/**
+ * Allocate the sumtable cache used for branch length optimization.
+ *
+ * The cache keeps the sumtables of up to `max_bytes / S` branches, where S is
+ * the total size of one sumtable of all local partitions, so that they can be
+ * reused as long as the CLVs at both ends of a branch do not change. It must
+ * be set after all partitions have been initialized. A budget of 0 releases
+ * the cache.
+ *
+ * Cached sumtables are kept across optimization calls, and dropped as the
+ * CLVs and p-matrices they depend on are invalidated through treeinfo, or
+ * recomputed by pllmod_treeinfo_compute_loglh() with `incremental` = 0.
+ * Changes made behind the back of treeinfo other than with
+ * pllmod_opt_optimize_branch_lengths_local_multi_cached() must be followed
+ * by pllmod_treeinfo_invalidate_all().
+ *
+ * @param treeinfo treeinfo structure
+ * @param max_bytes memory budget for the cache, in bytes
+ *
+ * @return PLL_SUCCESS if the cache was set, PLL_FAILURE otherwise
+ */
+PLL_EXPORT int pllmod_treeinfo_set_sumtable_cache(pllmod_treeinfo_t * treeinfo,
+                                                  size_t max_bytes)
+{
+  unsigned int p;
+  unsigned int branch_count = 2 * treeinfo->tip_count - 3;
+  unsigned int clv_count = treeinfo_clv_count(treeinfo);
+  size_t sumtable_bytes = 0;
+  size_t slots;
+
+  treeinfo_free_sumtable_cache(treeinfo);
+
+  for (p = 0; p < treeinfo->partition_count; ++p)
+  {
+    const pll_partition_t * partition = treeinfo->partitions[p];
+
+    /* skip remote partitions */
+    if (!partition)
+      continue;
+
+    sumtable_bytes += treeinfo_sumtable_size(partition) * sizeof(double);
+  }
+
+  slots = sumtable_bytes ? max_bytes / sumtable_bytes : 0;
+  if (slots > branch_count)
+    slots = branch_count;
+
+  if (!slots)
+    return PLL_SUCCESS;
+
+  treeinfo->sumtable_cache_slots = (unsigned int) slots;
+  treeinfo->sumtable_cache = (double **) calloc(treeinfo->partition_count,
+                                                sizeof(double *));
+  treeinfo->sumtable_tags = (uint64_t *) malloc(3 * slots * sizeof(uint64_t));
+  treeinfo->clv_epoch = (uint64_t *) malloc(clv_count * sizeof(uint64_t));
+  treeinfo->clv_inputs = (uint64_t *) malloc(4 * (size_t) clv_count *
+                                             sizeof(uint64_t));
+  treeinfo->pmatrix_epoch = (uint64_t *) calloc(branch_count,
+                                                sizeof(uint64_t));
+  if (!treeinfo->sumtable_cache || !treeinfo->sumtable_tags ||
+      !treeinfo->clv_epoch || !treeinfo->clv_inputs ||
+      !treeinfo->pmatrix_epoch)
+  {
+    treeinfo_free_sumtable_cache(treeinfo);
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for sumtable cache\n");
+    return PLL_FAILURE;
+  }
+
+  for (p = 0; p < treeinfo->partition_count; ++p)
+  {
+    if (!treeinfo_alloc_sumtable_buffer(treeinfo, p))
+      return PLL_FAILURE;
+  }
+
+  treeinfo_reset_sumtable_cache(treeinfo);
+
   return PLL_SUCCESS;
 }
 
@@ -428,6 +635,13 @@ PLL_EXPORT int pllmod_treeinfo_destroy_partition(pllmod_treeinfo_t * treeinfo,
     treeinfo->deriv_precomp[partition_index] = NULL;
   }
 
+  /* the cache is not used until the partition is initialized again */
+  if (treeinfo->sumtable_cache && treeinfo->sumtable_cache[partition_index])
+  {
+    pll_aligned_free(treeinfo->sumtable_cache[partition_index]);
+    treeinfo->sumtable_cache[partition_index] = NULL;
+  }
+
   return PLL_SUCCESS;
 }
 
@@ -454,6 +668,8 @@ PLL_EXPORT void pllmod_treeinfo_destroy(pllmod_treeinfo_t * treeinfo)
   if(treeinfo->subst_matrix_symmetries)
     free(treeinfo->subst_matrix_symmetries);
 
+  treeinfo_free_sumtable_cache(treeinfo);
+
   /* free invalidation arrays */
   free(treeinfo->clv_valid);
   free(treeinfo->pmatrix_valid);
@@ -467,6 +683,8 @@ PLL_EXPORT void pllmod_treeinfo_destroy(pllmod_treeinfo_t * treeinfo)
   free(treeinfo->param_indices);
   free(treeinfo->branch_lengths);
   free(treeinfo->partition_loglh);
+  free(treeinfo->model_dirty);
+  free(treeinfo->local_loglh);
 
   if(treeinfo->brlen_scalers)
     free(treeinfo->brlen_scalers);
@@ -509,6 +727,7 @@ PLL_EXPORT int pllmod_treeinfo_update_prob_matrices(pllmod_treeinfo_t * treeinfo
                                   1);
 
         treeinfo->pmatrix_valid[p][matrix_index] = 1;
+        treeinfo_pmatrix_changed(treeinfo, matrix_index);
         updated++;
       }
     }
@@ -533,8 +752,12 @@ PLL_EXPORT void pllmod_treeinfo_invalidate_all(pllmod_treeinfo_t * treeinfo)
 
       for (m = 0; m < clv_count; ++m)
         treeinfo->clv_valid[p][m] = 0;
+
+      treeinfo->model_dirty[p] = 1;
     }
   }
+
+  treeinfo_reset_sumtable_cache(treeinfo);
 }
 
 PLL_EXPORT int pllmod_treeinfo_validate_clvs(pllmod_treeinfo_t * treeinfo,
@@ -564,6 +787,23 @@ PLL_EXPORT int pllmod_treeinfo_validate_clvs(pllmod_treeinfo_t * treeinfo,
     }
   }
 
+  /* CLVs in the traversal were recomputed, and so the shared buffer of the
+     other directions was overwritten */
+  if (treeinfo->clv_epoch)
+  {
+    unsigned int i;
+    for (i = 0; i < travbuffer_size; ++i)
+    {
+      const pll_unode_t * node = travbuffer[i];
+      if (node->next)
+      {
+        treeinfo_clv_changed(treeinfo, node->node_index);
+        treeinfo_clv_changed(treeinfo, node->next->node_index);
+        treeinfo_clv_changed(treeinfo, node->next->next->node_index);
+      }
+    }
+  }
+
   return PLL_SUCCESS;
 }
 
@@ -574,8 +814,13 @@ PLL_EXPORT void pllmod_treeinfo_invalidate_pmatrix(pllmod_treeinfo_t * treeinfo,
   for (p = 0; p < treeinfo->partition_count; ++p)
   {
     if (treeinfo->pmatrix_valid[p] && treeinfo_partition_active(treeinfo, p))
+    {
       treeinfo->pmatrix_valid[p][edge->pmatrix_index] = 0;
+      treeinfo->model_dirty[p] = 1;
+    }
   }
+
+  treeinfo_pmatrix_changed(treeinfo, edge->pmatrix_index);
 }
 
 PLL_EXPORT void pllmod_treeinfo_invalidate_clv(pllmod_treeinfo_t * treeinfo,
@@ -585,12 +830,58 @@ PLL_EXPORT void pllmod_treeinfo_invalidate_clv(pllmod_treeinfo_t * treeinfo,
   for (p = 0; p < treeinfo->partition_count; ++p)
   {
     if (treeinfo->clv_valid[p] && treeinfo_partition_active(treeinfo, p))
+    {
       treeinfo->clv_valid[p][edge->node_index] = 0;
+      treeinfo->model_dirty[p] = 1;
+    }
   }
+
+  treeinfo_clv_changed(treeinfo, edge->node_index);
+}
+
+/**
+ * Mark the log-likelihood of every partition as outdated, without
+ * invalidating CLVs or p-matrices.
+ *
+ * Must be called after changing the partitions or branch lengths without the
+ * invalidation functions (e.g., with pllmod_opt_optimize_branch_lengths_*),
+ * such that pllmod_treeinfo_compute_loglh_dirty() does not reuse the
+ * log-likelihoods computed before the change.
+ */
+PLL_EXPORT void pllmod_treeinfo_invalidate_loglh(pllmod_treeinfo_t * treeinfo)
+{
+  unsigned int p;
+
+  for (p = 0; p < treeinfo->partition_count; ++p)
+    treeinfo->model_dirty[p] = 1;
 }
 
 PLL_EXPORT double pllmod_treeinfo_compute_loglh(pllmod_treeinfo_t * treeinfo,
                                                 int incremental)
+{
+  return treeinfo_compute_loglh(treeinfo, incremental, 0);
+}
+
+/**
+ * Compute the log-likelihood, recomputing only the partitions marked in
+ * `treeinfo->model_dirty`.
+ *
+ * Partitions are marked dirty by the invalidation functions, such that
+ * callers changing model parameters of a few partitions only need to
+ * invalidate those. Clean partitions reuse the log-likelihood from the last
+ * computation. Changes applied to the partitions behind the back of treeinfo
+ * (e.g., branch length optimization with pllmod_opt_optimize_branch_lengths_*)
+ * are not tracked, call pllmod_treeinfo_invalidate_loglh() after them.
+ */
+PLL_EXPORT double pllmod_treeinfo_compute_loglh_dirty(
+                                                  pllmod_treeinfo_t * treeinfo)
+{
+  return treeinfo_compute_loglh(treeinfo, 1, 1);
+}
+
+static double treeinfo_compute_loglh(pllmod_treeinfo_t * treeinfo,
+                                     int incremental,
+                                     int dirty_only)
 {
   /* tree root must be an inner node! */
   assert(!pllmod_utree_is_tip(treeinfo->root));
@@ -601,6 +892,10 @@ PLL_EXPORT double pllmod_treeinfo_compute_loglh(pllmod_treeinfo_t * treeinfo,
 
   const int old_active_partition = treeinfo->active_partition;
 
+  /* all CLVs and p-matrices will be recomputed */
+  if (!incremental)
+    treeinfo_reset_sumtable_cache(treeinfo);
+
   /* iterate over all partitions (we assume that traversal is the same) */
   unsigned int p;
   for (p = 0; p < treeinfo->partition_count; ++p)
@@ -612,6 +907,13 @@ PLL_EXPORT double pllmod_treeinfo_compute_loglh(pllmod_treeinfo_t * treeinfo,
       continue;
     }
 
+    if (dirty_only && !treeinfo->model_dirty[p])
+    {
+      /* nothing changed, reuse the last local likelihood */
+      treeinfo->partition_loglh[p] = treeinfo->local_loglh[p];
+      continue;
+    }
+
     /* all subsequent operation will affect current partition only */
     pllmod_treeinfo_set_active_partition(treeinfo, (int)p);
 
@@ -685,6 +987,9 @@ PLL_EXPORT double pllmod_treeinfo_compute_loglh(pllmod_treeinfo_t * treeinfo,
                                             treeinfo->root->pmatrix_index,
                                             treeinfo->param_indices[p],
                                             NULL);
+
+    treeinfo->local_loglh[p] = treeinfo->partition_loglh[p];
+    treeinfo->model_dirty[p] = 0;
   }
 
   /* sum up likelihood from all threads */
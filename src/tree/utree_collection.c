@@ -0,0 +1,749 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+
+ /**
+  * @file utree_collection.c
+  *
+  * @brief Splits of collections of unrooted trees
+  *
+  * Tree files are processed in a pipeline. The calling thread cuts the file
+  * into tree records at each ';', a pool of threads parses the records and
+  * extracts their normalized splits, and the splits of each tree are merged
+  * into the hashtable in file order. The hashtable is therefore the same as
+  * if the trees were read one by one.
+  *
+  * Splits are read directly from the newick strings, without building the
+  * trees. The parser keeps a stack with the taxa below each open inner node
+  * and no global state, such that several trees can be parsed at once.
+  *
+  * @author Diego Darriba
+  */
+
+#include <pthread.h>
+
+#include "pll_tree.h"
+#include "tree_hashtable.h"
+
+#include "../pllmod_common.h"
+
+/* tree records in flight for each thread */
+#define COLLECTION_SLOTS_PER_THREAD 4
+
+#define SLOT_FREE   0
+#define SLOT_QUEUED 1
+#define SLOT_BUSY   2
+#define SLOT_DONE   3
+
+/* tree record, from reading to merging */
+typedef struct collection_slot_s
+{
+  int state;
+  unsigned int tree_index;
+  char * newick;
+  pll_split_t * splits;             /* NULL if the tree could not be parsed */
+  int error_code;
+  char error_msg[PLLMOD_ERRMSG_LEN];
+} collection_slot_t;
+
+typedef struct collection_s
+{
+  bitv_hashtable_t * splits_hash;
+  string_hashtable_t * names_hash;
+  unsigned int tip_count;
+  double support;
+  int update_only;
+
+  collection_slot_t * slots;
+  unsigned int slot_count;
+  unsigned int next_read;           /* trees read so far */
+  unsigned int next_parse;          /* next tree to parse */
+  unsigned int next_merge;          /* next tree to merge */
+  int reading_done;
+  int merging;                      /* a thread is merging trees */
+
+  int status;                       /* PLL_SUCCESS or PLL_FAILURE */
+  unsigned int error_tree;          /* first tree that failed */
+  int error_code;
+  char error_msg[PLLMOD_ERRMSG_LEN];
+
+  pthread_mutex_t mutex;
+  pthread_cond_t slot_free;
+  pthread_cond_t work;
+} collection_t;
+
+static void collection_parse(collection_t * c, collection_slot_t * slot);
+static int collection_merge(collection_t * c, collection_slot_t * slot);
+static void collection_merge_ready(collection_t * c);
+static void * collection_worker(void * arg);
+static char * read_tree_record(FILE * file, int * status);
+static int parse_newick_splits(const char * newick,
+                               unsigned int tip_count,
+                               string_hashtable_t * names_hash,
+                               pll_split_t * splits,
+                               pll_split_t stack);
+
+/**
+ * Extracts the normalized splits of an unrooted binary tree in newick format
+ *
+ * The tree is not built: the splits are read directly from the newick string
+ * and tip labels are mapped to tip indices with `names_hash`. Apart from the
+ * returned splits, a single buffer is allocated for the whole tree.
+ *
+ * Several threads can parse trees at the same time with the same
+ * `names_hash`.
+ *
+ * @param newick     tree in newick format
+ * @param tip_count  number of tips
+ * @param names_hash tip labels to tip indices in [0, tip_count)
+ *
+ * @returns the `tip_count - 3` normalized splits in postorder, or NULL if
+ *          the string is not a binary unrooted tree with all the tips. The
+ *          splits are freed with `pllmod_utree_split_destroy`.
+ */
+PLL_EXPORT pll_split_t * pllmod_utree_split_newick_parse(
+                                              const char * newick,
+                                              unsigned int tip_count,
+                                              string_hashtable_t * names_hash)
+{
+  unsigned int i;
+  unsigned int split_count = tip_count - 3;
+  unsigned int split_len = bitv_length(tip_count);
+  pll_split_t * splits;
+  pll_split_t splits_data;
+  pll_split_t stack;
+
+  if (!newick || !names_hash || tip_count < 4)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Invalid parameters for parsing splits");
+    return NULL;
+  }
+
+  splits = (pll_split_t *) malloc(split_count * sizeof(pll_split_t));
+  splits_data = (pll_split_t) malloc(split_count * split_len *
+                                     sizeof(pll_split_base_t));
+  /* frames for the inner nodes, the tips seen and the child counts */
+  stack = (pll_split_t) malloc(((tip_count - 1) * split_len + tip_count - 2) *
+                               sizeof(pll_split_base_t));
+
+  if (!splits || !splits_data || !stack)
+  {
+    free(splits);
+    free(splits_data);
+    free(stack);
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for splits");
+    return NULL;
+  }
+
+  for (i = 0; i < split_count; ++i)
+    splits[i] = splits_data + i * split_len;
+
+  if (!parse_newick_splits(newick, tip_count, names_hash, splits, stack))
+  {
+    free(splits_data);
+    free(splits);
+    splits = NULL;
+  }
+
+  free(stack);
+
+  return splits;
+}
+
+/**
+ * Reads a collection of trees and adds their splits to a hashtable
+ *
+ * Trees are separated by ';'. They are parsed by `n_threads` threads, and
+ * their splits are merged into the hashtable in file order, such that the
+ * result does not depend on the number of threads.
+ *
+ * @param splits_hash    hashtable to update
+ * @param trees_filename file with the trees in newick format
+ * @param tip_count      number of tips
+ * @param names_hash     tip labels to tip indices
+ * @param support        support added for each split of each tree
+ * @param update_only    0: insert new splits as needed,
+ *                       1: only increment support for existing splits
+ * @param n_threads      number of threads parsing the trees
+ * @param[out] tree_count number of trees read (can be NULL)
+ *
+ * @returns PLL_SUCCESS, or PLL_FAILURE if a tree cannot be read. The error
+ *          message indicates the first tree that failed.
+ */
+PLL_EXPORT int pllmod_utree_split_hashtable_insert_file(
+                                             bitv_hashtable_t * splits_hash,
+                                             const char * trees_filename,
+                                             unsigned int tip_count,
+                                             string_hashtable_t * names_hash,
+                                             double support,
+                                             int update_only,
+                                             unsigned int n_threads,
+                                             unsigned int * tree_count)
+{
+  collection_t c;
+  pthread_t * threads = NULL;
+  unsigned int i, thread_count = 0;
+  char * newick;
+  int read_status = PLL_SUCCESS;
+  FILE * trees_file;
+
+  if (!splits_hash || !names_hash || tip_count < 4)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Invalid parameters for reading tree splits");
+    return PLL_FAILURE;
+  }
+
+  if (!(trees_file = fopen(trees_filename, "r")))
+  {
+    pllmod_set_error(PLL_ERROR_FILE_OPEN, "Cannot open trees file");
+    return PLL_FAILURE;
+  }
+
+  memset(&c, 0, sizeof(collection_t));
+  c.splits_hash = splits_hash;
+  c.names_hash = names_hash;
+  c.tip_count = tip_count;
+  c.support = support;
+  c.update_only = update_only;
+  c.status = PLL_SUCCESS;
+
+  if (n_threads < 1)
+    n_threads = 1;
+
+  if (n_threads > 1)
+  {
+    c.slot_count = n_threads * COLLECTION_SLOTS_PER_THREAD;
+    c.slots = (collection_slot_t *) calloc(c.slot_count,
+                                           sizeof(collection_slot_t));
+    threads = (pthread_t *) malloc(n_threads * sizeof(pthread_t));
+    if (!c.slots || !threads)
+    {
+      free(c.slots);
+      free(threads);
+      fclose(trees_file);
+      pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                       "Cannot allocate memory for reading trees");
+      return PLL_FAILURE;
+    }
+
+    pthread_mutex_init(&c.mutex, NULL);
+    pthread_cond_init(&c.slot_free, NULL);
+    pthread_cond_init(&c.work, NULL);
+
+    for (thread_count = 0; thread_count < n_threads; ++thread_count)
+      if (pthread_create(threads + thread_count, NULL, collection_worker, &c))
+        break;
+  }
+
+  if (!thread_count)
+  {
+    /* parse and merge every tree as it is read */
+    collection_slot_t slot;
+
+    memset(&slot, 0, sizeof(collection_slot_t));
+    while (c.status && (newick = read_tree_record(trees_file, &read_status)))
+    {
+      slot.newick = newick;
+      slot.tree_index = c.next_read++;
+      collection_parse(&c, &slot);
+      if (!collection_merge(&c, &slot))
+      {
+        c.status = PLL_FAILURE;
+        c.error_tree = slot.tree_index;
+        c.error_code = slot.error_code;
+        strcpy(c.error_msg, slot.error_msg);
+      }
+    }
+  }
+  else
+  {
+    while ((newick = read_tree_record(trees_file, &read_status)))
+    {
+      collection_slot_t * slot;
+
+      pthread_mutex_lock(&c.mutex);
+      slot = c.slots + c.next_read % c.slot_count;
+      while (slot->state != SLOT_FREE)
+        pthread_cond_wait(&c.slot_free, &c.mutex);
+
+      if (!c.status)
+      {
+        pthread_mutex_unlock(&c.mutex);
+        free(newick);
+        break;
+      }
+
+      slot->newick = newick;
+      slot->tree_index = c.next_read++;
+      slot->state = SLOT_QUEUED;
+      pthread_cond_signal(&c.work);
+      pthread_mutex_unlock(&c.mutex);
+    }
+
+    pthread_mutex_lock(&c.mutex);
+    c.reading_done = 1;
+    pthread_cond_broadcast(&c.work);
+    pthread_mutex_unlock(&c.mutex);
+
+    for (i = 0; i < thread_count; ++i)
+      pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&c.mutex);
+    pthread_cond_destroy(&c.slot_free);
+    pthread_cond_destroy(&c.work);
+  }
+
+  fclose(trees_file);
+  free(c.slots);
+  free(threads);
+
+  /* an unterminated tree at the end of the file */
+  if (c.status && !read_status)
+  {
+    c.status = PLL_FAILURE;
+    c.error_tree = c.next_read;
+    c.error_code = pll_errno;
+    strcpy(c.error_msg, pll_errmsg);
+  }
+
+  if (!c.status)
+  {
+    pllmod_set_error(c.error_code, "%s [tree #%u]", c.error_msg,
+                     c.error_tree + 1);
+    return PLL_FAILURE;
+  }
+
+  if (tree_count)
+    *tree_count = c.next_read;
+
+  return PLL_SUCCESS;
+}
+
+/******************************************************************************/
+/* static functions */
+
+static void collection_parse(collection_t * c, collection_slot_t * slot)
+{
+  slot->splits = pllmod_utree_split_newick_parse(slot->newick,
+                                                 c->tip_count,
+                                                 c->names_hash);
+
+  free(slot->newick);
+  slot->newick = NULL;
+
+  if (!slot->splits)
+  {
+    slot->error_code = pll_errno;
+    snprintf(slot->error_msg, PLLMOD_ERRMSG_LEN, "%s", pll_errmsg);
+  }
+}
+
+static int collection_merge(collection_t * c, collection_slot_t * slot)
+{
+  unsigned int i;
+  int retval = PLL_SUCCESS;
+
+  if (!slot->splits)
+    return PLL_FAILURE;
+
+  pll_errno = 0;
+  for (i = 0; i < c->tip_count - 3 && retval; ++i)
+  {
+    if (c->update_only)
+      hash_update(slot->splits[i], c->splits_hash, c->support);
+    else if (!hash_insert(slot->splits[i], c->splits_hash, i, c->support))
+    {
+      slot->error_code = pll_errno;
+      snprintf(slot->error_msg, PLLMOD_ERRMSG_LEN, "%s", pll_errmsg);
+      retval = PLL_FAILURE;
+    }
+  }
+
+  pllmod_utree_split_destroy(slot->splits);
+  slot->splits = NULL;
+
+  return retval;
+}
+
+/* merges the parsed trees that are next in file order (called locked) */
+static void collection_merge_ready(collection_t * c)
+{
+  if (c->merging)
+    return;
+
+  c->merging = 1;
+  while (c->next_merge < c->next_parse)
+  {
+    collection_slot_t * slot = c->slots + c->next_merge % c->slot_count;
+    int status = c->status;
+    int retval;
+
+    if (slot->state != SLOT_DONE)
+      break;
+
+    pthread_mutex_unlock(&c->mutex);
+    if (status)
+      retval = collection_merge(c, slot);
+    else
+    {
+      /* after a failure, only release the splits */
+      if (slot->splits)
+        pllmod_utree_split_destroy(slot->splits);
+      slot->splits = NULL;
+      retval = PLL_SUCCESS;
+    }
+    pthread_mutex_lock(&c->mutex);
+
+    if (!retval)
+    {
+      c->status = PLL_FAILURE;
+      c->error_tree = slot->tree_index;
+      c->error_code = slot->error_code;
+      strcpy(c->error_msg, slot->error_msg);
+    }
+
+    slot->state = SLOT_FREE;
+    ++c->next_merge;
+    pthread_cond_broadcast(&c->slot_free);
+  }
+  c->merging = 0;
+}
+
+static void * collection_worker(void * arg)
+{
+  collection_t * c = (collection_t *) arg;
+
+  pthread_mutex_lock(&c->mutex);
+  while (1)
+  {
+    collection_slot_t * slot;
+    int status;
+
+    while (c->next_parse == c->next_read && !c->reading_done)
+      pthread_cond_wait(&c->work, &c->mutex);
+
+    if (c->next_parse == c->next_read)
+      break;
+
+    slot = c->slots + c->next_parse % c->slot_count;
+    ++c->next_parse;
+    slot->state = SLOT_BUSY;
+    status = c->status;
+    pthread_mutex_unlock(&c->mutex);
+
+    if (status)
+      collection_parse(c, slot);
+    else
+    {
+      free(slot->newick);
+      slot->newick = NULL;
+    }
+
+    pthread_mutex_lock(&c->mutex);
+    slot->state = SLOT_DONE;
+    collection_merge_ready(c);
+  }
+  pthread_mutex_unlock(&c->mutex);
+
+  return NULL;
+}
+
+/* reads the next tree up to ';', NULL at the end of the file */
+static char * read_tree_record(FILE * file, int * status)
+{
+  char * record = NULL;
+  size_t record_size = 0;
+  ssize_t len = getdelim(&record, &record_size, ';', file);
+  ssize_t i;
+
+  if (len > 0 && record[len - 1] == ';')
+    return record;
+
+  /* only blanks may follow the last tree */
+  for (i = 0; i < len; ++i)
+  {
+    if (!isspace((unsigned char) record[i]))
+    {
+      pllmod_set_error(PLL_ERROR_NEWICK_SYNTAX, "Missing ';' after tree");
+      *status = PLL_FAILURE;
+      break;
+    }
+  }
+
+  free(record);
+  return NULL;
+}
+
+static void set_newick_error(int code,
+                             const char * newick,
+                             const char * pos,
+                             const char * msg)
+{
+  unsigned int line = 1, column = 1;
+  const char * p;
+
+  for (p = newick; p < pos; ++p)
+  {
+    if (*p == '\n')
+    {
+      ++line;
+      column = 1;
+    }
+    else
+      ++column;
+  }
+
+  pllmod_set_error(code, "%s (line %u column %u)", msg, line, column);
+}
+
+static const char * skip_blanks(const char * p)
+{
+  while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+    ++p;
+  return p;
+}
+
+/* returns the end of the label at p, or p if there is no label */
+static const char * scan_label(const char * p,
+                               const char ** label,
+                               size_t * label_len)
+{
+  const char * q;
+
+  if (*p == '\'' || *p == '"')
+  {
+    /* quoted labels are taken verbatim, as by the newick lexer */
+    for (q = p + 1; *q && *q != *p; ++q)
+      if (*q == '\\' && q[1])
+        ++q;
+
+    if (!*q)
+      return p;
+
+    *label = p + 1;
+    *label_len = (size_t) (q - p - 1);
+    return q + 1;
+  }
+
+  if (!*p || strchr(" \t\n\r()[],:;'\"", *p))
+    return p;
+
+  for (q = p + 1; *q && !strchr(" \t\n\r()[],:;", *q); ++q);
+
+  *label = p;
+  *label_len = (size_t) (q - p);
+  return q;
+}
+
+/* skips the optional branch length at p, NULL if it is not a number */
+static const char * scan_length(const char * p)
+{
+  char * end;
+
+  p = skip_blanks(p);
+  if (*p != ':')
+    return p;
+
+  p = skip_blanks(p + 1);
+  strtod(p, &end);
+
+  return (end == p) ? NULL : skip_blanks(end);
+}
+
+/*
+ * Each open inner node has a frame in the stack with the taxa below it. When
+ * the node is closed, its taxa are a split and they are merged into the frame
+ * of the parent. The stack is followed by the set of tips seen so far, to
+ * detect repeated labels, and by the number of children of each open node.
+ */
+static int parse_newick_splits(const char * newick,
+                               unsigned int tip_count,
+                               string_hashtable_t * names_hash,
+                               pll_split_t * splits,
+                               pll_split_t stack)
+{
+  unsigned int split_size = sizeof(pll_split_base_t) * 8;
+  unsigned int split_len = bitv_length(tip_count);
+  unsigned int max_depth = tip_count - 2;
+  pll_split_t seen = stack + max_depth * split_len;
+  unsigned int * child_count = seen + split_len;
+  pll_split_t frame = NULL;
+  unsigned int split_count = 0;
+  unsigned int tips_found = 0;
+  unsigned int depth = 0;
+  unsigned int i, tip_id;
+  const char * p = newick;
+  const char * end;
+  const char * label = NULL;
+  size_t label_len = 0;
+  int id;
+
+  memset(seen, 0, split_len * sizeof(pll_split_base_t));
+
+  while (1)
+  {
+    p = skip_blanks(p);
+
+    /* open an inner node */
+    if (*p == '(')
+    {
+      if (depth == max_depth)
+      {
+        set_newick_error(PLLMOD_TREE_ERROR_INVALID_TREE_SIZE, newick, p,
+                         "Too many inner nodes");
+        return PLL_FAILURE;
+      }
+      frame = stack + depth * split_len;
+      memset(frame, 0, split_len * sizeof(pll_split_base_t));
+      child_count[depth++] = 0;
+      ++p;
+      continue;
+    }
+
+    if (!depth)
+    {
+      set_newick_error(PLL_ERROR_NEWICK_SYNTAX, newick, p, "Expected '('");
+      return PLL_FAILURE;
+    }
+
+    /* tip */
+    end = scan_label(p, &label, &label_len);
+    if (end == p)
+    {
+      set_newick_error(PLL_ERROR_NEWICK_SYNTAX, newick, p,
+                       *p ? "Expected a tip label" : "Unexpected end of tree");
+      return PLL_FAILURE;
+    }
+
+    id = string_hash_lookup_n(label, label_len, names_hash);
+    if (id < 0 || (unsigned int) id >= tip_count)
+    {
+      set_newick_error(PLLMOD_TREE_ERROR_INVALID_TREE, newick, p,
+                       "Unknown tip label");
+      return PLL_FAILURE;
+    }
+
+    tip_id = (unsigned int) id;
+    if (seen[tip_id / split_size] & (1u << (tip_id % split_size)))
+    {
+      set_newick_error(PLLMOD_TREE_ERROR_INVALID_TREE, newick, p,
+                       "Repeated tip label");
+      return PLL_FAILURE;
+    }
+    seen[tip_id / split_size] |= 1u << (tip_id % split_size);
+    frame[tip_id / split_size] |= 1u << (tip_id % split_size);
+    ++child_count[depth - 1];
+    ++tips_found;
+
+    if (!(p = scan_length(end)))
+    {
+      set_newick_error(PLL_ERROR_NEWICK_SYNTAX, newick, end,
+                       "Invalid branch length");
+      return PLL_FAILURE;
+    }
+
+    /* close the inner nodes that are complete, except for the root */
+    while (*p == ')' && depth > 1)
+    {
+      if (child_count[depth - 1] != 2)
+      {
+        set_newick_error(PLLMOD_TREE_ERROR_INVALID_TREE, newick, p,
+                         "Tree is not binary");
+        return PLL_FAILURE;
+      }
+
+      if (split_count == tip_count - 3)
+      {
+        set_newick_error(PLLMOD_TREE_ERROR_INVALID_TREE, newick, p,
+                         "Tree is not unrooted binary");
+        return PLL_FAILURE;
+      }
+
+      memcpy(splits[split_count++], frame,
+             split_len * sizeof(pll_split_base_t));
+
+      --depth;
+      frame -= split_len;
+      for (i = 0; i < split_len; ++i)
+        frame[i] |= frame[i + split_len];
+      ++child_count[depth - 1];
+
+      /* inner node labels are ignored */
+      end = scan_label(p + 1, &label, &label_len);
+      if (!(p = scan_length(end)))
+      {
+        set_newick_error(PLL_ERROR_NEWICK_SYNTAX, newick, end,
+                         "Invalid branch length");
+        return PLL_FAILURE;
+      }
+    }
+
+    if (*p == ',')
+      ++p;
+    else if (*p == ')')
+      break;
+    else
+    {
+      set_newick_error(PLL_ERROR_NEWICK_SYNTAX, newick, p,
+                       *p ? "Unexpected character" : "Unexpected end of tree");
+      return PLL_FAILURE;
+    }
+  }
+
+  /* root */
+  if (child_count[0] != 3)
+  {
+    set_newick_error(PLLMOD_TREE_ERROR_INVALID_TREE, newick, p,
+                     "Tree is not unrooted binary");
+    return PLL_FAILURE;
+  }
+
+  end = scan_label(p + 1, &label, &label_len);
+  if (!(p = scan_length(end)))
+  {
+    set_newick_error(PLL_ERROR_NEWICK_SYNTAX, newick, end,
+                     "Invalid branch length");
+    return PLL_FAILURE;
+  }
+
+  if (*p != ';' || *skip_blanks(p + 1))
+  {
+    set_newick_error(PLL_ERROR_NEWICK_SYNTAX, newick, p,
+                     "Expected ';' at the end of the tree");
+    return PLL_FAILURE;
+  }
+
+  if (tips_found != tip_count)
+  {
+    set_newick_error(PLLMOD_TREE_ERROR_INVALID_TREE_SIZE, newick, p,
+                     "Missing tips");
+    return PLL_FAILURE;
+  }
+
+  assert(split_count == tip_count - 3);
+
+  for (i = 0; i < split_count; ++i)
+    bitv_normalize(splits[i], tip_count);
+
+  return PLL_SUCCESS;
+}
@@ -195,21 +195,25 @@ PLL_EXPORT unsigned int pllmod_utree_rf_distance(pll_unode_t * t1,
                                                  pll_unode_t * t2,
                                                  unsigned int tip_count)
 {
-  unsigned int rf_distance;
+  unsigned int rf_distance = 0;
 
   /* reset pll_error */
   pll_errno = 0;
 
   /* split both trees */
-  pll_split_t * s1 = pllmod_utree_split_create(t1, tip_count, NULL);
-  pll_split_t * s2 = pllmod_utree_split_create(t2, tip_count, NULL);
+  pll_split_set_t * s1 = pllmod_utree_split_set_create(t1, tip_count);
+  pll_split_set_t * s2 = pllmod_utree_split_set_create(t2, tip_count);
 
   /* compute distance */
-  rf_distance = pllmod_utree_split_rf_distance(s1, s2, tip_count);
+  if (s1 && s2 &&
+      pllmod_utree_split_set_sort(s1) && pllmod_utree_split_set_sort(s2))
+  {
+    rf_distance = pllmod_utree_split_set_rf_distance(s1, s2);
+  }
 
   /* clean up */
-  pllmod_utree_split_destroy(s1);
-  pllmod_utree_split_destroy(s2);
+  pllmod_utree_split_set_destroy(s1);
+  pllmod_utree_split_set_destroy(s2);
 
   assert(rf_distance <= 2*(tip_count-3));
   return rf_distance;
@@ -483,10 +487,38 @@ PLL_EXPORT pll_split_t * pllmod_utree_split_create(pll_unode_t * tree,
   return split_list;
 }
 
+/**
+ * Creates an empty split hashtable
+ *
+ * In concurrent mode, several threads can insert splits into the hashtable
+ * (`pllmod_utree_split_hashtable_insert`) and look them up at the same time.
+ * Support values are then summed up in a non-deterministic order.
+ *
+ * @param tip_count      number of tips
+ * @param concurrent     1: allow concurrent insertions, 0: single thread
+ *
+ * @returns the new hashtable, or NULL on error
+ */
+PLL_EXPORT bitv_hashtable_t *
+pllmod_utree_split_hashtable_create(unsigned int tip_count, int concurrent)
+{
+  bitv_hashtable_t * splits_hash = hash_init(tip_count * 10, tip_count);
+
+  if (splits_hash && concurrent && !hash_set_concurrent(splits_hash))
+  {
+    hash_destroy(splits_hash);
+    return NULL;
+  }
+
+  return splits_hash;
+}
+
 /**
  * Creates or updates hashtable with splits (and their support)
  *
- * @param splits_hash    hashtable to update, NULL: create new hashtable
+ * @param splits_hash    hashtable to update, NULL: create new hashtable.
+ *                       Several threads can update the same hashtable if it
+ *                       was created in concurrent mode.
  * @param tip_count      number of tips
  * @param split_count    number of splits in 'splits'
  * @param support        support values for the split
@@ -525,18 +557,14 @@ pllmod_utree_split_hashtable_insert(bitv_hashtable_t * splits_hash,
     {
       hash_update(splits[i],
                   splits_hash,
-                  HASH_KEY_UNDEF,
-                  support ? support[i] : 1.0,
-                  0);
+                  support ? support[i] : 1.0);
     }
-    else
+    else if (!hash_insert(splits[i],
+                          splits_hash,
+                          i,
+                          support ? support[i] : 1.0))
     {
-      hash_insert(splits[i],
-                  splits_hash,
-                  i,
-                  HASH_KEY_UNDEF,
-                  support ? support[i] : 1.0,
-                  0);
+      return NULL;
     }
   }
 
@@ -548,19 +576,9 @@ pllmod_utree_split_hashtable_lookup(bitv_hashtable_t * splits_hash,
                                     pll_split_t split,
                                     unsigned int tip_count)
 {
-  unsigned int split_len = bitv_length(tip_count);
-  hash_key_t position = hash_get_key(split, split_len) % splits_hash->table_size;
-  bitv_hash_entry_t *p = splits_hash->table[position];
-
-  for(; p!= NULL; p = p->next)
-  {
-    if(!compare_splits (p->bit_vector,
-                        split,
-                        split_len))
-      return p;
-  }
+  assert(bitv_length(tip_count) == splits_hash->bitv_len);
 
-  return 0;
+  return hash_lookup(splits_hash, split);
 }
 
 PLL_EXPORT
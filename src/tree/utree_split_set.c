@@ -0,0 +1,371 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+
+ /**
+  * @file utree_split_set.c
+  *
+  * @brief Compact sets of splits
+  *
+  * All splits of a tree are stored in a single matrix of 64-bit words, one
+  * split per row of `stride` words. Splits are normalized (the first taxon
+  * is always in the split) and they can be sorted with a radix sort over the
+  * bytes of the rows, such that comparing two sets is a linear merge.
+  *
+  * @author Diego Darriba
+  */
+
+#include "pll_tree.h"
+
+#include "../pllmod_common.h"
+
+#define SPLIT_WORD_BITS 64
+#define SPLIT_SET_ROW(set, i) ((set)->words + (size_t)(i) * (set)->stride)
+
+static pll_split_set_t * split_set_alloc(unsigned int tip_count,
+                                         unsigned int max_splits);
+static void split_set_fill(pll_unode_t * node,
+                           pll_split_set_t * set,
+                           uint64_t * row);
+static void split_set_normalize(pll_split_set_t * set);
+static int split_set_cmp(const uint64_t * s1,
+                         const uint64_t * s2,
+                         unsigned int stride);
+
+/**
+ * Creates the set of non-trivial splits of an unrooted tree
+ *
+ * Taxa are identified by the node indices at the tips. Splits are normalized
+ * but not sorted.
+ *
+ * @param tree      any node of the tree
+ * @param tip_count number of tips
+ *
+ * @returns the set of splits, or NULL on error
+ */
+PLL_EXPORT pll_split_set_t * pllmod_utree_split_set_create(
+                                                    pll_unode_t * tree,
+                                                    unsigned int tip_count)
+{
+  pll_split_set_t * set;
+  pll_unode_t * node;
+
+  if (!tree || tip_count < 3)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Invalid parameters for creating split set");
+    return NULL;
+  }
+
+  if (!(set = split_set_alloc(tip_count, tip_count - 3)))
+    return NULL;
+
+  if (pllmod_utree_is_tip(tree))
+    tree = tree->back;
+
+  /* one split for each inner node adjacent to the root node */
+  node = tree;
+  do
+  {
+    if (!pllmod_utree_is_tip(node->back))
+    {
+      uint64_t * row = SPLIT_SET_ROW(set, set->split_count++);
+      split_set_fill(node->back, set, row);
+    }
+    node = node->next;
+  }
+  while (node != tree);
+
+  split_set_normalize(set);
+
+  return set;
+}
+
+/**
+ * Creates a set of splits from an array of splits
+ *
+ * @param splits      splits (need not be normalized)
+ * @param split_count number of splits
+ * @param tip_count   number of tips
+ *
+ * @returns the set of normalized splits, or NULL on error
+ */
+PLL_EXPORT pll_split_set_t * pllmod_utree_split_set_from_splits(
+                                                  const pll_split_t * splits,
+                                                  unsigned int split_count,
+                                                  unsigned int tip_count)
+{
+  pll_split_set_t * set;
+  unsigned int split_size = sizeof(pll_split_base_t) * 8;
+  unsigned int i, j;
+
+  if (!splits || tip_count < 3)
+  {
+    pllmod_set_error(PLL_ERROR_PARAM_INVALID,
+                     "Invalid parameters for creating split set");
+    return NULL;
+  }
+
+  if (!(set = split_set_alloc(tip_count, split_count)))
+    return NULL;
+
+  for (i = 0; i < split_count; ++i)
+  {
+    uint64_t * row = SPLIT_SET_ROW(set, i);
+    for (j = 0; j < tip_count; j += split_size)
+    {
+      uint64_t word = splits[i][j / split_size];
+      row[j / SPLIT_WORD_BITS] |= word << (j % SPLIT_WORD_BITS);
+    }
+  }
+  set->split_count = split_count;
+
+  split_set_normalize(set);
+
+  return set;
+}
+
+/**
+ * Sorts a set of splits
+ *
+ * Splits are sorted by their words, the first word being the most
+ * significant. The sort is a least significant digit radix sort on the bytes
+ * of the splits, skipping the bytes that are equal in all splits.
+ *
+ * @param set set of splits
+ *
+ * @returns PLL_SUCCESS, or PLL_FAILURE if memory cannot be allocated
+ */
+PLL_EXPORT int pllmod_utree_split_set_sort(pll_split_set_t * set)
+{
+  unsigned int n = set->split_count;
+  unsigned int stride = set->stride;
+  unsigned int * order_mem;
+  unsigned int * order;
+  unsigned int * buffer;
+  uint64_t * words;
+  unsigned int count[256];
+  unsigned int i, w, shift;
+
+  if (n < 2)
+    return PLL_SUCCESS;
+
+  order_mem = (unsigned int *) malloc(2 * n * sizeof(unsigned int));
+  words = (uint64_t *) malloc((size_t) n * stride * sizeof(uint64_t));
+  if (!order_mem || !words)
+  {
+    free(order_mem);
+    free(words);
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for sorting splits");
+    return PLL_FAILURE;
+  }
+  order = order_mem;
+  buffer = order_mem + n;
+
+  for (i = 0; i < n; ++i)
+    order[i] = i;
+
+  /* stable passes from the least significant byte */
+  for (w = stride; w-- > 0; )
+  {
+    for (shift = 0; shift < SPLIT_WORD_BITS; shift += 8)
+    {
+      unsigned int * aux;
+      unsigned int sum = 0;
+
+      memset(count, 0, sizeof(count));
+      for (i = 0; i < n; ++i)
+        ++count[(SPLIT_SET_ROW(set, i)[w] >> shift) & 0xff];
+
+      /* this byte does not change the order */
+      if (count[(SPLIT_SET_ROW(set, 0)[w] >> shift) & 0xff] == n)
+        continue;
+
+      for (i = 0; i < 256; ++i)
+      {
+        unsigned int c = count[i];
+        count[i] = sum;
+        sum += c;
+      }
+
+      for (i = 0; i < n; ++i)
+      {
+        unsigned int row = order[i];
+        buffer[count[(SPLIT_SET_ROW(set, row)[w] >> shift) & 0xff]++] = row;
+      }
+
+      aux = order;
+      order = buffer;
+      buffer = aux;
+    }
+  }
+
+  for (i = 0; i < n; ++i)
+    memcpy(words + (size_t) i * stride, SPLIT_SET_ROW(set, order[i]),
+           stride * sizeof(uint64_t));
+
+  free(set->words);
+  set->words = words;
+  free(order_mem);
+
+  return PLL_SUCCESS;
+}
+
+/**
+ * Computes the Robinson-Foulds distance between two sets of splits
+ *
+ * Precondition: both sets must be sorted
+ *
+ * @param s1 first set of splits
+ * @param s2 second set of splits
+ *
+ * @returns the number of splits that are in only one of the sets
+ */
+PLL_EXPORT unsigned int pllmod_utree_split_set_rf_distance(
+                                                  const pll_split_set_t * s1,
+                                                  const pll_split_set_t * s2)
+{
+  unsigned int i = 0, j = 0, equal = 0;
+  unsigned int stride = s1->stride;
+
+  assert(s1->tip_count == s2->tip_count);
+
+  while (i < s1->split_count && j < s2->split_count)
+  {
+    int cmp = split_set_cmp(SPLIT_SET_ROW(s1, i), SPLIT_SET_ROW(s2, j), stride);
+
+    if (cmp < 0)
+      ++i;
+    else if (cmp > 0)
+      ++j;
+    else
+    {
+      ++equal;
+      ++i;
+      ++j;
+    }
+  }
+
+  return s1->split_count + s2->split_count - 2 * equal;
+}
+
+/**
+ * Destroys a set of splits
+ *
+ * @param set set of splits
+ */
+PLL_EXPORT void pllmod_utree_split_set_destroy(pll_split_set_t * set)
+{
+  if (set)
+  {
+    free(set->words);
+    free(set);
+  }
+}
+
+/******************************************************************************/
+/* static functions */
+
+static pll_split_set_t * split_set_alloc(unsigned int tip_count,
+                                         unsigned int max_splits)
+{
+  pll_split_set_t * set = (pll_split_set_t *) malloc(sizeof(pll_split_set_t));
+
+  if (set)
+  {
+    set->tip_count = tip_count;
+    set->split_count = 0;
+    set->stride = (tip_count + SPLIT_WORD_BITS - 1) / SPLIT_WORD_BITS;
+    set->words = (uint64_t *) calloc((size_t) (max_splits ? max_splits : 1) *
+                                     set->stride, sizeof(uint64_t));
+    if (!set->words)
+    {
+      free(set);
+      set = NULL;
+    }
+  }
+
+  if (!set)
+    pllmod_set_error(PLL_ERROR_MEM_ALLOC,
+                     "Cannot allocate memory for split set");
+
+  return set;
+}
+
+/* sets in row the taxa of the subtree at node, adding the splits below */
+static void split_set_fill(pll_unode_t * node,
+                           pll_split_set_t * set,
+                           uint64_t * row)
+{
+  pll_unode_t * child;
+  unsigned int i;
+
+  for (child = node->next; child != node; child = child->next)
+  {
+    if (pllmod_utree_is_tip(child->back))
+    {
+      unsigned int tip_id = child->back->node_index;
+      assert(tip_id < set->tip_count);
+      row[tip_id / SPLIT_WORD_BITS] |= (uint64_t) 1 << (tip_id %
+                                                        SPLIT_WORD_BITS);
+    }
+    else
+    {
+      uint64_t * child_row = SPLIT_SET_ROW(set, set->split_count++);
+      split_set_fill(child->back, set, child_row);
+      for (i = 0; i < set->stride; ++i)
+        row[i] |= child_row[i];
+    }
+  }
+}
+
+static void split_set_normalize(pll_split_set_t * set)
+{
+  unsigned int offset = set->tip_count % SPLIT_WORD_BITS;
+  uint64_t mask = offset ? ((uint64_t) 1 << offset) - 1 : ~(uint64_t) 0;
+  unsigned int i, j;
+
+  for (i = 0; i < set->split_count; ++i)
+  {
+    uint64_t * row = SPLIT_SET_ROW(set, i);
+
+    if (!(row[0] & 1))
+    {
+      for (j = 0; j < set->stride; ++j)
+        row[j] = ~row[j];
+    }
+    row[set->stride - 1] &= mask;
+  }
+}
+
+static int split_set_cmp(const uint64_t * s1,
+                         const uint64_t * s2,
+                         unsigned int stride)
+{
+  unsigned int i;
+
+  for (i = 0; i < stride; ++i)
+  {
+    if (s1[i] != s2[i])
+      return s1[i] > s2[i] ? 1 : -1;
+  }
+  return 0;
+}
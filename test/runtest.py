@@ -60,13 +60,15 @@ colors={"default":"",
   "mod_bin": "\033[1;45m",
   "mod_tre": "\033[1;46m",
   "mod_opt": "\033[1;42m",
+  "mod_alg": "\033[1;43m",
   "mod_msa": "\033[1;44m"}
 
 which_test={"default": 0,
   "validation": 1,
   "speed":      2}
 
-modules={"optimize" : "mod_opt",
+modules={"algorithm": "mod_alg",
+  "optimize" : "mod_opt",
   "binary"   : "mod_bin",
   "tree"     : "mod_tre"}
   #"msa"      : 3}
@@ -0,0 +1,155 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+#include "pllmod_algorithm.h"
+#include "../common.h"
+
+#define N_TIPS         TEST_NT_TAXA
+#define N_STATES       4
+#define N_SITES       40
+#define N_PARTITIONS   2
+#define N_RATE_CATS    4
+#define N_GROUPS       PLLMOD_ALGO_MODEL_GROUPS
+
+/*
+ * This test optimizes the substitution rates and alpha of one partition and
+ * the frequencies and alpha of another one with the adaptive scheduler. The
+ * schedule depends on the timings, so only properties that hold for any
+ * order are checked: the score is consistent with a full recomputation, the
+ * group and partition gains add up to the total gain, groups which were not
+ * requested do not run and the partition flags are restored.
+ */
+
+static int same_loglh(double a, double b)
+{
+  return fabs(a - b) < 1e-6;
+}
+
+int main(int argc, char * argv[])
+{
+  unsigned int attributes = get_attributes(argc, argv);
+  unsigned int g, p;
+  pll_utree_t * tree;
+  pllmod_treeinfo_t * treeinfo;
+  pllmod_algo_model_stats_t stats[N_GROUPS];
+  double partition_gain[N_GROUPS][N_PARTITIONS];
+  const int params[N_PARTITIONS] = {
+    PLLMOD_OPT_PARAM_SUBST_RATES | PLLMOD_OPT_PARAM_ALPHA,
+    PLLMOD_OPT_PARAM_FREQUENCIES | PLLMOD_OPT_PARAM_ALPHA
+  };
+  double start_loglh, opt_loglh, full_loglh, total_gain, result;
+  double frequencies[N_STATES] = {0.25, 0.25, 0.25, 0.25};
+  double subst_params[6] = {1, 1, 1, 1, 1, 1};
+  int ok;
+
+  tree = pll_utree_parse_newick_string(TEST_NT_TREE);
+  if (!tree)
+    fatal("Error parsing tree: %s", pll_errmsg);
+
+  treeinfo = pllmod_treeinfo_create(tree->nodes[2 * N_TIPS - 3], N_TIPS,
+                                    N_PARTITIONS, PLLMOD_TREE_BRLEN_LINKED);
+  if (!treeinfo)
+    fatal("Cannot create treeinfo: %s", pll_errmsg);
+
+  for (p = 0; p < N_PARTITIONS; ++p)
+  {
+    pll_partition_t * partition = create_nt_partition(tree, NULL,
+                                                      p * N_SITES, N_SITES,
+                                                      N_RATE_CATS, 1.0,
+                                                      frequencies,
+                                                      subst_params,
+                                                      attributes);
+    if (!pllmod_treeinfo_init_partition(treeinfo, p, partition, params[p],
+                                        PLL_GAMMA_RATES_MEAN, 1.0, NULL,
+                                        NULL))
+      fatal("Cannot initialize partition %u: %s", p, pll_errmsg);
+  }
+
+  for (g = 0; g < N_GROUPS; ++g)
+    stats[g].partition_gain = partition_gain[g];
+
+  start_loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+
+  printf("** model optimization\n");
+  result = pllmod_algo_opt_model_treeinfo(treeinfo,
+                                          PLLMOD_OPT_PARAM_SUBST_RATES |
+                                          PLLMOD_OPT_PARAM_FREQUENCIES |
+                                          PLLMOD_OPT_PARAM_ALPHA,
+                                          PLLMOD_ALGO_LBFGSB_ERROR,
+                                          0.1, 10, stats);
+  if (result == PLL_FAILURE)
+    fatal("Error optimizing the model: %s", pll_errmsg);
+  opt_loglh = -1 * result;
+
+  pllmod_treeinfo_invalidate_all(treeinfo);
+  full_loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+  printf("log-likelihood improved: %s\n",
+         opt_loglh > start_loglh + 1 ? "yes" : "no");
+  printf("score matches full recomputation: %s\n",
+         same_loglh(opt_loglh, full_loglh) ? "yes" : "no");
+  printf("negated log-likelihood returned: %s\n", result > 0 ? "yes" : "no");
+
+  ok = 1;
+  for (p = 0; p < N_PARTITIONS; ++p)
+    if (treeinfo->params_to_optimize[p] != params[p])
+      ok = 0;
+  printf("partition flags restored: %s\n", ok ? "yes" : "no");
+
+  printf("** statistics\n");
+  total_gain = 0;
+  ok = 1;
+  for (g = 0; g < N_GROUPS; ++g)
+  {
+    double group_gain = 0;
+
+    total_gain += stats[g].gain;
+    for (p = 0; p < N_PARTITIONS; ++p)
+    {
+      group_gain += partition_gain[g][p];
+
+      /* partitions not optimizing the group must not gain anything */
+      if (!(params[p] & stats[g].param) && partition_gain[g][p] != 0)
+        ok = 0;
+    }
+    if (!same_loglh(group_gain, stats[g].gain))
+      ok = 0;
+  }
+  printf("group gains add up: %s\n",
+         same_loglh(total_gain, opt_loglh - start_loglh) ? "yes" : "no");
+  printf("partition gains add up: %s\n", ok ? "yes" : "no");
+
+  ok = 1;
+  for (g = 0; g < N_GROUPS; ++g)
+  {
+    int requested = stats[g].param != (PLLMOD_OPT_PARAM_FREE_RATES |
+                                       PLLMOD_OPT_PARAM_RATE_WEIGHTS);
+    if (requested != (stats[g].runs > 0) || stats[g].runs > 10)
+      ok = 0;
+  }
+  printf("requested groups run: %s\n", ok ? "yes" : "no");
+
+  /* clean */
+  for (p = 0; p < N_PARTITIONS; ++p)
+    pll_partition_destroy(treeinfo->partitions[p]);
+  pllmod_treeinfo_destroy(treeinfo);
+  pll_utree_destroy(tree, NULL);
+
+  return (0);
+}
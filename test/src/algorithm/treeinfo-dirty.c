@@ -0,0 +1,137 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+#include "pllmod_algorithm.h"
+#include "../common.h"
+
+#define N_TIPS         TEST_NT_TAXA
+#define N_STATES       4
+#define N_SITES       40
+#define N_PARTITIONS   2
+#define N_RATE_CATS    4
+
+/*
+ * This test checks that the log-likelihood reported by the model optimizers,
+ * which evaluate only the partitions whose parameters changed, matches a full
+ * recomputation after the branch lengths were optimized outside of treeinfo.
+ * Only the first partition has substitution rates to optimize, such that the
+ * second one must not reuse its log-likelihood from before the branch length
+ * optimization.
+ */
+
+static int same_loglh(double a, double b)
+{
+  return fabs(a - b) < 1e-6;
+}
+
+int main(int argc, char * argv[])
+{
+  unsigned int attributes = get_attributes(argc, argv);
+  unsigned int p;
+  pll_utree_t * tree;
+  pllmod_treeinfo_t * treeinfo;
+  double start_loglh, bl_loglh, opt_loglh, full_loglh;
+  double frequencies[N_STATES] = {0.25, 0.25, 0.25, 0.25};
+  double subst_params[6] = {1, 1, 1, 1, 1, 1};
+
+  tree = pll_utree_parse_newick_string(TEST_NT_TREE);
+  if (!tree)
+    fatal("Error parsing tree: %s", pll_errmsg);
+
+  treeinfo = pllmod_treeinfo_create(tree->nodes[2 * N_TIPS - 3], N_TIPS,
+                                    N_PARTITIONS, PLLMOD_TREE_BRLEN_LINKED);
+  if (!treeinfo)
+    fatal("Cannot create treeinfo: %s", pll_errmsg);
+
+  for (p = 0; p < N_PARTITIONS; ++p)
+  {
+    pll_partition_t * partition = create_nt_partition(tree, NULL,
+                                                      p * N_SITES, N_SITES,
+                                                      N_RATE_CATS, 1.0,
+                                                      frequencies,
+                                                      subst_params,
+                                                      attributes);
+    if (!pllmod_treeinfo_init_partition(treeinfo, p, partition,
+                                        p ? 0 : PLLMOD_OPT_PARAM_SUBST_RATES,
+                                        PLL_GAMMA_RATES_MEAN, 1.0, NULL,
+                                        NULL))
+      fatal("Cannot initialize partition %u: %s", p, pll_errmsg);
+  }
+
+  start_loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+
+  printf("** branch lengths\n");
+  bl_loglh = -1 * pllmod_opt_optimize_branch_lengths_local_multi(
+                                                  treeinfo->partitions,
+                                                  N_PARTITIONS,
+                                                  treeinfo->root,
+                                                  treeinfo->param_indices,
+                                                  treeinfo->deriv_precomp,
+                                                  treeinfo->brlen_scalers,
+                                                  PLLMOD_OPT_MIN_BRANCH_LEN,
+                                                  PLLMOD_OPT_MAX_BRANCH_LEN,
+                                                  0.1,
+                                                  8,
+                                                  -1,
+                                                  1,
+                                                  NULL, NULL);
+  printf("log-likelihood improved: %s\n",
+         bl_loglh > start_loglh + 1 ? "yes" : "no");
+
+  printf("** substitution rates\n");
+  opt_loglh = -1 * pllmod_algo_opt_subst_rates_treeinfo(treeinfo, 0,
+                                                   PLLMOD_OPT_MIN_SUBST_RATE,
+                                                   PLLMOD_OPT_MAX_SUBST_RATE,
+                                                   PLLMOD_ALGO_BFGS_FACTR,
+                                                   PLLMOD_ALGO_LBFGSB_ERROR);
+  full_loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+  printf("log-likelihood improved: %s\n",
+         full_loglh > bl_loglh ? "yes" : "no");
+  printf("optimizer matches full recomputation: %s\n",
+         same_loglh(opt_loglh, full_loglh) ? "yes" : "no");
+
+  printf("** explicit invalidation\n");
+  pllmod_opt_optimize_branch_lengths_local_multi(treeinfo->partitions,
+                                                 N_PARTITIONS,
+                                                 treeinfo->root,
+                                                 treeinfo->param_indices,
+                                                 treeinfo->deriv_precomp,
+                                                 treeinfo->brlen_scalers,
+                                                 PLLMOD_OPT_MIN_BRANCH_LEN,
+                                                 PLLMOD_OPT_MAX_BRANCH_LEN,
+                                                 0.1,
+                                                 8,
+                                                 -1,
+                                                 1,
+                                                 NULL, NULL);
+  pllmod_treeinfo_invalidate_loglh(treeinfo);
+  opt_loglh = pllmod_treeinfo_compute_loglh_dirty(treeinfo);
+  full_loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+  printf("dirty computation matches full recomputation: %s\n",
+         same_loglh(opt_loglh, full_loglh) ? "yes" : "no");
+
+  /* clean */
+  for (p = 0; p < N_PARTITIONS; ++p)
+    pll_partition_destroy(treeinfo->partitions[p]);
+  pllmod_treeinfo_destroy(treeinfo);
+  pll_utree_destroy(tree, NULL);
+
+  return (0);
+}
@@ -0,0 +1,205 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+#include "pll_binary.h"
+#include "../common.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#define N_TIPS        12
+#define N_SITES       50
+#define N_RATE_CATS    4
+
+#define BLOCK_ID_PARTITION 1000
+#define BLOCK_ID_CLV       3000
+#define BLOCK_ID_CUSTOM    5000
+
+#define BIN_FILENAME     "test-async.bin"
+#define BIN_TMP_FILENAME "test-async.bin.tmp"
+
+/*
+ * This test writes a partition, two CLVs and a custom block in the background,
+ * loads them back and compares the contents. Then it starts a second write
+ * that fails and checks that the first file is left untouched.
+ */
+
+static pll_partition_t * load_partition(void)
+{
+  pll_binary_header_t bin_header;
+  unsigned int bin_attributes = 0;
+  pll_partition_t * partition;
+  FILE * bin_file = pllmod_binary_open(BIN_FILENAME, &bin_header);
+
+  if (!bin_file)
+    fatal("Cannot open binary file: %s", pll_errmsg);
+
+  partition = pllmod_binary_partition_load(bin_file,
+                                           BLOCK_ID_PARTITION,
+                                           NULL,
+                                           &bin_attributes,
+                                           PLLMOD_BIN_INVALID_OFFSET);
+  if (!partition)
+    fatal("Error loading partition: %s", pll_errmsg);
+
+  pllmod_binary_close(bin_file);
+
+  return partition;
+}
+
+int main (int argc, char * argv[])
+{
+  unsigned int attributes = get_attributes(argc, argv);
+  unsigned int bin_attributes, block_type;
+  unsigned int i;
+  pll_partition_t * partition, * loaded;
+  pll_binary_async_t * async;
+  pll_binary_header_t bin_header;
+  FILE * bin_file;
+  size_t clv_size, custom_size;
+  double * saved_clvs;
+  void * custom;
+  char custom_data[] = "background checkpoint";
+
+  if (attributes & PLL_ATTRIB_PATTERN_TIP)
+    skip_test();
+
+  partition = create_test_partition(N_TIPS, N_SITES, N_RATE_CATS, attributes);
+  clv_size = partition->sites * partition->states_padded *
+             partition->rate_cats;
+
+  printf("** write in background\n");
+  async = pllmod_binary_async_create(BIN_FILENAME, PLLMOD_BIN_ACCESS_RANDOM,
+                                     10);
+  if (!async)
+    fatal("Cannot create binary file: %s", pll_errmsg);
+
+  if (!pllmod_binary_async_partition_dump(async, BLOCK_ID_PARTITION,
+                                          partition,
+                                          PLLMOD_BIN_ATTRIB_PARTITION_DUMP_CLV |
+                                          PLLMOD_BIN_ATTRIB_UPDATE_MAP))
+    fatal("Error dumping partition: %s", pll_errmsg);
+
+  saved_clvs = (double *) malloc(2 * clv_size * sizeof(double));
+  for (i = 0; i < 2; ++i)
+  {
+    unsigned int clv_index = N_TIPS + i;
+    if (!pllmod_binary_async_clv_dump(async, BLOCK_ID_CLV + i, partition,
+                                      clv_index,
+                                      PLLMOD_BIN_ATTRIB_UPDATE_MAP |
+                                      (i ? PLLMOD_BIN_ATTRIB_COMPRESS : 0)))
+      fatal("Error dumping CLV %u: %s", clv_index, pll_errmsg);
+    memcpy(saved_clvs + i * clv_size, partition->clv[clv_index],
+           clv_size * sizeof(double));
+
+    /* the snapshot is already taken */
+    memset(partition->clv[clv_index], 0, clv_size * sizeof(double));
+  }
+
+  if (!pllmod_binary_async_custom_dump(async, BLOCK_ID_CUSTOM, custom_data,
+                                       sizeof(custom_data),
+                                       PLLMOD_BIN_ATTRIB_UPDATE_MAP))
+    fatal("Error dumping custom block: %s", pll_errmsg);
+
+  pllmod_binary_async_commit(async);
+  if (!pllmod_binary_async_wait(async))
+    fatal("Error writing binary file: %s", pll_errmsg);
+
+  printf("temporary file removed: %s\n",
+         access(BIN_TMP_FILENAME, F_OK) ? "yes" : "no");
+
+  /* restore the CLVs that were cleared after the snapshot */
+  for (i = 0; i < 2; ++i)
+    memcpy(partition->clv[N_TIPS + i], saved_clvs + i * clv_size,
+           clv_size * sizeof(double));
+
+  printf("** reload\n");
+  loaded = load_partition();
+  printf("partition OK: %s\n",
+         compare_partitions(partition, loaded) ? "yes" : "no");
+
+  bin_file = pllmod_binary_open(BIN_FILENAME, &bin_header);
+  if (!bin_file)
+    fatal("Cannot open binary file: %s", pll_errmsg);
+
+  for (i = 0; i < 2; ++i)
+  {
+    unsigned int clv_index = N_TIPS + i;
+    memset(loaded->clv[clv_index], 0, clv_size * sizeof(double));
+    bin_attributes = 0;
+    if (!pllmod_binary_clv_load(bin_file, BLOCK_ID_CLV + i, loaded,
+                                clv_index, &bin_attributes,
+                                PLLMOD_BIN_INVALID_OFFSET))
+      fatal("Error loading CLV %u: %s", clv_index, pll_errmsg);
+    printf("CLV %u OK: %s\n", clv_index,
+           memcmp(loaded->clv[clv_index], saved_clvs + i * clv_size,
+                  clv_size * sizeof(double)) ? "no" : "yes");
+  }
+
+  custom = pllmod_binary_custom_load(bin_file, BLOCK_ID_CUSTOM, &custom_size,
+                                     &block_type, &bin_attributes,
+                                     PLLMOD_BIN_INVALID_OFFSET);
+  if (!custom)
+    fatal("Error loading custom block: %s", pll_errmsg);
+  printf("custom block: %s\n", (char *) custom);
+  free(custom);
+
+  pllmod_binary_close(bin_file);
+  pll_partition_destroy(loaded);
+
+  printf("** failed write\n");
+  async = pllmod_binary_async_create(BIN_FILENAME, PLLMOD_BIN_ACCESS_RANDOM,
+                                     10);
+  if (!async)
+    fatal("Cannot create binary file: %s", pll_errmsg);
+
+  /* change the partition, such that a replaced file would be noticed */
+  partition->rates[0] *= 2;
+  if (!pllmod_binary_async_partition_dump(async, BLOCK_ID_PARTITION,
+                                          partition,
+                                          PLLMOD_BIN_ATTRIB_PARTITION_DUMP_CLV |
+                                          PLLMOD_BIN_ATTRIB_UPDATE_MAP))
+    fatal("Error dumping partition: %s", pll_errmsg);
+
+  /* invalid CLV index */
+  printf("invalid CLV dump rejected: %s\n",
+         pllmod_binary_async_clv_dump(async, BLOCK_ID_CLV, partition,
+                                      3 * N_TIPS,
+                                      PLLMOD_BIN_ATTRIB_UPDATE_MAP) ?
+                                      "no" : "yes");
+
+  printf("failed write reported: %s\n",
+         pllmod_binary_async_wait(async) ? "no" : "yes");
+  printf("temporary file removed: %s\n",
+         access(BIN_TMP_FILENAME, F_OK) ? "yes" : "no");
+
+  partition->rates[0] /= 2;
+  loaded = load_partition();
+  printf("previous file kept: %s\n",
+         compare_partitions(partition, loaded) ? "yes" : "no");
+
+  /* clean */
+  pll_partition_destroy(loaded);
+  pll_partition_destroy(partition);
+  free(saved_clvs);
+  remove(BIN_FILENAME);
+
+  return (0);
+}
@@ -0,0 +1,176 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+#include "pll_binary.h"
+#include "../common.h"
+
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#define N_TIPS           6
+#define N_PARTITIONS     5
+#define N_THREADS        3
+
+#define BIN_FILENAME     "test-checkpoint.bin"
+#define BIN_TMP_FILENAME "test-checkpoint.bin.tmp"
+
+#define TREE_STRING "((t1:0.1,t2:0.2):0.05,(t3:0.3,t4:0.1):0.2,(t5:0.15,t6:0.25):0.1);"
+
+/*
+ * This test dumps several partitions of different sizes and a tree with the
+ * parallel checkpoint, with plain and with compressed blocks, loads them back
+ * with a different number of threads and compares the contents. Then it makes
+ * a dump fail (by limiting the file size) and checks that the previous
+ * checkpoint is left untouched.
+ */
+
+static int compare_subtrees(pll_unode_t * n1, pll_unode_t * n2)
+{
+  if (n1->node_index != n2->node_index ||
+      n1->clv_index != n2->clv_index ||
+      n1->pmatrix_index != n2->pmatrix_index ||
+      n1->length != n2->length ||
+      !n1->next != !n2->next)
+    return 0;
+
+  if (!n1->next)
+    return n1->label && n2->label && !strcmp(n1->label, n2->label);
+
+  return compare_subtrees(n1->next->back, n2->next->back) &&
+         compare_subtrees(n1->next->next->back, n2->next->next->back);
+}
+
+static int compare_trees(pll_unode_t * t1, pll_unode_t * t2)
+{
+  return t1->node_index == t2->node_index &&
+         compare_subtrees(t1->back, t2->back) &&
+         compare_subtrees(t1->next->back, t2->next->back) &&
+         compare_subtrees(t1->next->next->back, t2->next->next->back);
+}
+
+static int load_and_compare(pll_partition_t ** partitions,
+                            pll_unode_t * tree,
+                            unsigned int n_threads)
+{
+  pll_partition_t * loaded[N_PARTITIONS];
+  pll_unode_t * loaded_tree;
+  unsigned int i;
+  int retval = 1;
+
+  memset(loaded, 0, N_PARTITIONS * sizeof(pll_partition_t *));
+  if (!pllmod_binary_checkpoint_load(BIN_FILENAME, loaded, N_PARTITIONS,
+                                     &loaded_tree, n_threads))
+    fatal("Error loading checkpoint: %s", pll_errmsg);
+
+  for (i = 0; i < N_PARTITIONS; ++i)
+  {
+    retval &= compare_partitions(partitions[i], loaded[i]);
+    pll_partition_destroy(loaded[i]);
+  }
+  retval &= compare_trees(tree, loaded_tree);
+  pll_utree_graph_destroy(loaded_tree, NULL);
+
+  return retval;
+}
+
+int main (int argc, char * argv[])
+{
+  unsigned int attributes = get_attributes(argc, argv);
+  unsigned int i;
+  pll_partition_t * partitions[N_PARTITIONS];
+  pll_utree_t * parsed_tree;
+  pll_unode_t * tree;
+  struct rlimit old_limit, limit;
+  double old_rate;
+
+  if (attributes & PLL_ATTRIB_PATTERN_TIP)
+    skip_test();
+
+  parsed_tree = pll_utree_parse_newick_string(TREE_STRING);
+  if (!parsed_tree)
+    fatal("Error parsing tree: %s", pll_errmsg);
+  tree = parsed_tree->nodes[2 * N_TIPS - 3];
+
+  for (i = 0; i < N_PARTITIONS; ++i)
+    partitions[i] = create_test_partition(N_TIPS, 20 + 15 * i, 1 + i % 4,
+                                          attributes);
+
+  printf("** parallel dump\n");
+  if (!pllmod_binary_checkpoint_dump(BIN_FILENAME, partitions, N_PARTITIONS,
+                                     tree, N_TIPS,
+                                     PLLMOD_BIN_ATTRIB_PARTITION_DUMP_CLV,
+                                     N_THREADS))
+    fatal("Error dumping checkpoint: %s", pll_errmsg);
+  printf("temporary file removed: %s\n",
+         access(BIN_TMP_FILENAME, F_OK) ? "yes" : "no");
+
+  printf("** parallel load\n");
+  printf("checkpoint OK (1 thread): %s\n",
+         load_and_compare(partitions, tree, 1) ? "yes" : "no");
+  printf("checkpoint OK (%d threads): %s\n", N_PARTITIONS + 1,
+         load_and_compare(partitions, tree, N_PARTITIONS + 1) ? "yes" : "no");
+
+  /* compressed blocks are measured by compressing them */
+  printf("** compressed parallel dump\n");
+  if (!pllmod_binary_checkpoint_dump(BIN_FILENAME, partitions, N_PARTITIONS,
+                                     tree, N_TIPS,
+                                     PLLMOD_BIN_ATTRIB_PARTITION_DUMP_CLV |
+                                     PLLMOD_BIN_ATTRIB_COMPRESS,
+                                     N_THREADS))
+    fatal("Error dumping checkpoint: %s", pll_errmsg);
+  printf("checkpoint OK (%d threads): %s\n", N_THREADS,
+         load_and_compare(partitions, tree, N_THREADS) ? "yes" : "no");
+
+  printf("** failed dump\n");
+  old_rate = partitions[1]->rates[0];
+  partitions[1]->rates[0] *= 2;
+
+  /* the new checkpoint does not fit in the file size limit */
+  signal(SIGXFSZ, SIG_IGN);
+  getrlimit(RLIMIT_FSIZE, &old_limit);
+  limit = old_limit;
+  limit.rlim_cur = 4096;
+  setrlimit(RLIMIT_FSIZE, &limit);
+
+  printf("failed dump reported: %s\n",
+         pllmod_binary_checkpoint_dump(BIN_FILENAME, partitions, N_PARTITIONS,
+                                       tree, N_TIPS,
+                                       PLLMOD_BIN_ATTRIB_PARTITION_DUMP_CLV,
+                                       N_THREADS) ? "no" : "yes");
+
+  setrlimit(RLIMIT_FSIZE, &old_limit);
+
+  printf("temporary file removed: %s\n",
+         access(BIN_TMP_FILENAME, F_OK) ? "yes" : "no");
+
+  partitions[1]->rates[0] = old_rate;
+  printf("previous checkpoint kept: %s\n",
+         load_and_compare(partitions, tree, N_THREADS) ? "yes" : "no");
+
+  /* clean */
+  for (i = 0; i < N_PARTITIONS; ++i)
+    pll_partition_destroy(partitions[i]);
+  pll_utree_destroy(parsed_tree, NULL);
+  remove(BIN_FILENAME);
+
+  return (0);
+}
@@ -0,0 +1,231 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+#include "pll_binary.h"
+#include "../common.h"
+
+#include <string.h>
+#include <signal.h>
+#include <sys/resource.h>
+
+#define N_TIPS        12
+#define N_SITES       50
+#define N_RATE_CATS    4
+
+#define BLOCK_ID_DELTA 2000
+#define MAX_BLOCKS       10
+
+#define BIN_FILENAME "test-delta.bin"
+
+/*
+ * This test writes a full partition checkpoint followed by two deltas, and
+ * checks that loading them restores the last state. Then it makes a delta
+ * dump fail halfway through the CLVs (by limiting the file size) and checks
+ * that the failed block is not registered, such that the file still loads
+ * the previous state.
+ */
+
+static void change_clv(pll_partition_t * partition, unsigned int clv_index)
+{
+  size_t j, clv_size = partition->sites * partition->states_padded *
+                       partition->rate_cats;
+
+  for (j = 0; j < clv_size; ++j)
+    partition->clv[clv_index][j] *= 0.5;
+}
+
+static int delta_dump(pll_partition_t * partition,
+                      pll_binary_delta_t * delta,
+                      const char * clv_valid)
+{
+  pll_binary_header_t bin_header;
+  int retval;
+  FILE * bin_file = pllmod_binary_append_open(BIN_FILENAME, &bin_header);
+
+  if (!bin_file)
+    fatal("Cannot open binary file: %s", pll_errmsg);
+
+  retval = pllmod_binary_partition_delta_dump(bin_file,
+                                              BLOCK_ID_DELTA,
+                                              partition,
+                                              delta,
+                                              clv_valid,
+                                              PLLMOD_BIN_ATTRIB_UPDATE_MAP);
+  pllmod_binary_close(bin_file);
+
+  return retval;
+}
+
+static pll_partition_t * delta_load(unsigned int * n_blocks)
+{
+  pll_binary_header_t bin_header;
+  unsigned int bin_attributes = 0;
+  pll_partition_t * partition;
+  FILE * bin_file = pllmod_binary_open(BIN_FILENAME, &bin_header);
+
+  if (!bin_file)
+    fatal("Cannot open binary file: %s", pll_errmsg);
+
+  *n_blocks = bin_header.n_blocks;
+  partition = pllmod_binary_partition_delta_load(bin_file,
+                                                 BLOCK_ID_DELTA,
+                                                 NULL,
+                                                 &bin_attributes);
+  pllmod_binary_close(bin_file);
+
+  return partition;
+}
+
+static long int file_size(void)
+{
+  long int size;
+  FILE * f = fopen(BIN_FILENAME, "rb");
+
+  if (!f)
+    fatal("Cannot open %s", BIN_FILENAME);
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  fclose(f);
+
+  return size;
+}
+
+int main (int argc, char * argv[])
+{
+  unsigned int attributes = get_attributes(argc, argv);
+  unsigned int n_blocks;
+  long int size_full, size_delta;
+  pll_partition_t * partition, * loaded, * stored;
+  pll_binary_delta_t * delta;
+  pll_binary_header_t bin_header;
+  FILE * bin_file;
+  struct rlimit old_limit, limit;
+  char * clv_valid;
+
+  if (attributes & PLL_ATTRIB_PATTERN_TIP)
+    skip_test();
+
+  partition = create_test_partition(N_TIPS, N_SITES, N_RATE_CATS, attributes);
+  delta = pllmod_binary_delta_create(partition);
+  if (!delta)
+    fatal("Cannot create delta state: %s", pll_errmsg);
+
+  bin_file = pllmod_binary_create(BIN_FILENAME, &bin_header,
+                                  PLLMOD_BIN_ACCESS_RANDOM, MAX_BLOCKS);
+  if (!bin_file)
+    fatal("Cannot create binary file: %s", pll_errmsg);
+  pllmod_binary_close(bin_file);
+
+  printf("** full dump\n");
+  size_full = file_size();
+  if (!delta_dump(partition, delta, NULL))
+    fatal("Error dumping full block: %s", pll_errmsg);
+  size_full = file_size() - size_full;
+
+  printf("** delta dumps\n");
+  size_delta = file_size();
+  change_clv(partition, N_TIPS + 1);
+  partition->scale_buffer[2][5] += 1;
+  if (!delta_dump(partition, delta, NULL))
+    fatal("Error dumping delta block: %s", pll_errmsg);
+  size_delta = file_size() - size_delta;
+  printf("delta smaller than full block: %s\n",
+         size_delta < size_full / 4 ? "yes" : "no");
+
+  /* an invalid CLV is not stored, even if it changed */
+  clv_valid = (char *) calloc(N_TIPS + partition->clv_buffers, sizeof(char));
+  memset(clv_valid, 1, N_TIPS + partition->clv_buffers);
+  clv_valid[N_TIPS + 4] = 0;
+  partition->rates[1] *= 1.5;
+  change_clv(partition, N_TIPS + 3);
+  change_clv(partition, N_TIPS + 4);
+  if (!delta_dump(partition, delta, clv_valid))
+    fatal("Error dumping delta block: %s", pll_errmsg);
+
+  stored = delta_load(&n_blocks);
+  if (!stored)
+    fatal("Error loading delta blocks: %s", pll_errmsg);
+  printf("blocks: %u\n", n_blocks);
+  printf("invalid CLV skipped: %s\n",
+         compare_partitions(partition, stored) ? "no" : "yes");
+  change_clv(stored, N_TIPS + 4);
+  printf("round-trip OK: %s\n",
+         compare_partitions(partition, stored) ? "yes" : "no");
+
+  printf("** failed delta dump\n");
+  /* the first changed CLV fits in the file size limit, the second does not */
+  signal(SIGXFSZ, SIG_IGN);
+  getrlimit(RLIMIT_FSIZE, &old_limit);
+  limit = old_limit;
+  limit.rlim_cur = (rlim_t) (file_size() + size_delta);
+  setrlimit(RLIMIT_FSIZE, &limit);
+
+  change_clv(partition, N_TIPS);
+  change_clv(partition, N_TIPS + 5);
+  change_clv(partition, N_TIPS + 6);
+  printf("failed dump reported: %s\n",
+         delta_dump(partition, delta, NULL) ? "no" : "yes");
+
+  setrlimit(RLIMIT_FSIZE, &old_limit);
+
+  loaded = delta_load(&n_blocks);
+  printf("blocks: %u\n", n_blocks);
+  if (loaded)
+    change_clv(loaded, N_TIPS + 4);
+  printf("previous state kept: %s\n",
+         loaded && compare_partitions(stored, loaded) ? "yes" : "no");
+  if (loaded)
+    pll_partition_destroy(loaded);
+
+  printf("** recovery dump\n");
+  if (!delta_dump(partition, delta, NULL))
+    fatal("Error dumping delta block: %s", pll_errmsg);
+  loaded = delta_load(&n_blocks);
+  if (!loaded)
+    fatal("Error loading delta blocks: %s", pll_errmsg);
+  printf("blocks: %u\n", n_blocks);
+  printf("round-trip OK: %s\n",
+         compare_partitions(partition, loaded) ? "yes" : "no");
+
+  /* flipping the sign bit of two words of a buffer cancels out in weak
+     multiplicative checksums, but must still be detected */
+  printf("** cancelling changes\n");
+  pll_partition_destroy(loaded);
+  partition->clv[N_TIPS + 2][0] = -partition->clv[N_TIPS + 2][0];
+  partition->clv[N_TIPS + 2][7] = -partition->clv[N_TIPS + 2][7];
+  if (!delta_dump(partition, delta, NULL))
+    fatal("Error dumping delta block: %s", pll_errmsg);
+  loaded = delta_load(&n_blocks);
+  if (!loaded)
+    fatal("Error loading delta blocks: %s", pll_errmsg);
+  printf("blocks: %u\n", n_blocks);
+  printf("round-trip OK: %s\n",
+         compare_partitions(partition, loaded) ? "yes" : "no");
+
+  /* clean */
+  pll_partition_destroy(loaded);
+  pll_partition_destroy(stored);
+  pll_partition_destroy(partition);
+  pllmod_binary_delta_destroy(delta);
+  free(clv_valid);
+  remove(BIN_FILENAME);
+
+  return (0);
+}
@@ -0,0 +1,162 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+#include "pll_binary.h"
+#include "../common.h"
+
+#include <string.h>
+
+#define N_TIPS        10
+#define N_SITES       60
+#define N_RATE_CATS    4
+
+#define BLOCK_ID_PARTITION 1000
+
+#define BIN_FILENAME       "test-truncated.bin"
+#define BIN_TRUNC_FILENAME "test-truncated.bin.trunc"
+
+/*
+ * This test dumps a partition with plain and with compressed blocks, and
+ * loads it back into a new and into an existing partition. Then it truncates
+ * the file in the middle of the partition body, and checks that loading fails
+ * in both cases, leaving the existing partition to the caller.
+ */
+
+static void dump_partition(pll_partition_t * partition, unsigned int compress)
+{
+  pll_binary_header_t bin_header;
+  FILE * bin_file = pllmod_binary_create(BIN_FILENAME,
+                                         &bin_header,
+                                         PLLMOD_BIN_ACCESS_RANDOM,
+                                         1);
+  if (!bin_file)
+    fatal("Cannot create binary file: %s", pll_errmsg);
+
+  if (!pllmod_binary_partition_dump(bin_file,
+                                    BLOCK_ID_PARTITION,
+                                    partition,
+                                    PLLMOD_BIN_ATTRIB_PARTITION_DUMP_CLV |
+                                    PLLMOD_BIN_ATTRIB_PARTITION_DUMP_WGT |
+                                    PLLMOD_BIN_ATTRIB_UPDATE_MAP |
+                                    compress))
+    fatal("Error dumping partition: %s", pll_errmsg);
+
+  pllmod_binary_close(bin_file);
+}
+
+/* copy the first 3/4 of the file, which ends inside the partition body */
+static void truncate_file(void)
+{
+  FILE * src = fopen(BIN_FILENAME, "rb");
+  FILE * dst = fopen(BIN_TRUNC_FILENAME, "wb");
+  long int size;
+  char * data;
+
+  if (!src || !dst)
+    fatal("Cannot open files for truncating");
+
+  fseek(src, 0, SEEK_END);
+  size = ftell(src) / 4 * 3;
+  fseek(src, 0, SEEK_SET);
+
+  data = (char *) malloc((size_t) size);
+  if (fread(data, 1, (size_t) size, src) != (size_t) size ||
+      fwrite(data, 1, (size_t) size, dst) != (size_t) size)
+    fatal("Cannot write truncated file");
+
+  free(data);
+  fclose(src);
+  fclose(dst);
+}
+
+static pll_partition_t * load_partition(const char * filename,
+                                        pll_partition_t * partition)
+{
+  pll_binary_header_t bin_header;
+  unsigned int bin_attributes = 0;
+  pll_partition_t * loaded;
+  FILE * bin_file = pllmod_binary_open(filename, &bin_header);
+
+  if (!bin_file)
+    fatal("Cannot open binary file: %s", pll_errmsg);
+
+  loaded = pllmod_binary_partition_load(bin_file,
+                                        BLOCK_ID_PARTITION,
+                                        partition,
+                                        &bin_attributes,
+                                        PLLMOD_BIN_ACCESS_SEEK);
+  pllmod_binary_close(bin_file);
+
+  return loaded;
+}
+
+int main(int argc, char * argv[])
+{
+  unsigned int attributes = get_attributes(argc, argv);
+  unsigned int compress[2] = {0, PLLMOD_BIN_ATTRIB_COMPRESS};
+  unsigned int c;
+  pll_partition_t * partition, * loaded, * target;
+
+  if (attributes != PLL_ATTRIB_ARCH_CPU)
+  {
+    skip_test();
+  }
+
+  partition = create_test_partition(N_TIPS, N_SITES, N_RATE_CATS, attributes);
+
+  for (c = 0; c < 2; ++c)
+  {
+    printf("** %s blocks\n", compress[c] ? "compressed" : "plain");
+
+    dump_partition(partition, compress[c]);
+
+    loaded = load_partition(BIN_FILENAME, NULL);
+    printf("load into a new partition: %s\n",
+           loaded && compare_partitions(partition, loaded) ? "yes" : "no");
+    if (loaded)
+      pll_partition_destroy(loaded);
+
+    /* a partition of the same size with different contents */
+    target = create_test_partition(N_TIPS, N_SITES, N_RATE_CATS, attributes);
+    memset(target->clv[N_TIPS], 0,
+           N_SITES * target->states_padded * N_RATE_CATS * sizeof(double));
+    loaded = load_partition(BIN_FILENAME, target);
+    printf("load into an existing partition: %s\n",
+           loaded == target && compare_partitions(partition, target) ?
+           "yes" : "no");
+
+    truncate_file();
+    printf("truncated file into a new partition fails: %s\n",
+           load_partition(BIN_TRUNC_FILENAME, NULL) ? "no" : "yes");
+
+    /* the existing partition is still owned (and destroyed) by the caller */
+    loaded = load_partition(BIN_TRUNC_FILENAME, target);
+    printf("truncated file into an existing partition fails: %s\n",
+           loaded ? "no" : "yes");
+    pll_partition_destroy(target);
+  }
+
+  /* clean */
+  pll_partition_destroy(partition);
+  remove(BIN_FILENAME);
+  remove(BIN_TRUNC_FILENAME);
+
+  return (0);
+}
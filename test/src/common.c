@@ -1,8 +1,11 @@
 #include "common.h"
+#include "rng.h"
+#include "pll_tree.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <math.h>
 
 unsigned int get_attributes(int argc, char **argv)
 {
@@ -105,3 +108,408 @@ void fatal(const char * format, ...)
   fprintf(stderr, "\n");
   exit(EXIT_FAILURE);
 }
+
+pll_partition_t * create_test_partition(unsigned int tips,
+                                        unsigned int sites,
+                                        unsigned int rate_cats,
+                                        unsigned int attributes)
+{
+  unsigned int i, j;
+  double subst_params[6];
+  double frequencies[4];
+  double * rates;
+  double sum = 0;
+  size_t clv_size;
+
+  pll_partition_t * partition = pll_partition_create(tips,
+                                                     tips - 2,
+                                                     4,
+                                                     sites,
+                                                     1,
+                                                     2 * tips - 3,
+                                                     rate_cats,
+                                                     tips - 2,
+                                                     attributes);
+  if (!partition)
+    fatal("Cannot create partition: %s", pll_errmsg);
+
+  for (i = 0; i < 6; ++i)
+    subst_params[i] = 0.5 + (RAND % 100) / 20.0;
+  for (i = 0; i < 4; ++i)
+  {
+    frequencies[i] = 1 + RAND % 10;
+    sum += frequencies[i];
+  }
+  for (i = 0; i < 4; ++i)
+    frequencies[i] /= sum;
+
+  rates = (double *) malloc(rate_cats * sizeof(double));
+  for (i = 0; i < rate_cats; ++i)
+    rates[i] = 0.25 + i * 0.5;
+
+  pll_set_subst_params(partition, 0, subst_params);
+  pll_set_frequencies(partition, 0, frequencies);
+  pll_set_category_rates(partition, rates);
+  free(rates);
+
+  clv_size = sites * partition->states_padded * rate_cats;
+  for (i = tips; i < tips + partition->clv_buffers; ++i)
+    for (j = 0; j < clv_size; ++j)
+      partition->clv[i][j] = ((i * 7919 + j * 104729) % 1000 + 1) / 1000.0;
+
+  for (i = 0; i < partition->scale_buffers; ++i)
+    for (j = 0; j < sites; ++j)
+      partition->scale_buffer[i][j] = (i + j) % 3;
+
+  return partition;
+}
+
+int compare_partitions(const pll_partition_t * p1, const pll_partition_t * p2)
+{
+  unsigned int i;
+  size_t clv_size = p1->sites * p1->states_padded * p1->rate_cats;
+  unsigned int n_subst_rates = p1->states * (p1->states - 1) / 2;
+
+  if (p1->tips != p2->tips || p1->clv_buffers != p2->clv_buffers ||
+      p1->states != p2->states || p1->sites != p2->sites ||
+      p1->rate_cats != p2->rate_cats ||
+      p1->scale_buffers != p2->scale_buffers)
+    return 0;
+
+  if (memcmp(p1->subst_params[0], p2->subst_params[0],
+             n_subst_rates * sizeof(double)) ||
+      memcmp(p1->frequencies[0], p2->frequencies[0],
+             p1->states * sizeof(double)) ||
+      memcmp(p1->rates, p2->rates, p1->rate_cats * sizeof(double)))
+    return 0;
+
+  for (i = p1->tips; i < p1->tips + p1->clv_buffers; ++i)
+    if (memcmp(p1->clv[i], p2->clv[i], clv_size * sizeof(double)))
+      return 0;
+
+  for (i = 0; i < p1->scale_buffers; ++i)
+    if (memcmp(p1->scale_buffer[i], p2->scale_buffer[i],
+               p1->sites * sizeof(unsigned int)))
+      return 0;
+
+  return 1;
+}
+
+const char * test_nt_sequences[TEST_NT_TAXA] = {
+  "TTTGCCCATCTACTTAAAGACCTTGTCCGTAATGTAGGAGAAATAGTAATCCATTTGGCGGAGTATACAAAATACCTCGT",
+  "TTTGCCCATACAATTATAGACCTTGTCTGTACTGTAGAAGAAATAGTAATCCAGTTGACGGCATTTACAAGATGCCTATC",
+  "TATGCCCAACCAATAAAAGACCAAGGCGCTAATGTAGGAGAAATCGGAATCCGTTTGACGGAGTAAACACAGTAAGTCGT",
+  "AATGCCCAACCAATAAAAGACCAAGGCGCTAATGTAGGAGGAATCGGAATCCGTTTGACGGAGTAAACACAGTAAATCGT",
+  "TGTACTCCTGCAATTCAAAACCATGTACAAAATGGCGGCGATATAGGAAATCATTATACGGAGGATACCAAATTCCCGCT",
+  "TTTCCCCATGCAATTCAAAACCAGGTACGCAATGGCGGCGATATTGCATTTCAATTTATGGAGGCAACCAAACTCTTGCA",
+  "TTTCCCCATGCTATTCAAAACCATGTACAAAATGGCGGCGCTTTAGCAACTCAGTTTAAGGAGGACACCAATATCCTTTT",
+  "TTTGCCCATGCTATACAAAACCATGTACAAAATGGCCGCGCTTTAGGAACTCAGTCTTAGTAGGACACCAATATCCTTTT"
+};
+
+pll_partition_t * create_nt_partition(const pll_utree_t * tree,
+                                      const char * const * sequences,
+                                      unsigned int first_site,
+                                      unsigned int sites,
+                                      unsigned int rate_cats,
+                                      double alpha,
+                                      const double * frequencies,
+                                      const double * subst_params,
+                                      unsigned int attributes)
+{
+  unsigned int i;
+  unsigned int tips = tree->tip_count;
+  double * rates;
+  char * sequence;
+
+  pll_partition_t * partition = pll_partition_create(tips,
+                                                     tips - 2,
+                                                     4,
+                                                     sites,
+                                                     1,
+                                                     2 * tips - 3,
+                                                     rate_cats,
+                                                     tips - 2,
+                                                     attributes);
+  if (!partition)
+    fatal("Cannot create partition: %s", pll_errmsg);
+
+  if (!sequences)
+    sequences = test_nt_sequences;
+
+  rates = (double *) malloc(rate_cats * sizeof(double));
+  pll_compute_gamma_cats(alpha, rate_cats, rates, PLL_GAMMA_RATES_MEAN);
+  pll_set_frequencies(partition, 0, frequencies);
+  pll_set_subst_params(partition, 0, subst_params);
+  pll_set_category_rates(partition, rates);
+  free(rates);
+
+  sequence = (char *) malloc(sites + 1);
+  sequence[sites] = '\0';
+  for (i = 0; i < tips; ++i)
+  {
+    pll_unode_t * tip = tree->nodes[i];
+    unsigned int seq_id = (unsigned int) atoi(tip->label + 1) - 1;
+
+    memcpy(sequence, sequences[seq_id] + first_site, sites);
+    if (!pll_set_tip_states(partition, tip->clv_index, pll_map_nt, sequence))
+      fatal("Cannot set tip states: %s", pll_errmsg);
+  }
+  free(sequence);
+
+  return partition;
+}
+
+int compare_branch_lengths(const pll_utree_t * t1,
+                           const pll_utree_t * t2,
+                           double tolerance)
+{
+  unsigned int i;
+  unsigned int node_count = t1->tip_count + t1->inner_count;
+
+  for (i = 0; i < node_count; ++i)
+  {
+    const pll_unode_t * n1 = t1->nodes[i];
+    const pll_unode_t * n2 = t2->nodes[i];
+
+    do
+    {
+      if (fabs(n1->length - n2->length) > tolerance)
+        return 0;
+      n1 = n1->next;
+      n2 = n2->next;
+    }
+    while (n1 && n1 != t1->nodes[i]);
+  }
+
+  return 1;
+}
+
+static unsigned int test_seed = 0;
+
+unsigned int test_random_seed(unsigned int seed)
+{
+  unsigned int previous = test_seed;
+
+  test_seed = seed;
+  return previous;
+}
+
+unsigned int test_random(void)
+{
+  test_seed = test_seed * 1103515245 + 12345;
+  return (test_seed >> 8);
+}
+
+void test_random_perm(unsigned int * perm, unsigned int n, unsigned int swaps)
+{
+  unsigned int i;
+
+  for (i = 0; i < n; ++i)
+    perm[i] = i;
+  for (i = 0; i < swaps; ++i)
+  {
+    unsigned int a = test_random() % n;
+    unsigned int b = test_random() % n;
+    unsigned int t = perm[a];
+    perm[a] = perm[b];
+    perm[b] = t;
+  }
+}
+
+char * random_newick(unsigned int tip_count,
+                     const unsigned int * perm,
+                     char * const * labels,
+                     unsigned int roots,
+                     int branch_lengths)
+{
+  char ** subtrees;
+  char * newick;
+  unsigned int i, n = tip_count;
+
+  subtrees = (char **) malloc(tip_count * sizeof(char *));
+  for (i = 0; i < tip_count; ++i)
+  {
+    unsigned int taxon = perm ? perm[i] : i;
+    char * s;
+
+    subtrees[i] = (char *) malloc((labels ? strlen(labels[taxon]) : 11) + 16);
+    s = subtrees[i];
+    if (labels)
+      s += sprintf(s, "%s", labels[taxon]);
+    else
+      s += sprintf(s, "t%u", taxon + 1);
+    if (branch_lengths)
+      sprintf(s, ":0.%u", test_random() % 100);
+  }
+
+  while (n > roots)
+  {
+    unsigned int a = test_random() % n;
+    unsigned int b = test_random() % (n - 1);
+    char * joined;
+    char * s;
+
+    if (b >= a)
+      ++b;
+
+    joined = (char *) malloc(strlen(subtrees[a]) + strlen(subtrees[b]) + 16);
+    s = joined + sprintf(joined, "(%s,%s)", subtrees[a], subtrees[b]);
+    if (branch_lengths)
+      sprintf(s, ":0.%u", test_random() % 100);
+    free(subtrees[a]);
+    free(subtrees[b]);
+    subtrees[a < b ? a : b] = joined;
+    subtrees[a < b ? b : a] = subtrees[--n];
+  }
+
+  newick = (char *) malloc(strlen(subtrees[0]) + strlen(subtrees[1]) +
+                           (roots == 3 ? strlen(subtrees[2]) : 0) + 6);
+  if (roots == 3)
+    sprintf(newick, "(%s,%s,%s);", subtrees[0], subtrees[1], subtrees[2]);
+  else
+    sprintf(newick, "(%s,%s);", subtrees[0], subtrees[1]);
+  for (i = 0; i < roots; ++i)
+    free(subtrees[i]);
+  free(subtrees);
+
+  return newick;
+}
+
+char * seeded_newick(unsigned int tip_count,
+                     const unsigned int * perm,
+                     unsigned int roots,
+                     unsigned int shape_seed)
+{
+  unsigned int saved_seed = test_random_seed(shape_seed);
+  char * newick = random_newick(tip_count, perm, NULL, roots, 0);
+
+  test_random_seed(saved_seed);
+
+  return newick;
+}
+
+pll_utree_t * parse_utree(const char * newick, unsigned int tip_count)
+{
+  unsigned int i;
+  pll_utree_t * tree = pll_utree_parse_newick_string(newick);
+
+  if (!tree)
+    fatal("Cannot parse tree: %s", pll_errmsg);
+
+  for (i = 0; i < tip_count; ++i)
+  {
+    unsigned int taxon = atoi(tree->nodes[i]->label + 1) - 1;
+    tree->nodes[i]->node_index = taxon;
+    tree->nodes[i]->clv_index = taxon;
+  }
+
+  return tree;
+}
+
+pll_rtree_t * parse_rtree(const char * newick, unsigned int tip_count)
+{
+  unsigned int i;
+  pll_rtree_t * tree = pll_rtree_parse_newick_string(newick);
+
+  if (!tree)
+    fatal("Cannot parse tree: %s", pll_errmsg);
+
+  for (i = 0; i < tip_count; ++i)
+  {
+    unsigned int taxon = atoi(tree->nodes[i]->label + 1) - 1;
+    tree->nodes[i]->node_index = taxon;
+    tree->nodes[i]->clv_index = taxon;
+  }
+
+  return tree;
+}
+
+test_reduce_t * test_reduce_create(unsigned int threads,
+                                   test_reduce_context_t * contexts)
+{
+  unsigned int i;
+  test_reduce_t * reduce = (test_reduce_t *) calloc(1, sizeof(test_reduce_t));
+
+  if (!reduce)
+    fatal("Cannot allocate reduction");
+
+  reduce->slots = (double *) malloc((size_t) threads * TEST_REDUCE_MAX_SIZE *
+                                    sizeof(double));
+  if (!reduce->slots)
+    fatal("Cannot allocate reduction buffers");
+
+  pthread_mutex_init(&reduce->mutex, NULL);
+  pthread_cond_init(&reduce->cond, NULL);
+  reduce->threads = threads;
+
+  for (i = 0; i < threads; ++i)
+  {
+    contexts[i].reduce = reduce;
+    contexts[i].id = i;
+  }
+
+  return reduce;
+}
+
+void test_reduce_destroy(test_reduce_t * reduce)
+{
+  pthread_mutex_destroy(&reduce->mutex);
+  pthread_cond_destroy(&reduce->cond);
+  free(reduce->slots);
+  free(reduce);
+}
+
+static void test_reduce_barrier(test_reduce_t * reduce)
+{
+  unsigned int generation;
+
+  pthread_mutex_lock(&reduce->mutex);
+  generation = reduce->generation;
+  if (++reduce->arrived == reduce->threads)
+  {
+    reduce->arrived = 0;
+    reduce->generation++;
+    pthread_cond_broadcast(&reduce->cond);
+  }
+  else
+  {
+    while (generation == reduce->generation)
+      pthread_cond_wait(&reduce->cond, &reduce->mutex);
+  }
+  pthread_mutex_unlock(&reduce->mutex);
+}
+
+void test_reduce_cb(void * context, double * data, size_t size, int op)
+{
+  test_reduce_context_t * ctx = (test_reduce_context_t *) context;
+  test_reduce_t * reduce = ctx->reduce;
+  unsigned int t;
+  size_t i;
+
+  if (size > TEST_REDUCE_MAX_SIZE)
+    fatal("Too many values to reduce: %lu", (unsigned long) size);
+
+  memcpy(reduce->slots + (size_t) ctx->id * TEST_REDUCE_MAX_SIZE, data,
+         size * sizeof(double));
+  test_reduce_barrier(reduce);
+
+  /* every thread combines the slots in the same order */
+  for (i = 0; i < size; ++i)
+  {
+    double value = reduce->slots[i];
+    for (t = 1; t < reduce->threads; ++t)
+    {
+      double x = reduce->slots[(size_t) t * TEST_REDUCE_MAX_SIZE + i];
+      if (op == PLLMOD_TREE_REDUCE_SUM)
+        value += x;
+      else if (op == PLLMOD_TREE_REDUCE_MAX)
+        value = x > value ? x : value;
+      else if (op == PLLMOD_TREE_REDUCE_MIN)
+        value = x < value ? x : value;
+    }
+    data[i] = value;
+  }
+
+  /* slots are overwritten by the next reduction */
+  test_reduce_barrier(reduce);
+}
@@ -26,6 +26,11 @@
 #include "pll.h"
 #endif
 
+#include <pthread.h>
+
+/* maximum number of values reduced at once by test_reduce_cb */
+#define TEST_REDUCE_MAX_SIZE 4096
+
 /* parse attributes from the arguments */
 unsigned int get_attributes(int argc, char **argv);
 /* skip current test */
@@ -41,4 +46,92 @@ void show_rtree (pll_rnode_t * tree, int SHOW_ASCII_TREE);
 /* print error and exit */
 void fatal(const char * format, ...) __attribute__ ((noreturn));
 
+/* partition of 4 states with random model parameters, and deterministic
+   CLVs and scale buffers */
+pll_partition_t * create_test_partition(unsigned int tips,
+                                        unsigned int sites,
+                                        unsigned int rate_cats,
+                                        unsigned int attributes);
+/* compare dimensions, model parameters, CLVs and scale buffers */
+int compare_partitions(const pll_partition_t * p1, const pll_partition_t * p2);
+
+/* nucleotide alignment of TEST_NT_TAXA taxa shared by the likelihood tests,
+   and trees on its taxa, labelled t1..t8 as the sequences */
+#define TEST_NT_TAXA   8
+#define TEST_NT_SITES 80
+#define TEST_NT_TREE "((t1:0.3,t2:0.05):0.2,(t3:0.02,t4:0.4):0.1," \
+                     "((t5:0.1,t6:0.3):0.05,(t7:0.2,t8:0.01):0.3):0.1);"
+/* branch lengths far from the optimum */
+#define TEST_NT_FLAT_TREE "((t1:1.0,t2:1.0):1.0,(t3:1.0,t4:1.0):1.0," \
+                          "((t5:1.0,t6:1.0):1.0,(t7:1.0,t8:1.0):1.0):1.0);"
+extern const char * test_nt_sequences[TEST_NT_TAXA];
+
+/* partition of 4 states for the tips of `tree`, with `sites` sites from
+   `first_site` on and gamma rates of shape `alpha`. The tip labelled t<i>
+   gets sequence i-1 of `sequences`, or of test_nt_sequences if NULL */
+pll_partition_t * create_nt_partition(const pll_utree_t * tree,
+                                      const char * const * sequences,
+                                      unsigned int first_site,
+                                      unsigned int sites,
+                                      unsigned int rate_cats,
+                                      double alpha,
+                                      const double * frequencies,
+                                      const double * subst_params,
+                                      unsigned int attributes);
+/* compare the branch lengths of trees with the same node layout */
+int compare_branch_lengths(const pll_utree_t * t1,
+                           const pll_utree_t * t2,
+                           double tolerance);
+
+/* deterministic random numbers for the tree tests. Setting the seed returns
+   the previous one, so that callers can restore it */
+unsigned int test_random_seed(unsigned int seed);
+unsigned int test_random(void);
+/* identity permutation of n elements after `swaps` random swaps */
+void test_random_perm(unsigned int * perm, unsigned int n, unsigned int swaps);
+/* random binary tree in newick format, joining random pairs of subtrees
+   until `roots` (2 or 3) remain. Tip i is labelled labels[perm[i]], or
+   t<perm[i] + 1> without labels, and perm may be NULL for the identity.
+   With branch_lengths, every branch gets a random length */
+char * random_newick(unsigned int tip_count,
+                     const unsigned int * perm,
+                     char * const * labels,
+                     unsigned int roots,
+                     int branch_lengths);
+/* random_newick without labels and branch lengths, with a shape that only
+   depends on shape_seed. The random sequence is left as it was */
+char * seeded_newick(unsigned int tip_count,
+                     const unsigned int * perm,
+                     unsigned int roots,
+                     unsigned int shape_seed);
+/* parsed trees with the tips indexed as in their t<i> labels */
+pll_utree_t * parse_utree(const char * newick, unsigned int tip_count);
+pll_rtree_t * parse_rtree(const char * newick, unsigned int tip_count);
+
+/* threads that reduce values with each other, as the processes of a
+   distributed run do through the parallel_reduce_cb of a treeinfo */
+typedef struct test_reduce
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  unsigned int threads;
+  unsigned int arrived;
+  unsigned int generation;
+  double * slots;
+} test_reduce_t;
+
+/* per-thread context passed to test_reduce_cb */
+typedef struct test_reduce_context
+{
+  test_reduce_t * reduce;
+  unsigned int id;
+} test_reduce_context_t;
+
+/* set up the reduction among `threads` threads and their contexts */
+test_reduce_t * test_reduce_create(unsigned int threads,
+                                   test_reduce_context_t * contexts);
+void test_reduce_destroy(test_reduce_t * reduce);
+/* parallel_reduce_cb: all threads must call it with the same size and op */
+void test_reduce_cb(void * context, double * data, size_t size, int op);
+
 #endif /* COMMON_H_ */
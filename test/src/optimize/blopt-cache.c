@@ -0,0 +1,248 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+#include "pll_optimize.h"
+#include "pll_tree.h"
+#include "../common.h"
+
+#include <string.h>
+
+#define N_TIPS         TEST_NT_TAXA
+#define N_STATES       4
+#define N_SUBST_RATES  6
+#define N_SITES       TEST_NT_SITES
+#define N_RATE_CATS    4
+
+#define SMOOTHINGS    16
+
+/*
+ * This test optimizes the branch lengths of the same tree without a sumtable
+ * cache, with a cache for every branch and with a cache for only three
+ * branches, where branches compete for the slots. Sumtables are only reused
+ * if the CLVs at both ends did not change, so the three runs must give
+ * exactly the same branch lengths and score.
+ *
+ * Cached sumtables are kept across calls: they are checked by clearing the
+ * cache buffers, which changes the result of the next call unless the cache
+ * was dropped by invalidating treeinfo, by a full recomputation, or by
+ * initializing the partition again, or is skipped for lacking buffers.
+ */
+
+static pllmod_treeinfo_t * create_treeinfo(unsigned int attributes,
+                                           pll_utree_t ** tree,
+                                           size_t cache_bytes)
+{
+  double frequencies[N_STATES] = {0.3, 0.2, 0.15, 0.35};
+  double subst_params[N_SUBST_RATES] = {1.45, 3.94, 0.46, 0.62, 4.75, 1.0};
+  pll_partition_t * partition;
+  pllmod_treeinfo_t * treeinfo;
+
+  *tree = pll_utree_parse_newick_string(TEST_NT_FLAT_TREE);
+  if (!*tree)
+    fatal("Error parsing tree: %s", pll_errmsg);
+
+  partition = create_nt_partition(*tree, NULL, 0, N_SITES, N_RATE_CATS, 0.6,
+                                  frequencies, subst_params, attributes);
+
+  treeinfo = pllmod_treeinfo_create((*tree)->nodes[2 * N_TIPS - 3], N_TIPS, 1,
+                                    PLLMOD_TREE_BRLEN_LINKED);
+  if (!treeinfo)
+    fatal("Cannot create treeinfo: %s", pll_errmsg);
+
+  if (!pllmod_treeinfo_init_partition(treeinfo, 0, partition, 0,
+                                      PLL_GAMMA_RATES_MEAN, 0.6, NULL, NULL))
+    fatal("Cannot initialize partition: %s", pll_errmsg);
+
+  if (!pllmod_treeinfo_set_sumtable_cache(treeinfo, cache_bytes))
+    fatal("Cannot set sumtable cache: %s", pll_errmsg);
+
+  /* update CLVs towards the root */
+  pllmod_treeinfo_compute_loglh(treeinfo, 0);
+
+  return treeinfo;
+}
+
+static void destroy_treeinfo(pllmod_treeinfo_t * treeinfo, pll_utree_t * tree)
+{
+  pll_partition_destroy(treeinfo->partitions[0]);
+  pllmod_treeinfo_destroy(treeinfo);
+  pll_utree_destroy(tree, NULL);
+}
+
+/* view of the sumtable cache kept in treeinfo, or NULL if it is not set */
+static pllmod_sumtable_cache_t * get_cache(pllmod_treeinfo_t * treeinfo,
+                                           pllmod_sumtable_cache_t * cache)
+{
+  if (!treeinfo->sumtable_cache)
+    return NULL;
+
+  cache->buffers       = treeinfo->sumtable_cache;
+  cache->slots         = treeinfo->sumtable_cache_slots;
+  cache->tags          = treeinfo->sumtable_tags;
+  cache->clv_epoch     = treeinfo->clv_epoch;
+  cache->clv_inputs    = treeinfo->clv_inputs;
+  cache->pmatrix_epoch = treeinfo->pmatrix_epoch;
+  cache->epoch         = &treeinfo->sumtable_epoch;
+
+  return cache;
+}
+
+static void clear_cache(pllmod_treeinfo_t * treeinfo, size_t sumtable_bytes)
+{
+  memset(treeinfo->sumtable_cache[0], 0,
+         treeinfo->sumtable_cache_slots * sumtable_bytes);
+}
+
+static double optimize_cached(pllmod_treeinfo_t * treeinfo,
+                              pllmod_sumtable_cache_t * cache)
+{
+  double loglh = -1 * pllmod_opt_optimize_branch_lengths_local_multi_cached(
+                                                  treeinfo->partitions,
+                                                  1,
+                                                  treeinfo->root,
+                                                  treeinfo->param_indices,
+                                                  treeinfo->deriv_precomp,
+                                                  NULL,
+                                                  PLLMOD_OPT_MIN_BRANCH_LEN,
+                                                  PLLMOD_OPT_MAX_BRANCH_LEN,
+                                                  1e-9,
+                                                  SMOOTHINGS,
+                                                  -1,
+                                                  1,
+                                                  cache,
+                                                  NULL, NULL);
+  if (loglh > 0)
+    fatal("Error optimizing branch lengths: %s", pll_errmsg);
+
+  return loglh;
+}
+
+static double optimize(pllmod_treeinfo_t * treeinfo)
+{
+  pllmod_sumtable_cache_t cache;
+
+  return optimize_cached(treeinfo, get_cache(treeinfo, &cache));
+}
+
+/* optimize both trees again, and check that the results are the same */
+static int same_again(pllmod_treeinfo_t * ti_plain, pll_utree_t * tree_plain,
+                      pllmod_treeinfo_t * ti_full, pll_utree_t * tree_full)
+{
+  double plain_loglh = optimize(ti_plain);
+  double full_loglh = optimize(ti_full);
+
+  return full_loglh == plain_loglh &&
+         compare_branch_lengths(tree_plain, tree_full, 0);
+}
+
+int main(int argc, char * argv[])
+{
+  unsigned int attributes = get_attributes(argc, argv);
+  size_t sumtable_bytes = N_SITES * N_RATE_CATS * N_STATES * sizeof(double);
+  pll_utree_t * tree_plain, * tree_full, * tree_small;
+  pllmod_treeinfo_t * ti_plain, * ti_full, * ti_small;
+  double start_loglh, plain_loglh, full_loglh, small_loglh;
+  pllmod_sumtable_cache_t cache;
+  double * no_buffers[1] = {NULL};
+  pll_partition_t * partition;
+
+  ti_plain = create_treeinfo(attributes, &tree_plain, 0);
+  ti_full = create_treeinfo(attributes, &tree_full,
+                            (2 * N_TIPS - 3) * sumtable_bytes);
+  ti_small = create_treeinfo(attributes, &tree_small, 3 * sumtable_bytes);
+
+  printf("** cache slots\n");
+  printf("no cache: %u\n", ti_plain->sumtable_cache_slots);
+  printf("full cache: %u\n", ti_full->sumtable_cache_slots);
+  printf("small cache: %u\n", ti_small->sumtable_cache_slots);
+
+  start_loglh = pllmod_treeinfo_compute_loglh(ti_plain, 0);
+
+  printf("** no cache\n");
+  plain_loglh = optimize(ti_plain);
+  printf("log-likelihood improved: %s\n",
+         plain_loglh > start_loglh + 1 ? "yes" : "no");
+
+  printf("** full cache\n");
+  full_loglh = optimize(ti_full);
+  printf("same result: %s\n",
+         (full_loglh == plain_loglh &&
+          compare_branch_lengths(tree_plain, tree_full, 0)) ?
+         "yes" : "no");
+
+  printf("** small cache\n");
+  small_loglh = optimize(ti_small);
+  printf("same result: %s\n",
+         (small_loglh == plain_loglh &&
+          compare_branch_lengths(tree_plain, tree_small, 0)) ?
+         "yes" : "no");
+
+  pllmod_treeinfo_invalidate_all(ti_small);
+  printf("score matches full recomputation: %s\n",
+         fabs(small_loglh - pllmod_treeinfo_compute_loglh(ti_small, 0)) < 1e-6 ?
+         "yes" : "no");
+
+  printf("** across calls\n");
+  printf("same result: %s\n",
+         same_again(ti_plain, tree_plain, ti_full, tree_full) ? "yes" : "no");
+
+  clear_cache(ti_full, sumtable_bytes);
+  pllmod_treeinfo_invalidate_all(ti_full);
+  printf("invalidation drops cached sumtables: %s\n",
+         same_again(ti_plain, tree_plain, ti_full, tree_full) ? "yes" : "no");
+
+  clear_cache(ti_full, sumtable_bytes);
+  pllmod_treeinfo_compute_loglh(ti_plain, 0);
+  pllmod_treeinfo_compute_loglh(ti_full, 0);
+  printf("full recomputation drops cached sumtables: %s\n",
+         same_again(ti_plain, tree_plain, ti_full, tree_full) ? "yes" : "no");
+
+  /* the partition is initialized again into an uninitialized buffer */
+  partition = ti_full->partitions[0];
+  pllmod_treeinfo_destroy_partition(ti_full, 0);
+  printf("removed partition has no buffer: %s\n",
+         ti_full->sumtable_cache[0] ? "no" : "yes");
+  if (!pllmod_treeinfo_init_partition(ti_full, 0, partition, 0,
+                                      PLL_GAMMA_RATES_MEAN, 0.6, NULL, NULL))
+    fatal("Cannot initialize partition: %s", pll_errmsg);
+  printf("initialization drops cached sumtables: %s\n",
+         same_again(ti_plain, tree_plain, ti_full, tree_full) ? "yes" : "no");
+
+  clear_cache(ti_full, sumtable_bytes);
+  get_cache(ti_full, &cache);
+  cache.buffers = no_buffers;
+  plain_loglh = optimize(ti_plain);
+  full_loglh = optimize_cached(ti_full, &cache);
+  printf("cache without buffers is skipped: %s\n",
+         (full_loglh == plain_loglh &&
+          compare_branch_lengths(tree_plain, tree_full, 0)) ?
+         "yes" : "no");
+
+  clear_cache(ti_full, sumtable_bytes);
+  printf("cached sumtables are reused: %s\n",
+         same_again(ti_plain, tree_plain, ti_full, tree_full) ? "no" : "yes");
+
+  /* clean */
+  destroy_treeinfo(ti_plain, tree_plain);
+  destroy_treeinfo(ti_full, tree_full);
+  destroy_treeinfo(ti_small, tree_small);
+
+  return (0);
+}
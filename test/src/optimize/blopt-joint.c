@@ -0,0 +1,139 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+#include "pll_optimize.h"
+#include "pll_tree.h"
+#include "../common.h"
+
+#define N_TIPS         TEST_NT_TAXA
+#define N_STATES       4
+#define N_SUBST_RATES  6
+#define N_SITES       TEST_NT_SITES
+#define N_RATE_CATS    4
+
+#define LOGLH_TOLERANCE  1e-2
+#define BRLEN_TOLERANCE  1e-3
+
+/*
+ * This test optimizes all branch lengths of the same tree with joint Newton
+ * steps and with the per-branch Newton-Raphson optimizer, and checks that
+ * both reach the same log-likelihood and branch lengths. The score returned
+ * by the joint optimizer must match a full recomputation.
+ */
+
+static pllmod_treeinfo_t * create_treeinfo(unsigned int attributes,
+                                           pll_utree_t ** tree)
+{
+  double frequencies[N_STATES] = {0.3, 0.2, 0.15, 0.35};
+  double subst_params[N_SUBST_RATES] = {1.45, 3.94, 0.46, 0.62, 4.75, 1.0};
+  pll_partition_t * partition;
+  pllmod_treeinfo_t * treeinfo;
+
+  *tree = pll_utree_parse_newick_string(TEST_NT_FLAT_TREE);
+  if (!*tree)
+    fatal("Error parsing tree: %s", pll_errmsg);
+
+  partition = create_nt_partition(*tree, NULL, 0, N_SITES, N_RATE_CATS, 0.6,
+                                  frequencies, subst_params, attributes);
+
+  treeinfo = pllmod_treeinfo_create((*tree)->nodes[2 * N_TIPS - 3], N_TIPS, 1,
+                                    PLLMOD_TREE_BRLEN_LINKED);
+  if (!treeinfo)
+    fatal("Cannot create treeinfo: %s", pll_errmsg);
+
+  if (!pllmod_treeinfo_init_partition(treeinfo, 0, partition, 0,
+                                      PLL_GAMMA_RATES_MEAN, 0.6, NULL, NULL))
+    fatal("Cannot initialize partition: %s", pll_errmsg);
+
+  /* update CLVs towards the root */
+  pllmod_treeinfo_compute_loglh(treeinfo, 0);
+
+  return treeinfo;
+}
+
+static void destroy_treeinfo(pllmod_treeinfo_t * treeinfo, pll_utree_t * tree)
+{
+  pll_partition_destroy(treeinfo->partitions[0]);
+  pllmod_treeinfo_destroy(treeinfo);
+  pll_utree_destroy(tree, NULL);
+}
+
+int main(int argc, char * argv[])
+{
+  unsigned int attributes = get_attributes(argc, argv);
+  pll_utree_t * tree_joint, * tree_local;
+  pllmod_treeinfo_t * ti_joint, * ti_local;
+  double start_loglh, joint_loglh, local_loglh, full_loglh;
+
+  ti_joint = create_treeinfo(attributes, &tree_joint);
+  ti_local = create_treeinfo(attributes, &tree_local);
+
+  start_loglh = pllmod_treeinfo_compute_loglh(ti_joint, 0);
+
+  printf("** joint Newton\n");
+  joint_loglh = -1 * pllmod_opt_optimize_branch_lengths_all_multi(
+                                                  ti_joint->partitions,
+                                                  1,
+                                                  ti_joint->root,
+                                                  ti_joint->param_indices,
+                                                  NULL,
+                                                  NULL,
+                                                  PLLMOD_OPT_MIN_BRANCH_LEN,
+                                                  PLLMOD_OPT_MAX_BRANCH_LEN,
+                                                  1e-7,
+                                                  100,
+                                                  NULL, NULL);
+  if (joint_loglh > 0)
+    fatal("Error optimizing branch lengths: %s", pll_errmsg);
+  printf("log-likelihood improved: %s\n",
+         joint_loglh > start_loglh + 1 ? "yes" : "no");
+
+  pllmod_treeinfo_invalidate_all(ti_joint);
+  full_loglh = pllmod_treeinfo_compute_loglh(ti_joint, 0);
+  printf("score matches full recomputation: %s\n",
+         fabs(joint_loglh - full_loglh) < 1e-6 ? "yes" : "no");
+
+  printf("** per-branch Newton-Raphson\n");
+  local_loglh = -1 * pllmod_opt_optimize_branch_lengths_local_multi(
+                                                  ti_local->partitions,
+                                                  1,
+                                                  ti_local->root,
+                                                  ti_local->param_indices,
+                                                  NULL,
+                                                  NULL,
+                                                  PLLMOD_OPT_MIN_BRANCH_LEN,
+                                                  PLLMOD_OPT_MAX_BRANCH_LEN,
+                                                  1e-7,
+                                                  32,
+                                                  -1,
+                                                  1,
+                                                  NULL, NULL);
+  printf("same log-likelihood: %s\n",
+         fabs(joint_loglh - local_loglh) < LOGLH_TOLERANCE ? "yes" : "no");
+  printf("same branch lengths: %s\n",
+         compare_branch_lengths(tree_joint, tree_local, BRLEN_TOLERANCE) ?
+         "yes" : "no");
+
+  /* clean */
+  destroy_treeinfo(ti_joint, tree_joint);
+  destroy_treeinfo(ti_local, tree_local);
+
+  return (0);
+}
@@ -0,0 +1,280 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+#include "pll_optimize.h"
+#include "pll_tree.h"
+#include "../common.h"
+
+#include <string.h>
+
+#define N_TIPS        32
+#define N_STATES       4
+#define N_SUBST_RATES  6
+#define N_SITES       TEST_NT_SITES
+#define N_RATE_CATS    4
+#define N_THREADS      4
+#define N_PROCESSES    2
+#define SMOOTHINGS    32
+
+#define LOGLH_TOLERANCE  1e-2
+
+/*
+ * This test optimizes the branch lengths of a 32-taxon tree with
+ * pllmod_opt_optimize_branch_lengths_parallel_multi, using one and several
+ * threads. Regions only see the rest of the tree as it was at the beginning
+ * of each smoothing, so the result must not depend on the order in which the
+ * threads process them. The returned score must match a full recomputation,
+ * and reach the same optimum as the serial per-branch optimizer. Finally,
+ * the sites are split between two threads acting as distributed processes,
+ * which reduce their derivatives with each other while optimizing with
+ * several threads each.
+ */
+
+/* balanced subtree with tips `first`..`first+count-1` */
+static char * subtree_newick(char * s, unsigned int first, unsigned int count)
+{
+  if (count == 1)
+    return s + sprintf(s, "t%u:0.5", first + 1);
+
+  *s++ = '(';
+  s = subtree_newick(s, first, count / 2);
+  *s++ = ',';
+  s = subtree_newick(s, first + count / 2, count - count / 2);
+  return s + sprintf(s, "):0.5");
+}
+
+static pll_utree_t * create_tree(void)
+{
+  char newick[N_TIPS * 32];
+  char * s = newick;
+  pll_utree_t * tree;
+
+  *s++ = '(';
+  s = subtree_newick(s, 0, N_TIPS / 4);
+  *s++ = ',';
+  s = subtree_newick(s, N_TIPS / 4, N_TIPS / 4);
+  *s++ = ',';
+  s = subtree_newick(s, N_TIPS / 2, N_TIPS / 2);
+  strcpy(s, ");");
+
+  tree = pll_utree_parse_newick_string(newick);
+  if (!tree)
+    fatal("Error parsing tree: %s", pll_errmsg);
+
+  return tree;
+}
+
+/* tip `i` carries a base sequence with a few substitutions */
+static void tip_sequence(unsigned int i, char * sequence)
+{
+  static const char nt[N_STATES] = {'A', 'C', 'G', 'T'};
+  unsigned int k;
+
+  memcpy(sequence, test_nt_sequences[i % TEST_NT_TAXA], N_SITES);
+  sequence[N_SITES] = '\0';
+  for (k = 0; k <= i / TEST_NT_TAXA; ++k)
+    sequence[(i * 7 + k * 13) % N_SITES] = nt[(i + k) % N_STATES];
+}
+
+/* treeinfo for the sites `first_site`..`first_site+sites-1` */
+static pllmod_treeinfo_t * create_treeinfo(unsigned int attributes,
+                                           pll_utree_t ** tree,
+                                           unsigned int first_site,
+                                           unsigned int sites)
+{
+  unsigned int i;
+  double frequencies[N_STATES] = {0.3, 0.2, 0.15, 0.35};
+  double subst_params[N_SUBST_RATES] = {1.45, 3.94, 0.46, 0.62, 4.75, 1.0};
+  char sequences[N_TIPS][N_SITES + 1];
+  const char * tip_sequences[N_TIPS];
+  pll_partition_t * partition;
+  pllmod_treeinfo_t * treeinfo;
+
+  *tree = create_tree();
+
+  for (i = 0; i < N_TIPS; ++i)
+  {
+    tip_sequence(i, sequences[i]);
+    tip_sequences[i] = sequences[i];
+  }
+
+  partition = create_nt_partition(*tree, tip_sequences, first_site, sites,
+                                  N_RATE_CATS, 0.6, frequencies, subst_params,
+                                  attributes);
+
+  treeinfo = pllmod_treeinfo_create((*tree)->nodes[2 * N_TIPS - 3], N_TIPS, 1,
+                                    PLLMOD_TREE_BRLEN_LINKED);
+  if (!treeinfo)
+    fatal("Cannot create treeinfo: %s", pll_errmsg);
+
+  if (!pllmod_treeinfo_init_partition(treeinfo, 0, partition, 0,
+                                      PLL_GAMMA_RATES_MEAN, 0.6, NULL, NULL))
+    fatal("Cannot initialize partition: %s", pll_errmsg);
+
+  /* update CLVs towards the root */
+  pllmod_treeinfo_compute_loglh(treeinfo, 0);
+
+  return treeinfo;
+}
+
+static void destroy_treeinfo(pllmod_treeinfo_t * treeinfo, pll_utree_t * tree)
+{
+  pll_partition_destroy(treeinfo->partitions[0]);
+  pllmod_treeinfo_destroy(treeinfo);
+  pll_utree_destroy(tree, NULL);
+}
+
+static double optimize_parallel(pllmod_treeinfo_t * treeinfo,
+                                unsigned int n_threads,
+                                test_reduce_context_t * reduce_context)
+{
+  double loglh = -1 * pllmod_opt_optimize_branch_lengths_parallel_multi(
+                                                  treeinfo->partitions,
+                                                  1,
+                                                  treeinfo->root,
+                                                  treeinfo->param_indices,
+                                                  NULL,
+                                                  PLLMOD_OPT_MIN_BRANCH_LEN,
+                                                  PLLMOD_OPT_MAX_BRANCH_LEN,
+                                                  1e-7,
+                                                  SMOOTHINGS,
+                                                  n_threads,
+                                                  reduce_context,
+                                                  reduce_context ?
+                                                  test_reduce_cb : NULL);
+  if (loglh > 0)
+    fatal("Error optimizing branch lengths: %s", pll_errmsg);
+
+  return loglh;
+}
+
+/* one of the processes holding a slice of the sites */
+struct process
+{
+  pllmod_treeinfo_t * treeinfo;
+  pll_utree_t * tree;
+  test_reduce_context_t ctx;
+  double loglh;
+};
+
+static void * run_process(void * arg)
+{
+  struct process * process = (struct process *) arg;
+
+  process->loglh = optimize_parallel(process->treeinfo, N_THREADS,
+                                     &process->ctx);
+  return NULL;
+}
+
+int main(int argc, char * argv[])
+{
+  unsigned int attributes = get_attributes(argc, argv);
+  pll_utree_t * tree_serial, * tree_mt, * tree_mt2, * tree_local;
+  pllmod_treeinfo_t * ti_serial, * ti_mt, * ti_mt2, * ti_local;
+  double start_loglh, serial_loglh, mt_loglh, mt2_loglh, local_loglh;
+  double full_loglh;
+
+  ti_serial = create_treeinfo(attributes, &tree_serial, 0, N_SITES);
+  ti_mt = create_treeinfo(attributes, &tree_mt, 0, N_SITES);
+  ti_mt2 = create_treeinfo(attributes, &tree_mt2, 0, N_SITES);
+  ti_local = create_treeinfo(attributes, &tree_local, 0, N_SITES);
+
+  start_loglh = pllmod_treeinfo_compute_loglh(ti_serial, 0);
+
+  printf("** one thread\n");
+  serial_loglh = optimize_parallel(ti_serial, 1, NULL);
+  printf("log-likelihood improved: %s\n",
+         serial_loglh > start_loglh + 1 ? "yes" : "no");
+
+  printf("** %d threads\n", N_THREADS);
+  mt_loglh = optimize_parallel(ti_mt, N_THREADS, NULL);
+  mt2_loglh = optimize_parallel(ti_mt2, N_THREADS, NULL);
+  printf("same result in repeated runs: %s\n",
+         (mt_loglh == mt2_loglh &&
+          compare_branch_lengths(tree_mt, tree_mt2, 0)) ? "yes" : "no");
+  printf("same log-likelihood as one thread: %s\n",
+         fabs(mt_loglh - serial_loglh) < LOGLH_TOLERANCE ? "yes" : "no");
+
+  pllmod_treeinfo_invalidate_all(ti_mt);
+  full_loglh = pllmod_treeinfo_compute_loglh(ti_mt, 0);
+  printf("score matches full recomputation: %s\n",
+         fabs(mt_loglh - full_loglh) < 1e-6 ? "yes" : "no");
+
+  printf("** per-branch Newton-Raphson\n");
+  local_loglh = -1 * pllmod_opt_optimize_branch_lengths_local_multi(
+                                                  ti_local->partitions,
+                                                  1,
+                                                  ti_local->root,
+                                                  ti_local->param_indices,
+                                                  NULL,
+                                                  NULL,
+                                                  PLLMOD_OPT_MIN_BRANCH_LEN,
+                                                  PLLMOD_OPT_MAX_BRANCH_LEN,
+                                                  1e-7,
+                                                  SMOOTHINGS,
+                                                  -1,
+                                                  1,
+                                                  NULL, NULL);
+  printf("same log-likelihood: %s\n",
+         fabs(mt_loglh - local_loglh) < LOGLH_TOLERANCE ? "yes" : "no");
+
+  printf("** %d processes with %d threads\n", N_PROCESSES, N_THREADS);
+  {
+    struct process processes[N_PROCESSES];
+    test_reduce_context_t contexts[N_PROCESSES];
+    pthread_t threads[N_PROCESSES];
+    test_reduce_t * reduce = test_reduce_create(N_PROCESSES, contexts);
+    unsigned int i;
+
+    for (i = 0; i < N_PROCESSES; ++i)
+    {
+      unsigned int first_site = N_SITES * i / N_PROCESSES;
+      processes[i].treeinfo = create_treeinfo(attributes, &processes[i].tree,
+                                              first_site,
+                                              N_SITES * (i + 1) / N_PROCESSES -
+                                              first_site);
+      processes[i].ctx = contexts[i];
+    }
+
+    for (i = 0; i < N_PROCESSES; ++i)
+      pthread_create(threads + i, NULL, run_process, processes + i);
+    for (i = 0; i < N_PROCESSES; ++i)
+      pthread_join(threads[i], NULL);
+
+    printf("same branch lengths on every process: %s\n",
+           compare_branch_lengths(processes[0].tree, processes[1].tree, 0) ?
+           "yes" : "no");
+    printf("same log-likelihood as one process: %s\n",
+           (processes[0].loglh == processes[1].loglh &&
+            fabs(processes[0].loglh - mt_loglh) < 1e-4) ? "yes" : "no");
+
+    for (i = 0; i < N_PROCESSES; ++i)
+      destroy_treeinfo(processes[i].treeinfo, processes[i].tree);
+    test_reduce_destroy(reduce);
+  }
+
+  /* clean */
+  destroy_treeinfo(ti_serial, tree_serial);
+  destroy_treeinfo(ti_mt, tree_mt);
+  destroy_treeinfo(ti_mt2, tree_mt2);
+  destroy_treeinfo(ti_local, tree_local);
+
+  return (0);
+}
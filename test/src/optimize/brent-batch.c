@@ -0,0 +1,150 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+#include "pll_optimize.h"
+#include "../common.h"
+
+#include <string.h>
+
+#define N_VARS    4
+#define X_MIN     0.01
+#define X_MAX    10.0
+#define X_TOL    1e-6
+
+/*
+ * This test minimizes four independent one-dimensional functions with the
+ * batch Brent optimizer and with pllmod_opt_minimize_brent_multi. The last
+ * function has its minimum beyond the upper bound. The optima must agree,
+ * the reported evaluation counts must match the evaluations performed by
+ * the target function, and the batch optimizer must not evaluate more.
+ */
+
+static const double x_best[N_VARS] = {0.5, 2.0, 7.5, 20.0};
+static const double x_start[N_VARS] = {1.0, 2.0, 5.0, 5.0};
+
+struct target_params
+{
+  unsigned int evaluations[N_VARS];
+};
+
+static double target(void * p, double * x, double * fx, int * converged)
+{
+  struct target_params * params = (struct target_params *) p;
+  double score = 0;
+  int i;
+
+  /* convergence check */
+  if (!x)
+  {
+    converged[N_VARS] = 1;
+    for (i = 0; i < N_VARS; ++i)
+      if (!converged[i])
+        converged[N_VARS] = 0;
+    return 0;
+  }
+
+  for (i = 0; i < N_VARS; ++i)
+  {
+    if (converged && converged[i])
+      continue;
+
+    /* a smooth, asymmetric function with its minimum at x_best[i] */
+    fx[i] = (i + 1) * (x[i] - x_best[i]) * (x[i] - x_best[i]) +
+            (x[i] / x_best[i] - log(x[i] / x_best[i]));
+    params->evaluations[i]++;
+    score += fx[i];
+  }
+
+  return score;
+}
+
+static double expected_optimum(int i)
+{
+  /* root of 2(i+1)(x - b) + 1/b - 1/x = 0 within the range */
+  double lo = X_MIN, hi = X_MAX;
+  int k;
+
+  for (k = 0; k < 100; ++k)
+  {
+    double mid = (lo + hi) / 2;
+    double deriv = 2 * (i + 1) * (mid - x_best[i]) + 1 / x_best[i] - 1 / mid;
+    if (deriv > 0)
+      hi = mid;
+    else
+      lo = mid;
+  }
+
+  return (lo + hi) / 2;
+}
+
+int main(int argc, char * argv[])
+{
+  int i;
+  double xmin = X_MIN, xmax = X_MAX;
+  double xguess[N_VARS], xopt_multi[N_VARS], xopt_batch[N_VARS];
+  double fx_multi[N_VARS], fx_batch[N_VARS], f2x[N_VARS];
+  unsigned int eval_counts[N_VARS];
+  unsigned int multi_evals = 0, batch_evals = 0;
+  struct target_params params_multi, params_batch;
+  int ok;
+
+  memset(&params_multi, 0, sizeof(params_multi));
+  memset(&params_batch, 0, sizeof(params_batch));
+
+  printf("** brent multi\n");
+  memcpy(xguess, x_start, N_VARS * sizeof(double));
+  if (!pllmod_opt_minimize_brent_multi(N_VARS, &xmin, xguess, &xmax, X_TOL,
+                                       xopt_multi, fx_multi, f2x,
+                                       &params_multi, target, 1))
+    fatal("Error in Brent multi: %s", pll_errmsg);
+
+  ok = 1;
+  for (i = 0; i < N_VARS; ++i)
+    if (fabs(xopt_multi[i] - expected_optimum(i)) > 1e-4)
+      ok = 0;
+  printf("optima found: %s\n", ok ? "yes" : "no");
+
+  printf("** brent batch\n");
+  memcpy(xguess, x_start, N_VARS * sizeof(double));
+  if (!pllmod_opt_minimize_brent_batch(N_VARS, &xmin, xguess, &xmax, X_TOL,
+                                       xopt_batch, fx_batch, eval_counts,
+                                       &params_batch, target, 1))
+    fatal("Error in Brent batch: %s", pll_errmsg);
+
+  ok = 1;
+  for (i = 0; i < N_VARS; ++i)
+    if (fabs(xopt_batch[i] - xopt_multi[i]) > 1e-4 ||
+        fabs(fx_batch[i] - fx_multi[i]) > 1e-8)
+      ok = 0;
+  printf("same optima: %s\n", ok ? "yes" : "no");
+
+  ok = 1;
+  for (i = 0; i < N_VARS; ++i)
+  {
+    if (eval_counts[i] != params_batch.evaluations[i])
+      ok = 0;
+    multi_evals += params_multi.evaluations[i];
+    batch_evals += params_batch.evaluations[i];
+  }
+  printf("evaluation counts match: %s\n", ok ? "yes" : "no");
+  printf("fewer evaluations: %s\n", batch_evals < multi_evals ? "yes" : "no");
+
+  return (0);
+}
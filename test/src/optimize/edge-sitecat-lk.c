@@ -0,0 +1,151 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+#include "pll_optimize.h"
+#include "pll_tree.h"
+#include "../common.h"
+
+#define N_TIPS         TEST_NT_TAXA
+#define N_STATES       4
+#define N_SUBST_RATES  6
+#define N_SITES       TEST_NT_SITES
+#define N_RATE_CATS    4
+
+#define TOLERANCE     1e-8
+
+/*
+ * This test computes the unweighted per-site, per-category likelihoods at the
+ * root edge and checks that they reproduce the log-likelihood for the current
+ * and for new rate category weights. It also checks that the decomposition is
+ * rejected for partitions with invariant sites or per-rate scalers.
+ */
+
+static pll_partition_t * create_partition(unsigned int attributes,
+                                          pll_utree_t * tree)
+{
+  double frequencies[N_STATES] = {0.3, 0.2, 0.15, 0.35};
+  double subst_params[N_SUBST_RATES] = {1.45, 3.94, 0.46, 0.62, 4.75, 1.0};
+
+  return create_nt_partition(tree, NULL, 0, N_SITES, N_RATE_CATS, 0.6,
+                             frequencies, subst_params, attributes);
+}
+
+static double sitecat_loglh(const pll_partition_t * partition,
+                            const double * sitecat_lh,
+                            const double * site_logscale,
+                            const double * weights)
+{
+  unsigned int s, k;
+  double loglh = 0;
+
+  for (s = 0; s < partition->sites; ++s)
+  {
+    double site_lh = 0;
+    for (k = 0; k < partition->rate_cats; ++k)
+      site_lh += weights[k] * sitecat_lh[s * partition->rate_cats + k];
+    loglh += partition->pattern_weights[s] *
+             (log(site_lh) + site_logscale[s]);
+  }
+
+  return loglh;
+}
+
+static int same_loglh(double a, double b)
+{
+  return fabs(a - b) < TOLERANCE * fabs(b);
+}
+
+int main(int argc, char * argv[])
+{
+  unsigned int attributes = get_attributes(argc, argv);
+  pll_utree_t * tree;
+  pll_partition_t * partition;
+  pllmod_treeinfo_t * treeinfo;
+  double sitecat_lh[N_SITES * N_RATE_CATS];
+  double site_logscale[N_SITES];
+  double weights[N_RATE_CATS] = {0.1, 0.2, 0.3, 0.4};
+  double loglh;
+
+  tree = pll_utree_parse_newick_string(TEST_NT_TREE);
+  if (!tree)
+    fatal("Error parsing tree: %s", pll_errmsg);
+
+  treeinfo = pllmod_treeinfo_create(tree->nodes[2 * N_TIPS - 3], N_TIPS, 1,
+                                    PLLMOD_TREE_BRLEN_LINKED);
+  if (!treeinfo)
+    fatal("Cannot create treeinfo: %s", pll_errmsg);
+
+  partition = create_partition(attributes, tree);
+  if (!pllmod_treeinfo_init_partition(treeinfo, 0, partition,
+                                      PLLMOD_OPT_PARAM_RATE_WEIGHTS,
+                                      PLL_GAMMA_RATES_MEAN, 0.6, NULL, NULL))
+    fatal("Cannot initialize partition: %s", pll_errmsg);
+
+  loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+
+  if (!pllmod_opt_compute_edge_sitecat_lk(partition, treeinfo->root,
+                                          treeinfo->param_indices[0],
+                                          sitecat_lh, site_logscale))
+    fatal("Error computing per-category likelihoods: %s", pll_errmsg);
+
+  printf("** current weights\n");
+  printf("log-likelihood matches: %s\n",
+         same_loglh(sitecat_loglh(partition, sitecat_lh, site_logscale,
+                                  partition->rate_weights), loglh) ?
+                                  "yes" : "no");
+
+  printf("** new weights\n");
+  pll_set_category_weights(partition, weights);
+  loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+  printf("log-likelihood matches: %s\n",
+         same_loglh(sitecat_loglh(partition, sitecat_lh, site_logscale,
+                                  weights), loglh) ? "yes" : "no");
+
+  printf("** invariant sites\n");
+  pll_update_invariant_sites_proportion(partition, 0, 0.2);
+  printf("decomposition rejected: %s\n",
+         pllmod_opt_compute_edge_sitecat_lk(partition, treeinfo->root,
+                                            treeinfo->param_indices[0],
+                                            sitecat_lh, site_logscale) ?
+                                            "no" : "yes");
+  pll_update_invariant_sites_proportion(partition, 0, 0.);
+
+#ifdef PLL_ATTRIB_RATE_SCALERS
+  /* scaling factors differ across rate categories */
+  {
+    pll_partition_t * scaled = create_partition(attributes |
+                                                PLL_ATTRIB_RATE_SCALERS,
+                                                tree);
+    if (pllmod_opt_compute_edge_sitecat_lk(scaled, treeinfo->root,
+                                           treeinfo->param_indices[0],
+                                           sitecat_lh, site_logscale))
+      fatal("Per-category likelihoods computed for a partition with "
+            "per-rate scalers");
+    pll_partition_destroy(scaled);
+  }
+#endif
+
+  /* clean */
+  pllmod_treeinfo_destroy(treeinfo);
+  pll_partition_destroy(partition);
+  pll_utree_destroy(tree, NULL);
+
+  return (0);
+}
@@ -0,0 +1,311 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+#include "pll_optimize.h"
+#include "../common.h"
+
+#include <string.h>
+
+#define N_SETS        3
+#define N_SITES   10000
+#define N_THREADS     4
+#define N_SLICES      2
+#define MAX_STEPS  1000
+#define EM_TOL     1e-9
+
+/*
+ * This test optimizes the mixture weights of three sets with EM: two
+ * categories, four categories and a skipped set. The two categories set is
+ * compared with a Brent optimization of the single free weight, and the
+ * results with several threads are compared with the serial ones. The sites
+ * are then split into two slices optimized by threads that reduce their
+ * statistics with each other, as distributed processes, and which must reach
+ * the serial weights. Finally, the minimum weight ratio must hold after the
+ * optimization.
+ */
+
+static const unsigned int w_count[N_SETS] = {2, 4, 3};
+
+static double site_lh(unsigned int set, unsigned int site, unsigned int cat)
+{
+  unsigned int h = (site * 7919 + cat * 104729 + set * 1299709) % 1000;
+  return 0.05 + h / 1000.0;
+}
+
+static double mixture_loglh(const double * w, unsigned int cats,
+                            const double * lh, const unsigned int * site_w)
+{
+  unsigned int s, c;
+  double loglh = 0;
+
+  for (s = 0; s < N_SITES; ++s)
+  {
+    double l = 0;
+    for (c = 0; c < cats; ++c)
+      l += w[c] * lh[s * cats + c];
+    loglh += site_w[s] * log(l);
+  }
+
+  return loglh;
+}
+
+struct brent_params
+{
+  const double * lh;
+  const unsigned int * site_w;
+};
+
+static double target_weight(void * p, double x)
+{
+  struct brent_params * params = (struct brent_params *) p;
+  double w[2];
+
+  w[0] = x;
+  w[1] = 1 - x;
+  return -1 * mixture_loglh(w, 2, params->lh, params->site_w);
+}
+
+/* the sites of one process: the first set is split among the slices, the
+   second one belongs to the first slice and the third one is skipped */
+struct em_slice
+{
+  test_reduce_context_t ctx;
+  const double * sitecat_lh[N_SETS];
+  const unsigned int * site_w[N_SETS];
+  unsigned int l[N_SETS];
+  double * w[N_SETS];
+  double loglh[N_SETS];
+  int retval;
+};
+
+static void * run_slice(void * arg)
+{
+  struct em_slice * slice = (struct em_slice *) arg;
+
+  slice->retval = pllmod_opt_minimize_em_multi(N_SETS, slice->w, w_count,
+                                               slice->sitecat_lh,
+                                               slice->site_w,
+                                               slice->l, 0., EM_TOL,
+                                               MAX_STEPS, 1,
+                                               &slice->ctx, test_reduce_cb,
+                                               slice->loglh);
+  return NULL;
+}
+
+static void reset_weights(double ** w)
+{
+  unsigned int p, c;
+
+  for (p = 0; p < N_SETS; ++p)
+    if (w[p])
+      for (c = 0; c < w_count[p]; ++c)
+        w[p][c] = 1.0 / w_count[p];
+}
+
+int main(int argc, char * argv[])
+{
+  unsigned int p, s, c;
+  double * sitecat_lh[N_SETS];
+  unsigned int * site_w[N_SETS];
+  unsigned int l[N_SETS];
+  double * w[N_SETS];
+  double * w_serial[N_SETS];
+  double loglh[N_SETS], loglh_serial[N_SETS];
+  double start_loglh;
+  struct brent_params bparams;
+  double brent_w, brent_score, f2x;
+  int ok;
+
+  for (p = 0; p < N_SETS; ++p)
+  {
+    l[p] = N_SITES;
+    sitecat_lh[p] = (double *) malloc(N_SITES * w_count[p] * sizeof(double));
+    site_w[p] = (unsigned int *) malloc(N_SITES * sizeof(unsigned int));
+    for (s = 0; s < N_SITES; ++s)
+    {
+      site_w[p][s] = 1 + s % 3;
+      for (c = 0; c < w_count[p]; ++c)
+        sitecat_lh[p][s * w_count[p] + c] = site_lh(p, s, c);
+    }
+    w[p] = (double *) malloc(w_count[p] * sizeof(double));
+    w_serial[p] = (double *) malloc(w_count[p] * sizeof(double));
+  }
+
+  /* the last set is skipped */
+  free(w[2]);
+  free(w_serial[2]);
+  w[2] = w_serial[2] = NULL;
+
+  reset_weights(w_serial);
+  start_loglh = mixture_loglh(w_serial[1], w_count[1], sitecat_lh[1],
+                              site_w[1]);
+
+  printf("** serial EM\n");
+  if (!pllmod_opt_minimize_em_multi(N_SETS, w_serial, w_count,
+                                    (const double * const *) sitecat_lh,
+                                    (const unsigned int * const *) site_w,
+                                    l, 0., EM_TOL, MAX_STEPS, 1, NULL, NULL,
+                                    loglh_serial))
+    fatal("Error in EM: %s", pll_errmsg);
+
+  ok = 1;
+  for (p = 0; p < 2; ++p)
+    if (fabs(loglh_serial[p] - mixture_loglh(w_serial[p], w_count[p],
+                                             sitecat_lh[p], site_w[p])) >
+        1e-6)
+      ok = 0;
+  printf("log-likelihood matches the weights: %s\n", ok ? "yes" : "no");
+  printf("log-likelihood improved: %s\n",
+         loglh_serial[1] > start_loglh ? "yes" : "no");
+  printf("skipped set untouched: %s\n", !loglh_serial[2] ? "yes" : "no");
+
+  printf("** Brent\n");
+  bparams.lh = sitecat_lh[0];
+  bparams.site_w = site_w[0];
+  brent_w = pllmod_opt_minimize_brent(1e-4, 0.5, 1 - 1e-4, 1e-8,
+                                      &brent_score, &f2x, &bparams,
+                                      target_weight);
+  printf("interior optimum: %s\n",
+         (brent_w > 0.01 && brent_w < 0.99) ? "yes" : "no");
+  printf("same weights: %s\n",
+         fabs(brent_w - w_serial[0][0]) < 1e-4 ? "yes" : "no");
+  printf("same log-likelihood: %s\n",
+         fabs(-brent_score - loglh_serial[0]) < 1e-4 ? "yes" : "no");
+
+  printf("** threaded EM\n");
+  reset_weights(w);
+  if (!pllmod_opt_minimize_em_multi(N_SETS, w, w_count,
+                                    (const double * const *) sitecat_lh,
+                                    (const unsigned int * const *) site_w,
+                                    l, 0., EM_TOL, MAX_STEPS, N_THREADS,
+                                    NULL, NULL, loglh))
+    fatal("Error in EM: %s", pll_errmsg);
+
+  ok = 1;
+  for (p = 0; p < 2; ++p)
+  {
+    if (fabs(loglh[p] - loglh_serial[p]) > 1e-6)
+      ok = 0;
+    for (c = 0; c < w_count[p]; ++c)
+      if (fabs(w[p][c] - w_serial[p][c]) > 1e-4)
+        ok = 0;
+  }
+  printf("same result as serial: %s\n", ok ? "yes" : "no");
+
+  printf("** two slices\n");
+  {
+    struct em_slice slices[N_SLICES];
+    test_reduce_context_t contexts[N_SLICES];
+    pthread_t threads[N_SLICES];
+    test_reduce_t * reduce = test_reduce_create(N_SLICES, contexts);
+    double loglh_sum[2] = {0, 0};
+    unsigned int t;
+
+    memset(slices, 0, sizeof(slices));
+    for (t = 0; t < N_SLICES; ++t)
+    {
+      unsigned int start = N_SITES * t / N_SLICES;
+
+      slices[t].ctx = contexts[t];
+      slices[t].sitecat_lh[0] = sitecat_lh[0] + start * w_count[0];
+      slices[t].site_w[0] = site_w[0] + start;
+      slices[t].l[0] = N_SITES * (t + 1) / N_SLICES - start;
+      slices[t].w[0] = (double *) malloc(w_count[0] * sizeof(double));
+      if (!t)
+      {
+        slices[t].sitecat_lh[1] = sitecat_lh[1];
+        slices[t].site_w[1] = site_w[1];
+        slices[t].l[1] = N_SITES;
+        slices[t].w[1] = (double *) malloc(w_count[1] * sizeof(double));
+      }
+      reset_weights(slices[t].w);
+      pthread_create(threads + t, NULL, run_slice, slices + t);
+    }
+
+    ok = 1;
+    for (t = 0; t < N_SLICES; ++t)
+    {
+      pthread_join(threads[t], NULL);
+      if (!slices[t].retval)
+        fatal("Error in EM: %s", pll_errmsg);
+      for (p = 0; p < 2; ++p)
+      {
+        if (!slices[t].w[p])
+          continue;
+        loglh_sum[p] += slices[t].loglh[p];
+        for (c = 0; c < w_count[p]; ++c)
+          if (fabs(slices[t].w[p][c] - w_serial[p][c]) > 1e-6)
+            ok = 0;
+      }
+    }
+    printf("same weights as a single slice: %s\n", ok ? "yes" : "no");
+
+    ok = 1;
+    for (p = 0; p < 2; ++p)
+      if (fabs(loglh_sum[p] - loglh_serial[p]) > 1e-6)
+        ok = 0;
+    printf("slice log-likelihoods add up: %s\n", ok ? "yes" : "no");
+
+    for (t = 0; t < N_SLICES; ++t)
+      for (p = 0; p < 2; ++p)
+        if (slices[t].w[p])
+          free(slices[t].w[p]);
+    test_reduce_destroy(reduce);
+  }
+
+  printf("** minimum weight ratio\n");
+  reset_weights(w);
+  if (!pllmod_opt_minimize_em_multi(N_SETS, w, w_count,
+                                    (const double * const *) sitecat_lh,
+                                    (const unsigned int * const *) site_w,
+                                    l, 0.5, EM_TOL, MAX_STEPS, N_THREADS,
+                                    NULL, NULL, loglh))
+    fatal("Error in EM: %s", pll_errmsg);
+
+  ok = 1;
+  for (p = 0; p < 2; ++p)
+  {
+    double max_w = 0, sum = 0;
+    for (c = 0; c < w_count[p]; ++c)
+    {
+      max_w = w[p][c] > max_w ? w[p][c] : max_w;
+      sum += w[p][c];
+    }
+    if (fabs(sum - 1) > 1e-12)
+      ok = 0;
+    for (c = 0; c < w_count[p]; ++c)
+      if (w[p][c] < 0.5 * max_w - 1e-12)
+        ok = 0;
+  }
+  printf("weights within bounds: %s\n", ok ? "yes" : "no");
+
+  /* clean */
+  for (p = 0; p < N_SETS; ++p)
+  {
+    free(sitecat_lh[p]);
+    free(site_w[p]);
+    if (w[p])
+      free(w[p]);
+    if (w_serial[p])
+      free(w_serial[p]);
+  }
+
+  return (0);
+}
@@ -0,0 +1,232 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+#include "pll_optimize.h"
+#include "../common.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#define N_THREADS   3
+#define N_SETS      3
+#define MAX_VARS    6
+
+/*
+ * This test minimizes a set of Rosenbrock-like functions with L-BFGS-B,
+ * estimating the gradients with finite differences either serially or with
+ * several threads. The results must be exactly the same, every thread must
+ * evaluate its own context and no context can be used by two threads at once.
+ */
+
+struct eval_context
+{
+  pthread_mutex_t busy;
+  unsigned int evaluations;
+  int concurrent;
+};
+
+static const unsigned int set_vars[N_SETS] = {2, 4, 6};
+
+static double rosenbrock(const double * x, unsigned int n, unsigned int set)
+{
+  unsigned int i;
+  double score = 0;
+
+  for (i = 0; i < n; ++i)
+    score += (set + 1) * (1 - x[i]) * (1 - x[i]);
+  for (i = 0; i + 1 < n; ++i)
+    score += 10 * (x[i+1] - x[i] * x[i]) * (x[i+1] - x[i] * x[i]);
+
+  return score;
+}
+
+static void context_enter(struct eval_context * ctx)
+{
+  if (pthread_mutex_trylock(&ctx->busy))
+  {
+    ctx->concurrent = 1;
+    pthread_mutex_lock(&ctx->busy);
+  }
+  ctx->evaluations++;
+}
+
+static double target_single(void * p, double * x)
+{
+  struct eval_context * ctx = (struct eval_context *) p;
+  double score;
+
+  context_enter(ctx);
+  score = rosenbrock(x, MAX_VARS, 0);
+  pthread_mutex_unlock(&ctx->busy);
+
+  return score;
+}
+
+static double target_multi(void * p, double ** x, double * fx, int * converged)
+{
+  struct eval_context * ctx = (struct eval_context *) p;
+  unsigned int i;
+  double score = 0;
+
+  /* convergence check */
+  if (!x)
+  {
+    converged[N_SETS] = 1;
+    for (i = 0; i < N_SETS; ++i)
+      if (!converged[i])
+        converged[N_SETS] = 0;
+    return 0;
+  }
+
+  context_enter(ctx);
+  for (i = 0; i < N_SETS; ++i)
+  {
+    double set_score = rosenbrock(x[i], set_vars[i], i);
+    if (fx)
+      fx[i] = set_score;
+    score += set_score;
+  }
+  pthread_mutex_unlock(&ctx->busy);
+
+  return score;
+}
+
+static void init_bounds(double * x, double * xmin, double * xmax,
+                        int * bound, unsigned int n)
+{
+  unsigned int i;
+
+  for (i = 0; i < n; ++i)
+  {
+    x[i] = 0.2 + 0.5 * i;
+    xmin[i] = 0.01;
+    xmax[i] = 5.0;
+    bound[i] = PLLMOD_OPT_LBFGSB_BOUND_BOTH;
+  }
+}
+
+static int check_contexts(struct eval_context * ctx, unsigned int count)
+{
+  unsigned int i;
+  int ok = 1;
+
+  for (i = 0; i < count; ++i)
+  {
+    if (!ctx[i].evaluations || ctx[i].concurrent)
+      ok = 0;
+    ctx[i].evaluations = 0;
+    ctx[i].concurrent = 0;
+  }
+
+  return ok;
+}
+
+int main(int argc, char * argv[])
+{
+  unsigned int i, p;
+  struct eval_context ctx[N_THREADS];
+  void * params[N_THREADS];
+  double x_serial[MAX_VARS], x_mt[MAX_VARS];
+  double xmin[MAX_VARS], xmax[MAX_VARS];
+  int bound[MAX_VARS];
+  double start_score, score_serial, score_mt;
+  double * mx_serial[N_SETS], * mx_mt[N_SETS];
+  double * mxmin[N_SETS], * mxmax[N_SETS];
+  int * mbound[N_SETS];
+  unsigned int n[N_SETS];
+  int same;
+
+  for (i = 0; i < N_THREADS; ++i)
+  {
+    pthread_mutex_init(&ctx[i].busy, NULL);
+    ctx[i].evaluations = 0;
+    ctx[i].concurrent = 0;
+    params[i] = &ctx[i];
+  }
+
+  printf("** single set\n");
+  init_bounds(x_serial, xmin, xmax, bound, MAX_VARS);
+  init_bounds(x_mt, xmin, xmax, bound, MAX_VARS);
+  start_score = rosenbrock(x_serial, MAX_VARS, 0);
+
+  score_serial = pllmod_opt_minimize_lbfgsb(x_serial, xmin, xmax, bound,
+                                            MAX_VARS, 1e7, 1e-5, params[0],
+                                            target_single);
+  check_contexts(ctx, 1);
+  score_mt = pllmod_opt_minimize_lbfgsb_mt(x_mt, xmin, xmax, bound,
+                                           MAX_VARS, 1e7, 1e-5, params,
+                                           N_THREADS, target_single);
+
+  printf("score improved: %s\n", score_serial < start_score ? "yes" : "no");
+  printf("same result as serial: %s\n",
+         (score_serial == score_mt &&
+          !memcmp(x_serial, x_mt, MAX_VARS * sizeof(double))) ? "yes" : "no");
+  printf("one thread per context: %s\n",
+         check_contexts(ctx, N_THREADS) ? "yes" : "no");
+
+  printf("** multiple sets\n");
+  for (p = 0; p < N_SETS; ++p)
+  {
+    n[p] = set_vars[p];
+    mx_serial[p] = (double *) malloc(MAX_VARS * sizeof(double));
+    mx_mt[p] = (double *) malloc(MAX_VARS * sizeof(double));
+    mxmin[p] = (double *) malloc(MAX_VARS * sizeof(double));
+    mxmax[p] = (double *) malloc(MAX_VARS * sizeof(double));
+    mbound[p] = (int *) malloc(MAX_VARS * sizeof(int));
+    init_bounds(mx_serial[p], mxmin[p], mxmax[p], mbound[p], n[p]);
+    init_bounds(mx_mt[p], mxmin[p], mxmax[p], mbound[p], n[p]);
+  }
+  start_score = target_multi(params[0], mx_serial, NULL, NULL);
+  check_contexts(ctx, 1);
+
+  score_serial = pllmod_opt_minimize_lbfgsb_multi(N_SETS, mx_serial, mxmin,
+                                                  mxmax, mbound, n, MAX_VARS,
+                                                  1e7, 1e-5, params[0],
+                                                  target_multi);
+  check_contexts(ctx, 1);
+  score_mt = pllmod_opt_minimize_lbfgsb_multi_mt(N_SETS, mx_mt, mxmin, mxmax,
+                                                 mbound, n, MAX_VARS, 1e7,
+                                                 1e-5, params, N_THREADS,
+                                                 target_multi);
+
+  same = (score_serial == score_mt);
+  for (p = 0; p < N_SETS; ++p)
+    if (memcmp(mx_serial[p], mx_mt[p], n[p] * sizeof(double)))
+      same = 0;
+
+  printf("score improved: %s\n", score_serial < start_score ? "yes" : "no");
+  printf("same result as serial: %s\n", same ? "yes" : "no");
+  printf("one thread per context: %s\n",
+         check_contexts(ctx, N_THREADS) ? "yes" : "no");
+
+  /* clean */
+  for (p = 0; p < N_SETS; ++p)
+  {
+    free(mx_serial[p]);
+    free(mx_mt[p]);
+    free(mxmin[p]);
+    free(mxmax[p]);
+    free(mbound[p]);
+  }
+  for (i = 0; i < N_THREADS; ++i)
+    pthread_mutex_destroy(&ctx[i].busy);
+
+  return (0);
+}
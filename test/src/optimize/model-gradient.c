@@ -0,0 +1,212 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+#include "pll_optimize.h"
+#include "pll_tree.h"
+#include "pllmod_algorithm.h"
+#include "../common.h"
+
+#define N_TIPS         TEST_NT_TAXA
+#define N_STATES       4
+#define N_SUBST_RATES  6
+#define N_SITES       TEST_NT_SITES
+#define N_RATE_CATS    4
+
+#define FD_STEP       1e-5
+#define FD_TOLERANCE  1e-4
+#define OPT_TOLERANCE 1e-3
+
+/*
+ * This test compares the analytic gradient of the log-likelihood w.r.t. the
+ * substitution rates and the frequencies with central finite differences.
+ * It also checks that the analytic gradient is rejected for partitions with
+ * per-rate scalers, for which the scaling factors do not cancel out, and that
+ * the substitution rates optimized with unlinked branch lengths (which fall
+ * back to finite differences) reach the same optimum as with linked ones.
+ */
+
+static pll_partition_t * create_partition(unsigned int attributes,
+                                          pll_utree_t * tree)
+{
+  double frequencies[N_STATES] = {0.3, 0.2, 0.15, 0.35};
+  double subst_params[N_SUBST_RATES] = {1.45, 3.94, 0.46, 0.62, 4.75, 1.0};
+
+  return create_nt_partition(tree, NULL, 0, N_SITES, N_RATE_CATS, 0.6,
+                             frequencies, subst_params, attributes);
+}
+
+/* optimize the substitution rates on a new partition */
+static double optimize_rates(pll_utree_t * tree,
+                             unsigned int attributes,
+                             int brlen_linkage,
+                             double * start_loglh)
+{
+  double loglh;
+  pll_partition_t * partition = create_partition(attributes, tree);
+  pllmod_treeinfo_t * treeinfo = pllmod_treeinfo_create(
+                                                tree->nodes[2 * N_TIPS - 3],
+                                                N_TIPS, 1, brlen_linkage);
+  if (!treeinfo)
+    fatal("Cannot create treeinfo: %s", pll_errmsg);
+
+  if (!pllmod_treeinfo_init_partition(treeinfo, 0, partition,
+                                      PLLMOD_OPT_PARAM_SUBST_RATES,
+                                      PLL_GAMMA_RATES_MEAN, 0.6, NULL, NULL))
+    fatal("Cannot initialize partition: %s", pll_errmsg);
+
+  *start_loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+  pllmod_algo_opt_subst_rates_treeinfo(treeinfo, 0, 1e-3, 1e3, 1e7, 1e-4);
+  loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+
+  pllmod_treeinfo_destroy(treeinfo);
+  pll_partition_destroy(partition);
+
+  return loglh;
+}
+
+static double eval_loglh(pllmod_treeinfo_t * treeinfo, double * param,
+                         double value)
+{
+  pll_partition_t * partition = treeinfo->partitions[0];
+
+  *param = value;
+  partition->eigen_decomp_valid[0] = 0;
+  pllmod_treeinfo_invalidate_all(treeinfo);
+
+  return pllmod_treeinfo_compute_loglh(treeinfo, 0);
+}
+
+static int check_gradient(pllmod_treeinfo_t * treeinfo, double * params,
+                          const double * gradient, unsigned int count)
+{
+  unsigned int i;
+  int ok = 1;
+
+  for (i = 0; i < count; ++i)
+  {
+    double x = params[i];
+    double fd = (eval_loglh(treeinfo, params + i, x + FD_STEP) -
+                 eval_loglh(treeinfo, params + i, x - FD_STEP)) /
+                (2 * FD_STEP);
+    eval_loglh(treeinfo, params + i, x);
+
+    if (fabs(fd - gradient[i]) > FD_TOLERANCE * fmax(1., fabs(fd)))
+    {
+      printf("  parameter %u: analytic %f, finite differences %f\n",
+             i, gradient[i], fd);
+      ok = 0;
+    }
+  }
+
+  return ok;
+}
+
+int main(int argc, char * argv[])
+{
+  unsigned int attributes = get_attributes(argc, argv);
+  pll_utree_t * tree;
+  pll_partition_t * partition;
+  pllmod_treeinfo_t * treeinfo;
+  double subst_grad[N_SUBST_RATES];
+  double freqs_grad[N_STATES];
+  double loglh;
+
+  tree = pll_utree_parse_newick_string(TEST_NT_TREE);
+  if (!tree)
+    fatal("Error parsing tree: %s", pll_errmsg);
+
+  treeinfo = pllmod_treeinfo_create(tree->nodes[2 * N_TIPS - 3], N_TIPS, 1,
+                                    PLLMOD_TREE_BRLEN_LINKED);
+  if (!treeinfo)
+    fatal("Cannot create treeinfo: %s", pll_errmsg);
+
+  partition = create_partition(attributes, tree);
+  if (!pllmod_treeinfo_init_partition(treeinfo, 0, partition,
+                                      PLLMOD_OPT_PARAM_SUBST_RATES |
+                                      PLLMOD_OPT_PARAM_FREQUENCIES,
+                                      PLL_GAMMA_RATES_MEAN, 0.6, NULL, NULL))
+    fatal("Cannot initialize partition: %s", pll_errmsg);
+
+  loglh = pllmod_treeinfo_compute_loglh(treeinfo, 0);
+  printf("log-likelihood computed: %s\n", loglh < 0 ? "yes" : "no");
+
+  if (!pllmod_opt_compute_model_gradient(partition, treeinfo->root,
+                                         treeinfo->param_indices[0], 0, 1.0,
+                                         subst_grad, freqs_grad))
+    fatal("Error computing the gradient: %s", pll_errmsg);
+
+  printf("** substitution rates\n");
+  printf("gradient matches finite differences: %s\n",
+         check_gradient(treeinfo, partition->subst_params[0], subst_grad,
+                        N_SUBST_RATES) ? "yes" : "no");
+
+  printf("** frequencies\n");
+  printf("gradient matches finite differences: %s\n",
+         check_gradient(treeinfo, partition->frequencies[0], freqs_grad,
+                        N_STATES) ? "yes" : "no");
+
+  printf("** invariant sites\n");
+  pll_update_invariant_sites_proportion(partition, 0, 0.2);
+  printf("gradient rejected: %s\n",
+         pllmod_opt_compute_model_gradient(partition, treeinfo->root,
+                                           treeinfo->param_indices[0], 0, 1.0,
+                                           subst_grad, freqs_grad) ?
+                                           "no" : "yes");
+  pll_update_invariant_sites_proportion(partition, 0, 0.);
+
+#ifdef PLL_ATTRIB_RATE_SCALERS
+  /* scaling factors differ across rate categories */
+  {
+    pll_partition_t * scaled = create_partition(attributes |
+                                                PLL_ATTRIB_RATE_SCALERS,
+                                                tree);
+    pll_update_eigen(scaled, 0);
+    if (pllmod_opt_compute_model_gradient(scaled, treeinfo->root,
+                                          treeinfo->param_indices[0], 0, 1.0,
+                                          subst_grad, freqs_grad))
+      fatal("Gradient computed for a partition with per-rate scalers");
+    pll_partition_destroy(scaled);
+  }
+#endif
+
+  printf("** unlinked branch lengths\n");
+  {
+    double start_linked, start_unlinked;
+    double linked = optimize_rates(tree, attributes,
+                                   PLLMOD_TREE_BRLEN_LINKED,
+                                   &start_linked);
+    double unlinked = optimize_rates(tree, attributes,
+                                     PLLMOD_TREE_BRLEN_UNLINKED,
+                                     &start_unlinked);
+
+    printf("log-likelihood improved: %s\n",
+           unlinked > start_unlinked ? "yes" : "no");
+    printf("same optimum as linked branch lengths: %s\n",
+           fabs(linked - unlinked) < OPT_TOLERANCE * fabs(linked) ?
+           "yes" : "no");
+  }
+
+  /* clean */
+  pllmod_treeinfo_destroy(treeinfo);
+  pll_partition_destroy(partition);
+  pll_utree_destroy(tree, NULL);
+
+  return (0);
+}
@@ -0,0 +1,357 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+#include "pll_tree.h"
+#include "../common.h"
+
+#include <math.h>
+#include <string.h>
+
+#define TIP_COUNT    36
+#define SPLIT_LEN    ((TIP_COUNT + 31) / 32)
+#define N_TREES      60
+#define POOL_SIZE     6
+#define MAX_SPLITS   (N_TREES * (TIP_COUNT - 3))
+
+/*
+ * This test feeds the same weighted trees to three consensus builders: as
+ * parsed trees, as NEWICK strings and as split sets. The majority-rule
+ * consensus of every builder must hold exactly the splits whose weighted
+ * support is above one half, and the extended majority-rule consensus must
+ * be the same for all builders and for the one-shot weighted consensus.
+ * Finally, it checks that invalid weights, trees and thresholds are rejected.
+ */
+
+typedef struct
+{
+  pll_split_base_t split[SPLIT_LEN];
+  double support;
+} ref_split_t;
+
+static void normalize(pll_split_t split)
+{
+  unsigned int i;
+
+  if (split[0] & 1)
+    return;
+
+  for (i = 0; i < SPLIT_LEN; ++i)
+    split[i] = ~split[i];
+  split[SPLIT_LEN - 1] &= (1u << (TIP_COUNT % 32)) - 1;
+}
+
+/* adds the weight to the reference support of the splits */
+static void add_reference(ref_split_t * reference,
+                          unsigned int * ref_count,
+                          pll_split_t * splits,
+                          double weight)
+{
+  unsigned int i, j;
+  pll_split_base_t split[SPLIT_LEN];
+
+  for (i = 0; i < TIP_COUNT - 3; ++i)
+  {
+    memcpy(split, splits[i], sizeof(split));
+    normalize(split);
+    for (j = 0; j < *ref_count; ++j)
+      if (!memcmp(reference[j].split, split, sizeof(split)))
+        break;
+    if (j == *ref_count)
+    {
+      memcpy(reference[j].split, split, sizeof(split));
+      reference[j].support = 0;
+      ++*ref_count;
+    }
+    reference[j].support += weight;
+  }
+}
+
+/* normalized splits and supports of the consensus branches, sorted */
+static unsigned int consensus_splits(const pll_consensus_utree_t * constree,
+                                     ref_split_t * result)
+{
+  unsigned int i, j;
+
+  for (i = 0; i < constree->branch_count; ++i)
+  {
+    memcpy(result[i].split, constree->branch_data[i].split,
+           SPLIT_LEN * sizeof(pll_split_base_t));
+    normalize(result[i].split);
+    result[i].support = constree->branch_data[i].support;
+  }
+
+  /* insertion sort, the consensus is small */
+  for (i = 1; i < constree->branch_count; ++i)
+  {
+    ref_split_t t = result[i];
+    for (j = i; j > 0 && memcmp(result[j-1].split, t.split,
+                                sizeof(t.split)) > 0; --j)
+      result[j] = result[j-1];
+    result[j] = t;
+  }
+
+  return constree->branch_count;
+}
+
+static int same_consensus(const pll_consensus_utree_t * c1,
+                          const pll_consensus_utree_t * c2)
+{
+  ref_split_t s1[TIP_COUNT], s2[TIP_COUNT];
+  unsigned int i, n;
+
+  if (!c1 || !c2 || c1->branch_count != c2->branch_count)
+    return 0;
+
+  n = consensus_splits(c1, s1);
+  consensus_splits(c2, s2);
+  for (i = 0; i < n; ++i)
+    if (memcmp(s1[i].split, s2[i].split, sizeof(s1[i].split)) ||
+        fabs(s1[i].support - s2[i].support) > 1e-9)
+      return 0;
+
+  return 1;
+}
+
+/* majority-rule consensus against the reference supports */
+static int check_majority(const pll_consensus_utree_t * constree,
+                          const ref_split_t * reference,
+                          unsigned int ref_count,
+                          double total_weight)
+{
+  ref_split_t result[TIP_COUNT];
+  unsigned int i, j, n, majority = 0;
+
+  if (!constree)
+    return 0;
+
+  n = consensus_splits(constree, result);
+  for (i = 0; i < ref_count; ++i)
+  {
+    double support = reference[i].support / total_weight;
+    if (support <= 0.5)
+      continue;
+
+    ++majority;
+    for (j = 0; j < n; ++j)
+      if (!memcmp(result[j].split, reference[i].split,
+                  sizeof(reference[i].split)))
+        break;
+    if (j == n || fabs(result[j].support - support) > 1e-9)
+      return 0;
+  }
+
+  return majority > 0 && majority == n;
+}
+
+int main (int argc, char * argv[])
+{
+  unsigned int i, j, k, b, ref_count = 0;
+  unsigned int attributes = get_attributes(argc, argv);
+  char * labels[TIP_COUNT];
+  char * pool[POOL_SIZE];
+  char * trees[N_TREES];
+  double weights[N_TREES];
+  double total_weight = 0;
+  ref_split_t * reference;
+  pll_utree_t * utrees[N_TREES];
+  pll_utree_t * small_tree;
+  pll_split_t * splits;
+  pll_consensus_builder_t * builders[3];
+  pll_consensus_utree_t * majority[3], * extended[4];
+  int majority_ok = 1, extended_ok = 1;
+  const char * names[] = {"trees", "newick", "splits"};
+  char * repeated_labels[] = {"t1", "t2", "t1", "t4"};
+
+  if (attributes != PLL_ATTRIB_ARCH_CPU)
+  {
+    skip_test();
+  }
+
+  test_random_seed(3141);
+
+  for (i = 0; i < TIP_COUNT; ++i)
+  {
+    labels[i] = (char *) malloc(8);
+    sprintf(labels[i], "t%u", i + 1);
+  }
+
+  /* trees are drawn from a small pool, the first tree being the most
+     frequent one, such that majority splits exist */
+  for (i = 0; i < POOL_SIZE; ++i)
+    pool[i] = random_newick(TIP_COUNT, NULL, NULL, 3, 1);
+  for (i = 0; i < N_TREES; ++i)
+  {
+    unsigned int r = test_random() % (2 * POOL_SIZE);
+    trees[i] = pool[r < POOL_SIZE ? r : 0];
+    weights[i] = 1 + (test_random() % 1000) / 100.0;
+    utrees[i] = parse_utree(trees[i], TIP_COUNT);
+    total_weight += weights[i];
+  }
+
+  reference = (ref_split_t *) malloc(MAX_SPLITS * sizeof(ref_split_t));
+
+  printf("** weighted consensus\n");
+  for (b = 0; b < 3; ++b)
+  {
+    builders[b] = pllmod_utree_consensus_builder_create(TIP_COUNT, labels);
+    if (!builders[b])
+      fatal("Cannot create consensus builder: %s", pll_errmsg);
+  }
+
+  for (i = 0; i < N_TREES; ++i)
+  {
+    int retval = 1;
+
+    splits = pllmod_utree_split_create(utrees[i]->nodes[TIP_COUNT],
+                                       TIP_COUNT, NULL);
+    add_reference(reference, &ref_count, splits, weights[i]);
+
+    /* splits need not be normalized */
+    for (j = i % 2; j < TIP_COUNT - 3; j += 2)
+    {
+      for (k = 0; k < SPLIT_LEN; ++k)
+        splits[j][k] = ~splits[j][k];
+      splits[j][SPLIT_LEN - 1] &= (1u << (TIP_COUNT % 32)) - 1;
+    }
+
+    retval &= pllmod_utree_consensus_builder_add_tree(builders[0], utrees[i],
+                                                      weights[i]);
+    retval &= pllmod_utree_consensus_builder_add_newick(builders[1], trees[i],
+                                                        weights[i]);
+    retval &= pllmod_utree_consensus_builder_add_splits(builders[2],
+                                                        (const pll_split_t *)
+                                                          splits,
+                                                        TIP_COUNT - 3,
+                                                        weights[i]);
+    if (!retval)
+      fatal("Cannot add tree: %s", pll_errmsg);
+
+    pllmod_utree_split_destroy(splits);
+  }
+
+  for (b = 0; b < 3; ++b)
+  {
+    printf("%s: trees added: %u\n", names[b], builders[b]->tree_count);
+    printf("%s: total weight OK: %s\n", names[b],
+           fabs(builders[b]->total_weight - total_weight) < 1e-9 ?
+           "yes" : "no");
+  }
+
+  /* majority rule, with fresh builders for the extended majority rule */
+  for (b = 0; b < 3; ++b)
+  {
+    majority[b] = pllmod_utree_consensus_builder_finalize(builders[b], 0.5);
+    if (!check_majority(majority[b], reference, ref_count, total_weight))
+      majority_ok = 0;
+    pllmod_utree_consensus_builder_destroy(builders[b]);
+
+    builders[b] = pllmod_utree_consensus_builder_create(TIP_COUNT, labels);
+    for (i = 0; i < N_TREES; ++i)
+    {
+      if (b == 0)
+        pllmod_utree_consensus_builder_add_tree(builders[b], utrees[i],
+                                                weights[i]);
+      else
+        pllmod_utree_consensus_builder_add_newick(builders[b], trees[i],
+                                                  weights[i]);
+    }
+    extended[b] = pllmod_utree_consensus_builder_finalize(builders[b], 0.0);
+  }
+  printf("majority splits and support: %s\n", majority_ok ? "yes" : "no");
+
+  /* one-shot consensus with weights normalized to one */
+  for (i = 0; i < N_TREES; ++i)
+    weights[i] /= total_weight;
+  extended[3] = pllmod_utree_weight_consensus(utrees, weights, 0.0, N_TREES);
+  for (b = 1; b < 4; ++b)
+    if (!same_consensus(extended[0], extended[b]))
+      extended_ok = 0;
+  printf("same extended majority consensus: %s\n",
+         extended_ok ? "yes" : "no");
+
+  printf("** errors\n");
+  pll_errno = 0;
+  printf("add after finalize: %s\n",
+         !pllmod_utree_consensus_builder_add_tree(builders[0], utrees[0], 1) &&
+         pll_errno == PLL_ERROR_PARAM_INVALID ? "yes" : "no");
+  pll_errno = 0;
+  printf("finalize twice: %s\n",
+         !pllmod_utree_consensus_builder_finalize(builders[0], 0.5) &&
+         pll_errno == PLL_ERROR_PARAM_INVALID ? "yes" : "no");
+
+  pllmod_utree_consensus_builder_destroy(builders[0]);
+  builders[0] = pllmod_utree_consensus_builder_create(TIP_COUNT, labels);
+
+  pll_errno = 0;
+  printf("negative weight: %s\n",
+         !pllmod_utree_consensus_builder_add_newick(builders[0], trees[0],
+                                                    -1) &&
+         pll_errno == PLLMOD_TREE_ERROR_INVALID_TREE ? "yes" : "no");
+  pll_errno = 0;
+  printf("no trees added: %s\n",
+         !pllmod_utree_consensus_builder_finalize(builders[0], 0.5) &&
+         pll_errno == PLLMOD_TREE_ERROR_INVALID_TREE ? "yes" : "no");
+  small_tree = pll_utree_parse_newick_string("((t1,t2),(t3,t4),(t5,t6));");
+  pll_errno = 0;
+  printf("wrong tip count: %s\n",
+         !pllmod_utree_consensus_builder_add_tree(builders[0], small_tree, 1) &&
+         pll_errno == PLLMOD_TREE_ERROR_INVALID_TREE_SIZE ? "yes" : "no");
+  pll_utree_destroy(small_tree, NULL);
+  splits = pllmod_utree_split_create(utrees[0]->nodes[TIP_COUNT], TIP_COUNT,
+                                     NULL);
+  pll_errno = 0;
+  printf("too many splits: %s\n",
+         !pllmod_utree_consensus_builder_add_splits(builders[0],
+                                                    (const pll_split_t *)
+                                                      splits,
+                                                    TIP_COUNT - 2,
+                                                    1) &&
+         pll_errno == PLLMOD_TREE_ERROR_INVALID_SPLIT ? "yes" : "no");
+  pllmod_utree_split_destroy(splits);
+  pll_errno = 0;
+  pllmod_utree_consensus_builder_add_newick(builders[0], trees[0], 1);
+  printf("invalid threshold: %s\n",
+         !pllmod_utree_consensus_builder_finalize(builders[0], 1.5) &&
+         pll_errno == PLLMOD_TREE_ERROR_INVALID_THRESHOLD ? "yes" : "no");
+  pll_errno = 0;
+  printf("repeated labels: %s\n",
+         !pllmod_utree_consensus_builder_create(4, repeated_labels) &&
+         pll_errno == PLLMOD_TREE_ERROR_INVALID_TREE ? "yes" : "no");
+
+  /* clean */
+  for (b = 0; b < 3; ++b)
+  {
+    pllmod_utree_consensus_builder_destroy(builders[b]);
+    if (majority[b])
+      pllmod_utree_consensus_destroy(majority[b]);
+  }
+  for (b = 0; b < 4; ++b)
+    if (extended[b])
+      pllmod_utree_consensus_destroy(extended[b]);
+  for (i = 0; i < N_TREES; ++i)
+    pll_utree_destroy(utrees[i], NULL);
+  for (i = 0; i < POOL_SIZE; ++i)
+    free(pool[i]);
+  for (i = 0; i < TIP_COUNT; ++i)
+    free(labels[i]);
+  free(reference);
+
+  return (0);
+}
@@ -0,0 +1,228 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+#include "pll_tree.h"
+#include "../common.h"
+
+#include <string.h>
+
+#define MAX_TIPS  64
+#define N_ITERS   10
+
+/*
+ * This test builds multifurcating trees out of random subsets of the splits
+ * of random binary trees, given in random order. The branches of the result
+ * must hold exactly the given splits and their support, and every tip must
+ * appear once. A split that conflicts with the others must be rejected.
+ * Tip counts include a multiple of the split word size.
+ */
+
+static void normalize(pll_split_t split, unsigned int tip_count)
+{
+  unsigned int split_len = (tip_count + 31) / 32;
+  unsigned int i;
+
+  if (split[0] & 1)
+    return;
+
+  for (i = 0; i < split_len; ++i)
+    split[i] = ~split[i];
+  if (tip_count % 32)
+    split[split_len - 1] &= (1u << (tip_count % 32)) - 1;
+}
+
+static unsigned int count_tips(pll_unode_t * node,
+                               char * const * labels,
+                               unsigned int tip_count,
+                               unsigned int * seen)
+{
+  pll_unode_t * child;
+  unsigned int i, count = 0;
+
+  if (!node->next)
+  {
+    for (i = 0; i < tip_count; ++i)
+      if (node->label && !strcmp(node->label, labels[i]))
+        ++seen[i];
+    return 1;
+  }
+
+  for (child = node->next; child != node; child = child->next)
+    count += count_tips(child->back, labels, tip_count, seen);
+
+  return count;
+}
+
+/* checks the tree built out of split_system */
+static int check_tree(const pll_consensus_utree_t * constree,
+                      const pll_split_system_t * split_system,
+                      char * const * labels,
+                      unsigned int tip_count)
+{
+  unsigned int split_len = (tip_count + 31) / 32;
+  unsigned int i, j, tips;
+  unsigned int seen[MAX_TIPS];
+  pll_split_base_t split[MAX_TIPS / 32 + 1];
+
+  if (constree->branch_count != split_system->split_count)
+    return 0;
+
+  /* every branch must hold one of the splits, with its support */
+  for (i = 0; i < constree->branch_count; ++i)
+  {
+    const pll_consensus_data_t * data = constree->branch_data + i;
+    memcpy(split, data->split, split_len * sizeof(pll_split_base_t));
+    normalize(split, tip_count);
+    for (j = 0; j < split_system->split_count; ++j)
+      if (!memcmp(split, split_system->splits[j],
+                  split_len * sizeof(pll_split_base_t)))
+        break;
+    if (j == split_system->split_count ||
+        data->support != split_system->support[j])
+      return 0;
+  }
+
+  /* the splits are distinct, so every split is there */
+  memset(seen, 0, sizeof(seen));
+  tips = count_tips(constree->tree, labels, tip_count, seen) +
+         count_tips(constree->tree->back, labels, tip_count, seen);
+  if (tips != tip_count)
+    return 0;
+  for (i = 0; i < tip_count; ++i)
+    if (seen[i] != 1)
+      return 0;
+
+  return 1;
+}
+
+int main (int argc, char * argv[])
+{
+  unsigned int sizes[] = {45, 64};
+  unsigned int attributes = get_attributes(argc, argv);
+  unsigned int s, iter, i, j;
+  int built_ok = 1, rejected_ok = 1, resolved_ok = 1;
+
+  if (attributes != PLL_ATTRIB_ARCH_CPU)
+  {
+    skip_test();
+  }
+
+  test_random_seed(4321);
+
+  printf("** trees from splits\n");
+  for (s = 0; s < 2; ++s)
+  {
+    unsigned int tip_count = sizes[s];
+    unsigned int n_splits = tip_count - 3;
+    unsigned int split_len = (tip_count + 31) / 32;
+    char * labels[MAX_TIPS];
+
+    for (iter = 0; iter < N_ITERS; ++iter)
+    {
+      char * newick = random_newick(tip_count, NULL, NULL, 3, 0);
+      pll_utree_t * tree = pll_utree_parse_newick_string(newick);
+      pll_split_t * splits;
+      pll_split_t conflict;
+      pll_split_system_t split_system;
+      pll_consensus_utree_t * constree;
+      double support[MAX_TIPS];
+      unsigned int side_count[2];
+
+      if (!tree)
+        fatal("Cannot parse tree: %s", pll_errmsg);
+
+      /* splits and the consensus tree use the tip node indices */
+      for (i = 0; i < tip_count; ++i)
+        labels[tree->nodes[i]->node_index] = tree->nodes[i]->label;
+
+      splits = pllmod_utree_split_create(tree->nodes[tip_count], tip_count,
+                                         NULL);
+
+      /* random subset in random order: all splits on the first iteration */
+      split_system.splits = (pll_split_t *) malloc((n_splits + 1) *
+                                                   sizeof(pll_split_t));
+      split_system.support = support;
+      split_system.split_count = 0;
+      split_system.max_support = 1.0;
+      for (i = 0; i < n_splits; ++i)
+        if (!iter || test_random() % 2)
+        {
+          split_system.splits[split_system.split_count] = splits[i];
+          support[split_system.split_count] = 0.5 + 0.001 * i;
+          ++split_system.split_count;
+        }
+      for (i = split_system.split_count; i > 1; --i)
+      {
+        pll_split_t t;
+        double d;
+        j = test_random() % i;
+        t = split_system.splits[i-1];
+        split_system.splits[i-1] = split_system.splits[j];
+        split_system.splits[j] = t;
+        d = support[i-1]; support[i-1] = support[j]; support[j] = d;
+      }
+
+      constree = pllmod_utree_from_splits(&split_system, tip_count, labels);
+      if (!constree || !check_tree(constree, &split_system, labels, tip_count))
+        built_ok = 0;
+      if (!iter && constree &&
+          constree->branch_count != n_splits)
+        resolved_ok = 0;
+      if (constree)
+        pllmod_utree_consensus_destroy(constree);
+
+      /* a split that conflicts with one of the splits of the system */
+      conflict = (pll_split_t) calloc(split_len, sizeof(pll_split_base_t));
+      side_count[0] = side_count[1] = 0;
+      for (i = 0; i < tip_count; ++i)
+      {
+        pll_split_t target = split_system.splits[0];
+        int side = (target[i / 32] >> (i % 32)) & 1;
+
+        /* every other taxon of each side */
+        if (side_count[side]++ % 2)
+          conflict[i / 32] |= 1u << (i % 32);
+      }
+      normalize(conflict, tip_count);
+      split_system.splits[split_system.split_count] = conflict;
+      support[split_system.split_count] = 0.5;
+      ++split_system.split_count;
+
+      pll_errno = 0;
+      constree = pllmod_utree_from_splits(&split_system, tip_count, labels);
+      if (constree || pll_errno != PLLMOD_TREE_ERROR_INVALID_SPLIT)
+        rejected_ok = 0;
+      if (constree)
+        pllmod_utree_consensus_destroy(constree);
+
+      free(conflict);
+      free(split_system.splits);
+      pllmod_utree_split_destroy(splits);
+      pll_utree_destroy(tree, NULL);
+      free(newick);
+    }
+  }
+
+  printf("splits and tips OK: %s\n", built_ok ? "yes" : "no");
+  printf("binary trees fully resolved: %s\n", resolved_ok ? "yes" : "no");
+  printf("conflicting splits rejected: %s\n", rejected_ok ? "yes" : "no");
+
+  return (0);
+}
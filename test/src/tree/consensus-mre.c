@@ -0,0 +1,318 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+#include "pll_tree.h"
+#include "../common.h"
+
+#include <string.h>
+
+#define TIP_COUNT      40
+#define SPLIT_LEN      ((TIP_COUNT + 31) / 32)
+#define N_CANDIDATES  400
+#define N_MAJORITY      3
+#define THRESHOLD    0.05
+#define N_TIES          8
+
+/*
+ * This test builds an extended majority-rule (MRE) consensus out of a set of
+ * splits with distinct support values, and compares it with a plain greedy
+ * construction: majority splits first, then the other splits by decreasing
+ * support, as long as they are compatible with all the splits accepted so far.
+ * Candidates are intervals of random taxa orderings, such that many of them
+ * conflict with each other. Candidates with the same support are taken by
+ * increasing split words, whatever the order they were inserted in.
+ */
+
+typedef struct
+{
+  pll_split_t split;
+  double support;
+} candidate_t;
+
+static void shuffle(unsigned int * perm, unsigned int n)
+{
+  unsigned int i, j, t;
+  for (i = 0; i < n; ++i)
+    perm[i] = i;
+  for (i = n - 1; i > 0; --i)
+  {
+    j = test_random() % (i + 1);
+    t = perm[i]; perm[i] = perm[j]; perm[j] = t;
+  }
+}
+
+/* split of the taxa at positions [from, to] of perm, normalized */
+static void interval_split(pll_split_t split,
+                           const unsigned int * perm,
+                           unsigned int from,
+                           unsigned int to)
+{
+  unsigned int i;
+
+  memset(split, 0, SPLIT_LEN * sizeof(pll_split_base_t));
+  for (i = from; i <= to; ++i)
+    split[perm[i] / 32] |= 1u << (perm[i] % 32);
+
+  if (!(split[0] & 1))
+  {
+    for (i = 0; i < SPLIT_LEN; ++i)
+      split[i] = ~split[i];
+    split[SPLIT_LEN - 1] &= (1u << (TIP_COUNT % 32)) - 1;
+  }
+}
+
+/* two bipartitions are compatible iff one of the four intersections of their
+   sides is empty */
+static int compatible(const pll_split_t s1, const pll_split_t s2)
+{
+  unsigned int i;
+  int c11 = 1, c10 = 1, c01 = 1, c00 = 1;
+  pll_split_base_t mask;
+
+  for (i = 0; i < SPLIT_LEN; ++i)
+  {
+    mask = (i < SPLIT_LEN - 1) ? ~0u : (1u << (TIP_COUNT % 32)) - 1;
+    if (s1[i] & s2[i])
+      c11 = 0;
+    if (s1[i] & ~s2[i] & mask)
+      c10 = 0;
+    if (~s1[i] & s2[i] & mask)
+      c01 = 0;
+    if (~s1[i] & ~s2[i] & mask)
+      c00 = 0;
+  }
+
+  return c11 || c10 || c01 || c00;
+}
+
+static int cmp_support(const void * a, const void * b)
+{
+  const candidate_t * ca = (const candidate_t *) a;
+  const candidate_t * cb = (const candidate_t *) b;
+  return (ca->support < cb->support) ? 1 : -1;
+}
+
+/* order of the candidates with the same support */
+static int cmp_words(const pll_split_t s1, const pll_split_t s2)
+{
+  unsigned int i;
+
+  for (i = 0; i < SPLIT_LEN; ++i)
+    if (s1[i] != s2[i])
+      return (s1[i] < s2[i]) ? -1 : 1;
+
+  return 0;
+}
+
+static int cmp_split(const void * a, const void * b)
+{
+  return memcmp(((const candidate_t *) a)->split,
+                ((const candidate_t *) b)->split,
+                SPLIT_LEN * sizeof(pll_split_base_t));
+}
+
+int main (int argc, char * argv[])
+{
+  unsigned int i, j, k, n, ref_count = 0, cand_count = 0;
+  unsigned int attributes = get_attributes(argc, argv);
+  unsigned int perm[2][TIP_COUNT];
+  unsigned int * ranks;
+  unsigned int max_splits = TIP_COUNT - 3;
+  int same_splits, same_support, all_compatible, has_minor;
+  pll_split_t buffer, tie_buffer, tie_first;
+  int ties_ok;
+  candidate_t * candidates, * reference, * result;
+  bitv_hashtable_t * splits_hash;
+  pll_split_system_t * consensus;
+
+  if (attributes != PLL_ATTRIB_ARCH_CPU)
+  {
+    skip_test();
+  }
+
+  test_random_seed(2017);
+
+  shuffle(perm[0], TIP_COUNT);
+  shuffle(perm[1], TIP_COUNT);
+
+  candidates = (candidate_t *) calloc(N_CANDIDATES + N_MAJORITY,
+                                      sizeof(candidate_t));
+  reference = (candidate_t *) calloc(max_splits, sizeof(candidate_t));
+  result = (candidate_t *) calloc(max_splits, sizeof(candidate_t));
+  buffer = (pll_split_t) calloc((N_CANDIDATES + N_MAJORITY + 1) * SPLIT_LEN,
+                                sizeof(pll_split_base_t));
+  ranks = (unsigned int *) malloc(N_CANDIDATES * sizeof(unsigned int));
+
+  splits_hash = pllmod_utree_split_hashtable_create(TIP_COUNT, 0);
+  if (!splits_hash)
+    fatal("Cannot create hashtable: %s", pll_errmsg);
+
+  /* disjoint intervals: compatible, but their normalized splits overlap */
+  for (i = 0; i < N_MAJORITY; ++i)
+  {
+    candidate_t * c = candidates + cand_count++;
+    c->split = buffer + i * SPLIT_LEN;
+    c->support = 0.9 - 0.1 * i;
+    interval_split(c->split, perm[0], 10 * i + 1, 10 * i + 4);
+  }
+
+  /* minority candidates, with distinct supports in (0, 0.5) */
+  shuffle(ranks, N_CANDIDATES);
+  for (n = 0; n < N_CANDIDATES; ++n)
+  {
+    candidate_t * c = candidates + cand_count;
+    unsigned int len = 2 + test_random() % (TIP_COUNT - 4);
+    unsigned int from = test_random() % (TIP_COUNT - len + 1);
+
+    c->split = buffer + cand_count * SPLIT_LEN;
+    c->support = 0.01 + 0.48 * ranks[n] / N_CANDIDATES;
+    interval_split(c->split, perm[n % 3 == 0], from, from + len - 1);
+
+    /* skip repeated splits, such that all supports are distinct */
+    if (!pllmod_utree_split_hashtable_lookup(splits_hash, c->split,
+                                             TIP_COUNT))
+    {
+      pll_split_t s = c->split;
+      pllmod_utree_split_hashtable_insert(splits_hash, &s, TIP_COUNT, 1,
+                                          &c->support, 0);
+      ++cand_count;
+    }
+  }
+  for (i = 0; i < N_MAJORITY; ++i)
+    pllmod_utree_split_hashtable_insert(splits_hash, &candidates[i].split,
+                                        TIP_COUNT, 1, &candidates[i].support,
+                                        0);
+
+  /* greedy reference */
+  qsort(candidates, cand_count, sizeof(candidate_t), cmp_support);
+  has_minor = 0;
+  for (i = 0; i < cand_count && ref_count < max_splits; ++i)
+  {
+    int ok = candidates[i].support >= THRESHOLD;
+    for (j = 0; j < ref_count && ok; ++j)
+      ok = compatible(candidates[i].split, reference[j].split);
+    if (ok)
+    {
+      reference[ref_count++] = candidates[i];
+      if (candidates[i].support < 0.5)
+        has_minor = 1;
+    }
+  }
+
+  printf("** MRE consensus\n");
+  consensus = pllmod_utree_split_consensus(splits_hash, TIP_COUNT, THRESHOLD,
+                                           SPLIT_LEN);
+  if (!consensus)
+    fatal("Cannot build consensus: %s", pll_errmsg);
+
+  printf("minority splits accepted: %s\n", has_minor ? "yes" : "no");
+  printf("split count OK: %s\n",
+         consensus->split_count == ref_count ? "yes" : "no");
+
+  n = consensus->split_count < max_splits ? consensus->split_count : max_splits;
+  for (i = 0; i < n; ++i)
+  {
+    result[i].split = consensus->splits[i];
+    result[i].support = consensus->support[i];
+  }
+  qsort(result, n, sizeof(candidate_t), cmp_split);
+  qsort(reference, ref_count, sizeof(candidate_t), cmp_split);
+
+  same_splits = same_support = (n == ref_count);
+  for (i = 0; i < n && same_splits; ++i)
+  {
+    if (cmp_split(result + i, reference + i))
+      same_splits = 0;
+    else if (result[i].support != reference[i].support)
+      same_support = 0;
+  }
+  printf("same splits as greedy: %s\n", same_splits ? "yes" : "no");
+  printf("same support: %s\n", same_support ? "yes" : "no");
+
+  all_compatible = 1;
+  for (i = 0; i < n; ++i)
+    for (j = i + 1; j < n; ++j)
+      if (!compatible(result[i].split, result[j].split))
+        all_compatible = 0;
+  printf("splits pairwise compatible: %s\n", all_compatible ? "yes" : "no");
+
+  for (i = 0; i < consensus->split_count; ++i)
+    free(consensus->splits[i]);
+  free(consensus->splits);
+  free(consensus->support);
+  free(consensus);
+
+  /* pairwise conflicting splits {5, 6 + n} with the same support */
+  printf("** ties\n");
+  tie_buffer = (pll_split_t) calloc(N_TIES * SPLIT_LEN,
+                                    sizeof(pll_split_base_t));
+  tie_first = tie_buffer;
+  for (n = 0; n < N_TIES; ++n)
+  {
+    unsigned int pair[2] = {5, 6 + n};
+    interval_split(tie_buffer + n * SPLIT_LEN, pair, 0, 1);
+    if (cmp_words(tie_buffer + n * SPLIT_LEN, tie_first) < 0)
+      tie_first = tie_buffer + n * SPLIT_LEN;
+  }
+
+  ties_ok = 1;
+  for (k = 0; k < 2; ++k)
+  {
+    double tie_support = 0.3;
+
+    splits_hash = pllmod_utree_split_hashtable_create(TIP_COUNT, 0);
+    if (!splits_hash)
+      fatal("Cannot create hashtable: %s", pll_errmsg);
+
+    /* insert in both orders */
+    for (n = 0; n < N_TIES; ++n)
+    {
+      pll_split_t s = tie_buffer + (k ? N_TIES - 1 - n : n) * SPLIT_LEN;
+      pllmod_utree_split_hashtable_insert(splits_hash, &s, TIP_COUNT, 1,
+                                          &tie_support, 0);
+    }
+
+    consensus = pllmod_utree_split_consensus(splits_hash, TIP_COUNT,
+                                             THRESHOLD, SPLIT_LEN);
+    if (!consensus)
+      fatal("Cannot build consensus: %s", pll_errmsg);
+
+    if (consensus->split_count != 1 ||
+        cmp_words(consensus->splits[0], tie_first))
+      ties_ok = 0;
+
+    for (i = 0; i < consensus->split_count; ++i)
+      free(consensus->splits[i]);
+    free(consensus->splits);
+    free(consensus->support);
+    free(consensus);
+  }
+  printf("ties taken by split words: %s\n", ties_ok ? "yes" : "no");
+
+  /* clean */
+  free(tie_buffer);
+  free(ranks);
+  free(buffer);
+  free(result);
+  free(reference);
+  free(candidates);
+
+  return (0);
+}
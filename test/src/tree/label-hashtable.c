@@ -0,0 +1,286 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+#include "pll_tree.h"
+#include "../common.h"
+
+#include <string.h>
+
+#define N_LABELS  2000
+#define PREFIX    "Lineage_B.1.1.7/isolate/England/2021/"
+
+/*
+ * This test fills the taxon label hashtable of a consensus builder with many
+ * labels that share a long prefix, and with few labels whose common prefix
+ * gets shorter as they are inserted. Labels are then looked up by reading
+ * the splits of NEWICK trees, which must match the splits of the parsed
+ * trees. Labels that differ from the stored ones only in the prefix, or that
+ * extend or truncate them, must not be found.
+ */
+
+/* every label is stored once, and it can be reached from its home slot */
+static int check_table(const string_hashtable_t * h,
+                       char * const * labels,
+                       unsigned int label_count)
+{
+  unsigned int mask = h->table_size - 1;
+  unsigned int i, j, count = 0;
+
+  if (h->table_size & mask || h->entry_count != label_count ||
+      h->entry_count > h->table_size / 2)
+    return 0;
+
+  for (i = 0; i < label_count; ++i)
+    if (strcmp(h->labels[i], labels[i]))
+      return 0;
+
+  for (i = 0; i < h->table_size; ++i)
+  {
+    const string_hash_entry_t * e = h->table + i;
+    if (!e->word)
+      continue;
+
+    ++count;
+    if (strcmp(e->word, labels[e->node_number]) ||
+        e->length != strlen(e->word))
+      return 0;
+    for (j = e->key & mask; j != i; j = (j + 1) & mask)
+      if (!h->table[j].word)
+        return 0;
+  }
+
+  return count == label_count;
+}
+
+/* normalized splits of a parsed tree, with the taxa numbered by labels */
+static pll_split_t * tree_splits(const char * newick,
+                                 char * const * labels,
+                                 unsigned int tip_count)
+{
+  unsigned int split_len = (tip_count + 31) / 32;
+  unsigned int i, j;
+  unsigned int * taxon;
+  pll_utree_t * tree = pll_utree_parse_newick_string(newick);
+  pll_split_t * splits, * result;
+
+  if (!tree)
+    fatal("Cannot parse tree: %s", pll_errmsg);
+
+  taxon = (unsigned int *) malloc(tip_count * sizeof(unsigned int));
+  for (i = 0; i < tip_count; ++i)
+  {
+    for (j = 0; strcmp(tree->nodes[i]->label, labels[j]); ++j);
+    taxon[tree->nodes[i]->node_index] = j;
+  }
+
+  splits = pllmod_utree_split_create(tree->nodes[tip_count], tip_count, NULL);
+
+  result = (pll_split_t *) malloc((tip_count - 3) * sizeof(pll_split_t));
+  result[0] = (pll_split_t) calloc((tip_count - 3) * split_len,
+                                   sizeof(pll_split_base_t));
+  for (i = 0; i < tip_count - 3; ++i)
+  {
+    result[i] = result[0] + i * split_len;
+    for (j = 0; j < tip_count; ++j)
+      if (splits[i][j / 32] & (1u << (j % 32)))
+        result[i][taxon[j] / 32] |= 1u << (taxon[j] % 32);
+
+    if (!(result[i][0] & 1))
+    {
+      for (j = 0; j < split_len; ++j)
+        result[i][j] = ~result[i][j];
+      if (tip_count % 32)
+        result[i][split_len - 1] &= (1u << (tip_count % 32)) - 1;
+    }
+  }
+
+  free(taxon);
+  pllmod_utree_split_destroy(splits);
+  pll_utree_destroy(tree, NULL);
+
+  return result;
+}
+
+static int cmp_split(const void * a, const void * b)
+{
+  return memcmp(*(const pll_split_t *) a, *(const pll_split_t *) b,
+                ((N_LABELS + 31) / 32) * sizeof(pll_split_base_t));
+}
+
+/* splits of the newick string read through the label hashtable */
+static int same_splits(const char * newick,
+                       const pll_split_t * ref_splits,
+                       string_hashtable_t * names_hash,
+                       unsigned int tip_count)
+{
+  unsigned int split_len = (tip_count + 31) / 32;
+  unsigned int i, j;
+  int retval = 1;
+  pll_split_t * splits;
+  pll_split_t * sorted[2];
+
+  splits = pllmod_utree_split_newick_parse(newick, tip_count, names_hash);
+  if (!splits)
+    return 0;
+
+  /* sort copies: the first pointer owns the splits */
+  sorted[0] = (pll_split_t *) malloc((tip_count - 3) * sizeof(pll_split_t));
+  sorted[1] = (pll_split_t *) malloc((tip_count - 3) * sizeof(pll_split_t));
+  for (i = 0; i < tip_count - 3; ++i)
+  {
+    /* compare full words, the split buffers are large enough */
+    sorted[0][i] = (pll_split_t) calloc((N_LABELS + 31) / 32,
+                                        sizeof(pll_split_base_t));
+    sorted[1][i] = (pll_split_t) calloc((N_LABELS + 31) / 32,
+                                        sizeof(pll_split_base_t));
+    memcpy(sorted[0][i], splits[i], split_len * sizeof(pll_split_base_t));
+    memcpy(sorted[1][i], ref_splits[i], split_len * sizeof(pll_split_base_t));
+  }
+  qsort(sorted[0], tip_count - 3, sizeof(pll_split_t), cmp_split);
+  qsort(sorted[1], tip_count - 3, sizeof(pll_split_t), cmp_split);
+
+  for (i = 0; i < tip_count - 3; ++i)
+    if (memcmp(sorted[0][i], sorted[1][i],
+               split_len * sizeof(pll_split_base_t)))
+      retval = 0;
+
+  for (j = 0; j < 2; ++j)
+  {
+    for (i = 0; i < tip_count - 3; ++i)
+      free(sorted[j][i]);
+    free(sorted[j]);
+  }
+  pllmod_utree_split_destroy(splits);
+
+  return retval;
+}
+
+static int unknown_label(const char * label, string_hashtable_t * names_hash)
+{
+  char newick[128];
+  pll_split_t * splits;
+
+  sprintf(newick,
+          "((%s,abX_1),(abcdef_1,abcdef_2),(abcdef_12,(abcdef_3,abcdef_)));",
+          label);
+
+  pll_errno = 0;
+  splits = pllmod_utree_split_newick_parse(newick, 7, names_hash);
+  if (splits)
+  {
+    pllmod_utree_split_destroy(splits);
+    return 0;
+  }
+
+  return pll_errno == PLLMOD_TREE_ERROR_INVALID_TREE &&
+         strstr(pll_errmsg, "column 3") != NULL;
+}
+
+int main (int argc, char * argv[])
+{
+  unsigned int i;
+  unsigned int attributes = get_attributes(argc, argv);
+  char * labels[N_LABELS];
+  char * newick;
+  pll_split_t * ref_splits;
+  pll_consensus_builder_t * builder;
+  string_hashtable_t * names_hash;
+  char * short_labels[] = {"abcdef_1", "abcdef_2", "abcdef_12", "abc",
+                           "abcdef_3", "abX_1", "abcdef_"};
+  char * repeated_labels[] = {"abcdef_1", "abcdef_2", "abX", "abcdef_2"};
+  const char * tree1 =
+             "((abc,abX_1),(abcdef_1,abcdef_2),(abcdef_12,(abcdef_3,abcdef_)));";
+  const char * tree2 =
+             "(abcdef_12,(abcdef_3,abcdef_),((abcdef_2,abcdef_1),(abX_1,abc)));";
+
+  if (attributes != PLL_ATTRIB_ARCH_CPU)
+  {
+    skip_test();
+  }
+
+  test_random_seed(1999);
+
+  printf("** long common prefix\n");
+  for (i = 0; i < N_LABELS; ++i)
+  {
+    labels[i] = (char *) malloc(strlen(PREFIX) + 8);
+    sprintf(labels[i], "%s%u", PREFIX, i + 1);
+  }
+
+  builder = pllmod_utree_consensus_builder_create(N_LABELS, labels);
+  if (!builder)
+    fatal("Cannot create consensus builder: %s", pll_errmsg);
+  names_hash = builder->names_hash;
+
+  printf("labels stored: %s\n",
+         check_table(names_hash, labels, N_LABELS) ? "yes" : "no");
+  printf("common prefix: %s\n",
+         names_hash->prefix_length == strlen(PREFIX) ? "yes" : "no");
+
+  newick = random_newick(N_LABELS, NULL, labels, 3, 0);
+  ref_splits = tree_splits(newick, labels, N_LABELS);
+  printf("same splits as the tree: %s\n",
+         same_splits(newick, ref_splits, names_hash, N_LABELS) ? "yes" : "no");
+  pllmod_utree_split_destroy(ref_splits);
+  free(newick);
+  pllmod_utree_consensus_builder_destroy(builder);
+
+  printf("** shrinking prefix\n");
+  builder = pllmod_utree_consensus_builder_create(7, short_labels);
+  if (!builder)
+    fatal("Cannot create consensus builder: %s", pll_errmsg);
+  names_hash = builder->names_hash;
+
+  printf("labels stored: %s\n",
+         check_table(names_hash, short_labels, 7) ? "yes" : "no");
+  printf("common prefix: %s\n", names_hash->prefix_length == 2 ? "yes" : "no");
+
+  ref_splits = tree_splits(tree1, short_labels, 7);
+  printf("same splits as the tree: %s\n",
+         same_splits(tree1, ref_splits, names_hash, 7) &&
+         same_splits(tree2, ref_splits, names_hash, 7) ? "yes" : "no");
+  pllmod_utree_split_destroy(ref_splits);
+
+  printf("prefix only: %s\n", unknown_label("ab", names_hash) ? "yes" : "no");
+  printf("shorter than prefix: %s\n",
+         unknown_label("a", names_hash) ? "yes" : "no");
+  printf("different prefix: %s\n",
+         unknown_label("xbc", names_hash) ? "yes" : "no");
+  printf("extended label: %s\n",
+         unknown_label("abcd", names_hash) ? "yes" : "no");
+  printf("truncated label: %s\n",
+         unknown_label("abcdef", names_hash) ? "yes" : "no");
+  printf("new label: %s\n",
+         unknown_label("abcdef_4", names_hash) ? "yes" : "no");
+  pllmod_utree_consensus_builder_destroy(builder);
+
+  pll_errno = 0;
+  builder = pllmod_utree_consensus_builder_create(4, repeated_labels);
+  printf("repeated label: %s\n",
+         !builder && pll_errno == PLLMOD_TREE_ERROR_INVALID_TREE ? "yes" : "no");
+  if (builder)
+    pllmod_utree_consensus_builder_destroy(builder);
+
+  /* clean */
+  for (i = 0; i < N_LABELS; ++i)
+    free(labels[i]);
+
+  return (0);
+}
@@ -0,0 +1,297 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+#include "pll_tree.h"
+#include "../common.h"
+
+#include <string.h>
+
+#define MAX_TIPS      40
+#define N_PAIRS       16
+#define N_TREES       12
+#define MATRIX_TIPS   30
+#define N_THREADS      4
+
+/*
+ * This test compares quartet distances between unrooted trees and triplet
+ * distances between rooted trees with a brute-force count over all sets of 4
+ * and 3 taxa. Pairs of trees differ in a few swapped taxa, such that the
+ * distances cover a wide range. It also computes a matrix of quartet
+ * distances with one and with several threads.
+ */
+
+/* taxa of the non-trivial splits of an unrooted tree */
+static void utree_masks(pll_utree_t * tree, uint64_t * masks)
+{
+  unsigned int tip_count = tree->tip_count;
+  unsigned int i, j;
+  pll_split_t * splits = pllmod_utree_split_create(tree->nodes[tip_count],
+                                                   tip_count, NULL);
+
+  for (i = 0; i < tip_count - 3; ++i)
+  {
+    masks[i] = 0;
+    for (j = 0; j < tip_count; ++j)
+      if (splits[i][j / 32] & (1u << (j % 32)))
+        masks[i] |= (uint64_t) 1 << j;
+  }
+
+  pllmod_utree_split_destroy(splits);
+}
+
+/* taxa of the clades of a rooted tree */
+static uint64_t rtree_masks(const pll_rnode_t * node,
+                            uint64_t * masks,
+                            unsigned int * count)
+{
+  uint64_t mask;
+
+  if (!node->left)
+    return (uint64_t) 1 << node->node_index;
+
+  mask = rtree_masks(node->left, masks, count) |
+         rtree_masks(node->right, masks, count);
+  masks[(*count)++] = mask;
+
+  return mask;
+}
+
+/* 0: ab|cd, 1: ac|bd, 2: ad|bc */
+static int quartet_topology(const uint64_t * masks,
+                            unsigned int mask_count,
+                            unsigned int a,
+                            unsigned int b,
+                            unsigned int c,
+                            unsigned int d)
+{
+  unsigned int i;
+
+  for (i = 0; i < mask_count; ++i)
+  {
+    uint64_t m = masks[i];
+    int in_a = (m >> a) & 1, in_b = (m >> b) & 1;
+    int in_c = (m >> c) & 1, in_d = (m >> d) & 1;
+    if (in_a == in_b && in_c == in_d && in_a != in_c)
+      return 0;
+    if (in_a == in_c && in_b == in_d && in_a != in_b)
+      return 1;
+    if (in_a == in_d && in_b == in_c && in_a != in_b)
+      return 2;
+  }
+
+  return -1;
+}
+
+/* 0: ab|c, 1: ac|b, 2: bc|a */
+static int triplet_topology(const uint64_t * masks,
+                            unsigned int mask_count,
+                            unsigned int a,
+                            unsigned int b,
+                            unsigned int c)
+{
+  unsigned int i;
+
+  for (i = 0; i < mask_count; ++i)
+  {
+    uint64_t m = masks[i];
+    int in_a = (m >> a) & 1, in_b = (m >> b) & 1, in_c = (m >> c) & 1;
+    if (in_a + in_b + in_c != 2)
+      continue;
+    return in_c ? (in_b ? 2 : 1) : 0;
+  }
+
+  return -1;
+}
+
+static uint64_t brute_quartets(pll_utree_t * t1, pll_utree_t * t2)
+{
+  unsigned int n = t1->tip_count;
+  unsigned int a, b, c, d;
+  uint64_t m1[MAX_TIPS], m2[MAX_TIPS];
+  uint64_t distance = 0;
+
+  utree_masks(t1, m1);
+  utree_masks(t2, m2);
+
+  for (a = 0; a < n; ++a)
+    for (b = a + 1; b < n; ++b)
+      for (c = b + 1; c < n; ++c)
+        for (d = c + 1; d < n; ++d)
+          if (quartet_topology(m1, n - 3, a, b, c, d) !=
+              quartet_topology(m2, n - 3, a, b, c, d))
+            ++distance;
+
+  return distance;
+}
+
+static uint64_t brute_triplets(pll_rtree_t * t1, pll_rtree_t * t2)
+{
+  unsigned int n = t1->tip_count;
+  unsigned int a, b, c, c1 = 0, c2 = 0;
+  uint64_t m1[MAX_TIPS], m2[MAX_TIPS];
+  uint64_t distance = 0;
+
+  rtree_masks(t1->root, m1, &c1);
+  rtree_masks(t2->root, m2, &c2);
+
+  for (a = 0; a < n; ++a)
+    for (b = a + 1; b < n; ++b)
+      for (c = b + 1; c < n; ++c)
+        if (triplet_topology(m1, c1, a, b, c) !=
+            triplet_topology(m2, c2, a, b, c))
+          ++distance;
+
+  return distance;
+}
+
+int main (int argc, char * argv[])
+{
+  unsigned int sizes[] = {5, 17, MAX_TIPS};
+  unsigned int attributes = get_attributes(argc, argv);
+  unsigned int s, p, i, j;
+  unsigned int perm[MAX_TIPS];
+  pll_utree_t * trees[N_TREES + 1];
+  uint64_t distances[N_TREES * N_TREES], mt_distances[N_TREES * N_TREES];
+  int matrix_ok = 1;
+  char * newick;
+
+  if (attributes != PLL_ATTRIB_ARCH_CPU)
+  {
+    skip_test();
+  }
+
+  test_random_seed(1357);
+
+  for (s = 0; s < 3; ++s)
+  {
+    unsigned int tip_count = sizes[s];
+    int quartets_ok = 1, triplets_ok = 1, start_ok = 1;
+    uint64_t max_quartets = 0, max_triplets = 0;
+
+    printf("** %u tips\n", tip_count);
+
+    for (p = 0; p < N_PAIRS; ++p)
+    {
+      unsigned int swaps = p % 4;
+      unsigned int shape_seed = test_random();
+      unsigned int shape_seed2 = (p % 8 == 7) ? test_random() : shape_seed;
+      uint64_t q, t;
+      char * newick1, * newick2;
+      pll_utree_t * u1, * u2;
+      pll_rtree_t * r1, * r2;
+
+      /* identical trees, a few swapped taxa, or unrelated shapes */
+      test_random_perm(perm, tip_count, 0);
+      newick1 = seeded_newick(tip_count, perm, 3, shape_seed);
+      test_random_perm(perm, tip_count, swaps);
+      newick2 = seeded_newick(tip_count, perm, 3, shape_seed2);
+      u1 = parse_utree(newick1, tip_count);
+      u2 = parse_utree(newick2, tip_count);
+      free(newick1);
+      free(newick2);
+
+      q = pllmod_utree_quartet_distance(u1->nodes[tip_count],
+                                        u2->nodes[tip_count], tip_count);
+      if (q != brute_quartets(u1, u2) || (!swaps && q))
+        quartets_ok = 0;
+
+      /* the result does not depend on where the trees are entered */
+      if (pllmod_utree_quartet_distance(u1->nodes[p % tip_count],
+                                        u2->nodes[2 * tip_count - 3],
+                                        tip_count) != q)
+        start_ok = 0;
+      if (q > max_quartets)
+        max_quartets = q;
+
+      test_random_perm(perm, tip_count, 0);
+      newick1 = seeded_newick(tip_count, perm, 2, shape_seed);
+      test_random_perm(perm, tip_count, swaps);
+      newick2 = seeded_newick(tip_count, perm, 2, shape_seed2);
+      r1 = parse_rtree(newick1, tip_count);
+      r2 = parse_rtree(newick2, tip_count);
+      free(newick1);
+      free(newick2);
+
+      t = pllmod_rtree_triplet_distance(r1->root, r2->root, tip_count);
+      if (t != brute_triplets(r1, r2) || (!swaps && t))
+        triplets_ok = 0;
+      if (t > max_triplets)
+        max_triplets = t;
+
+      pll_utree_destroy(u1, NULL);
+      pll_utree_destroy(u2, NULL);
+      pll_rtree_destroy(r1, NULL);
+      pll_rtree_destroy(r2, NULL);
+    }
+
+    printf("quartet distances OK: %s\n", quartets_ok ? "yes" : "no");
+    printf("any starting node: %s\n", start_ok ? "yes" : "no");
+    printf("triplet distances OK: %s\n", triplets_ok ? "yes" : "no");
+    printf("trees differ: %s\n",
+           max_quartets > 0 && max_triplets > 0 ? "yes" : "no");
+  }
+
+  printf("** distance matrix\n");
+  for (i = 0; i < N_TREES; ++i)
+  {
+    test_random_perm(perm, MATRIX_TIPS, i % 3 ? i : 0);
+    newick = seeded_newick(MATRIX_TIPS, perm, 3, i % 3 ? 99 : test_random());
+    trees[i] = parse_utree(newick, MATRIX_TIPS);
+    free(newick);
+  }
+
+  if (!pllmod_utree_quartet_distance_matrix(trees, N_TREES, 1, distances) ||
+      !pllmod_utree_quartet_distance_matrix(trees, N_TREES, N_THREADS,
+                                            mt_distances))
+    fatal("Cannot compute quartet distances: %s", pll_errmsg);
+
+  for (i = 0; i < N_TREES; ++i)
+    for (j = 0; j < N_TREES; ++j)
+    {
+      uint64_t d = distances[i * N_TREES + j];
+      if (d != distances[j * N_TREES + i] ||
+          d != mt_distances[i * N_TREES + j] ||
+          (i == j && d) ||
+          (i < j && d != pllmod_utree_quartet_distance(
+                                   trees[i]->nodes[MATRIX_TIPS],
+                                   trees[j]->nodes[MATRIX_TIPS],
+                                   MATRIX_TIPS)))
+        matrix_ok = 0;
+    }
+  printf("%u threads: same distances: %s\n", N_THREADS,
+         matrix_ok ? "yes" : "no");
+
+  /* a tree with a different number of tips */
+  test_random_perm(perm, MATRIX_TIPS - 1, 0);
+  newick = seeded_newick(MATRIX_TIPS - 1, perm, 3, 7);
+  trees[N_TREES] = parse_utree(newick, MATRIX_TIPS - 1);
+  free(newick);
+  pll_errno = 0;
+  printf("different tip count: %s\n",
+         !pllmod_utree_quartet_distance_matrix(trees + 1, N_TREES,
+                                               N_THREADS, distances) &&
+         pll_errno == PLL_ERROR_PARAM_INVALID ? "yes" : "no");
+
+  /* clean */
+  for (i = 0; i <= N_TREES; ++i)
+    pll_utree_destroy(trees[i], NULL);
+
+  return (0);
+}
@@ -0,0 +1,253 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+#include "pll_tree.h"
+#include "../common.h"
+
+#include <string.h>
+
+#define TIP_COUNT   30
+#define SPLIT_LEN   ((TIP_COUNT + 31) / 32)
+#define N_TREES    200
+#define BAD_TREE    57
+
+#define TREES_FILENAME "test-collection.trees"
+
+/*
+ * This test writes a collection of random trees and reads their splits into
+ * a hashtable, with one and with several threads. Both hashtables must be
+ * identical, slot by slot, and the support of every split must match the
+ * splits of the trees built one by one. Then it replaces one of the trees by
+ * a tree with a missing taxon, and checks that the error points to that tree
+ * with any number of threads.
+ */
+
+/* splits of a parsed tree, with the taxa numbered as in the labels */
+static void insert_tree_splits(bitv_hashtable_t * splits_hash,
+                               const char * newick)
+{
+  unsigned int i, j;
+  pll_utree_t * tree = parse_utree(newick, TIP_COUNT);
+  pll_split_t * splits;
+  pll_split_base_t split[SPLIT_LEN];
+  pll_split_t split_ptr = split;
+
+  splits = pllmod_utree_split_create(tree->nodes[TIP_COUNT], TIP_COUNT, NULL);
+  for (i = 0; i < TIP_COUNT - 3; ++i)
+  {
+    memcpy(split, splits[i], sizeof(split));
+
+    if (!(split[0] & 1))
+    {
+      for (j = 0; j < SPLIT_LEN; ++j)
+        split[j] = ~split[j];
+      split[SPLIT_LEN - 1] &= (1u << (TIP_COUNT % 32)) - 1;
+    }
+
+    pllmod_utree_split_hashtable_insert(splits_hash, &split_ptr, TIP_COUNT, 1,
+                                        NULL, 0);
+  }
+
+  pllmod_utree_split_destroy(splits);
+  pll_utree_destroy(tree, NULL);
+}
+
+static int same_layout(const bitv_hashtable_t * h1,
+                       const bitv_hashtable_t * h2)
+{
+  unsigned int i;
+
+  if (h1->table_size != h2->table_size || h1->entry_count != h2->entry_count)
+    return 0;
+
+  for (i = 0; i < h1->table_size; ++i)
+  {
+    const bitv_hash_entry_t * e1 = h1->table[i];
+    const bitv_hash_entry_t * e2 = h2->table[i];
+    if ((e1 == NULL) != (e2 == NULL))
+      return 0;
+    if (e1 && (e1->support != e2->support ||
+               memcmp(e1->bit_vector, e2->bit_vector,
+                      SPLIT_LEN * sizeof(pll_split_base_t))))
+      return 0;
+  }
+
+  return 1;
+}
+
+static int same_support(const bitv_hashtable_t * h,
+                        bitv_hashtable_t * reference)
+{
+  unsigned int i;
+
+  if (h->entry_count != reference->entry_count)
+    return 0;
+
+  for (i = 0; i < h->table_size; ++i)
+  {
+    bitv_hash_entry_t * e = h->table[i];
+    bitv_hash_entry_t * r;
+    if (!e)
+      continue;
+    r = pllmod_utree_split_hashtable_lookup(reference, e->bit_vector,
+                                            TIP_COUNT);
+    if (!r || r->support != e->support)
+      return 0;
+  }
+
+  return 1;
+}
+
+static void write_trees(char ** trees, int bad_tree)
+{
+  unsigned int i;
+  FILE * file = fopen(TREES_FILENAME, "w");
+
+  if (!file)
+    fatal("Cannot write trees file");
+
+  for (i = 0; i < N_TREES; ++i)
+  {
+    if (bad_tree && i == BAD_TREE - 1)
+      fprintf(file, "((t1,t2),(t3,t4),(t5,t6));\n");
+    else
+      fprintf(file, "%s\n", trees[i]);
+  }
+
+  fclose(file);
+}
+
+int main (int argc, char * argv[])
+{
+  unsigned int i, tree_count;
+  unsigned int attributes = get_attributes(argc, argv);
+  unsigned int n_threads[] = {1, 4};
+  char * labels[TIP_COUNT];
+  char * trees[N_TREES];
+  char expected_error[32];
+  pll_consensus_builder_t * builder;
+  bitv_hashtable_t * reference, * splits_hash[2];
+
+  if (attributes != PLL_ATTRIB_ARCH_CPU)
+  {
+    skip_test();
+  }
+
+  test_random_seed(1234);
+
+  for (i = 0; i < TIP_COUNT; ++i)
+  {
+    labels[i] = (char *) malloc(8);
+    sprintf(labels[i], "t%u", i + 1);
+  }
+
+  /* the builder maps the tip labels to tip indices */
+  builder = pllmod_utree_consensus_builder_create(TIP_COUNT, labels);
+  if (!builder)
+    fatal("Cannot create consensus builder: %s", pll_errmsg);
+
+  /* trees are drawn from a small pool, such that splits are repeated */
+  reference = pllmod_utree_split_hashtable_create(TIP_COUNT, 0);
+  for (i = 0; i < N_TREES; ++i)
+  {
+    if (i < 20)
+      trees[i] = random_newick(TIP_COUNT, NULL, NULL, 3, 1);
+    else
+    {
+      const char * tree = trees[test_random() % 20];
+      trees[i] = (char *) malloc(strlen(tree) + 1);
+      strcpy(trees[i], tree);
+    }
+    insert_tree_splits(reference, trees[i]);
+  }
+  write_trees(trees, 0);
+
+  printf("** read trees\n");
+  for (i = 0; i < 2; ++i)
+  {
+    splits_hash[i] = pllmod_utree_split_hashtable_create(TIP_COUNT, 0);
+    tree_count = 0;
+    if (!pllmod_utree_split_hashtable_insert_file(splits_hash[i],
+                                                  TREES_FILENAME,
+                                                  TIP_COUNT,
+                                                  builder->names_hash,
+                                                  1.0,
+                                                  0,
+                                                  n_threads[i],
+                                                  &tree_count))
+      fatal("Cannot read trees: %s", pll_errmsg);
+
+    printf("%u threads: trees read: %u\n", n_threads[i], tree_count);
+    printf("%u threads: support OK: %s\n", n_threads[i],
+           same_support(splits_hash[i], reference) ? "yes" : "no");
+  }
+  printf("same hashtables: %s\n",
+         same_layout(splits_hash[0], splits_hash[1]) ? "yes" : "no");
+
+  printf("** update only\n");
+  for (i = 0; i < 2; ++i)
+  {
+    if (!pllmod_utree_split_hashtable_insert_file(splits_hash[i],
+                                                  TREES_FILENAME,
+                                                  TIP_COUNT,
+                                                  builder->names_hash,
+                                                  1.0,
+                                                  1,
+                                                  n_threads[i],
+                                                  NULL))
+      fatal("Cannot read trees: %s", pll_errmsg);
+  }
+  printf("same hashtables: %s\n",
+         same_layout(splits_hash[0], splits_hash[1]) ? "yes" : "no");
+  printf("no splits added: %s\n",
+         splits_hash[0]->entry_count == reference->entry_count ? "yes" : "no");
+
+  printf("** invalid tree\n");
+  write_trees(trees, 1);
+  sprintf(expected_error, "[tree #%u]", BAD_TREE);
+  for (i = 0; i < 2; ++i)
+  {
+    bitv_hashtable_t * h = pllmod_utree_split_hashtable_create(TIP_COUNT, 0);
+    int retval = pllmod_utree_split_hashtable_insert_file(h,
+                                                          TREES_FILENAME,
+                                                          TIP_COUNT,
+                                                          builder->names_hash,
+                                                          1.0,
+                                                          0,
+                                                          n_threads[i],
+                                                          NULL);
+    printf("%u threads: error reported: %s\n", n_threads[i],
+           (!retval && strstr(pll_errmsg, expected_error)) ? "yes" : "no");
+    pllmod_utree_split_hashtable_destroy(h);
+  }
+
+  /* clean */
+  remove(TREES_FILENAME);
+  for (i = 0; i < 2; ++i)
+    pllmod_utree_split_hashtable_destroy(splits_hash[i]);
+  pllmod_utree_split_hashtable_destroy(reference);
+  pllmod_utree_consensus_builder_destroy(builder);
+  for (i = 0; i < N_TREES; ++i)
+    free(trees[i]);
+  for (i = 0; i < TIP_COUNT; ++i)
+    free(labels[i]);
+
+  return (0);
+}
@@ -0,0 +1,217 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+#include "pll_tree.h"
+#include "../common.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#define TIP_COUNT     50
+#define SPLIT_LEN     ((TIP_COUNT + 31) / 32)
+#define N_SPLITS   20000
+#define N_THREADS      8
+#define N_INSERTS  80000
+#define BATCH_SIZE    50
+
+/*
+ * This test inserts the same sequence of splits into a split hashtable,
+ * once from a single thread and once from several threads at the same time
+ * into a concurrent hashtable. Since support values are small integers, the
+ * support of every split must be the same in both tables, regardless of the
+ * order of the additions. Threads also look up the splits they inserted
+ * while the table keeps growing.
+ */
+
+typedef struct
+{
+  bitv_hashtable_t * splits_hash;
+  pll_split_t * splits;
+  double * support;
+  unsigned int count;
+  int update_only;
+  int lookups_ok;
+} thread_data_t;
+
+static pthread_barrier_t barrier;
+
+static void * insert_thread(void * arg)
+{
+  thread_data_t * data = (thread_data_t *) arg;
+  unsigned int i, j;
+
+  data->lookups_ok = 1;
+
+  pthread_barrier_wait(&barrier);
+
+  for (i = 0; i < data->count; i += BATCH_SIZE)
+  {
+    if (!pllmod_utree_split_hashtable_insert(data->splits_hash,
+                                             data->splits + i,
+                                             TIP_COUNT,
+                                             BATCH_SIZE,
+                                             data->support + i,
+                                             data->update_only))
+      data->lookups_ok = 0;
+
+    if (data->update_only)
+      continue;
+
+    /* the entries of the batch must be there, and must not move */
+    for (j = i; j < i + BATCH_SIZE; ++j)
+    {
+      bitv_hash_entry_t * e =
+            pllmod_utree_split_hashtable_lookup(data->splits_hash,
+                                                data->splits[j],
+                                                TIP_COUNT);
+      if (!e || memcmp(e->bit_vector, data->splits[j],
+                       SPLIT_LEN * sizeof(pll_split_base_t)))
+        data->lookups_ok = 0;
+    }
+  }
+
+  return NULL;
+}
+
+static int compare_tables(bitv_hashtable_t * h1,
+                          bitv_hashtable_t * h2,
+                          pll_split_t * splits)
+{
+  unsigned int i;
+
+  if (h1->entry_count != h2->entry_count)
+    return 0;
+
+  for (i = 0; i < N_SPLITS; ++i)
+  {
+    bitv_hash_entry_t * e1 = pllmod_utree_split_hashtable_lookup(h1,
+                                                                 splits[i],
+                                                                 TIP_COUNT);
+    bitv_hash_entry_t * e2 = pllmod_utree_split_hashtable_lookup(h2,
+                                                                 splits[i],
+                                                                 TIP_COUNT);
+    if ((e1 == NULL) != (e2 == NULL))
+      return 0;
+    if (e1 && e1->support != e2->support)
+      return 0;
+  }
+
+  return 1;
+}
+
+int main (int argc, char * argv[])
+{
+  unsigned int i, j;
+  unsigned int attributes = get_attributes(argc, argv);
+  unsigned int per_thread = N_INSERTS / N_THREADS;
+  int lookups_ok = 1;
+  pll_split_t * splits, * sequence;
+  double * support;
+  bitv_hashtable_t * serial_hash, * concurrent_hash;
+  pthread_t threads[N_THREADS];
+  thread_data_t data[N_THREADS];
+
+  if (attributes != PLL_ATTRIB_ARCH_CPU)
+  {
+    skip_test();
+  }
+
+  test_random_seed(54321);
+
+  splits = (pll_split_t *) malloc(N_SPLITS * sizeof(pll_split_t));
+  splits[0] = (pll_split_t) calloc(N_SPLITS * SPLIT_LEN,
+                                   sizeof(pll_split_base_t));
+  for (i = 0; i < N_SPLITS; ++i)
+  {
+    splits[i] = splits[0] + i * SPLIT_LEN;
+    for (j = 0; j < SPLIT_LEN; ++j)
+      splits[i][j] = test_random() ^ (test_random() << 16);
+    splits[i][SPLIT_LEN - 1] &= (1u << (TIP_COUNT % 32)) - 1;
+  }
+
+  /* insertion sequence, drawing from a small range to have many repeats */
+  sequence = (pll_split_t *) malloc(2 * N_INSERTS * sizeof(pll_split_t));
+  support = (double *) malloc(2 * N_INSERTS * sizeof(double));
+  for (i = 0; i < 2 * N_INSERTS; ++i)
+  {
+    sequence[i] = splits[test_random() % N_SPLITS];
+    support[i] = 1 + test_random() % 8;
+  }
+
+  printf("** serial\n");
+  serial_hash = pllmod_utree_split_hashtable_create(TIP_COUNT, 0);
+  if (!serial_hash)
+    fatal("Cannot create hashtable: %s", pll_errmsg);
+
+  /* first half inserts, second half only updates */
+  pllmod_utree_split_hashtable_insert(serial_hash, sequence, TIP_COUNT,
+                                      N_INSERTS, support, 0);
+  pllmod_utree_split_hashtable_insert(serial_hash, sequence + N_INSERTS,
+                                      TIP_COUNT, N_INSERTS,
+                                      support + N_INSERTS, 1);
+  printf("serial table filled: %s\n",
+         serial_hash->entry_count > 0 ? "yes" : "no");
+
+  printf("** concurrent\n");
+  concurrent_hash = pllmod_utree_split_hashtable_create(TIP_COUNT, 1);
+  if (!concurrent_hash)
+    fatal("Cannot create hashtable: %s", pll_errmsg);
+
+  pthread_barrier_init(&barrier, NULL, N_THREADS);
+  for (i = 0; i < N_THREADS; ++i)
+  {
+    data[i].splits_hash = concurrent_hash;
+    data[i].splits = sequence + i * per_thread;
+    data[i].support = support + i * per_thread;
+    data[i].count = per_thread;
+    data[i].update_only = 0;
+    pthread_create(&threads[i], NULL, insert_thread, &data[i]);
+  }
+  for (i = 0; i < N_THREADS; ++i)
+  {
+    pthread_join(threads[i], NULL);
+    lookups_ok &= data[i].lookups_ok;
+  }
+  printf("inserted splits found: %s\n", lookups_ok ? "yes" : "no");
+
+  /* concurrent updates of existing splits */
+  for (i = 0; i < N_THREADS; ++i)
+  {
+    data[i].splits = sequence + N_INSERTS + i * per_thread;
+    data[i].support = support + N_INSERTS + i * per_thread;
+    data[i].update_only = 1;
+    pthread_create(&threads[i], NULL, insert_thread, &data[i]);
+  }
+  for (i = 0; i < N_THREADS; ++i)
+    pthread_join(threads[i], NULL);
+  pthread_barrier_destroy(&barrier);
+
+  printf("same splits and support: %s\n",
+         compare_tables(serial_hash, concurrent_hash, splits) ? "yes" : "no");
+
+  /* clean */
+  pllmod_utree_split_hashtable_destroy(serial_hash);
+  pllmod_utree_split_hashtable_destroy(concurrent_hash);
+  free(sequence);
+  free(support);
+  pllmod_utree_split_destroy(splits);
+
+  return (0);
+}
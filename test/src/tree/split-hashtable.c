@@ -0,0 +1,196 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+#include "pll_tree.h"
+#include "../common.h"
+
+#include <string.h>
+
+#define TIP_COUNT    70
+#define SPLIT_LEN    ((TIP_COUNT + 31) / 32)
+#define N_SPLITS   3000
+#define N_BATCHES    40
+#define BATCH_SIZE  200
+
+/*
+ * This test inserts batches of random splits into the split hashtable,
+ * such that it has to grow several times, and checks the entries and their
+ * support against a plain list of the distinct splits. It also checks that
+ * entries do not move while the table grows, and that update-only insertions
+ * never add new splits.
+ */
+
+static void random_split(pll_split_t split)
+{
+  unsigned int i;
+  for (i = 0; i < SPLIT_LEN; ++i)
+    split[i] = test_random() ^ (test_random() << 16);
+  split[SPLIT_LEN - 1] &= (1u << (TIP_COUNT % 32)) - 1;
+}
+
+static unsigned int count_slots(const bitv_hashtable_t * splits_hash)
+{
+  unsigned int i, count = 0;
+  for (i = 0; i < splits_hash->table_size; ++i)
+    if (splits_hash->table[i])
+      ++count;
+  return count;
+}
+
+int main (int argc, char * argv[])
+{
+  unsigned int i, j, b;
+  unsigned int attributes = get_attributes(argc, argv);
+  unsigned int initial_size, found_ok, support_ok, missing_ok;
+  unsigned int load_ok = 1;
+  pll_split_t * splits, * batch, * missing;
+  double * support, * batch_support;
+  bitv_hashtable_t * splits_hash;
+  bitv_hash_entry_t * first_entry;
+
+  if (attributes != PLL_ATTRIB_ARCH_CPU)
+  {
+    skip_test();
+  }
+
+  test_random_seed(12345);
+
+  /* distinct splits, plus some that are never inserted */
+  splits = (pll_split_t *) malloc(N_SPLITS * sizeof(pll_split_t));
+  missing = (pll_split_t *) malloc(N_SPLITS * sizeof(pll_split_t));
+  support = (double *) calloc(N_SPLITS, sizeof(double));
+  splits[0] = (pll_split_t) calloc(2 * N_SPLITS * SPLIT_LEN,
+                                   sizeof(pll_split_base_t));
+  for (i = 0; i < N_SPLITS; ++i)
+  {
+    splits[i] = splits[0] + i * SPLIT_LEN;
+    missing[i] = splits[0] + (N_SPLITS + i) * SPLIT_LEN;
+    random_split(splits[i]);
+    random_split(missing[i]);
+  }
+
+  batch = (pll_split_t *) malloc(BATCH_SIZE * sizeof(pll_split_t));
+  batch_support = (double *) malloc(BATCH_SIZE * sizeof(double));
+
+  printf("** insert\n");
+  splits_hash = pllmod_utree_split_hashtable_create(TIP_COUNT, 0);
+  if (!splits_hash)
+    fatal("Cannot create hashtable: %s", pll_errmsg);
+  initial_size = splits_hash->table_size;
+
+  /* the first split is inserted alone, to follow its entry */
+  support[0] = 1.0;
+  pllmod_utree_split_hashtable_insert(splits_hash, splits, TIP_COUNT, 1,
+                                      NULL, 0);
+  first_entry = pllmod_utree_split_hashtable_lookup(splits_hash, splits[0],
+                                                    TIP_COUNT);
+
+  /* batches draw from a growing range of splits, so most are repeated */
+  for (b = 0; b < N_BATCHES; ++b)
+  {
+    unsigned int range = N_SPLITS * (b + 1) / N_BATCHES;
+    for (j = 0; j < BATCH_SIZE; ++j)
+    {
+      unsigned int k = test_random() % range;
+      batch[j] = splits[k];
+      batch_support[j] = 1 + test_random() % 4;
+      support[k] += batch_support[j];
+    }
+    if (!pllmod_utree_split_hashtable_insert(splits_hash, batch, TIP_COUNT,
+                                             BATCH_SIZE, batch_support, 0))
+      fatal("Cannot insert splits: %s", pll_errmsg);
+
+    if (2 * splits_hash->entry_count > splits_hash->table_size)
+      load_ok = 0;
+  }
+
+  /* count the distinct splits inserted so far */
+  j = 0;
+  for (i = 0; i < N_SPLITS; ++i)
+    if (support[i] > 0)
+      ++j;
+
+  printf("table grown: %s\n",
+         splits_hash->table_size > initial_size ? "yes" : "no");
+  printf("load factor below 1/2: %s\n", load_ok ? "yes" : "no");
+  printf("entry count OK: %s\n", splits_hash->entry_count == j ? "yes" : "no");
+  printf("occupied slots OK: %s\n",
+         count_slots(splits_hash) == j ? "yes" : "no");
+
+  printf("** lookup\n");
+  found_ok = support_ok = missing_ok = 1;
+  for (i = 0; i < N_SPLITS; ++i)
+  {
+    bitv_hash_entry_t * e = pllmod_utree_split_hashtable_lookup(splits_hash,
+                                                                splits[i],
+                                                                TIP_COUNT);
+    if ((e != NULL) != (support[i] > 0))
+      found_ok = 0;
+    else if (e && (e->support != support[i] ||
+                   memcmp(e->bit_vector, splits[i],
+                          SPLIT_LEN * sizeof(pll_split_base_t))))
+      support_ok = 0;
+
+    if (pllmod_utree_split_hashtable_lookup(splits_hash, missing[i],
+                                            TIP_COUNT))
+      missing_ok = 0;
+  }
+  printf("inserted splits found: %s\n", found_ok ? "yes" : "no");
+  printf("support OK: %s\n", support_ok ? "yes" : "no");
+  printf("other splits not found: %s\n", missing_ok ? "yes" : "no");
+  printf("entries kept after growth: %s\n",
+         first_entry == pllmod_utree_split_hashtable_lookup(splits_hash,
+                                                            splits[0],
+                                                            TIP_COUNT) ?
+         "yes" : "no");
+
+  printf("** update only\n");
+  j = splits_hash->entry_count;
+  for (i = 0; i < BATCH_SIZE; ++i)
+  {
+    batch[i] = (i % 2) ? missing[i] : splits[i];
+    batch_support[i] = 1.0;
+  }
+  pllmod_utree_split_hashtable_insert(splits_hash, batch, TIP_COUNT,
+                                      BATCH_SIZE, batch_support, 1);
+  printf("no splits added: %s\n",
+         splits_hash->entry_count == j ? "yes" : "no");
+
+  support_ok = 1;
+  for (i = 0; i < BATCH_SIZE; i += 2)
+  {
+    bitv_hash_entry_t * e = pllmod_utree_split_hashtable_lookup(splits_hash,
+                                                                splits[i],
+                                                                TIP_COUNT);
+    if (support[i] > 0 ? (!e || e->support != support[i] + 1) : e != NULL)
+      support_ok = 0;
+  }
+  printf("support updated: %s\n", support_ok ? "yes" : "no");
+
+  /* clean */
+  pllmod_utree_split_hashtable_destroy(splits_hash);
+  free(batch);
+  free(batch_support);
+  free(support);
+  free(missing);
+  pllmod_utree_split_destroy(splits);
+
+  return (0);
+}
@@ -0,0 +1,291 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+#include "pll_tree.h"
+#include "../common.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#define MAX_TIPS   64
+#define N_TREES    20
+#define N_THREADS   4
+
+/*
+ * This test reads the splits of random trees directly from their newick
+ * strings, and compares them with the splits of the trees built by the newick
+ * parser. Tip counts include a multiple of the split word size. It also reads
+ * the same trees from several threads at once, and checks that invalid trees
+ * are rejected with the right error.
+ */
+
+typedef struct
+{
+  char ** trees;
+  unsigned int tip_count;
+  string_hashtable_t * names_hash;
+  pll_split_t ** splits;
+} thread_data_t;
+
+static int cmp_split(const void * a, const void * b, unsigned int split_len)
+{
+  return memcmp(*(const pll_split_t *) a, *(const pll_split_t *) b,
+                split_len * sizeof(pll_split_base_t));
+}
+
+static int cmp_split1(const void * a, const void * b)
+{
+  return cmp_split(a, b, 1);
+}
+
+static int cmp_split2(const void * a, const void * b)
+{
+  return cmp_split(a, b, 2);
+}
+
+static void sort_splits(pll_split_t * splits, unsigned int tip_count)
+{
+  qsort(splits, tip_count - 3, sizeof(pll_split_t),
+        tip_count > 32 ? cmp_split2 : cmp_split1);
+}
+
+/* splits of the parsed tree, with the taxa numbered as in the labels */
+static pll_split_t * tree_splits(const char * newick, unsigned int tip_count)
+{
+  unsigned int split_len = (tip_count + 31) / 32;
+  unsigned int i, j;
+  pll_utree_t * tree = parse_utree(newick, tip_count);
+  pll_split_t * splits, * result;
+
+  splits = pllmod_utree_split_create(tree->nodes[tip_count], tip_count, NULL);
+
+  result = (pll_split_t *) malloc((tip_count - 3) * sizeof(pll_split_t));
+  result[0] = (pll_split_t) calloc((tip_count - 3) * split_len,
+                                   sizeof(pll_split_base_t));
+  for (i = 0; i < tip_count - 3; ++i)
+  {
+    result[i] = result[0] + i * split_len;
+    memcpy(result[i], splits[i], split_len * sizeof(pll_split_base_t));
+
+    if (!(result[i][0] & 1))
+    {
+      for (j = 0; j < split_len; ++j)
+        result[i][j] = ~result[i][j];
+      if (tip_count % 32)
+        result[i][split_len - 1] &= (1u << (tip_count % 32)) - 1;
+    }
+  }
+
+  pllmod_utree_split_destroy(splits);
+  pll_utree_destroy(tree, NULL);
+
+  return result;
+}
+
+static int same_splits(pll_split_t * s1,
+                       pll_split_t * s2,
+                       unsigned int tip_count)
+{
+  unsigned int split_len = (tip_count + 31) / 32;
+  unsigned int i;
+  pll_split_t sorted1[MAX_TIPS], sorted2[MAX_TIPS];
+
+  /* sort copies: the first pointer owns the splits */
+  memcpy(sorted1, s1, (tip_count - 3) * sizeof(pll_split_t));
+  memcpy(sorted2, s2, (tip_count - 3) * sizeof(pll_split_t));
+  sort_splits(sorted1, tip_count);
+  sort_splits(sorted2, tip_count);
+  for (i = 0; i < tip_count - 3; ++i)
+    if (memcmp(sorted1[i], sorted2[i], split_len * sizeof(pll_split_base_t)))
+      return 0;
+
+  return 1;
+}
+
+static void * parse_thread(void * arg)
+{
+  thread_data_t * data = (thread_data_t *) arg;
+  unsigned int i;
+
+  for (i = 0; i < N_TREES; ++i)
+    data->splits[i] = pllmod_utree_split_newick_parse(data->trees[i],
+                                                      data->tip_count,
+                                                      data->names_hash);
+
+  return NULL;
+}
+
+static int check_error(const char * newick,
+                       string_hashtable_t * names_hash,
+                       unsigned int tip_count,
+                       int error_code,
+                       const char * position)
+{
+  pll_split_t * splits;
+
+  pll_errno = 0;
+  splits = pllmod_utree_split_newick_parse(newick, tip_count, names_hash);
+  if (splits)
+  {
+    pllmod_utree_split_destroy(splits);
+    return 0;
+  }
+
+  return pll_errno == error_code && strstr(pll_errmsg, position) != NULL;
+}
+
+int main (int argc, char * argv[])
+{
+  unsigned int sizes[] = {45, 64};
+  unsigned int attributes = get_attributes(argc, argv);
+  unsigned int s, i, t;
+  char * labels[MAX_TIPS];
+  pll_consensus_builder_t * builder;
+  string_hashtable_t * names_hash;
+
+  if (attributes != PLL_ATTRIB_ARCH_CPU)
+  {
+    skip_test();
+  }
+
+  test_random_seed(777);
+
+  for (i = 0; i < MAX_TIPS; ++i)
+  {
+    labels[i] = (char *) malloc(8);
+    sprintf(labels[i], "t%u", i + 1);
+  }
+
+  for (s = 0; s < 2; ++s)
+  {
+    unsigned int tip_count = sizes[s];
+    char * trees[N_TREES];
+    pll_split_t * splits[N_THREADS][N_TREES];
+    pthread_t threads[N_THREADS];
+    thread_data_t data[N_THREADS];
+    int splits_ok = 1, threads_ok = 1;
+
+    printf("** %u tips\n", tip_count);
+
+    /* the builder maps the tip labels to tip indices */
+    builder = pllmod_utree_consensus_builder_create(tip_count, labels);
+    if (!builder)
+      fatal("Cannot create consensus builder: %s", pll_errmsg);
+    names_hash = builder->names_hash;
+
+    for (i = 0; i < N_TREES; ++i)
+    {
+      pll_split_t * ref_splits;
+
+      trees[i] = random_newick(tip_count, NULL, NULL, 3, 1);
+      splits[0][i] = pllmod_utree_split_newick_parse(trees[i], tip_count,
+                                                     names_hash);
+      if (!splits[0][i])
+        fatal("Cannot read splits: %s", pll_errmsg);
+
+      ref_splits = tree_splits(trees[i], tip_count);
+      if (!same_splits(splits[0][i], ref_splits, tip_count))
+        splits_ok = 0;
+      pllmod_utree_split_destroy(ref_splits);
+      pllmod_utree_split_destroy(splits[0][i]);
+    }
+    printf("same splits as the tree: %s\n", splits_ok ? "yes" : "no");
+
+    for (t = 0; t < N_THREADS; ++t)
+    {
+      data[t].trees = trees;
+      data[t].tip_count = tip_count;
+      data[t].names_hash = names_hash;
+      data[t].splits = splits[t];
+      pthread_create(&threads[t], NULL, parse_thread, &data[t]);
+    }
+    for (t = 0; t < N_THREADS; ++t)
+      pthread_join(threads[t], NULL);
+
+    for (i = 0; i < N_TREES; ++i)
+    {
+      for (t = 0; t < N_THREADS; ++t)
+      {
+        if (!splits[t][i] ||
+            (t && !same_splits(splits[0][i], splits[t][i], tip_count)))
+          threads_ok = 0;
+      }
+      for (t = 0; t < N_THREADS; ++t)
+        if (splits[t][i])
+          pllmod_utree_split_destroy(splits[t][i]);
+      free(trees[i]);
+    }
+    printf("same splits from %u threads: %s\n", N_THREADS,
+           threads_ok ? "yes" : "no");
+
+    pllmod_utree_consensus_builder_destroy(builder);
+  }
+
+  printf("** labels and errors\n");
+  builder = pllmod_utree_consensus_builder_create(6, labels);
+  names_hash = builder->names_hash;
+  {
+    pll_split_t * s1, * s2;
+    s1 = pllmod_utree_split_newick_parse(
+                        "((t1:1,t2:1)x:1,(t3,t4)c,(t5,t6):0.5);",
+                        6, names_hash);
+    s2 = pllmod_utree_split_newick_parse(
+                        "( ('t1' ,t2) ,\n ('t3',\"t4\"), (t5, t6) ) ;\n",
+                        6, names_hash);
+    printf("quoted labels and blanks: %s\n",
+           (s1 && s2 && same_splits(s1, s2, 6)) ? "yes" : "no");
+    if (s1)
+      pllmod_utree_split_destroy(s1);
+    if (s2)
+      pllmod_utree_split_destroy(s2);
+  }
+
+  printf("unknown label: %s\n",
+         check_error("((t1,t2),(t3,t7),(t5,t6));", names_hash, 6,
+                     PLLMOD_TREE_ERROR_INVALID_TREE, "column 14") ?
+         "yes" : "no");
+  printf("repeated label: %s\n",
+         check_error("((t1,t2),(t3,t4),(t5,t1));", names_hash, 6,
+                     PLLMOD_TREE_ERROR_INVALID_TREE, "column 22") ?
+         "yes" : "no");
+  printf("missing tip: %s\n",
+         check_error("((t1,t2),(t3,t4),t5);", names_hash, 6,
+                     PLLMOD_TREE_ERROR_INVALID_TREE_SIZE, "column") ?
+         "yes" : "no");
+  printf("multifurcation: %s\n",
+         check_error("((t1,t2,t3),t4,(t5,t6));", names_hash, 6,
+                     PLLMOD_TREE_ERROR_INVALID_TREE, "column") ?
+         "yes" : "no");
+  printf("rooted tree: %s\n",
+         check_error("((t1,t2),((t3,t4),(t5,t6)));", names_hash, 6,
+                     PLLMOD_TREE_ERROR_INVALID_TREE, "column") ?
+         "yes" : "no");
+  printf("syntax error: %s\n",
+         check_error("((t1,t2),\n(t3,t4)(t5,t6));", names_hash, 6,
+                     PLL_ERROR_NEWICK_SYNTAX, "line 2 column 8") ?
+         "yes" : "no");
+
+  /* clean */
+  pllmod_utree_consensus_builder_destroy(builder);
+  for (i = 0; i < MAX_TIPS; ++i)
+    free(labels[i]);
+
+  return (0);
+}
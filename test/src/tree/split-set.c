@@ -0,0 +1,257 @@
+/*
+ Copyright (C) 2017 Diego Darriba
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as
+ published by the Free Software Foundation, either version 3 of the
+ License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ Contact: Diego Darriba <Diego.Darriba@h-its.org>,
+ Exelixis Lab, Heidelberg Instutute for Theoretical Studies
+ Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+ */
+#include "pll_tree.h"
+#include "../common.h"
+
+#include <string.h>
+
+#define MAX_TIPS  130
+#define N_PAIRS    20
+
+/*
+ * This test builds split sets out of pairs of random trees that differ in a
+ * few swapped taxa, and compares them with the 32-bit splits of the same
+ * trees. Split sets built from trees and from unnormalized splits must hold
+ * the same normalized splits, sorting must order them without losing any, and
+ * the Robinson-Foulds distance must match a pairwise comparison of the
+ * splits. Tip counts include multiples of both split word sizes.
+ */
+
+/* 32-bit split i, widened to 64-bit words and normalized */
+static void widen_split(const pll_split_t split,
+                        unsigned int tip_count,
+                        uint64_t * row)
+{
+  unsigned int stride = (tip_count + 63) / 64;
+  unsigned int i;
+
+  memset(row, 0, stride * sizeof(uint64_t));
+  for (i = 0; i < tip_count; ++i)
+    if (split[i / 32] & (1u << (i % 32)))
+      row[i / 64] |= (uint64_t) 1 << (i % 64);
+
+  if (!(row[0] & 1))
+    for (i = 0; i < tip_count; ++i)
+      row[i / 64] ^= (uint64_t) 1 << (i % 64);
+}
+
+static int find_row(const pll_split_set_t * set, const uint64_t * row)
+{
+  unsigned int i;
+
+  for (i = 0; i < set->split_count; ++i)
+    if (!memcmp(set->words + i * set->stride, row,
+                set->stride * sizeof(uint64_t)))
+      return 1;
+
+  return 0;
+}
+
+/* same splits as the 32-bit splits, normalized and with no bits set beyond
+   the last taxon */
+static int check_set(const pll_split_set_t * set,
+                     pll_split_t * splits,
+                     unsigned int tip_count)
+{
+  unsigned int i, j;
+  uint64_t row[MAX_TIPS / 64 + 1];
+
+  if (set->split_count != tip_count - 3 ||
+      set->stride != (tip_count + 63) / 64)
+    return 0;
+
+  for (i = 0; i < set->split_count; ++i)
+  {
+    const uint64_t * r = set->words + i * set->stride;
+    if (!(r[0] & 1))
+      return 0;
+    for (j = tip_count; j < 64 * set->stride; ++j)
+      if (r[j / 64] & ((uint64_t) 1 << (j % 64)))
+        return 0;
+  }
+
+  for (i = 0; i < tip_count - 3; ++i)
+  {
+    widen_split(splits[i], tip_count, row);
+    if (!find_row(set, row))
+      return 0;
+  }
+
+  return 1;
+}
+
+static int is_sorted(const pll_split_set_t * set)
+{
+  unsigned int i, j;
+
+  for (i = 1; i < set->split_count; ++i)
+  {
+    const uint64_t * a = set->words + (i - 1) * set->stride;
+    const uint64_t * b = set->words + i * set->stride;
+    for (j = 0; j < set->stride && a[j] == b[j]; ++j);
+    if (j == set->stride || a[j] > b[j])
+      return 0;
+  }
+
+  return 1;
+}
+
+static unsigned int brute_rf(pll_split_t * s1,
+                             pll_split_t * s2,
+                             unsigned int tip_count)
+{
+  unsigned int stride = (tip_count + 63) / 64;
+  unsigned int i, j, equal = 0;
+  uint64_t r1[MAX_TIPS / 64 + 1], r2[MAX_TIPS / 64 + 1];
+
+  for (i = 0; i < tip_count - 3; ++i)
+  {
+    widen_split(s1[i], tip_count, r1);
+    for (j = 0; j < tip_count - 3; ++j)
+    {
+      widen_split(s2[j], tip_count, r2);
+      if (!memcmp(r1, r2, stride * sizeof(uint64_t)))
+      {
+        ++equal;
+        break;
+      }
+    }
+  }
+
+  return 2 * (tip_count - 3 - equal);
+}
+
+int main (int argc, char * argv[])
+{
+  unsigned int sizes[] = {10, 64, 65, 130};
+  unsigned int attributes = get_attributes(argc, argv);
+  unsigned int s, p, i, j;
+
+  if (attributes != PLL_ATTRIB_ARCH_CPU)
+  {
+    skip_test();
+  }
+
+  test_random_seed(8086);
+
+  for (s = 0; s < 4; ++s)
+  {
+    unsigned int tip_count = sizes[s];
+    unsigned int split_len = (tip_count + 31) / 32;
+    unsigned int perm[MAX_TIPS];
+    unsigned int min_rf = ~0u, max_rf = 0;
+    int create_ok = 1, from_splits_ok = 1, sort_ok = 1, rf_ok = 1;
+
+    printf("** %u tips\n", tip_count);
+
+    for (p = 0; p < N_PAIRS; ++p)
+    {
+      unsigned int shape_seed = test_random();
+      unsigned int swaps = p % 8;
+      unsigned int rf, ref_rf;
+      char * newick1, * newick2;
+      pll_utree_t * t1, * t2;
+      pll_split_t * splits1, * splits2;
+      pll_split_set_t * set1, * set2, * set3;
+
+      /* the second tree moves a few taxa of the first one */
+      newick1 = seeded_newick(tip_count, NULL, 3, shape_seed);
+      test_random_perm(perm, tip_count, swaps);
+      newick2 = seeded_newick(tip_count, perm, 3, shape_seed);
+
+      t1 = parse_utree(newick1, tip_count);
+      t2 = parse_utree(newick2, tip_count);
+      splits1 = pllmod_utree_split_create(t1->nodes[tip_count], tip_count,
+                                          NULL);
+      splits2 = pllmod_utree_split_create(t2->nodes[tip_count], tip_count,
+                                          NULL);
+
+      /* start from a tip, and from an inner node */
+      set1 = pllmod_utree_split_set_create(t1->nodes[0], tip_count);
+      set2 = pllmod_utree_split_set_create(t2->nodes[tip_count], tip_count);
+      if (!set1 || !set2)
+        fatal("Cannot create split set: %s", pll_errmsg);
+      if (!check_set(set1, splits1, tip_count) ||
+          !check_set(set2, splits2, tip_count))
+        create_ok = 0;
+
+      /* complement every other split before converting them */
+      for (i = 0; i < tip_count - 3; i += 2)
+      {
+        for (j = 0; j < split_len; ++j)
+          splits1[i][j] = ~splits1[i][j];
+        if (tip_count % 32)
+          splits1[i][split_len - 1] &= (1u << (tip_count % 32)) - 1;
+      }
+      set3 = pllmod_utree_split_set_from_splits(
+                                        (const pll_split_t *) splits1,
+                                        tip_count - 3,
+                                        tip_count);
+      if (!set3)
+        fatal("Cannot create split set: %s", pll_errmsg);
+
+      if (!pllmod_utree_split_set_sort(set1) ||
+          !pllmod_utree_split_set_sort(set2) ||
+          !pllmod_utree_split_set_sort(set3))
+        fatal("Cannot sort split set: %s", pll_errmsg);
+      if (!is_sorted(set1) || !is_sorted(set2) ||
+          !check_set(set1, splits1, tip_count) ||
+          !check_set(set2, splits2, tip_count))
+        sort_ok = 0;
+      if (memcmp(set1->words, set3->words,
+                 set1->split_count * set1->stride * sizeof(uint64_t)))
+        from_splits_ok = 0;
+
+      rf = pllmod_utree_split_set_rf_distance(set1, set2);
+      ref_rf = brute_rf(splits1, splits2, tip_count);
+      if (rf != ref_rf ||
+          pllmod_utree_split_set_rf_distance(set2, set1) != ref_rf ||
+          pllmod_utree_split_set_rf_distance(set1, set3) != 0 ||
+          pllmod_utree_rf_distance(t1->nodes[0], t2->nodes[0],
+                                   tip_count) != ref_rf)
+        rf_ok = 0;
+      if (rf < min_rf)
+        min_rf = rf;
+      if (rf > max_rf)
+        max_rf = rf;
+
+      pllmod_utree_split_set_destroy(set1);
+      pllmod_utree_split_set_destroy(set2);
+      pllmod_utree_split_set_destroy(set3);
+      pllmod_utree_split_destroy(splits1);
+      pllmod_utree_split_destroy(splits2);
+      pll_utree_destroy(t1, NULL);
+      pll_utree_destroy(t2, NULL);
+      free(newick1);
+      free(newick2);
+    }
+
+    printf("splits from trees: %s\n", create_ok ? "yes" : "no");
+    printf("sorted splits: %s\n", sort_ok ? "yes" : "no");
+    printf("splits from unnormalized splits: %s\n",
+           from_splits_ok ? "yes" : "no");
+    printf("RF distances OK: %s\n", rf_ok ? "yes" : "no");
+    printf("RF distances vary: %s\n",
+           (min_rf == 0 && max_rf > 4) ? "yes" : "no");
+  }
+
+  return (0);
+}